@@ -0,0 +1,134 @@
+#ifndef DBSI_COLUMN_BATCH_H
+#define DBSI_COLUMN_BATCH_H
+
+
+#include <vector>
+#include "dbsi_types.h"
+#include "dbsi_assert.h"
+
+
+namespace dbsi
+{
+
+
+/*
+* A batch of rows of codes, stored column by column, which iterators
+* over coded rows fill by `next_batch` (see `ICodedRowIterator`).
+* Passing rows on a batch at a time, rather than one per call of
+* `current` and `next`, saves a couple of virtual calls and a copy
+* per row, and lets each column be read or written by a simple loop
+* over a contiguous array.
+*/
+class ColumnBatch
+{
+public:
+	// small enough that a batch of a few columns stays in cache
+	static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+	explicit ColumnBatch(size_t num_columns, size_t capacity = DEFAULT_CAPACITY) :
+		m_num_columns(num_columns),
+		m_max_capacity(capacity),
+		m_capacity(capacity),
+		m_num_rows(0),
+		m_codes(num_columns * capacity)
+	{
+		DBSI_CHECK_PRECOND(capacity > 0);
+	}
+
+	size_t num_columns() const
+	{
+		return m_num_columns;
+	}
+
+	size_t num_rows() const
+	{
+		return m_num_rows;
+	}
+
+	size_t capacity() const
+	{
+		return m_capacity;
+	}
+
+	bool full() const
+	{
+		return m_num_rows == m_capacity;
+	}
+
+	/*
+	* Remove every row. If `capacity` is given, the batch then only
+	* takes that many rows (which must be positive, and at most the
+	* capacity it was created with) until it is next cleared.
+	*/
+	void clear()
+	{
+		m_num_rows = 0;
+	}
+	void clear(size_t capacity)
+	{
+		DBSI_CHECK_PRECOND(capacity > 0 && capacity <= m_max_capacity);
+		m_num_rows = 0;
+		m_capacity = capacity;
+	}
+
+	/*
+	* The values of column `col` of the rows, of which there is
+	* room for `capacity()`.
+	*/
+	CodedResource* column(size_t col)
+	{
+		DBSI_CHECK_PRECOND(col < m_num_columns);
+		return m_codes.data() + col * m_max_capacity;
+	}
+	const CodedResource* column(size_t col) const
+	{
+		DBSI_CHECK_PRECOND(col < m_num_columns);
+		return m_codes.data() + col * m_max_capacity;
+	}
+
+	/*
+	* Add `n` rows to the end, and return the index of the first of
+	* them, whose values must then be written to each column.
+	*/
+	size_t add_rows(size_t n)
+	{
+		DBSI_CHECK_PRECOND(m_num_rows + n <= m_capacity);
+		const size_t first = m_num_rows;
+		m_num_rows += n;
+		return first;
+	}
+
+	/*
+	* Add a row to the end, whose columns are the subject, predicate
+	* and object of `t`, or the values of `vm` in order of variable.
+	*/
+	void push_back(const CodedTriple& t)
+	{
+		DBSI_CHECK_PRECOND(m_num_columns == 3);
+		const size_t row = add_rows(1);
+		column(0)[row] = t.sub;
+		column(1)[row] = t.pred;
+		column(2)[row] = t.obj;
+	}
+	void push_back(const CodedVarMap& vm)
+	{
+		DBSI_CHECK_PRECOND(vm.size() == m_num_columns);
+		const size_t row = add_rows(1);
+		size_t col = 0;
+		for (const auto& kv : vm)
+			column(col++)[row] = kv.second;
+	}
+
+private:
+	const size_t m_num_columns, m_max_capacity;
+	size_t m_capacity, m_num_rows;
+
+	// column `c` is `m_codes[c * m_max_capacity]` onwards
+	std::vector<CodedResource> m_codes;
+};
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_COLUMN_BATCH_H
@@ -1,3 +1,6 @@
+#include <limits>
+#include <stdexcept>
+#include <mutex>
 #include "dbsi_dictionary.h"
 #include "dbsi_assert.h"
 
@@ -6,31 +9,244 @@ namespace dbsi
 {
 
 
+// the first byte of each heap entry is the index of its type in
+// `Resource`, and this is the one for IRIs
+static const size_t IRI_INDEX = 1;
+static_assert(std::is_same_v<std::variant_alternative_t<IRI_INDEX, Resource>, IRI>);
+
+
+// the first byte of the heap entry for `r`
+static std::uint8_t kind_of(const ResourceRef& r)
+{
+	return static_cast<std::uint8_t>(r.is_iri ? IRI_INDEX : 1 - IRI_INDEX);
+}
+
+
+Dictionary::Dictionary() :
+	m_mapped_heap(nullptr),
+	m_mapped_heap_size(0),
+	m_encoder(EncoderPolicy{ this }),
+	m_log(nullptr)
+{
+	m_offsets.push_back(0);
+}
+
+
 CodedResource Dictionary::encode(const Resource& r)
 {
-	// if the resource was new, this is what its new key would be
-	const CodedResource potential_new_code = m_decoder.size();
+	return encode(ResourceRef{ r.index() == IRI_INDEX, std::visit(
+		[](const auto& x) -> std::string_view { return x.val; }, r) });
+}
+
+
+CodedResource Dictionary::encode(const ResourceRef& r)
+{
+	// most resources have been seen before, so look for them with just
+	// a shared lock first, so that threads parsing different parts of
+	// a file at once (see `parse_mapped_turtle`) don't queue up here
+	{
+		std::shared_lock<std::shared_mutex> lock(m_mutex);
+		if (const CodedResource* code = m_encoder.find(r))
+		{
+			// when you decode the return value, it should give the input to this function
+			DBSI_CHECK_INVARIANT(entry(*code).substr(1) == r.val);
+			return *code;
+		}
+	}
+
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	return encode_locked(r);
+}
+
+
+void Dictionary::encode(const ResourceRef* refs, size_t count, CodedResource* out)
+{
+	// as in `encode`, first look for them all with a shared lock
+	const std::vector<size_t> missing = find(refs, count, out);
+	if (missing.empty())
+		return;
+
+	// (in order, so that new resources are numbered in the order they
+	// first appear, just as when encoding them one at a time)
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	for (size_t i : missing)
+		out[i] = encode_locked(refs[i]);
+}
+
+
+std::vector<size_t> Dictionary::find(const ResourceRef* refs, size_t count,
+	CodedResource* out) const
+{
+	std::vector<size_t> missing;
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (const CodedResource* code = m_encoder.find(refs[i]))
+			out[i] = *code;
+		else
+			missing.push_back(i);
+	}
+	return missing;
+}
+
 
-	// do a lookup, but insert if the resource doesn't exist, with a new ID
-	// (note that map's `insert` does not update the value if the key already
-	// exists)
-	auto [iter, is_new] = m_encoder.insert(std::make_pair(r, potential_new_code));
+CodedResource Dictionary::encode_locked(const ResourceRef& r)
+{
+	// (another thread may have added it since the caller looked, or it
+	// may have appeared earlier in the same batch)
+	if (const CodedResource* code = m_encoder.find(r))
+		return *code;
 
-	if (is_new)
-		// store address of iterator's key (NOT `r`)
-		m_decoder.push_back(&iter->first);
+	// check we haven't run out of codes (which is only realistic
+	// when they are 32-bit)
+	const size_t new_code = m_offsets.size() - 1;
+	if (new_code > std::numeric_limits<CodedResource>::max())
+		throw std::overflow_error("Too many distinct resources for the coded resource width; "
+			"consider building without DBSI_32_BIT_IDS.");
 
-	// when you decode the return value, it should give the input to this function
-	DBSI_CHECK_INVARIANT(*m_decoder[iter->second] == r);
+	// append the new entry to the heap before inserting, because
+	// the encoder compares against it
+	const std::uint8_t kind = kind_of(r);
+	m_heap.push_back(static_cast<char>(kind));
+	m_heap.insert(m_heap.end(), r.val.begin(), r.val.end());
+	m_offsets.push_back(m_mapped_heap_size + m_heap.size());
 
-	return iter->second;
+	[[maybe_unused]] const bool is_new = m_encoder.insert(r, static_cast<CodedResource>(new_code)).second;
+	DBSI_CHECK_POSTCOND(is_new);
+
+	// (this is done while still holding the lock, so that the log
+	// has the resources in order of code)
+	if (m_log != nullptr)
+		m_log->log_resource(kind, r.val);
+
+	return static_cast<CodedResource>(new_code);
 }
 
 
 Resource Dictionary::decode(CodedResource i) const
 {
-	DBSI_CHECK_PRECOND(i < m_decoder.size());
-	return *m_decoder[i];
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	return decode_locked(i);
+}
+
+
+void Dictionary::decode(const CodedResource* codes, size_t count, Resource* out) const
+{
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	for (size_t i = 0; i < count; ++i)
+		out[i] = decode_locked(codes[i]);
+}
+
+
+Resource Dictionary::decode_locked(CodedResource i) const
+{
+	DBSI_CHECK_PRECOND(i + 1 < m_offsets.size());
+
+	const std::string_view e = entry(i);
+	if (static_cast<std::uint8_t>(e[0]) == IRI_INDEX)
+		return IRI{ std::string(e.substr(1)) };
+	else
+		return Literal{ std::string(e.substr(1)) };
+}
+
+
+size_t Dictionary::size() const
+{
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	return m_offsets.size() - 1;
+}
+
+
+void Dictionary::set_log(WriteAheadLog* log)
+{
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	m_log = log;
+}
+
+
+void Dictionary::save(ImageWriter& out) const
+{
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+
+	out.begin_array(sizeof(char), m_mapped_heap_size + m_heap.size());
+	out.write_bytes(m_mapped_heap, m_mapped_heap_size);
+	out.write_bytes(m_heap.data(), m_heap.size());
+	out.end_array();
+	m_offsets.save(out);
+	m_encoder.save(out);
+}
+
+
+void Dictionary::open(ImageReader& in)
+{
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+
+	auto [heap, heap_size] = in.read_array<char>();
+	m_mapped_heap = heap;
+	m_mapped_heap_size = heap_size;
+	m_mapping = in.mapping();
+	m_heap.clear();
+	m_offsets.open(in);
+	m_encoder.open(in);
+
+	// (the entries themselves are trusted, rather than spending
+	// time checking them all)
+	if (m_offsets.empty() || m_offsets[0] != 0
+		|| m_offsets[m_offsets.size() - 1] != heap_size
+		|| m_encoder.size() != m_offsets.size() - 1)
+		throw std::runtime_error("Corrupted image: bad dictionary.");
+}
+
+
+void Dictionary::clear()
+{
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+
+	m_mapped_heap = nullptr;
+	m_mapped_heap_size = 0;
+	m_mapping.reset();
+	m_heap.clear();
+	m_offsets.clear();
+	m_offsets.push_back(0);
+	m_encoder.clear();
+}
+
+
+std::string_view Dictionary::entry(CodedResource i) const
+{
+	const size_t begin = m_offsets[i], end = m_offsets[i + 1];
+
+	// entries never span the two parts of the heap
+	if (begin < m_mapped_heap_size)
+		return std::string_view(m_mapped_heap + begin, end - begin);
+	else
+		return std::string_view(m_heap.data() + (begin - m_mapped_heap_size), end - begin);
+}
+
+
+size_t Dictionary::hash_entry(std::uint8_t kind, std::string_view val)
+{
+	return hash_combine(kind, std::hash<std::string_view>()(val));
+}
+
+
+size_t Dictionary::EncoderPolicy::hash(const ResourceRef& r) const
+{
+	return hash_entry(kind_of(r), r.val);
+}
+
+
+size_t Dictionary::EncoderPolicy::hash_slot(const CodedResource& i) const
+{
+	const std::string_view e = dict->entry(i);
+	return hash_entry(static_cast<std::uint8_t>(e[0]), e.substr(1));
+}
+
+
+bool Dictionary::EncoderPolicy::equal(const CodedResource& i, const ResourceRef& r) const
+{
+	const std::string_view e = dict->entry(i);
+	return static_cast<std::uint8_t>(e[0]) == kind_of(r) && e.substr(1) == r.val;
 }
 
 
@@ -4,8 +4,13 @@
 
 #include <vector>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <shared_mutex>
 #include "dbsi_types.h"
+#include "dbsi_flat_hash_map.h"
+#include "dbsi_segmented_vector.h"
+#include "dbsi_image.h"
+#include "dbsi_log.h"
 
 
 namespace dbsi
@@ -17,24 +22,118 @@ namespace dbsi
 * to save memory.
 * Resources are assigned new integer codes as they are
 * encountered.
+* This class is thread-safe, so that queries can be encoded and
+* their results decoded while a LOAD is running in the background.
 */
 class Dictionary
 {
 public:
+	Dictionary();
+
+	// the encoder refers to the heap, so don't copy
+	Dictionary(const Dictionary&) = delete;
+	Dictionary& operator=(const Dictionary&) = delete;
+
+	/*
+	* Get the code of a resource, giving it a new one if it hasn't
+	* been seen before. Only a new resource's value is copied, so
+	* encoding a `ResourceRef` into the input (e.g. by a parser) saves
+	* a copy per occurrence.
+	*/
 	CodedResource encode(const Resource& r);
+	CodedResource encode(const ResourceRef& r);
 	Resource decode(CodedResource i) const;
 
+	/*
+	* Encode the `count` resources starting at `refs` into `out`,
+	* taking the lock once to look them all up (and once more if any
+	* are new).
+	*/
+	void encode(const ResourceRef* refs, size_t count, CodedResource* out);
+
+	/*
+	* Look up the `count` resources starting at `refs` without adding
+	* any, writing the codes of those which are found into `out`.
+	* Returns the positions of those which aren't, in order.
+	*/
+	std::vector<size_t> find(const ResourceRef* refs, size_t count, CodedResource* out) const;
+
+	/*
+	* Decode the `count` codes starting at `codes` into `out`
+	* (e.g. a column of a `ColumnBatch`), taking the lock once.
+	*/
+	void decode(const CodedResource* codes, size_t count, Resource* out) const;
+
+	// the number of resources encoded so far
+	size_t size() const;
+
+	/*
+	* If `log` is non-null, every new resource encoded from now on is
+	* appended to it (see `dbsi_log.h`).
+	*/
+	void set_log(WriteAheadLog* log);
+
+	/*
+	* Write the dictionary to an image, or replace it with one read
+	* from an image (see `dbsi_image.h`). Opening uses the image's
+	* heap and hash table in place, so takes constant time.
+	* If opening fails (with `std::runtime_error`), the dictionary
+	* must be cleared before it is used again.
+	*/
+	void save(ImageWriter& out) const;
+	void open(ImageReader& in);
+
+	void clear();
+
 private:
-	std::unordered_map<Resource, CodedResource> m_encoder;
+	// looks codes up by the resource they hold in the heap
+	struct EncoderPolicy
+	{
+		const Dictionary* dict;
+
+		size_t hash(const ResourceRef& r) const;
+		size_t hash_slot(const CodedResource& i) const;
+		bool equal(const CodedResource& i, const ResourceRef& r) const;
+	};
+
+	/*
+	* The heap entry for code `i`: a byte holding the index of its
+	* type in `Resource` (i.e. Literal or IRI), followed by its string.
+	*/
+	std::string_view entry(CodedResource i) const;
+
+	// the implementation of `decode`, with the lock already held
+	Resource decode_locked(CodedResource i) const;
+
+	// the implementation of `encode`, with the exclusive lock already
+	// held
+	CodedResource encode_locked(const ResourceRef& r);
+
+	static size_t hash_entry(std::uint8_t kind, std::string_view val);
 
+private:
 	/*
-	* Store pointers here rather than the `Resource`, to prevent
-	* duplication of memory by a factor of 2.
-	* (note that `std::unordered_map` guarantees that elements'
-	* pointers are never invalidated, even though their iterators
-	* may be)
+	* All of the heap entries, back-to-back, in order of code, so that
+	* entry `i` spans `m_offsets[i]` to `m_offsets[i + 1]`. This is far
+	* smaller than a `Resource` object per code, and can be saved and
+	* opened as it is.
+	* The heap is in two parts: the entries which were opened from an
+	* image, which stay in the mapped file, followed by the entries
+	* encoded since, in `m_heap`.
 	*/
-	std::vector<const Resource*> m_decoder;
+	const char* m_mapped_heap;
+	size_t m_mapped_heap_size;
+	std::shared_ptr<const void> m_mapping;
+	std::vector<char> m_heap;
+	SegmentedVector<std::uint64_t> m_offsets;
+
+	FlatHashTable<CodedResource, EncoderPolicy> m_encoder;
+
+	WriteAheadLog* m_log;
+
+	// `decode`, and `encode` of a resource seen before, only need a
+	// shared lock; adding a resource takes an exclusive one
+	mutable std::shared_mutex m_mutex;
 };
 
 
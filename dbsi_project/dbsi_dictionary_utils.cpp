@@ -1,3 +1,5 @@
+#include <vector>
+#include <optional>
 #include "dbsi_dictionary_utils.h"
 #include "dbsi_dictionary.h"
 #include "dbsi_assert.h"
@@ -113,6 +115,28 @@ VarMap decode(const Dictionary& dict, const CodedVarMap& cvm)
 }
 
 
+/*
+* Refill `batch` from `iter`, and decode each of its columns into the
+* vector of `columns` for it, with one call of the batched
+* `Dictionary::decode` per column rather than one per value. This is
+* how the autodecoding iterators read their input, a batch at a time.
+*/
+template<typename T>
+static void decode_next_batch(const Dictionary& dict, ICodedRowIterator<T>& iter,
+	ColumnBatch& batch, std::vector<std::vector<Resource>>& columns)
+{
+	DBSI_CHECK_PRECOND(columns.size() == batch.num_columns());
+
+	batch.clear();
+	iter.next_batch(batch);
+	for (size_t c = 0; c < columns.size(); ++c)
+	{
+		columns[c].resize(batch.num_rows());
+		dict.decode(batch.column(c), batch.num_rows(), columns[c].data());
+	}
+}
+
+
 std::unique_ptr<ICodedTripleIterator> autoencode(
 	Dictionary& dict, std::unique_ptr<ITripleIterator> iter)
 {
@@ -162,39 +186,58 @@ std::unique_ptr<ITripleIterator> autodecode(
 {
 	DBSI_CHECK_PRECOND(iter != nullptr);
 
-	// simple wrapper around the given iterator which calls `decode` in `current`
+	// wrapper around the given iterator which decodes its triples a
+	// batch at a time (see `decode_next_batch`)
 	class AutodecodingTripleIterator :
 		public ITripleIterator
 	{
 	public:
 		AutodecodingTripleIterator(
 			const Dictionary& dict, std::unique_ptr<ICodedTripleIterator> iter) :
-			m_dict(dict), m_iter(std::move(iter))
+			m_dict(dict), m_iter(std::move(iter)),
+			m_batch(3), m_columns(3), m_row(0)
 		{ }
 
 		void start() override
 		{
 			m_iter->start();
+			fill();
 		}
 
 		Triple current() const override
 		{
-			return decode(m_dict, m_iter->current());
+			DBSI_CHECK_PRECOND(valid());
+			return { m_columns[0][m_row], m_columns[1][m_row], m_columns[2][m_row] };
 		}
 
 		void next() override
 		{
-			m_iter->next();
+			DBSI_CHECK_PRECOND(valid());
+			if (++m_row == m_batch.num_rows())
+				fill();
 		}
 
 		bool valid() const override
 		{
-			return m_iter->valid();
+			return m_row < m_batch.num_rows();
+		}
+
+	private:
+		void fill()
+		{
+			decode_next_batch(m_dict, *m_iter, m_batch, m_columns);
+			m_row = 0;
 		}
 
 	private:
 		const Dictionary& m_dict;
 		std::unique_ptr<ICodedTripleIterator> m_iter;
+
+		// the current batch, decoded column by column, and the row
+		// of it which is current
+		ColumnBatch m_batch;
+		std::vector<std::vector<Resource>> m_columns;
+		size_t m_row;
 	};
 
 	return std::make_unique<AutodecodingTripleIterator>(dict, std::move(iter));
@@ -250,39 +293,74 @@ std::unique_ptr<IVarMapIterator> autodecode(
 {
 	DBSI_CHECK_PRECOND(iter != nullptr);
 
-	// simple wrapper around the given iterator which calls `decode` in `current`
+	// wrapper around the given iterator which decodes its maps a batch
+	// at a time (see `decode_next_batch`), as columns of the values of
+	// their variables, which are the same for every map
 	class AutodecodingVarMapIterator :
 		public IVarMapIterator
 	{
 	public:
 		AutodecodingVarMapIterator(
 			const Dictionary& dict, std::unique_ptr<ICodedVarMapIterator> iter) :
-			m_dict(dict), m_iter(std::move(iter))
+			m_dict(dict), m_iter(std::move(iter)), m_row(0)
 		{ }
 
 		void start() override
 		{
 			m_iter->start();
+			m_batch.reset();
+			m_row = 0;
+			if (!m_iter->valid())
+				return;
+
+			// (the variables are taken from the first map)
+			m_vars.clear();
+			for (const auto& pair : m_iter->current())
+				m_vars.push_back(pair.first);
+			m_batch.emplace(m_vars.size());
+			m_columns.resize(m_vars.size());
+			fill();
 		}
 
 		VarMap current() const override
 		{
-			return decode(m_dict, m_iter->current());
+			DBSI_CHECK_PRECOND(valid());
+			VarMap vm;
+			for (size_t c = 0; c < m_vars.size(); ++c)
+				vm.emplace_hint(vm.end(), m_vars[c], m_columns[c][m_row]);
+			return vm;
 		}
 
 		void next() override
 		{
-			m_iter->next();
+			DBSI_CHECK_PRECOND(valid());
+			if (++m_row == m_batch->num_rows())
+				fill();
 		}
 
 		bool valid() const override
 		{
-			return m_iter->valid();
+			return m_batch.has_value() && m_row < m_batch->num_rows();
+		}
+
+	private:
+		void fill()
+		{
+			decode_next_batch(m_dict, *m_iter, *m_batch, m_columns);
+			m_row = 0;
 		}
 
 	private:
 		const Dictionary& m_dict;
 		std::unique_ptr<ICodedVarMapIterator> m_iter;
+
+		// the maps' variables, in order, and the current batch, decoded
+		// column by column (once `start` has found the variables), and
+		// the row of it which is current
+		std::vector<Variable> m_vars;
+		std::optional<ColumnBatch> m_batch;
+		std::vector<std::vector<Resource>> m_columns;
+		size_t m_row;
 	};
 
 	return std::make_unique<AutodecodingVarMapIterator>(dict, std::move(iter));
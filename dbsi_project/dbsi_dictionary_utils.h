@@ -29,6 +29,10 @@ VarMap decode(const Dictionary& dict, const CodedVarMap& cvm);
 * encodes its outputs. Subsumes management of the given input
 * iterator. Warning: `dict` must remain alive for the entire
 * duration of the returned iterator's lifetime.
+* The decoding iterators read their input a batch at a time (see
+* `ICodedRowIterator::next_batch`), decoding a column of each batch
+* at a time, so the maps which a decoded map iterator reads must all
+* have the same variables, as the results of a join do.
 */
 std::unique_ptr<ICodedTripleIterator> autoencode(
 	Dictionary& dict, std::unique_ptr<ITripleIterator> iter);
@@ -0,0 +1,446 @@
+#include <algorithm>
+#include <numeric>
+#include <tuple>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include "dbsi_dump.h"
+#include "dbsi_assert.h"
+
+
+namespace dbsi
+{
+
+
+static const char DUMP_MAGIC[8] = { 'D', 'B', 'S', 'I', 'D', 'U', 'M', 'P' };
+static const std::uint64_t DUMP_VERSION = 1;
+
+
+// the index of IRIs in `Resource`, which come first in a dump
+static const size_t IRI_INDEX = 1;
+static_assert(std::is_same_v<std::variant_alternative_t<IRI_INDEX, Resource>, IRI>);
+
+
+// the number of triples decoded at a time while writing a Turtle
+// dump, and of resources encoded at a time while loading a binary one
+static const size_t BATCH_SIZE = 4096;
+
+// output is buffered until there is this much of it
+static const size_t WRITE_BUFFER_SIZE = size_t(1) << 20;
+
+
+namespace
+{
+
+
+/*
+* Buffers the output of a dump, and writes its varints.
+*/
+class DumpWriter
+{
+public:
+	explicit DumpWriter(std::ostream& out) :
+		m_out(out)
+	{
+		m_buffer.reserve(WRITE_BUFFER_SIZE);
+	}
+
+	void varint(std::uint64_t x)
+	{
+		while (x >= 0x80)
+		{
+			m_buffer.push_back(static_cast<char>((x & 0x7F) | 0x80));
+			x >>= 7;
+		}
+		m_buffer.push_back(static_cast<char>(x));
+		if (m_buffer.size() >= WRITE_BUFFER_SIZE)
+			flush();
+	}
+
+	void bytes(std::string_view s)
+	{
+		m_buffer.append(s);
+		if (m_buffer.size() >= WRITE_BUFFER_SIZE)
+			flush();
+	}
+
+	// throws `std::runtime_error` if anything failed to be written
+	void finish()
+	{
+		flush();
+		m_out.flush();
+		if (!m_out)
+			throw std::runtime_error("Failed to write the dump.");
+	}
+
+private:
+	void flush()
+	{
+		m_out.write(m_buffer.data(), m_buffer.size());
+		m_buffer.clear();
+	}
+
+private:
+	std::ostream& m_out;
+	std::string m_buffer;
+};
+
+
+/*
+* Reads the varints and strings of a binary dump, in place. All
+* functions throw `std::runtime_error` if they would go past the end.
+*/
+class DumpReader
+{
+public:
+	DumpReader(const char* data, size_t size) :
+		m_pos(data),
+		m_end(data + size)
+	{ }
+
+	std::uint64_t varint()
+	{
+		std::uint64_t x = 0;
+		for (unsigned shift = 0; ; shift += 7)
+		{
+			if (m_pos == m_end)
+				throw corrupted("it ends part-way through");
+			const std::uint64_t byte = static_cast<unsigned char>(*m_pos++);
+
+			// (the tenth byte may only hold the top bit)
+			if (shift == 63 && byte > 1)
+				throw corrupted("a number is too big");
+			x |= (byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+				return x;
+		}
+	}
+
+	/*
+	* A varint giving the number of things to follow, each of which
+	* takes at least `min_bytes`, so that it can be checked against
+	* what is left of the file before anything is allocated for them.
+	*/
+	size_t count(size_t min_bytes)
+	{
+		const std::uint64_t n = varint();
+		if (n > remaining() / min_bytes)
+			throw corrupted("a count is too big");
+		return static_cast<size_t>(n);
+	}
+
+	std::string_view bytes(std::uint64_t n)
+	{
+		if (n > remaining())
+			throw corrupted("it ends part-way through");
+		const std::string_view s(m_pos, static_cast<size_t>(n));
+		m_pos += n;
+		return s;
+	}
+
+	size_t remaining() const
+	{
+		return static_cast<size_t>(m_end - m_pos);
+	}
+
+	static std::runtime_error corrupted(const std::string& reason)
+	{
+		return std::runtime_error("Corrupted dump: " + reason + ".");
+	}
+
+private:
+	const char* m_pos;
+	const char* m_end;
+};
+
+
+}  // namespace
+
+
+static const std::string& value_of(const Resource& r)
+{
+	return std::visit([](const auto& x) -> const std::string& { return x.val; }, r);
+}
+
+
+static std::vector<CodedTriple> read_triples(const RDFIndex& idx)
+{
+	std::vector<CodedTriple> triples;
+	triples.reserve(idx.size());
+	auto iter = idx.full_scan();
+	for (iter->start(); iter->valid(); iter->next())
+		triples.push_back(iter->current());
+	return triples;
+}
+
+
+void write_turtle_dump(std::ostream& out, const Dictionary& dict, const RDFIndex& idx)
+{
+	const std::vector<CodedTriple> triples = read_triples(idx);
+
+	// decode the triples a batch at a time
+	std::vector<CodedResource> codes;
+	std::vector<Resource> resources(3 * BATCH_SIZE);
+	for (size_t first = 0; first < triples.size(); first += BATCH_SIZE)
+	{
+		const size_t n = std::min(BATCH_SIZE, triples.size() - first);
+		codes.clear();
+		for (size_t i = first; i < first + n; ++i)
+			codes.insert(codes.end(), { triples[i].sub, triples[i].pred, triples[i].obj });
+		dict.decode(codes.data(), codes.size(), resources.data());
+
+		for (size_t i = 0; i < codes.size(); i += 3)
+		{
+			out << DbsiToStringVisitor()(resources[i]) << ' '
+				<< DbsiToStringVisitor()(resources[i + 1]) << ' '
+				<< DbsiToStringVisitor()(resources[i + 2]) << " .\n";
+		}
+	}
+
+	out.flush();
+	if (!out)
+		throw std::runtime_error("Failed to write the dump.");
+}
+
+
+void write_binary_dump(std::ostream& out, const Dictionary& dict, const RDFIndex& idx)
+{
+	std::vector<CodedTriple> triples = read_triples(idx);
+
+	// the codes which the triples use (which needn't be all of those
+	// in the dictionary, e.g. if triples have been deleted)
+	std::vector<CodedResource> codes;
+	{
+		std::vector<bool> used(dict.size());
+		for (const CodedTriple& t : triples)
+		{
+			for (CodedResource c : { t.sub, t.pred, t.obj })
+			{
+				DBSI_CHECK_INVARIANT(c < used.size());
+				if (!used[c])
+				{
+					used[c] = true;
+					codes.push_back(c);
+				}
+			}
+		}
+	}
+	std::vector<Resource> resources(codes.size());
+	dict.decode(codes.data(), codes.size(), resources.data());
+
+	// sort the resources into the order of the dictionary section, and
+	// number them in that order
+	std::vector<size_t> order(codes.size());
+	std::iota(order.begin(), order.end(), size_t(0));
+	std::sort(order.begin(), order.end(), [&resources](size_t a, size_t b)
+		{
+			const bool a_iri = (resources[a].index() == IRI_INDEX);
+			const bool b_iri = (resources[b].index() == IRI_INDEX);
+			if (a_iri != b_iri)
+				return a_iri;
+			return value_of(resources[a]) < value_of(resources[b]);
+		});
+	const size_t num_iris = static_cast<size_t>(std::count_if(resources.begin(), resources.end(),
+		[](const Resource& r) { return r.index() == IRI_INDEX; }));
+
+	std::vector<CodedResource> number_of(dict.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		number_of[codes[order[i]]] = static_cast<CodedResource>(i);
+
+	DumpWriter writer(out);
+	writer.bytes(std::string_view(DUMP_MAGIC, sizeof(DUMP_MAGIC)));
+	writer.varint(DUMP_VERSION);
+	writer.varint(num_iris);
+	writer.varint(codes.size() - num_iris);
+
+	// the dictionary, front-coded within each of its two parts
+	std::string_view prev;
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		const std::string_view val = value_of(resources[order[i]]);
+		size_t shared = 0;
+		if (i != num_iris)
+		{
+			const size_t max_shared = std::min(prev.size(), val.size());
+			while (shared < max_shared && prev[shared] == val[shared])
+				++shared;
+		}
+		writer.varint(shared);
+		writer.varint(val.size() - shared);
+		writer.bytes(val.substr(shared));
+		prev = val;
+	}
+
+	// the triples, by number
+	for (CodedTriple& t : triples)
+		t = CodedTriple{ number_of[t.sub], number_of[t.pred], number_of[t.obj] };
+	std::sort(triples.begin(), triples.end(), [](const CodedTriple& a, const CodedTriple& b)
+		{
+			return std::tie(a.sub, a.pred, a.obj) < std::tie(b.sub, b.pred, b.obj);
+		});
+
+	writer.varint(triples.size());
+	for (size_t first = 0; first < triples.size(); )
+	{
+		const CodedResource sub = triples[first].sub;
+		size_t last = first + 1;
+		while (last < triples.size() && triples[last].sub == sub)
+			++last;
+
+		writer.varint(first == 0 ? sub : sub - triples[first - 1].sub);
+		writer.varint(last - first);
+		for (size_t i = first; i < last; ++i)
+		{
+			const CodedTriple& t = triples[i];
+			if (i != first && t.pred == triples[i - 1].pred)
+			{
+				writer.varint(0);
+				writer.varint(t.obj - triples[i - 1].obj);
+			}
+			else
+			{
+				writer.varint(i == first ? t.pred : t.pred - triples[i - 1].pred);
+				writer.varint(t.obj);
+			}
+		}
+		first = last;
+	}
+
+	writer.finish();
+}
+
+
+/*
+* Read `count` resources of the dictionary section of a dump, appending
+* their values back-to-back to `values`, and the end of each to `ends`.
+*/
+static void read_resources(DumpReader& in, size_t count,
+	std::string& values, std::vector<size_t>& ends)
+{
+	std::string prev;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const std::uint64_t shared = in.varint();
+		if (shared > prev.size())
+			throw DumpReader::corrupted("a shared prefix is too long");
+		const std::string_view rest = in.bytes(in.varint());
+		prev.resize(static_cast<size_t>(shared));
+		prev.append(rest);
+		values.append(prev);
+		ends.push_back(values.size());
+	}
+}
+
+
+size_t load_binary_dump(const MappedFile& file, Dictionary& dict, RDFIndex& idx,
+	ThreadPool& pool, size_t num_threads)
+{
+	DumpReader in(file.data(), file.size());
+	if (file.size() < sizeof(DUMP_MAGIC)
+		|| std::memcmp(in.bytes(sizeof(DUMP_MAGIC)).data(), DUMP_MAGIC, sizeof(DUMP_MAGIC)) != 0)
+	{
+		throw std::runtime_error("Not a binary DBSI dump.");
+	}
+	if (in.varint() != DUMP_VERSION)
+		throw std::runtime_error("Unsupported dump version.");
+
+	// (each resource takes at least two bytes, for its lengths)
+	const size_t num_iris = in.count(2);
+	const size_t num_literals = in.count(2);
+	const size_t num_resources = num_iris + num_literals;
+
+	// the triples are held by number until the whole file has been
+	// checked, so the numbers must fit (and if they don't, neither
+	// would the codes)
+	if (num_resources != 0 && num_resources - 1 > std::numeric_limits<CodedResource>::max())
+	{
+		throw std::overflow_error("Too many distinct resources for the coded resource width; "
+			"consider building without DBSI_32_BIT_IDS.");
+	}
+
+	// nothing is encoded until the whole file has been read, so the
+	// values are kept until then
+	std::string values;
+	std::vector<size_t> ends;
+	ends.reserve(num_resources);
+	read_resources(in, num_iris, values, ends);
+	read_resources(in, num_literals, values, ends);
+
+	// the number which is `gap` after `base`, which must be a resource
+	auto number = [num_resources](std::uint64_t base, std::uint64_t gap)
+	{
+		if (gap >= num_resources - base)
+			throw DumpReader::corrupted("a triple refers to a resource which isn't in it");
+		return static_cast<size_t>(base + gap);
+	};
+
+	// (and each triple takes at least two bytes, for its predicate
+	// and object)
+	const size_t num_triples = in.count(2);
+	std::vector<CodedTriple> triples;
+	triples.reserve(num_triples);
+	size_t sub = 0;
+	while (triples.size() < num_triples)
+	{
+		const std::uint64_t sub_gap = in.varint();
+		if (!triples.empty() && sub_gap == 0)
+			throw DumpReader::corrupted("the triples are out of order");
+		sub = number(triples.empty() ? 0 : sub, sub_gap);
+
+		const std::uint64_t group_size = in.varint();
+		if (group_size == 0 || group_size > num_triples - triples.size())
+			throw DumpReader::corrupted("a group of triples has the wrong size");
+
+		size_t pred = 0, obj = 0;
+		for (std::uint64_t i = 0; i < group_size; ++i)
+		{
+			const std::uint64_t pred_gap = in.varint();
+			if (i != 0 && pred_gap == 0)
+			{
+				const std::uint64_t obj_gap = in.varint();
+				if (obj_gap == 0)
+					throw DumpReader::corrupted("the triples are out of order");
+				obj = number(obj, obj_gap);
+			}
+			else
+			{
+				pred = number(pred, pred_gap);
+				obj = number(0, in.varint());
+			}
+			triples.push_back(CodedTriple{ static_cast<CodedResource>(sub),
+				static_cast<CodedResource>(pred), static_cast<CodedResource>(obj) });
+		}
+	}
+	if (in.remaining() != 0)
+		throw DumpReader::corrupted("there is more after the triples");
+
+	// the file is valid, so now encode the resources, a batch at a time
+	std::vector<CodedResource> codes(num_resources);
+	std::vector<ResourceRef> refs;
+	for (size_t first = 0; first < num_resources; first += BATCH_SIZE)
+	{
+		const size_t n = std::min(BATCH_SIZE, num_resources - first);
+		refs.clear();
+		for (size_t i = first; i < first + n; ++i)
+		{
+			const size_t begin = (i == 0) ? 0 : ends[i - 1];
+			refs.push_back(ResourceRef{ i < num_iris,
+				std::string_view(values.data() + begin, ends[i] - begin) });
+		}
+		dict.encode(refs.data(), n, codes.data() + first);
+	}
+
+	// and turn the numbers into codes
+	for (CodedTriple& t : triples)
+		t = CodedTriple{ codes[t.sub], codes[t.pred], codes[t.obj] };
+
+	if (num_threads > 1)
+		return idx.parallel_load(triples, pool, num_threads);
+	return idx.bulk_load(std::move(triples));
+}
+
+
+}  // namespace dbsi
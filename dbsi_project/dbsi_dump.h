@@ -0,0 +1,81 @@
+#ifndef DBSI_DUMP_H
+#define DBSI_DUMP_H
+
+
+#include <ostream>
+#include "dbsi_image.h"
+#include "dbsi_dictionary.h"
+#include "dbsi_rdf_index.h"
+#include "dbsi_thread_pool.h"
+
+
+namespace dbsi
+{
+
+
+/*
+* A "dump" is a file holding the triples of the database, written by
+* the `DUMP` command and read back by `LOAD`. Unlike an image (see
+* `dbsi_image.h`), a dump only holds the triples themselves, so it
+* can be loaded into a database which already has triples in it, and
+* by any build, on any platform.
+*
+* A dump is either a Turtle file, with a triple per line, or (for
+* `DUMP <file> BINARY`) a compact binary file in the style of HDT
+* (Fernandez et al., "Binary RDF Representation for Publication and
+* Exchange", 2013), which is several times smaller and quicker to
+* load. Its integers are all varints (7 bits per byte, least
+* significant first, with the top bit set on all but the last byte),
+* and it consists of:
+* 1. A header: the magic "DBSIDUMP", and then the version, the number
+*    of IRIs and the number of Literals.
+* 2. The dictionary: the IRIs, and then the Literals, each in sorted
+*    order and front-coded: each is the length of the prefix which it
+*    shares with the one before it, and then the length and bytes of
+*    the rest of it. The resources are numbered in this order, from
+*    0, and are referred to by these numbers below, rather than by
+*    the codes which they have in the database.
+* 3. The triples: their number, and then the triples sorted by
+*    subject, predicate and object, in a group per subject. A group
+*    is the gap between its subject and the one before it (or the
+*    subject itself, for the first), and its number of triples, and
+*    then for each triple, the gap between its predicate and the one
+*    before it in the group (or the predicate itself, for the first),
+*    and then, if that is zero (and it isn't the first), the gap
+*    between its object and the one before it, and otherwise the
+*    object itself.
+*/
+
+
+/*
+* Write every triple in `idx` to `out` as Turtle, or in the binary
+* format.
+* Nothing else may be modifying the database meanwhile.
+*/
+void write_turtle_dump(std::ostream& out, const Dictionary& dict, const RDFIndex& idx);
+void write_binary_dump(std::ostream& out, const Dictionary& dict, const RDFIndex& idx);
+
+
+/*
+* Load the triples of a binary dump into `idx`, using `num_threads`
+* threads from `pool` (see `RDFIndex::parallel_load`) if that is more
+* than one. The whole file is read and checked first, and only then
+* is each resource encoded into `dict`, just once, in a batch (see
+* `Dictionary::encode`), after which the triples are turned into codes
+* by looking up their numbers in an array, so are never hashed on the
+* way in.
+* Returns the number of triples read, as `RDFIndex::bulk_load` does.
+* Throws `std::runtime_error` if the file isn't a valid dump, in
+* which case neither `dict` nor `idx` is changed, or
+* `std::overflow_error` if there are too many resources for the coded
+* resource width (see `dbsi_types.h`), in which case resources which
+* were encoded before that was found are left in `dict`.
+*/
+size_t load_binary_dump(const MappedFile& file, Dictionary& dict, RDFIndex& idx,
+	ThreadPool& pool, size_t num_threads);
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_DUMP_H
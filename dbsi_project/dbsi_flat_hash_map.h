@@ -0,0 +1,551 @@
+#ifndef DBSI_FLAT_HASH_MAP_H
+#define DBSI_FLAT_HASH_MAP_H
+
+
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "dbsi_types.h"
+#include "dbsi_assert.h"
+#include "dbsi_image.h"
+
+
+namespace dbsi
+{
+
+
+/*
+* An open-addressing hash table, using linear probing, which stores
+* its elements ("slots") directly in one array, rather than in heap
+* allocated nodes like `std::unordered_map`.
+* Alongside the slot array is an array of one-byte control words,
+* which say whether each slot is full, and if so, hold 7 bits of its
+* hash, so that most unsuccessful key comparisons are avoided without
+* touching the slot array at all.
+*
+* The table is parameterised by a `Policy`, which says how to hash
+* and compare slots. This allows slots to be smaller than a full
+* key/value pair (see `rdf_idx_helper::TripleIndex`). A policy must
+* provide:
+* - `size_t hash(const K&) const` for each type of key K you want
+*   to look up with, and
+* - `size_t hash_slot(const Slot&) const`, consistent with the above,
+*   which is used when growing the table, and
+* - `bool equal(const Slot&, const K&) const`.
+* Hashes are mixed again by the table, so the identity function is an
+* acceptable hash for integer keys.
+*
+* WARNING: unlike `std::unordered_map`, inserting into this table may
+* move all of its elements, invalidating all pointers into it.
+* Slots must be trivially copyable.
+*
+* The table supports two kinds of concurrency:
+* - one thread inserting, while others look up keys using `View`s
+* - concurrent insertion (`insert_concurrent`) by several threads,
+*   provided that enough room has been `reserve`d beforehand, so
+*   that it never needs to grow.
+*/
+template<typename Slot, typename Policy>
+class FlatHashTable
+{
+private:
+	// the arrays, which are shared with any `View`s of the table
+	struct Storage
+	{
+		explicit Storage(size_t capacity) :
+			capacity(capacity),
+			owned_ctrl(new std::uint8_t[capacity]()),  // i.e. `CTRL_EMPTY`
+			owned_slots(new Slot[capacity]()),
+			ctrl(owned_ctrl.get()),
+			slots(owned_slots.get())
+		{ }
+
+		// use arrays in an image's mapped file, keeping it alive
+		Storage(size_t capacity, std::uint8_t* ctrl, Slot* slots, std::shared_ptr<const void> mapping) :
+			capacity(capacity),
+			ctrl(ctrl),
+			slots(slots),
+			mapping(std::move(mapping))
+		{ }
+
+		// invariant: this is a power of two
+		size_t capacity;
+
+		// the arrays, which are either owned here, or mapped
+		std::unique_ptr<std::uint8_t[]> owned_ctrl;
+		std::unique_ptr<Slot[]> owned_slots;
+		std::uint8_t* ctrl;
+		Slot* slots;
+		std::shared_ptr<const void> mapping;
+	};
+
+public:
+	/*
+	* A read-only view of the table, which other threads can use to
+	* look up keys while one thread is inserting into the table.
+	* Insertions made after the view was created may or may not be
+	* visible through it: if the table grows, the view keeps using
+	* (and keeping alive) the old arrays.
+	* Values in slots which may be modified at the same time must
+	* be read atomically.
+	*/
+	class View
+	{
+	public:
+		template<typename K>
+		const Slot* find(const K& key) const
+		{
+			return find_in(m_storage.get(), m_policy, key);
+		}
+
+	private:
+		friend class FlatHashTable;
+
+		View(std::shared_ptr<const Storage> storage, Policy policy) :
+			m_storage(std::move(storage)),
+			m_policy(std::move(policy))
+		{ }
+
+	private:
+		std::shared_ptr<const Storage> m_storage;
+		Policy m_policy;
+	};
+
+	FlatHashTable(Policy policy = Policy()) :
+		m_policy(std::move(policy)),
+		m_size(0),
+		m_storage(nullptr)
+	{ }
+
+	// views may share our storage, so don't copy
+	FlatHashTable(const FlatHashTable&) = delete;
+	FlatHashTable& operator=(const FlatHashTable&) = delete;
+
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	size_t capacity() const { return (m_storage != nullptr) ? m_storage->capacity : 0; }
+
+	/*
+	* Create a view of the table as it is now; see `View`.
+	* This is safe to call while another thread is inserting.
+	*/
+	View view() const
+	{
+		std::lock_guard<std::mutex> lock(m_published_mutex);
+		return View(m_published, m_policy);
+	}
+
+	/*
+	* Returns a pointer to the slot matching `key`, or null if
+	* there isn't one.
+	*/
+	template<typename K>
+	Slot* find(const K& key)
+	{
+		return const_cast<Slot*>(find_in(m_storage, m_policy, key));
+	}
+	template<typename K>
+	const Slot* find(const K& key) const
+	{
+		return find_in(m_storage, m_policy, key);
+	}
+
+	/*
+	* If there is a slot matching `key`, returns a pointer to it
+	* and false. Else, inserts `slot` (which must match `key`) and
+	* returns a pointer to it and true.
+	* This is safe to do while other threads are using `View`s.
+	*/
+	template<typename K>
+	std::pair<Slot*, bool> insert(const K& key, const Slot& slot)
+	{
+		DBSI_CHECK_PRECOND(m_policy.equal(slot, key));
+
+		// grow before probing, so that the position we find is
+		// still valid when we insert
+		if ((m_size + 1) * 8 > capacity() * 7)
+			rehash(std::max<size_t>(16, 2 * capacity()));
+
+		const std::uint64_t h = hash_mix(m_policy.hash(key));
+		const std::uint8_t tag = tag_of(h);
+		const size_t mask = capacity() - 1;
+		std::uint8_t* ctrl = m_storage->ctrl;
+		Slot* slots = m_storage->slots;
+		size_t i = h & mask;
+		for (; ctrl[i] != CTRL_EMPTY; i = (i + 1) & mask)
+		{
+			if (ctrl[i] == tag && m_policy.equal(slots[i], key))
+				return std::make_pair(&slots[i], false);
+		}
+
+		// readers only look at the slot once they see its tag
+		slots[i] = slot;
+		std::atomic_ref<std::uint8_t>(ctrl[i]).store(tag, std::memory_order_release);
+		++m_size;
+		return std::make_pair(&slots[i], true);
+	}
+
+	/*
+	* Thread-safe version of `insert`, which may be called by many
+	* threads at once, as long as no other member functions are
+	* being called at the same time. Instead of a slot, this takes
+	* a function `make_slot` to create it, which is only called if
+	* an insertion is actually going to happen (and then exactly
+	* once, by the inserting thread). This allows the slot to hold
+	* resources which must not be wasted on duplicates, like IDs.
+	* Precondition: there is room for the new element without
+	* growing, according to `reserve`.
+	*/
+	template<typename K, typename MakeSlot>
+	std::pair<Slot*, bool> insert_concurrent(const K& key, MakeSlot make_slot)
+	{
+		DBSI_CHECK_PRECOND((std::atomic_ref<size_t>(m_size).load(std::memory_order_relaxed) + 1) * 8
+			<= capacity() * 7);
+
+		const std::uint64_t h = hash_mix(m_policy.hash(key));
+		const std::uint8_t tag = tag_of(h);
+		const size_t mask = capacity() - 1;
+		for (size_t i = h & mask; ; i = (i + 1) & mask)
+		{
+			std::atomic_ref<std::uint8_t> ctrl(m_storage->ctrl[i]);
+			std::uint8_t c = ctrl.load(std::memory_order_acquire);
+
+			// try to claim the empty slot; while it is `CTRL_BUSY`
+			// nobody else will read or write it
+			if (c == CTRL_EMPTY && ctrl.compare_exchange_strong(c, CTRL_BUSY,
+				std::memory_order_acquire))
+			{
+				m_storage->slots[i] = make_slot();
+				DBSI_CHECK_POSTCOND(m_policy.equal(m_storage->slots[i], key));
+				ctrl.store(tag, std::memory_order_release);
+				std::atomic_ref<size_t>(m_size).fetch_add(1, std::memory_order_relaxed);
+				return std::make_pair(&m_storage->slots[i], true);
+			}
+
+			// else somebody else has this slot, but if they are still
+			// creating it, we must wait to see if it is our key
+			while (c == CTRL_BUSY)
+			{
+				std::this_thread::yield();
+				c = ctrl.load(std::memory_order_acquire);
+			}
+			if (c == tag && m_policy.equal(m_storage->slots[i], key))
+				return std::make_pair(&m_storage->slots[i], false);
+		}
+	}
+
+	/*
+	* Make enough room for `n` elements in total, so that no
+	* growing is done until there are more than `n` elements.
+	*/
+	void reserve(size_t n)
+	{
+		const size_t new_capacity = capacity_for(n);
+		if (new_capacity > capacity())
+			rehash(new_capacity);
+	}
+
+	/*
+	* Shrink the table to the smallest capacity which `reserve`
+	* would give for its current size.
+	*/
+	void shrink_to_fit()
+	{
+		const size_t new_capacity = capacity_for(m_size);
+		if (m_size == 0)
+			clear();
+		else if (new_capacity < capacity())
+			rehash(new_capacity);
+	}
+
+	void clear()
+	{
+		publish(nullptr);
+		m_storage = nullptr;
+		m_size = 0;
+	}
+
+	/*
+	* Write the table to an image, as its raw arrays.
+	*/
+	void save(ImageWriter& out) const
+	{
+		out.write_value<std::uint64_t>(m_size);
+		out.write_array(capacity() > 0 ? m_storage->ctrl : nullptr, capacity());
+		out.write_array(capacity() > 0 ? m_storage->slots : nullptr, capacity());
+	}
+
+	/*
+	* Replace the contents with a table read from an image, which
+	* uses its arrays in place (until it next grows). The image
+	* must have been written with an equivalent policy.
+	*/
+	void open(ImageReader& in)
+	{
+		clear();
+
+		const auto size = in.read_value<std::uint64_t>();
+		auto [ctrl, num_ctrl] = in.read_array<std::uint8_t>();
+		auto [slots, num_slots] = in.read_array<Slot>();
+		if (num_ctrl != num_slots || (num_ctrl & (num_ctrl - 1)) != 0 || size * 8 > num_ctrl * 7)
+			throw std::runtime_error("Corrupted image: bad hash table.");
+
+		if (num_ctrl > 0)
+		{
+			auto storage = std::make_shared<Storage>(num_ctrl, ctrl, slots, in.mapping());
+			m_storage = storage.get();
+			publish(std::move(storage));
+		}
+		m_size = size;
+	}
+
+	// iteration over the full slots, in no particular order
+	class const_iterator
+	{
+	public:
+		const_iterator(const FlatHashTable& table, size_t i) :
+			m_table(&table), m_i(i)
+		{
+			skip_empty();
+		}
+
+		const Slot& operator*() const { return m_table->m_storage->slots[m_i]; }
+		const Slot* operator->() const { return &m_table->m_storage->slots[m_i]; }
+		const_iterator& operator++()
+		{
+			++m_i;
+			skip_empty();
+			return *this;
+		}
+		bool operator==(const const_iterator& other) const { return m_i == other.m_i; }
+		bool operator!=(const const_iterator& other) const { return m_i != other.m_i; }
+
+	private:
+		void skip_empty()
+		{
+			while (m_i < m_table->capacity() && m_table->m_storage->ctrl[m_i] == CTRL_EMPTY)
+				++m_i;
+		}
+
+	private:
+		const FlatHashTable* m_table;
+		size_t m_i;
+	};
+
+	const_iterator begin() const { return const_iterator(*this, 0); }
+	const_iterator end() const { return const_iterator(*this, capacity()); }
+
+private:
+	static constexpr std::uint8_t CTRL_EMPTY = 0;
+
+	// a slot which is in the middle of being inserted by
+	// `insert_concurrent`, and which is neither empty nor full
+	static constexpr std::uint8_t CTRL_BUSY = 1;
+
+	// full slots always have their top bit set, so are never `CTRL_EMPTY`
+	static std::uint8_t tag_of(std::uint64_t h)
+	{
+		return static_cast<std::uint8_t>(0x80 | (h >> 57));
+	}
+
+	static size_t capacity_for(size_t n)
+	{
+		size_t capacity = 16;
+		while (n * 8 > capacity * 7)
+			capacity *= 2;
+		return capacity;
+	}
+
+	/*
+	* The lookup shared by the table and its views. This may run
+	* while another thread is inserting into `storage`, which is
+	* fine because slots are written before their control bytes.
+	*/
+	template<typename K>
+	static const Slot* find_in(const Storage* storage, const Policy& policy, const K& key)
+	{
+		if (storage == nullptr)
+			return nullptr;
+
+		const std::uint64_t h = hash_mix(policy.hash(key));
+		const std::uint8_t tag = tag_of(h);
+		const size_t mask = storage->capacity - 1;
+		for (size_t i = h & mask; ; i = (i + 1) & mask)
+		{
+			const std::uint8_t c = std::atomic_ref<std::uint8_t>(
+				storage->ctrl[i]).load(std::memory_order_acquire);
+			if (c == CTRL_EMPTY)
+				return nullptr;
+			if (c == tag && policy.equal(storage->slots[i], key))
+				return &storage->slots[i];
+		}
+	}
+
+	/*
+	* Move everything into new arrays. The old ones are left alone
+	* (rather than being modified in place) for the sake of any views
+	* still using them.
+	*/
+	void rehash(size_t new_capacity)
+	{
+		DBSI_CHECK_PRECOND((new_capacity & (new_capacity - 1)) == 0);
+		DBSI_CHECK_PRECOND(m_size * 8 <= new_capacity * 7);
+
+		auto new_storage = std::make_shared<Storage>(new_capacity);
+		const size_t mask = new_capacity - 1;
+
+		for (size_t j = 0; j < capacity(); ++j)
+		{
+			if (m_storage->ctrl[j] == CTRL_EMPTY)
+				continue;
+
+			const std::uint64_t h = hash_mix(m_policy.hash_slot(m_storage->slots[j]));
+			size_t i = h & mask;
+			while (new_storage->ctrl[i] != CTRL_EMPTY)
+				i = (i + 1) & mask;
+			new_storage->ctrl[i] = tag_of(h);
+			new_storage->slots[i] = m_storage->slots[j];
+		}
+
+		m_storage = new_storage.get();
+		publish(std::move(new_storage));
+	}
+
+	/*
+	* Replace the storage given to new views. This is rare (only
+	* when growing) so a lock is fine.
+	*/
+	void publish(std::shared_ptr<Storage> storage)
+	{
+		std::lock_guard<std::mutex> lock(m_published_mutex);
+		m_published = std::move(storage);
+	}
+
+private:
+	Policy m_policy;
+	size_t m_size;
+
+	// the current arrays, which we own via `m_published`
+	// (this is just a shortcut to save taking the lock)
+	Storage* m_storage;
+	std::shared_ptr<Storage> m_published;
+	mutable std::mutex m_published_mutex;
+};
+
+
+/*
+* The slot type of `FlatHashMap`. Named for consistency with
+* `std::pair`, which is what `std::unordered_map` uses.
+*/
+template<typename Key, typename Value>
+struct FlatHashMapSlot
+{
+	Key first;
+	Value second;
+};
+
+
+template<typename Key, typename Value, typename Hash>
+struct FlatHashMapPolicy
+{
+	size_t hash(const Key& k) const
+	{
+		return Hash()(k);
+	}
+	size_t hash_slot(const FlatHashMapSlot<Key, Value>& s) const
+	{
+		return Hash()(s.first);
+	}
+	bool equal(const FlatHashMapSlot<Key, Value>& s, const Key& k) const
+	{
+		return s.first == k;
+	}
+};
+
+
+/*
+* A flat replacement for `std::unordered_map`, in the common case
+* where the key can just be hashed and compared.
+*/
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class FlatHashMap :
+	public FlatHashTable<FlatHashMapSlot<Key, Value>, FlatHashMapPolicy<Key, Value, Hash>>
+{
+public:
+	typedef FlatHashMapSlot<Key, Value> Slot;
+
+	// see `FlatHashTable::View`
+	class View
+	{
+	public:
+		const Value* find(const Key& key) const
+		{
+			const Slot* s = m_view.find(key);
+			return (s != nullptr) ? &s->second : nullptr;
+		}
+
+	private:
+		friend class FlatHashMap;
+
+		explicit View(typename FlatHashMap::FlatHashTable::View view) :
+			m_view(std::move(view))
+		{ }
+
+	private:
+		typename FlatHashMap::FlatHashTable::View m_view;
+	};
+
+	View view() const
+	{
+		return View(FlatHashMap::FlatHashTable::view());
+	}
+
+	/*
+	* Returns a pointer to the value for `key`, or null.
+	*/
+	Value* find(const Key& key)
+	{
+		Slot* s = FlatHashMap::FlatHashTable::find(key);
+		return (s != nullptr) ? &s->second : nullptr;
+	}
+	const Value* find(const Key& key) const
+	{
+		const Slot* s = FlatHashMap::FlatHashTable::find(key);
+		return (s != nullptr) ? &s->second : nullptr;
+	}
+
+	/*
+	* Insert `value` for `key` if `key` is not already present.
+	* Returns a pointer to the value now associated with `key`,
+	* and whether or not an insertion happened.
+	*/
+	std::pair<Value*, bool> insert(const Key& key, const Value& value)
+	{
+		auto [s, is_new] = FlatHashMap::FlatHashTable::insert(key, Slot{ key, value });
+		return std::make_pair(&s->second, is_new);
+	}
+
+	/*
+	* Thread-safe version of `insert`; see
+	* `FlatHashTable::insert_concurrent`. `make_value` is only
+	* called if an insertion is going to happen.
+	*/
+	template<typename MakeValue>
+	std::pair<Value*, bool> insert_concurrent(const Key& key, MakeValue make_value)
+	{
+		auto [s, is_new] = FlatHashMap::FlatHashTable::insert_concurrent(key,
+			[&key, &make_value]() { return Slot{ key, make_value() }; });
+		return std::make_pair(&s->second, is_new);
+	}
+};
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_FLAT_HASH_MAP_H
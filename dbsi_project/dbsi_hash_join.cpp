@@ -0,0 +1,254 @@
+#include <array>
+#include <algorithm>
+#include "dbsi_hash_join.h"
+#include "dbsi_assert.h"
+#include "dbsi_flat_hash_map.h"
+
+
+namespace dbsi
+{
+namespace joins
+{
+
+
+class HashJoinIterator :
+	public ISlotRowIterator
+{
+public:
+	HashJoinIterator(
+		std::unique_ptr<ISlotRowIterator> probe,
+		const CodedTriplePattern& build_pattern,
+		std::unique_ptr<ICodedTripleIterator> build) :
+		m_probe(std::move(probe)),
+		m_build(std::move(build)),
+		m_slots(m_probe->slots(), { build_pattern }),
+		m_probe_out(m_slots.find_all(m_probe->slots())),
+		m_built(false),
+		m_row(m_slots.size()),
+		m_valid(false),
+		m_match(0),
+		m_matches_end(0)
+	{
+		// each of the pattern's variables (at the first place it
+		// appears) is either a join variable, and so part of the key,
+		// or is only bound by the build side
+		const VariableSlots& probe_slots = m_probe->slots();
+		for (size_t i = 0; i < 3; ++i)
+		{
+			const CodedTerm& term = build_pattern.*PATTERN_TERMS[i];
+			if (!std::holds_alternative<Variable>(term))
+				continue;
+			const Variable& var = std::get<Variable>(term);
+			if (std::any_of(PATTERN_TERMS.begin(), PATTERN_TERMS.begin() + i,
+				[&](auto term_ptr) { return build_pattern.*term_ptr == term; }))
+			{
+				continue;
+			}
+
+			const size_t probe_slot = probe_slots.find(var);
+			if (probe_slot != VariableSlots::NO_SLOT)
+			{
+				m_key_columns.push_back(i);
+				m_probe_key_slots.push_back(probe_slot);
+			}
+			else
+			{
+				m_build_columns.push_back(i);
+				m_build_out.push_back(m_slots.find(var));
+			}
+		}
+	}
+
+	void start() override
+	{
+		// the build side never changes, so is only read once
+		if (!m_built)
+			build_table();
+
+		m_probe->start();
+		find_matches();
+	}
+
+	void next() override
+	{
+		DBSI_CHECK_PRECOND(valid());
+
+		if (++m_match == m_matches_end)
+		{
+			m_probe->next();
+			find_matches();
+		}
+		else
+		{
+			bind_match();
+		}
+	}
+
+	bool valid() const override
+	{
+		return m_valid;
+	}
+
+	const VariableSlots& slots() const override
+	{
+		return m_slots;
+	}
+
+	const CodedResource* row() const override
+	{
+		DBSI_CHECK_PRECOND(valid());
+		return m_row.data();
+	}
+
+private:
+	static constexpr std::array<CodedTerm CodedTriplePattern::*, 3> PATTERN_TERMS = {
+		&CodedTriplePattern::sub, &CodedTriplePattern::pred, &CodedTriplePattern::obj };
+
+	// the values of the join variables in a result (of which there
+	// are at most three, since they are all in one pattern), followed
+	// by zeros
+	typedef std::array<CodedResource, 3> Key;
+
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const
+		{
+			return hash_combine(hash_combine(hash_mix(key[0]), key[1]), key[2]);
+		}
+	};
+
+	void build_table()
+	{
+		// the group (i.e. key) of each triple, in the order of
+		// `m_build`, and its values of the other variables
+		std::vector<size_t> group_of;
+		std::vector<CodedResource> values;
+		std::vector<size_t> group_sizes;
+
+		ColumnBatch batch(3);
+		for (m_build->start(); m_build->valid(); )
+		{
+			batch.clear();
+			m_build->next_batch(batch);
+			for (size_t r = 0; r < batch.num_rows(); ++r)
+			{
+				Key key{};
+				for (size_t k = 0; k < m_key_columns.size(); ++k)
+					key[k] = batch.column(m_key_columns[k])[r];
+				const auto [group, is_new] = m_table.insert(key, group_sizes.size());
+				if (is_new)
+					group_sizes.push_back(0);
+				++group_sizes[*group];
+				group_of.push_back(*group);
+
+				for (size_t col : m_build_columns)
+					values.push_back(batch.column(col)[r]);
+			}
+		}
+
+		// then lay the rows out by group, keeping them in the order of
+		// `m_build` within each group
+		m_group_starts.assign(group_sizes.size() + 1, 0);
+		for (size_t g = 0; g < group_sizes.size(); ++g)
+			m_group_starts[g + 1] = m_group_starts[g] + group_sizes[g];
+
+		const size_t width = m_build_columns.size();
+		std::vector<size_t> next_row(m_group_starts.begin(), m_group_starts.end() - 1);
+		m_build_rows.resize(values.size());
+		for (size_t i = 0; i < group_of.size(); ++i)
+		{
+			const size_t row = next_row[group_of[i]]++;
+			std::copy(values.begin() + i * width, values.begin() + (i + 1) * width,
+				m_build_rows.begin() + row * width);
+		}
+
+		m_built = true;
+
+		// nothing else will be read from it
+		m_build.reset();
+	}
+
+	/*
+	* Move `m_probe` on to the first result (including the current
+	* one) which has any matches, and bind the first of them. The
+	* iterator is invalid if there are none.
+	*/
+	void find_matches()
+	{
+		for (; m_probe->valid(); m_probe->next())
+		{
+			const CodedResource* const probe_row = m_probe->row();
+			Key key{};
+			for (size_t k = 0; k < m_probe_key_slots.size(); ++k)
+				key[k] = probe_row[m_probe_key_slots[k]];
+
+			if (const size_t* group = m_table.find(key))
+			{
+				for (size_t i = 0; i < m_probe_out.size(); ++i)
+					m_row[m_probe_out[i]] = probe_row[i];
+				m_match = m_group_starts[*group];
+				m_matches_end = m_group_starts[*group + 1];
+				bind_match();
+				m_valid = true;
+				return;
+			}
+		}
+		m_valid = false;
+	}
+
+	// write the values of match `m_match` into `m_row`
+	void bind_match()
+	{
+		const CodedResource* const values = m_build_rows.data() + m_match * m_build_out.size();
+		for (size_t j = 0; j < m_build_out.size(); ++j)
+			m_row[m_build_out[j]] = values[j];
+	}
+
+private:
+	std::unique_ptr<ISlotRowIterator> m_probe;
+	std::unique_ptr<ICodedTripleIterator> m_build;
+	const VariableSlots m_slots;
+
+	// the slot of each of `m_probe`'s slots in `m_slots`
+	const std::vector<size_t> m_probe_out;
+
+	// the join variables, as the columns of the build side's triples
+	// (sub, pred, obj) and the slots of `m_probe`'s rows which they
+	// are in, in the same order
+	std::vector<size_t> m_key_columns, m_probe_key_slots;
+
+	// the build side's other variables, as the columns of its triples
+	// and their slots in `m_slots`, in the same order
+	std::vector<size_t> m_build_columns, m_build_out;
+
+	// the group of the build side's triples with each key, whose rows
+	// (the values of `m_build_columns`, back-to-back) are
+	// `m_group_starts[g]` up to `m_group_starts[g + 1]` of `m_build_rows`
+	FlatHashMap<Key, size_t, KeyHash> m_table;
+	std::vector<size_t> m_group_starts;
+	std::vector<CodedResource> m_build_rows;
+	bool m_built;
+
+	// invariant: if `valid()`, the current result of `m_probe` has
+	// matches `m_match` up to `m_matches_end` of `m_build_rows`, the
+	// current one being `m_match`, and `m_row` is the two together
+	SlotBinding m_row;
+	bool m_valid;
+	size_t m_match, m_matches_end;
+};
+
+
+std::unique_ptr<ISlotRowIterator> create_hash_join_iterator(
+	std::unique_ptr<ISlotRowIterator> probe,
+	const CodedTriplePattern& build_pattern,
+	std::unique_ptr<ICodedTripleIterator> build)
+{
+	DBSI_CHECK_PRECOND(probe != nullptr && build != nullptr);
+
+	return std::make_unique<HashJoinIterator>(std::move(probe), build_pattern,
+		std::move(build));
+}
+
+
+}  // namespace joins
+}  // namespace dbsi
@@ -0,0 +1,46 @@
+#ifndef DBSI_HASH_JOIN_H
+#define DBSI_HASH_JOIN_H
+
+
+#include <vector>
+#include <memory>
+#include "dbsi_types.h"
+#include "dbsi_iterator.h"
+#include "dbsi_slots.h"
+
+
+namespace dbsi
+{
+namespace joins
+{
+
+
+/*
+* Creates an iterator which returns the join of `probe` and the
+* triples `build`, which must all match `build_pattern`, on the
+* variables which they have in common, using a hash join.
+* The first time it is started, all of `build` is read into a hash
+* table on the values of the shared variables. Then, for each result
+* of `probe`, the matching triples of `build` are found with a single
+* lookup, rather than by evaluating anything again, as a nested loop
+* join would. So this is best when `probe` has many results, and
+* `build` has few enough to hold in memory.
+* Results are returned in the order of `probe`, and then of `build`.
+* If there are no shared variables, this is the cross product.
+* The rows are read from `probe`, and returned, as bindings of slots
+* (see `ISlotRowIterator`), and the table is keyed on arrays of codes
+* and holds the rest of the matches' values flat, grouped by key, so
+* nothing is allocated per row.
+*/
+std::unique_ptr<ISlotRowIterator> create_hash_join_iterator(
+	std::unique_ptr<ISlotRowIterator> probe,
+	const CodedTriplePattern& build_pattern,
+	std::unique_ptr<ICodedTripleIterator> build
+);
+
+
+}  // namespace joins
+}  // namespace dbsi
+
+
+#endif  // DBSI_HASH_JOIN_H
@@ -0,0 +1,191 @@
+#include <cstring>
+#include <algorithm>
+#include "dbsi_image.h"
+#include "dbsi_assert.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+namespace dbsi
+{
+
+
+// the header is the magic string followed by the format version
+static const char IMAGE_MAGIC[8] = { 'D', 'B', 'S', 'I', 'I', 'M', 'G', '\0' };
+static const std::uint64_t IMAGE_VERSION = 2;
+
+
+#ifdef _WIN32
+
+
+MappedFile::MappedFile(const std::string& filename) :
+	m_data(nullptr), m_size(0), m_mapping(nullptr)
+{
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Cannot open file '" + filename + "'.");
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		throw std::runtime_error("File '" + filename + "' is empty or unreadable.");
+	}
+
+	// (the mapping object keeps the file open)
+	m_mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (m_mapping == nullptr)
+		throw std::runtime_error("Cannot map file '" + filename + "'.");
+
+	m_data = static_cast<char*>(MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0));
+	if (m_data == nullptr)
+	{
+		CloseHandle(m_mapping);
+		throw std::runtime_error("Cannot map file '" + filename + "'.");
+	}
+	m_size = static_cast<size_t>(size.QuadPart);
+}
+
+
+MappedFile::~MappedFile()
+{
+	UnmapViewOfFile(m_data);
+	CloseHandle(m_mapping);
+}
+
+
+#else
+
+
+MappedFile::MappedFile(const std::string& filename) :
+	m_data(nullptr), m_size(0)
+{
+	const int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Cannot open file '" + filename + "'.");
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		throw std::runtime_error("File '" + filename + "' is empty or unreadable.");
+	}
+
+	// (the mapping keeps the file open)
+	void* p = ::mmap(nullptr, static_cast<size_t>(st.st_size),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED)
+		throw std::runtime_error("Cannot map file '" + filename + "'.");
+
+	m_data = static_cast<char*>(p);
+	m_size = static_cast<size_t>(st.st_size);
+}
+
+
+MappedFile::~MappedFile()
+{
+	::munmap(m_data, m_size);
+}
+
+
+#endif  // _WIN32
+
+
+ImageWriter::ImageWriter(std::ostream& out) :
+	m_out(out), m_pos(0)
+{
+	write_bytes(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	write_bytes(&IMAGE_VERSION, sizeof(IMAGE_VERSION));
+	pad();
+}
+
+
+void ImageWriter::begin_array(size_t elem_size, size_t count)
+{
+	const std::uint64_t header[2] = { elem_size, count };
+	write_bytes(header, sizeof(header));
+	pad();
+}
+
+
+void ImageWriter::write_bytes(const void* data, size_t num_bytes)
+{
+	m_out.write(static_cast<const char*>(data), static_cast<std::streamsize>(num_bytes));
+	m_pos += num_bytes;
+}
+
+
+void ImageWriter::end_array()
+{
+	pad();
+}
+
+
+void ImageWriter::finish()
+{
+	m_out.flush();
+	if (!m_out)
+		throw std::runtime_error("Failed to write the image.");
+}
+
+
+void ImageWriter::pad()
+{
+	static const char zeros[IMAGE_ALIGNMENT] = {};
+	write_bytes(zeros, (IMAGE_ALIGNMENT - m_pos % IMAGE_ALIGNMENT) % IMAGE_ALIGNMENT);
+}
+
+
+ImageReader::ImageReader(std::shared_ptr<MappedFile> file) :
+	m_file(std::move(file)), m_pos(IMAGE_ALIGNMENT)
+{
+	DBSI_CHECK_PRECOND(m_file != nullptr);
+
+	std::uint64_t version = 0;
+	if (m_file->size() < IMAGE_ALIGNMENT
+		|| std::memcmp(m_file->data(), IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0)
+		throw std::runtime_error("Not a DBSI image.");
+
+	std::memcpy(&version, m_file->data() + sizeof(IMAGE_MAGIC), sizeof(version));
+	if (version != IMAGE_VERSION)
+		throw std::runtime_error("Unsupported image version.");
+}
+
+
+std::pair<char*, size_t> ImageReader::read_array_bytes(size_t elem_size)
+{
+	std::uint64_t header[2];
+	if (m_file->size() - m_pos < IMAGE_ALIGNMENT)
+		throw std::runtime_error("Corrupted image: unexpected end of file.");
+	std::memcpy(header, m_file->data() + m_pos, sizeof(header));
+	m_pos += IMAGE_ALIGNMENT;
+
+	// this catches images written by a build with a different ID width
+	if (header[0] != elem_size)
+		throw std::runtime_error("Image was written by an incompatible build.");
+
+	const std::uint64_t count = header[1];
+	if (count > (m_file->size() - m_pos) / elem_size)
+		throw std::runtime_error("Corrupted image: unexpected end of file.");
+
+	char* data = m_file->data() + m_pos;
+	const std::uint64_t num_bytes = count * elem_size;
+	m_pos += num_bytes + (IMAGE_ALIGNMENT - num_bytes % IMAGE_ALIGNMENT) % IMAGE_ALIGNMENT;
+	m_pos = std::min<std::uint64_t>(m_pos, m_file->size());
+
+	return std::make_pair(data, static_cast<size_t>(count));
+}
+
+
+}  // namespace dbsi
@@ -0,0 +1,161 @@
+#ifndef DBSI_IMAGE_H
+#define DBSI_IMAGE_H
+
+
+#include <string>
+#include <memory>
+#include <ostream>
+#include <utility>
+#include <cstdint>
+#include <stdexcept>
+
+
+namespace dbsi
+{
+
+
+/*
+* An "image" is a binary file holding the whole database (see the
+* `SAVE` and `OPEN` commands), laid out exactly as it is in memory,
+* so that it can be opened by mapping the file into memory and using
+* its arrays in place, without any parsing or rebuilding.
+*
+* The file is a short header, followed by a sequence of arrays, each
+* of which is an element size and count followed by the raw elements.
+* Arrays start at multiples of `IMAGE_ALIGNMENT` so that they are
+* suitably aligned once mapped. What the arrays mean is up to the
+* classes writing and reading them (see their `save` and `open`
+* functions), which must read them back in the same order.
+*
+* Note: because the elements are written raw (and hash tables are
+* written with their hashes baked in), an image can only be opened
+* by a build with the same ID width, on the same platform.
+*/
+static const size_t IMAGE_ALIGNMENT = 64;
+
+
+/*
+* A file mapped into memory. The mapping is private and writable:
+* writes are copy-on-write, so go to memory rather than the file,
+* which means that the arrays of an opened image can be modified
+* in place just like any others.
+*/
+class MappedFile
+{
+public:
+	// throws `std::runtime_error` if the file can't be mapped
+	explicit MappedFile(const std::string& filename);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	char* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	char* m_data;
+	size_t m_size;
+#ifdef _WIN32
+	void* m_mapping;
+#endif
+};
+
+
+/*
+* Writes an image to a (binary) output stream.
+*/
+class ImageWriter
+{
+public:
+	// writes the header
+	explicit ImageWriter(std::ostream& out);
+
+	template<typename T>
+	void write_array(const T* data, size_t count)
+	{
+		begin_array(sizeof(T), count);
+		write_bytes(data, count * sizeof(T));
+		end_array();
+	}
+
+	template<typename T>
+	void write_value(const T& x)
+	{
+		write_array(&x, 1);
+	}
+
+	/*
+	* Write an array in pieces, for when the elements aren't all
+	* contiguous in memory: `begin_array`, then `write_bytes` for
+	* exactly `elem_size * count` bytes in total, then `end_array`.
+	*/
+	void begin_array(size_t elem_size, size_t count);
+	void write_bytes(const void* data, size_t num_bytes);
+	void end_array();
+
+	/*
+	* Throws `std::runtime_error` if anything failed to be written.
+	*/
+	void finish();
+
+private:
+	void pad();
+
+private:
+	std::ostream& m_out;
+	std::uint64_t m_pos;
+};
+
+
+/*
+* Reads the arrays of an image, returning pointers into the mapped
+* file rather than copying them.
+* All functions throw `std::runtime_error` if the file is not a
+* valid image (or is not in the layout expected of it).
+*/
+class ImageReader
+{
+public:
+	// checks the header
+	explicit ImageReader(std::shared_ptr<MappedFile> file);
+
+	/*
+	* Returns a pointer to, and the size of, the next array, whose
+	* elements must be of type T.
+	*/
+	template<typename T>
+	std::pair<T*, size_t> read_array()
+	{
+		auto [data, count] = read_array_bytes(sizeof(T));
+		return std::make_pair(reinterpret_cast<T*>(data), count);
+	}
+
+	template<typename T>
+	T read_value()
+	{
+		auto [data, count] = read_array<T>();
+		if (count != 1)
+			throw std::runtime_error("Corrupted image: expected a single value.");
+		return *data;
+	}
+
+	/*
+	* Returns an owner of the mapping, which anything holding
+	* pointers returned by `read_array` should keep hold of.
+	*/
+	std::shared_ptr<const void> mapping() const { return m_file; }
+
+private:
+	std::pair<char*, size_t> read_array_bytes(size_t elem_size);
+
+private:
+	std::shared_ptr<MappedFile> m_file;
+	std::uint64_t m_pos;
+};
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_IMAGE_H
@@ -3,6 +3,7 @@
 
 
 #include "dbsi_types.h"
+#include "dbsi_column_batch.h"
 #include <optional>
 
 
@@ -36,10 +37,66 @@ public:
 };
 
 
+/*
+* An iterator over rows of codes, which can also return its values
+* a batch at a time (see `ColumnBatch`). The columns of a coded triple
+* are its subject, predicate and object, and those of a coded variable
+* map are the values of its variables, in order of variable (so, for
+* the results of a join, the slots of `VariableSlots`).
+*/
+template<typename T>
+class ICodedRowIterator :
+	public IIterator<T>
+{
+public:
+	/*
+	* Add the rows from the current one onwards to `batch`, until
+	* either it is full or this iterator is finished, and move this
+	* iterator on past them. `batch` must have a column for each of
+	* the rows' columns.
+	* By default this uses `current` and `next` for each row; the
+	* iterators which produce the most rows do better.
+	*/
+	virtual void next_batch(ColumnBatch& batch)
+	{
+		while (this->valid() && !batch.full())
+		{
+			batch.push_back(this->current());
+			this->next();
+		}
+	}
+};
+
+
 typedef IIterator<Triple> ITripleIterator;
-typedef IIterator<CodedTriple> ICodedTripleIterator;
+typedef ICodedRowIterator<CodedTriple> ICodedTripleIterator;
 typedef IIterator<VarMap> IVarMapIterator;
-typedef IIterator<CodedVarMap> ICodedVarMapIterator;
+typedef ICodedRowIterator<CodedVarMap> ICodedVarMapIterator;
+
+
+/*
+* An iterator over the triples which match a pattern, which can be
+* pointed at another pattern in place, rather than being replaced by
+* a new iterator. This is for the inner loops of joins, which look up
+* the same pattern with different constants once per outer result, so
+* that they don't allocate an iterator each time.
+*/
+class IMatchIterator :
+	public ICodedTripleIterator
+{
+public:
+	/*
+	* Iterate over the matches of `pattern` instead. This leaves the
+	* iterator invalid, until `start` is called.
+	*/
+	virtual void rebind(const CodedTriplePattern& pattern) = 0;
+
+	/*
+	* The number of rows of the index read so far, for every pattern
+	* this has been bound to, including any which didn't match.
+	*/
+	virtual size_t rows_scanned() const = 0;
+};
 
 
 }  // namespace dbsi
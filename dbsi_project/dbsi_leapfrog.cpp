@@ -0,0 +1,486 @@
+#include <algorithm>
+#include "dbsi_leapfrog.h"
+#include "dbsi_assert.h"
+#include "dbsi_pattern_utils.h"
+
+
+namespace dbsi
+{
+namespace joins
+{
+
+
+/*
+* The matches of a pattern, as a trie over its variables (in the
+* order of the join): stored as the rows of their values, sorted
+* lexicographically, and without duplicates, in a single array.
+* Each node of the trie at depth `d` is then a contiguous range of
+* rows, which agree on their first `d` columns.
+*/
+class TrieRelation
+{
+public:
+	TrieRelation(const RDFIndex::Snapshot& snapshot, const CodedTriplePattern& pattern,
+		std::vector<Variable> vars, StepProfile* profile) :
+		m_vars(std::move(vars))
+	{
+		const size_t arity = m_vars.size();
+
+		// the component of the triples which each variable is bound to
+		std::vector<CodedResource CodedTriple::*> columns;
+		for (const Variable& var : m_vars)
+		{
+			if (pattern.sub == CodedTerm(var))
+				columns.push_back(&CodedTriple::sub);
+			else if (pattern.pred == CodedTerm(var))
+				columns.push_back(&CodedTriple::pred);
+			else
+			{
+				DBSI_CHECK_PRECOND(pattern.obj == CodedTerm(var));
+				columns.push_back(&CodedTriple::obj);
+			}
+		}
+
+		auto iter = snapshot.match(pattern);
+		if (profile != nullptr)
+			iter = profile_matches(std::move(iter), *profile);
+		size_t num_matches = 0;
+		for (iter->start(); iter->valid(); iter->next())
+		{
+			const CodedTriple t = iter->current();
+			for (auto column : columns)
+				m_values.push_back(t.*column);
+			++num_matches;
+		}
+
+		// sort the rows, via their indices, and then copy them
+		// back in that order, leaving out duplicates
+		std::vector<size_t> rows(arity == 0 ? 0 : num_matches);
+		for (size_t i = 0; i < rows.size(); ++i)
+			rows[i] = i;
+		auto row_less = [this, arity](size_t a, size_t b)
+		{
+			return std::lexicographical_compare(
+				m_values.begin() + a * arity, m_values.begin() + (a + 1) * arity,
+				m_values.begin() + b * arity, m_values.begin() + (b + 1) * arity);
+		};
+		std::sort(rows.begin(), rows.end(), row_less);
+		std::vector<CodedResource> sorted;
+		sorted.reserve(m_values.size());
+		for (size_t i = 0; i < rows.size(); ++i)
+		{
+			if (i > 0 && !row_less(rows[i - 1], rows[i]))
+				continue;  // a duplicate
+			sorted.insert(sorted.end(), m_values.begin() + rows[i] * arity,
+				m_values.begin() + (rows[i] + 1) * arity);
+		}
+		m_values = std::move(sorted);
+
+		// a pattern with no variables has one empty row if it matches
+		m_num_rows = (arity == 0) ? std::min<size_t>(num_matches, 1) : m_values.size() / arity;
+	}
+
+	const std::vector<Variable>& vars() const
+	{
+		return m_vars;
+	}
+
+	size_t num_rows() const
+	{
+		return m_num_rows;
+	}
+
+	CodedResource value(size_t row, size_t col) const
+	{
+		return m_values[row * m_vars.size() + col];
+	}
+
+private:
+	const std::vector<Variable> m_vars;
+	std::vector<CodedResource> m_values;
+	size_t m_num_rows;
+};
+
+
+/*
+* The trie iterator interface of leapfrog triejoin, over a
+* `TrieRelation`: it is positioned at a node of the trie (starting at
+* the root), and at one of the values of that node's children.
+*/
+class TrieIterator
+{
+public:
+	explicit TrieIterator(const TrieRelation& rel) :
+		m_rel(rel)
+	{ }
+
+	// descend to the first child of the current value (or, from the
+	// root, to the first value of the first column)
+	void open()
+	{
+		DBSI_CHECK_PRECOND(m_levels.size() < m_rel.vars().size());
+
+		Level level;
+		if (m_levels.empty())
+		{
+			level.begin = 0;
+			level.end = m_rel.num_rows();
+		}
+		else
+		{
+			DBSI_CHECK_PRECOND(!at_end());
+			const Level& parent = m_levels.back();
+			level.begin = parent.pos;
+			level.end = find_first(parent.pos, parent.end, m_levels.size() - 1,
+				key(), true);
+		}
+		level.pos = level.begin;
+		m_levels.push_back(level);
+	}
+
+	// return to the parent of the current node
+	void up()
+	{
+		DBSI_CHECK_PRECOND(!m_levels.empty());
+		m_levels.pop_back();
+	}
+
+	CodedResource key() const
+	{
+		DBSI_CHECK_PRECOND(!at_end());
+		return m_rel.value(m_levels.back().pos, m_levels.size() - 1);
+	}
+
+	// move on to the next value
+	void next()
+	{
+		DBSI_CHECK_PRECOND(!at_end());
+		Level& level = m_levels.back();
+		level.pos = find_first(level.pos, level.end, m_levels.size() - 1, key(), true);
+	}
+
+	// move on to the first value which is at least `k` (this never
+	// moves backwards)
+	void seek(CodedResource k)
+	{
+		DBSI_CHECK_PRECOND(!at_end());
+		Level& level = m_levels.back();
+		level.pos = find_first(level.pos, level.end, m_levels.size() - 1, k, false);
+	}
+
+	bool at_end() const
+	{
+		DBSI_CHECK_PRECOND(!m_levels.empty());
+		return m_levels.back().pos == m_levels.back().end;
+	}
+
+	// return to the root
+	void reset()
+	{
+		m_levels.clear();
+	}
+
+private:
+	/*
+	* The first row in [`begin`, `end`), whose column `col` is sorted,
+	* at which that column is at least (or if `strictly`, more than)
+	* `k`. This gallops forwards from `begin` before binary searching,
+	* since seeks are usually short.
+	*/
+	size_t find_first(size_t begin, size_t end, size_t col, CodedResource k,
+		bool strictly) const
+	{
+		auto before = [&](size_t row)
+		{
+			const CodedResource v = m_rel.value(row, col);
+			return strictly ? (v <= k) : (v < k);
+		};
+
+		// invariant: every row before `lo` is before `k`
+		size_t lo = begin, step = 1;
+		while (lo + step <= end && before(lo + step - 1))
+		{
+			lo += step;
+			step *= 2;
+		}
+
+		// now the answer is in [`lo`, `hi`]
+		size_t hi = std::min(lo + step - 1, end);
+		while (lo < hi)
+		{
+			const size_t mid = lo + (hi - lo) / 2;
+			if (before(mid))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+
+private:
+	struct Level
+	{
+		size_t begin, end;  // the rows of the current node
+		size_t pos;  // the first row with the current value
+	};
+
+	const TrieRelation& m_rel;
+	std::vector<Level> m_levels;
+};
+
+
+class LeapfrogJoinIterator :
+	public ICodedVarMapIterator
+{
+public:
+	LeapfrogJoinIterator(
+		std::shared_ptr<const RDFIndex::Snapshot> snapshot,
+		std::vector<CodedTriplePattern> patterns,
+		std::vector<Variable> var_order,
+		StepProfile* profiles) :
+		m_snapshot(std::move(snapshot)),
+		m_patterns(std::move(patterns)),
+		m_vars(std::move(var_order)),
+		m_profiles(profiles),
+		m_depth(0),
+		m_valid(false)
+	{ }
+
+	void start() override
+	{
+		// the tries never change, so are only built once
+		if (m_snapshot != nullptr)
+			build_tries();
+
+		for (auto& iter : m_iters)
+			iter.reset();
+
+		// if any pattern has no matches, then neither does the join
+		// (which is all that the patterns with no variables do)
+		bool all_match = true;
+		for (const auto& rel : m_relations)
+			all_match &= (rel.num_rows() > 0);
+
+		m_keys.assign(m_vars.size(), CodedResource());
+		if (!all_match)
+		{
+			m_valid = false;
+		}
+		else if (m_vars.empty())
+		{
+			m_valid = true;
+		}
+		else
+		{
+			m_depth = 0;
+			find_result(open_level());
+		}
+	}
+
+	CodedVarMap current() const override
+	{
+		DBSI_CHECK_PRECOND(valid());
+
+		CodedVarMap vm;
+		for (size_t i = 0; i < m_vars.size(); ++i)
+			vm.emplace(m_vars[i], m_keys[i]);
+		return vm;
+	}
+
+	void next() override
+	{
+		DBSI_CHECK_PRECOND(valid());
+
+		if (m_vars.empty())
+			m_valid = false;
+		else
+			find_result(next_key());
+	}
+
+	bool valid() const override
+	{
+		return m_valid;
+	}
+
+private:
+	void build_tries()
+	{
+		m_relations.reserve(m_patterns.size());
+		for (size_t i = 0; i < m_patterns.size(); ++i)
+		{
+			const CodedTriplePattern& pat = m_patterns[i];
+
+			// the pattern's variables, in the join's order
+			const CodedVarMap pat_vars = extract_map(pat);
+			std::vector<Variable> vars;
+			for (const Variable& var : m_vars)
+			{
+				if (pat_vars.find(var) != pat_vars.end())
+					vars.push_back(var);
+			}
+			DBSI_CHECK_PRECOND(vars.size() == pat_vars.size());
+
+			m_relations.emplace_back(*m_snapshot, pat, std::move(vars),
+				m_profiles != nullptr ? &m_profiles[i] : nullptr);
+		}
+
+		// then the tries which take part in binding each variable
+		m_level_iters.resize(m_vars.size());
+		for (const auto& rel : m_relations)
+		{
+			const size_t iter_idx = m_iters.size();
+			m_iters.emplace_back(rel);
+			for (const Variable& var : rel.vars())
+			{
+				const size_t depth = std::find(m_vars.begin(), m_vars.end(), var)
+					- m_vars.begin();
+				m_level_iters[depth].push_back(iter_idx);
+			}
+		}
+		m_level_pos.assign(m_vars.size(), 0);
+		// (otherwise a variable isn't in any of the patterns)
+		DBSI_CHECK_PRECOND(std::none_of(m_level_iters.begin(), m_level_iters.end(),
+			[](const auto& iters) { return iters.empty(); }));
+
+		// nothing else will be read from it
+		m_snapshot.reset();
+	}
+
+	/*
+	* Starting from a state where `found` says whether the tries at
+	* `m_depth` have been leapfrogged to a common value, carry on
+	* until every variable is bound (and so this is valid), or there
+	* are no more results.
+	*/
+	void find_result(bool found)
+	{
+		while (true)
+		{
+			if (found)
+			{
+				m_keys[m_depth] = m_iters[m_level_iters[m_depth][0]].key();
+				if (m_depth + 1 == m_vars.size())
+				{
+					m_valid = true;
+					return;
+				}
+				++m_depth;
+				found = open_level();
+			}
+			else
+			{
+				for (size_t idx : m_level_iters[m_depth])
+					m_iters[idx].up();
+				if (m_depth == 0)
+				{
+					m_valid = false;
+					return;
+				}
+				--m_depth;
+				found = next_key();
+			}
+		}
+	}
+
+	/*
+	* Open the tries at `m_depth`, and leapfrog them to their first
+	* common value. Returns whether there is one.
+	*/
+	bool open_level()
+	{
+		auto& level = m_level_iters[m_depth];
+		bool any_at_end = false;
+		for (size_t idx : level)
+		{
+			m_iters[idx].open();
+			any_at_end |= m_iters[idx].at_end();
+		}
+		if (any_at_end)
+			return false;
+
+		// the leapfrog visits the tries in order of their values
+		std::sort(level.begin(), level.end(), [this](size_t a, size_t b)
+			{ return m_iters[a].key() < m_iters[b].key(); });
+		m_level_pos[m_depth] = 0;
+		return leapfrog_search();
+	}
+
+	/*
+	* Move the tries at `m_depth` on from their common value to the
+	* next. Returns whether there is one.
+	*/
+	bool next_key()
+	{
+		const auto& level = m_level_iters[m_depth];
+		size_t& p = m_level_pos[m_depth];
+		m_iters[level[p]].next();
+		if (m_iters[level[p]].at_end())
+			return false;
+		p = (p + 1) % level.size();
+		return leapfrog_search();
+	}
+
+	/*
+	* The leapfrog: repeatedly seek the trie with the smallest value
+	* to the largest value, until they all agree.
+	*/
+	bool leapfrog_search()
+	{
+		const auto& level = m_level_iters[m_depth];
+		size_t& p = m_level_pos[m_depth];
+		CodedResource max_key = m_iters[level[(p + level.size() - 1) % level.size()]].key();
+		while (true)
+		{
+			TrieIterator& iter = m_iters[level[p]];
+			if (iter.key() == max_key)
+				return true;
+			iter.seek(max_key);
+			if (iter.at_end())
+				return false;
+			max_key = iter.key();
+			p = (p + 1) % level.size();
+		}
+	}
+
+private:
+	// null once the tries have been built
+	std::shared_ptr<const RDFIndex::Snapshot> m_snapshot;
+	const std::vector<CodedTriplePattern> m_patterns;
+	const std::vector<Variable> m_vars;
+
+	// if non-null, where each pattern's reading is measured
+	StepProfile* const m_profiles;
+
+	// one trie per pattern, and an iterator over each (never
+	// reallocated once built, since the iterators point into them)
+	std::vector<TrieRelation> m_relations;
+	std::vector<TrieIterator> m_iters;
+
+	// for each variable, the iterators of the tries containing it,
+	// in order of their current values from the position in
+	// `m_level_pos` (cyclically)
+	std::vector<std::vector<size_t>> m_level_iters;
+	std::vector<size_t> m_level_pos;
+
+	// invariant: the first `m_depth` variables are bound to the
+	// first `m_depth` values of `m_keys`, and the tries are open to
+	// that depth; if `valid()`, then so are all of them
+	size_t m_depth;
+	std::vector<CodedResource> m_keys;
+	bool m_valid;
+};
+
+
+std::unique_ptr<ICodedVarMapIterator> create_leapfrog_join_iterator(
+	std::shared_ptr<const RDFIndex::Snapshot> snapshot,
+	std::vector<CodedTriplePattern> patterns,
+	std::vector<Variable> var_order,
+	StepProfile* profiles)
+{
+	return std::make_unique<LeapfrogJoinIterator>(std::move(snapshot),
+		std::move(patterns), std::move(var_order), profiles);
+}
+
+
+}  // namespace joins
+}  // namespace dbsi
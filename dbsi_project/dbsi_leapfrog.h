@@ -0,0 +1,52 @@
+#ifndef DBSI_LEAPFROG_H
+#define DBSI_LEAPFROG_H
+
+
+#include <vector>
+#include <memory>
+#include "dbsi_types.h"
+#include "dbsi_iterator.h"
+#include "dbsi_rdf_index.h"
+#include "dbsi_profile.h"
+
+
+namespace dbsi
+{
+namespace joins
+{
+
+
+/*
+* Creates an iterator which returns the join of the given patterns,
+* using a leapfrog triejoin (Veldhuizen, "Leapfrog Triejoin: a
+* worst-case optimal join algorithm", ICDT 2014).
+* Rather than joining one pattern at a time, this binds one variable
+* at a time, in the order `var_order` (which must be exactly the
+* variables of the patterns): the values of each variable are found
+* by intersecting the sorted values which every pattern containing it
+* allows, given the variables bound so far. So, unlike with pairwise
+* joins, nothing is generated that doesn't extend to a result of all
+* of the patterns which have been seen so far, which makes this much
+* better for cyclic queries (e.g. triangles) that would otherwise
+* generate every path before filtering most of them out.
+* The first time it is started, the matches of each pattern (with
+* nothing bound) are read from `snapshot` into a trie: a sorted array
+* of their values, in the order `var_order`. Results are returned in
+* lexicographic order of the variables' codes, in the order
+* `var_order`.
+* If `profiles` is non-null, what is done to read each pattern's
+* matches is added to `profiles[i]` (see `analyze_join`).
+*/
+std::unique_ptr<ICodedVarMapIterator> create_leapfrog_join_iterator(
+	std::shared_ptr<const RDFIndex::Snapshot> snapshot,
+	std::vector<CodedTriplePattern> patterns,
+	std::vector<Variable> var_order,
+	StepProfile* profiles = nullptr
+);
+
+
+}  // namespace joins
+}  // namespace dbsi
+
+
+#endif  // DBSI_LEAPFROG_H
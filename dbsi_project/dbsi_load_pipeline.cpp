@@ -0,0 +1,216 @@
+#include <thread>
+#include <exception>
+#include "dbsi_load_pipeline.h"
+#include "dbsi_turtle.h"
+#include "dbsi_ring_buffer.h"
+
+
+namespace dbsi
+{
+
+
+// the number of triples in each batch passed between the stages, and
+// the number of batches which each queue holds
+static const size_t BATCH_SIZE = 4096;
+static const size_t QUEUE_CAPACITY = 16;
+
+
+namespace
+{
+
+
+/*
+* Adds the time since it was created, or last called, to either the
+* busy time or the waiting time of a stage.
+*/
+class StageClock
+{
+public:
+	explicit StageClock(LoadStageStatistics& stats) :
+		m_stats(stats),
+		m_last(std::chrono::steady_clock::now())
+	{ }
+
+	void busy()
+	{
+		m_stats.busy_time += lap();
+	}
+
+	void waited()
+	{
+		m_stats.wait_time += lap();
+	}
+
+private:
+	std::chrono::nanoseconds lap()
+	{
+		const auto now = std::chrono::steady_clock::now();
+		const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_last);
+		m_last = now;
+		return elapsed;
+	}
+
+private:
+	LoadStageStatistics& m_stats;
+	std::chrono::steady_clock::time_point m_last;
+};
+
+
+}  // namespace
+
+
+size_t pipelined_load(std::shared_ptr<const MappedFile> file, Dictionary& dict,
+	RDFIndex& idx, std::vector<LoadStageStatistics>* stats)
+{
+	std::vector<LoadStageStatistics> stage_stats{
+		{ "parse", 0, {}, {} },
+		{ "encode", 0, {}, {} },
+		{ "index", 0, {}, {} }
+	};
+
+	// the parser passes on the resources of each batch of triples
+	// flattened, three per triple, so that they can be encoded at once
+	RingBuffer<std::vector<ResourceRef>> parsed(QUEUE_CAPACITY);
+	RingBuffer<std::vector<CodedTriple>> encoded(QUEUE_CAPACITY);
+
+	// (each written only by its own thread, and read once it's joined)
+	std::exception_ptr parse_error, encode_error, index_error;
+
+	std::thread parser([&]()
+		{
+			LoadStageStatistics& stage = stage_stats[0];
+			StageClock clock(stage);
+			try
+			{
+				auto scanner = create_mapped_turtle_scanner(file);
+				std::vector<ResourceRef> batch;
+				batch.reserve(3 * BATCH_SIZE);
+
+				// pass on the batch so far, returning false if the
+				// encoder has stopped
+				auto flush = [&]()
+				{
+					stage.num_triples += batch.size() / 3;
+					clock.busy();
+					const bool pushed = parsed.push(std::move(batch));
+					clock.waited();
+					batch.clear();
+					batch.reserve(3 * BATCH_SIZE);
+					return pushed;
+				};
+
+				for (scanner->start(); scanner->valid(); scanner->next())
+				{
+					const RawTriple t = scanner->current();
+					batch.insert(batch.end(), { t.sub, t.pred, t.obj });
+					if (batch.size() == 3 * BATCH_SIZE && !flush())
+						break;
+				}
+				if (!batch.empty())
+					flush();
+				clock.busy();
+			}
+			catch (...)
+			{
+				parse_error = std::current_exception();
+			}
+			parsed.close_producer();
+		});
+
+	auto encode_stage = [&]()
+	{
+		LoadStageStatistics& stage = stage_stats[1];
+		StageClock clock(stage);
+		try
+		{
+			std::vector<ResourceRef> refs;
+			std::vector<CodedResource> codes;
+			while (parsed.pop(refs))
+			{
+				clock.waited();
+
+				codes.resize(refs.size());
+				dict.encode(refs.data(), refs.size(), codes.data());
+
+				std::vector<CodedTriple> batch(refs.size() / 3);
+				for (size_t i = 0; i < batch.size(); ++i)
+					batch[i] = CodedTriple{ codes[3 * i], codes[3 * i + 1], codes[3 * i + 2] };
+				stage.num_triples += batch.size();
+
+				clock.busy();
+				if (!encoded.push(std::move(batch)))
+					break;
+			}
+			clock.waited();
+		}
+		catch (...)
+		{
+			encode_error = std::current_exception();
+		}
+
+		// (so that the parser stops, if this stopped early)
+		parsed.close_consumer();
+		encoded.close_producer();
+	};
+
+	std::thread encoder;
+	try
+	{
+		encoder = std::thread(encode_stage);
+	}
+	catch (...)
+	{
+		parsed.close_consumer();
+		parser.join();
+		throw;
+	}
+
+	// meanwhile, insert each batch of coded triples into the index on
+	// this thread, as it arrives
+	LoadStageStatistics& stage = stage_stats[2];
+	StageClock clock(stage);
+	idx.begin_batched_load();
+	try
+	{
+		std::vector<CodedTriple> batch;
+		while (encoded.pop(batch))
+		{
+			clock.waited();
+			stage.num_triples += batch.size();
+			idx.add_batch(std::move(batch));
+			clock.busy();
+		}
+	}
+	catch (...)
+	{
+		index_error = std::current_exception();
+		encoded.close_consumer();
+	}
+
+	parser.join();
+	encoder.join();
+	clock.waited();
+
+	for (const std::exception_ptr& error : { parse_error, encode_error, index_error })
+	{
+		if (error)
+		{
+			// take out whatever was inserted before the error
+			idx.abort_batched_load();
+			std::rethrow_exception(error);
+		}
+	}
+
+	// and finally make the new triples visible, all at once
+	idx.end_batched_load();
+	clock.busy();
+
+	const size_t read_count = stage.num_triples;
+	if (stats != nullptr)
+		*stats = std::move(stage_stats);
+
+	return read_count;
+}
+
+
+}  // namespace dbsi
@@ -0,0 +1,60 @@
+#ifndef DBSI_LOAD_PIPELINE_H
+#define DBSI_LOAD_PIPELINE_H
+
+
+#include <memory>
+#include <vector>
+#include <chrono>
+#include "dbsi_image.h"
+#include "dbsi_dictionary.h"
+#include "dbsi_rdf_index.h"
+
+
+namespace dbsi
+{
+
+
+/*
+* What one stage of `pipelined_load` did. Busy time is time spent on
+* the stage's own work, and waiting time is time spent waiting for
+* the stage before it to produce a batch, or for the stage after it
+* to make room for one. The stage with the least waiting time is the
+* bottleneck.
+*/
+struct LoadStageStatistics
+{
+	const char* name;
+	size_t num_triples;
+	std::chrono::nanoseconds busy_time, wait_time;
+};
+
+
+/*
+* Load a mapped Turtle file into `idx`, in three stages which run at
+* once, each on its own thread:
+* 1. parsing the file (see `create_mapped_turtle_scanner`),
+* 2. encoding the resources of the triples into `dict`, and
+* 3. (on this thread) inserting each batch of coded triples into the
+*    index as it arrives (see `RDFIndex::add_batch`).
+* The stages pass batches of triples to each other through bounded
+* queues (see `RingBuffer`), so a stage which falls behind holds up
+* the ones before it, rather than the batches piling up in memory.
+* The index ends up with the same triples as after `bulk_load` of
+* `create_mapped_turtle_parser` (which handles errors in the file the
+* same way), and the return value is the same. As with `bulk_load`,
+* the new triples only become visible to snapshots at the end, all
+* at once.
+* If a stage throws (e.g. `std::overflow_error`), the other stages
+* are stopped, the triples inserted so far are taken out again (see
+* `RDFIndex::abort_batched_load`), and the exception is rethrown.
+* If `stats` is non-null, it is given each stage's statistics, in
+* order.
+*/
+size_t pipelined_load(std::shared_ptr<const MappedFile> file, Dictionary& dict,
+	RDFIndex& idx, std::vector<LoadStageStatistics>* stats = nullptr);
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_LOAD_PIPELINE_H
@@ -0,0 +1,470 @@
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+#include "dbsi_log.h"
+#include "dbsi_image.h"
+#include "dbsi_dictionary.h"
+#include "dbsi_rdf_index.h"
+#include "dbsi_assert.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+namespace dbsi
+{
+
+
+/*
+* The header of a log file. The sizes of the dictionary and the
+* index are those of the image which the log follows on from, to
+* catch logs being replayed onto the wrong image.
+*/
+struct LogHeader
+{
+	char magic[8];
+	std::uint64_t version;
+	std::uint64_t id_width;
+	std::uint64_t num_resources;
+	std::uint64_t num_triples;
+};
+
+
+static const char LOG_MAGIC[8] = { 'D', 'B', 'S', 'I', 'W', 'A', 'L', '\0' };
+static const std::uint64_t LOG_VERSION = 1;
+
+
+// resource records hold the index of their type in `Resource`, and
+// this is the one for IRIs
+static const size_t IRI_INDEX = 1;
+static_assert(std::is_same_v<std::variant_alternative_t<IRI_INDEX, Resource>, IRI>);
+
+
+// once this much is buffered, it is written out without waiting
+// for a commit, to bound the memory used by a large LOAD
+static const size_t MAX_BUFFER_SIZE = size_t(16) << 20;
+
+
+// the checksum of each batch is 64-bit FNV-1a
+static const std::uint64_t CHECKSUM_SEED = 0xcbf29ce484222325ULL;
+static std::uint64_t update_checksum(std::uint64_t h, const void* data, size_t num_bytes)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < num_bytes; ++i)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+
+/*
+* Platform-specific file access.
+*/
+#ifdef _WIN32
+
+
+static void* open_log_file(const std::string& filename, bool truncate)
+{
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_WRITE, 0, nullptr,
+		truncate ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Cannot open log file '" + filename + "'.");
+	return file;
+}
+
+
+// discards everything after `size` bytes, and moves to the end
+static bool set_log_file_size(void* file, std::uint64_t size)
+{
+	LARGE_INTEGER pos;
+	pos.QuadPart = static_cast<LONGLONG>(size);
+	return SetFilePointerEx(file, pos, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+}
+
+
+static bool write_log_file(void* file, const char* data, size_t num_bytes)
+{
+	while (num_bytes > 0)
+	{
+		const DWORD chunk = static_cast<DWORD>(std::min<size_t>(num_bytes, 1 << 30));
+		DWORD written = 0;
+		if (!WriteFile(file, data, chunk, &written, nullptr))
+			return false;
+		data += written;
+		num_bytes -= written;
+	}
+	return true;
+}
+
+
+static bool sync_log_file(void* file)
+{
+	return FlushFileBuffers(file);
+}
+
+
+static void close_log_file(void* file)
+{
+	CloseHandle(file);
+}
+
+
+#else
+
+
+static int open_log_file(const std::string& filename, bool truncate)
+{
+	const int fd = ::open(filename.c_str(), O_WRONLY | (truncate ? O_CREAT | O_TRUNC : 0), 0644);
+	if (fd < 0)
+		throw std::runtime_error("Cannot open log file '" + filename + "'.");
+	return fd;
+}
+
+
+// discards everything after `size` bytes, and moves to the end
+static bool set_log_file_size(int fd, std::uint64_t size)
+{
+	return ::ftruncate(fd, static_cast<off_t>(size)) == 0
+		&& ::lseek(fd, static_cast<off_t>(size), SEEK_SET) >= 0;
+}
+
+
+static bool write_log_file(int fd, const char* data, size_t num_bytes)
+{
+	while (num_bytes > 0)
+	{
+		const ssize_t written = ::write(fd, data, num_bytes);
+		if (written < 0)
+			return false;
+		data += written;
+		num_bytes -= static_cast<size_t>(written);
+	}
+	return true;
+}
+
+
+static bool sync_log_file(int fd)
+{
+	return ::fsync(fd) == 0;
+}
+
+
+static void close_log_file(int fd)
+{
+	::close(fd);
+}
+
+
+#endif  // _WIN32
+
+
+std::unique_ptr<WriteAheadLog> WriteAheadLog::create(const std::string& filename,
+	const Dictionary& dict, const RDFIndex& idx)
+{
+	LogHeader header;
+	std::memcpy(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+	header.version = LOG_VERSION;
+	header.id_width = sizeof(CodedResource);
+	header.num_resources = dict.size();
+	header.num_triples = idx.size();
+
+	const NativeFile file = open_log_file(filename, true);
+	if (!write_log_file(file, reinterpret_cast<const char*>(&header), sizeof(header))
+		|| !sync_log_file(file))
+	{
+		close_log_file(file);
+		throw std::runtime_error("Failed to write log file '" + filename + "'.");
+	}
+
+	return std::unique_ptr<WriteAheadLog>(new WriteAheadLog(file, sizeof(header)));
+}
+
+
+std::unique_ptr<WriteAheadLog> WriteAheadLog::recover(const std::string& filename,
+	Dictionary& dict, RDFIndex& idx)
+{
+	// the length of the log up to the end of the last valid batch
+	std::uint64_t valid_size = 0;
+
+	{
+		const MappedFile log(filename);
+		const char* const data = log.data();
+		const char* const end = data + log.size();
+
+		LogHeader header;
+		if (log.size() < sizeof(header))
+			throw std::runtime_error("Log file '" + filename + "' is not a DBSI log.");
+		std::memcpy(&header, data, sizeof(header));
+		if (std::memcmp(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 || header.version != LOG_VERSION)
+			throw std::runtime_error("Log file '" + filename + "' is not a DBSI log.");
+		if (header.id_width != sizeof(CodedResource))
+			throw std::runtime_error("Log file '" + filename + "' was written by an incompatible build.");
+		if (header.num_resources != dict.size() || header.num_triples != idx.size())
+			throw std::runtime_error("Log file '" + filename + "' doesn't follow on from this image.");
+
+		// find each batch by reading up to its commit record, and only
+		// replay it once its checksum is known to be correct
+		const char* batch_begin = data + sizeof(header);
+		const char* p = batch_begin;
+		std::uint64_t checksum = CHECKSUM_SEED;
+		while (p < end)
+		{
+			const char* const record = p;
+			const RecordType type = static_cast<RecordType>(*p++);
+			size_t record_size = 0;
+			if (type == RecordType::RESOURCE)
+			{
+				std::uint32_t len = 0;
+				if (end - p >= static_cast<std::ptrdiff_t>(1 + sizeof(len)))
+				{
+					std::memcpy(&len, p + 1, sizeof(len));
+					record_size = 1 + sizeof(len) + len;
+				}
+				else
+					break;
+			}
+			else if (type == RecordType::ADD || type == RecordType::REMOVE)
+				record_size = 3 * sizeof(CodedResource);
+			else if (type == RecordType::COMMIT)
+				record_size = sizeof(std::uint64_t);
+			else
+				break;
+
+			if (end - p < static_cast<std::ptrdiff_t>(record_size))
+				break;
+			p += record_size;
+
+			if (type == RecordType::COMMIT)
+			{
+				std::uint64_t expected;
+				std::memcpy(&expected, record + 1, sizeof(expected));
+				if (checksum != expected)
+					break;
+
+				replay_batch(batch_begin, record, dict, idx);
+				batch_begin = p;
+				checksum = CHECKSUM_SEED;
+			}
+			else
+				checksum = update_checksum(checksum, record, p - record);
+		}
+
+		valid_size = static_cast<std::uint64_t>(batch_begin - data);
+	}
+
+	// continue from the end of the last batch, overwriting anything
+	// after it
+	const NativeFile file = open_log_file(filename, false);
+	if (!set_log_file_size(file, valid_size) || !sync_log_file(file))
+	{
+		close_log_file(file);
+		throw std::runtime_error("Failed to write log file '" + filename + "'.");
+	}
+
+	return std::unique_ptr<WriteAheadLog>(new WriteAheadLog(file, valid_size));
+}
+
+
+void WriteAheadLog::replay_batch(const char* begin, const char* end,
+	Dictionary& dict, RDFIndex& idx)
+{
+	// consecutive additions are inserted together
+	std::vector<CodedTriple> added;
+
+	for (const char* p = begin; p < end; )
+	{
+		const RecordType type = static_cast<RecordType>(*p++);
+		if (type == RecordType::RESOURCE)
+		{
+			const std::uint8_t kind = static_cast<std::uint8_t>(*p++);
+			std::uint32_t len;
+			std::memcpy(&len, p, sizeof(len));
+			p += sizeof(len);
+			std::string val(p, len);
+			p += len;
+
+			// resources are logged in order of code, so they should
+			// all be new, and get the same code again
+			const size_t expected_code = dict.size();
+			const CodedResource code = (kind == IRI_INDEX) ? dict.encode(IRI{ std::move(val) })
+				: dict.encode(Literal{ std::move(val) });
+			if (code != expected_code)
+				throw std::runtime_error("Log doesn't follow on from this image.");
+		}
+		else
+		{
+			CodedTriple t;
+			std::memcpy(&t.sub, p, sizeof(CodedResource));
+			std::memcpy(&t.pred, p + sizeof(CodedResource), sizeof(CodedResource));
+			std::memcpy(&t.obj, p + 2 * sizeof(CodedResource), sizeof(CodedResource));
+			p += 3 * sizeof(CodedResource);
+
+			if (type == RecordType::ADD)
+				added.push_back(t);
+			else
+			{
+				DBSI_CHECK_INVARIANT(type == RecordType::REMOVE);
+				if (!added.empty())
+				{
+					idx.bulk_load(std::move(added));
+					added.clear();
+				}
+				idx.remove(t);
+			}
+		}
+	}
+
+	if (!added.empty())
+		idx.bulk_load(std::move(added));
+}
+
+
+WriteAheadLog::WriteAheadLog(NativeFile file, std::uint64_t size) :
+	m_file(file),
+	m_checksum(CHECKSUM_SEED),
+	m_batch_size(0),
+	m_appended_size(size),
+	m_written_size(size),
+	m_synced_size(size),
+	m_writing(false),
+	m_failed(false)
+{ }
+
+
+WriteAheadLog::~WriteAheadLog()
+{
+	// (wait for any write which is still going on)
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_write_done.wait(lock, [this]() { return !m_writing; });
+	close_log_file(m_file);
+}
+
+
+void WriteAheadLog::log_resource(std::uint8_t kind, std::string_view val)
+{
+	DBSI_CHECK_PRECOND(val.size() <= std::numeric_limits<std::uint32_t>::max());
+
+	const std::uint8_t type = static_cast<std::uint8_t>(RecordType::RESOURCE);
+	const std::uint32_t len = static_cast<std::uint32_t>(val.size());
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	append(&type, sizeof(type));
+	append(&kind, sizeof(kind));
+	append(&len, sizeof(len));
+	append(val.data(), val.size());
+
+	if (m_buffer.size() >= MAX_BUFFER_SIZE)
+		write_out(lock, false);
+}
+
+
+void WriteAheadLog::log_add(const CodedTriple* triples, size_t count)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < count; ++i)
+		append_triple(RecordType::ADD, triples[i]);
+
+	if (m_buffer.size() >= MAX_BUFFER_SIZE)
+		write_out(lock, false);
+}
+
+
+void WriteAheadLog::log_remove(const CodedTriple& t)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	append_triple(RecordType::REMOVE, t);
+
+	if (m_buffer.size() >= MAX_BUFFER_SIZE)
+		write_out(lock, false);
+}
+
+
+void WriteAheadLog::commit()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	// end the batch (unless it's empty, in which case this only
+	// waits for any earlier batches to be synced)
+	if (m_batch_size > 0)
+	{
+		char record[1 + sizeof(m_checksum)];
+		record[0] = static_cast<char>(RecordType::COMMIT);
+		std::memcpy(record + 1, &m_checksum, sizeof(m_checksum));
+		m_buffer.insert(m_buffer.end(), record, record + sizeof(record));
+		m_appended_size += sizeof(record);
+		m_checksum = CHECKSUM_SEED;
+		m_batch_size = 0;
+	}
+
+	write_out(lock, true);
+
+	if (m_failed)
+		throw std::runtime_error("Failed to write to the log.");
+}
+
+
+void WriteAheadLog::append(const void* data, size_t num_bytes)
+{
+	const char* p = static_cast<const char*>(data);
+	m_buffer.insert(m_buffer.end(), p, p + num_bytes);
+	m_appended_size += num_bytes;
+	m_batch_size += num_bytes;
+	m_checksum = update_checksum(m_checksum, data, num_bytes);
+}
+
+
+void WriteAheadLog::append_triple(RecordType type, const CodedTriple& t)
+{
+	char record[1 + 3 * sizeof(CodedResource)];
+	record[0] = static_cast<char>(type);
+	std::memcpy(record + 1, &t.sub, sizeof(CodedResource));
+	std::memcpy(record + 1 + sizeof(CodedResource), &t.pred, sizeof(CodedResource));
+	std::memcpy(record + 1 + 2 * sizeof(CodedResource), &t.obj, sizeof(CodedResource));
+	append(record, sizeof(record));
+}
+
+
+void WriteAheadLog::write_out(std::unique_lock<std::mutex>& lock, bool sync)
+{
+	const std::uint64_t target = m_appended_size;
+
+	// whoever is writing takes everything buffered so far, so the
+	// other threads can just wait for them
+	while (!m_failed && (sync ? m_synced_size : m_written_size) < target)
+	{
+		if (m_writing)
+		{
+			m_write_done.wait(lock);
+			continue;
+		}
+
+		m_writing = true;
+		std::vector<char> data;
+		data.swap(m_buffer);
+		const std::uint64_t new_size = m_appended_size;
+
+		lock.unlock();
+		const bool ok = write_log_file(m_file, data.data(), data.size())
+			&& (!sync || sync_log_file(m_file));
+		lock.lock();
+
+		m_writing = false;
+		if (ok)
+		{
+			m_written_size = new_size;
+			if (sync)
+				m_synced_size = new_size;
+		}
+		else
+			m_failed = true;
+		m_write_done.notify_all();
+	}
+}
+
+
+}  // namespace dbsi
@@ -0,0 +1,154 @@
+#ifndef DBSI_LOG_H
+#define DBSI_LOG_H
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "dbsi_types.h"
+
+
+namespace dbsi
+{
+
+
+class Dictionary;
+class RDFIndex;
+
+
+/*
+* A write-ahead log of the changes made to the database since it was
+* last saved to (or opened from) an image; see the `-W` option.
+* The `Dictionary` and `RDFIndex` append a compact binary record to
+* the log for every resource they encode and every triple they add
+* or remove, and then, once a whole command has finished, `commit`
+* writes the records out and waits for them to reach the disk.
+*
+* Records are only buffered in memory until a commit (or until the
+* buffer is large), so logging costs little more than a copy. Commits
+* are grouped: if several threads commit at once, only one of them
+* writes and syncs the file, on behalf of all of them.
+*
+* The log file is a header, describing the image which it follows on
+* from, then the records, where each batch of records is ended by a
+* commit record holding a checksum of the batch. On recovery, the
+* records are replayed directly into the dictionary and the index
+* (rather than through the Turtle parser), one batch at a time, and
+* any batch without a valid commit record (i.e. one which was being
+* written when the program stopped) is discarded.
+*
+* Note: like images, logs can only be replayed by a build with the
+* same ID width, on the same platform.
+*/
+class WriteAheadLog
+{
+public:
+	/*
+	* Start a new log, which follows on from the database as it is
+	* now, replacing the file if it exists.
+	* Throws `std::runtime_error` if the file can't be created.
+	*/
+	static std::unique_ptr<WriteAheadLog> create(const std::string& filename,
+		const Dictionary& dict, const RDFIndex& idx);
+
+	/*
+	* Replay the committed records of an existing log into the
+	* database, which must be as it was when the log was created
+	* (i.e. just opened from the same image). Then discard any
+	* uncommitted records, and continue the log from there.
+	* Throws `std::runtime_error` if the file can't be read or
+	* written, or doesn't follow on from the database. In that case,
+	* the database may have been partly modified.
+	*/
+	static std::unique_ptr<WriteAheadLog> recover(const std::string& filename,
+		Dictionary& dict, RDFIndex& idx);
+
+	// doesn't commit anything
+	~WriteAheadLog();
+
+	WriteAheadLog(const WriteAheadLog&) = delete;
+	WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+	/*
+	* Append records to the log. These are thread-safe, and never
+	* throw (any failure to write is reported by `commit`).
+	* `kind` is the index of the resource's type in `Resource`.
+	*/
+	void log_resource(std::uint8_t kind, std::string_view val);
+	void log_add(const CodedTriple* triples, size_t count);
+	void log_remove(const CodedTriple& t);
+
+	/*
+	* Make all of the records appended so far durable, as one batch.
+	* Thread-safe. Throws `std::runtime_error` if the log couldn't be
+	* written, after which it is unusable.
+	*/
+	void commit();
+
+private:
+	enum class RecordType : std::uint8_t
+	{
+		RESOURCE = 1,  // kind byte, 32-bit length, string
+		ADD = 2,  // coded triple
+		REMOVE = 3,  // coded triple
+		COMMIT = 4  // checksum of the batch
+	};
+
+#ifdef _WIN32
+	typedef void* NativeFile;
+#else
+	typedef int NativeFile;
+#endif
+
+	// takes ownership of `file`, which has `size` bytes
+	WriteAheadLog(NativeFile file, std::uint64_t size);
+
+	// pre: `m_mutex` is held
+	void append(const void* data, size_t num_bytes);
+	void append_triple(RecordType type, const CodedTriple& t);
+
+	/*
+	* Write out everything appended so far, and sync the file if
+	* `sync`. Any failure sets `m_failed`.
+	* pre: `lock` holds `m_mutex` (it is released while writing).
+	*/
+	void write_out(std::unique_lock<std::mutex>& lock, bool sync);
+
+	/*
+	* Apply the records in `[begin, end)` to the database.
+	*/
+	static void replay_batch(const char* begin, const char* end,
+		Dictionary& dict, RDFIndex& idx);
+
+private:
+	NativeFile m_file;
+
+	std::mutex m_mutex;
+	std::condition_variable m_write_done;
+
+	// the records appended, but not yet written
+	std::vector<char> m_buffer;
+
+	// checksum and size of the records appended since the last commit
+	std::uint64_t m_checksum;
+	std::uint64_t m_batch_size;
+
+	// sizes of the log (in bytes, including the header) once
+	// everything is appended / written / synced
+	std::uint64_t m_appended_size, m_written_size, m_synced_size;
+
+	// true while some thread is in the middle of writing
+	bool m_writing;
+
+	bool m_failed;
+};
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_LOG_H
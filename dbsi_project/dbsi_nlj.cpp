@@ -1,9 +1,17 @@
 #include <algorithm>
 #include <iterator>
+#include <limits>
+#include <cstdint>
+#include <mutex>
+#include <atomic>
+#include <array>
 #include "dbsi_nlj.h"
+#include "dbsi_hash_join.h"
+#include "dbsi_leapfrog.h"
 #include "dbsi_assert.h"
 #include "dbsi_rdf_index.h"
 #include "dbsi_pattern_utils.h"
+#include "dbsi_slots.h"
 
 
 namespace dbsi
@@ -14,7 +22,7 @@ namespace joins
 
 /*
 * Score a pattern based on how selective it is estimated
-* to be.
+* to be, without looking at the data.
 * The ordering here is given by the ordering from the paper.
 * Lower scores are more selective.
 */
@@ -63,129 +71,378 @@ bool var_maps_disjoint(const CodedVarMap& cvm1, const CodedVarMap& cvm2)
 }
 
 
+/*
+* The nested loop join of `patterns`, where each pattern is evaluated
+* once per result of the patterns before it (and of `outer`, if there
+* is one, which is then the outermost loop, e.g. a hash join).
+* The variables are given slots (see `VariableSlots`) when the join is
+* created, and the loops bind them by writing the matching triples'
+* components (and the rows of `outer`) into a single `SlotBinding`, so
+* no variable map is built unless `current` is called.
+*/
 class NestedLoopJoinIterator :
-	public ICodedVarMapIterator
+	public ISlotRowIterator
 {
 public:
+	/*
+	* If `first` is given, the outermost loop is over its triples,
+	* which must all match the first pattern, rather than over all
+	* of the first pattern's matches.
+	* If `profiles` is non-null, what is done to look up each pattern
+	* is added to `profiles[i]` (see `analyze_join`).
+	*/
 	NestedLoopJoinIterator(
-		const RDFIndex& rdf_idx,
-		std::vector<CodedTriplePattern> patterns) :
-		m_idx(rdf_idx),
-		m_patterns(std::move(patterns))
+		std::shared_ptr<const RDFIndex::Snapshot> snapshot,
+		std::vector<CodedTriplePattern> patterns,
+		std::unique_ptr<ICodedTripleIterator> first = nullptr,
+		StepProfile* profiles = nullptr) :
+		NestedLoopJoinIterator(std::move(snapshot), nullptr, std::move(patterns), profiles)
 	{
-		DBSI_CHECK_PRECOND(m_patterns.size() > 0);
+		m_levels.front().iter = std::move(first);
 	}
 
-	void start() override
+	NestedLoopJoinIterator(
+		std::shared_ptr<const RDFIndex::Snapshot> snapshot,
+		std::unique_ptr<ISlotRowIterator> outer,
+		std::vector<CodedTriplePattern> patterns,
+		StepProfile* profiles = nullptr) :
+		m_idx(std::move(snapshot)),
+		m_outer(std::move(outer)),
+		m_slots((m_outer != nullptr) ? VariableSlots(m_outer->slots(), patterns)
+			: VariableSlots(CodedVarMap(), patterns)),
+		m_outer_slots((m_outer != nullptr) ? m_slots.find_all(m_outer->slots())
+			: std::vector<size_t>()),
+		m_binding(m_slots.size()),
+		m_valid(false),
+		m_profiles(profiles),
+		m_inner_matches(3)
 	{
-		// clear any old iterators
-		m_iter_depth.clear();
+		DBSI_CHECK_PRECOND(m_outer != nullptr || !patterns.empty());
 
-		if (!m_patterns.empty())
-		// initialise with outermost loop
-		m_iter_depth.push_back(m_idx.evaluate(m_patterns[0]));
-		// start first iterator
-		m_iter_depth[0]->start();
-		// create remaining iterators
-		update_iterators();
+		// work out which of each pattern's variables are bound by the
+		// time that it is evaluated, and which it binds itself
+		std::vector<bool> bound(m_slots.size(), false);
+		for (size_t slot : m_outer_slots)
+			bound[slot] = true;
+
+		for (CodedTriplePattern& pat : patterns)
+		{
+			Level level;
+			level.pattern = std::move(pat);
+			level.has_bound = false;
+			for (size_t i = 0; i < 3; ++i)
+			{
+				const CodedTerm& term = level.pattern.*PATTERN_TERMS[i];
+				level.slot[i] = std::holds_alternative<Variable>(term)
+					? m_slots.find(std::get<Variable>(term)) : VariableSlots::NO_SLOT;
+				level.bound[i] = (level.slot[i] != VariableSlots::NO_SLOT) && bound[level.slot[i]];
+				level.has_bound = level.has_bound || level.bound[i];
+			}
+			level.lookup = level.pattern;
+			for (size_t i = 0; i < 3; ++i)
+			{
+				if (level.bound[i])
+					level.lookup.*PATTERN_TERMS[i] = CodedResource(0);
+			}
+			for (size_t i = 0; i < 3; ++i)
+			{
+				if (level.slot[i] != VariableSlots::NO_SLOT)
+					bound[level.slot[i]] = true;
+			}
+			m_levels.push_back(std::move(level));
+		}
+
+		// where each column of a batch comes from (see `next_batch`)
+		m_inner_columns.assign(m_slots.size(), NO_COLUMN);
+		if (!m_levels.empty())
+		{
+			const Level& inner = m_levels.back();
+			for (size_t i = 0; i < 3; ++i)
+			{
+				if (inner.slot[i] != VariableSlots::NO_SLOT && !inner.bound[i])
+					m_inner_columns[inner.slot[i]] = i;
+			}
+		}
+	}
+
+	void start() override
+	{
+		open(0);
+		find_result(0);
 	}
 
-	CodedVarMap current() const override
+	void next() override
 	{
-		// note: even though it is an invariant that the size of
-		// m_iter_depth is either 0 or equal to the size of m_patterns,
-		// this function is explicitly required to relax the latter
-		// case, because it is useful to build partial variable maps.
 		DBSI_CHECK_PRECOND(valid());
 
-		CodedVarMap vm;
-		for (const auto& iter : m_iter_depth)
+		const size_t depth = num_depths() - 1;
+		advance(depth);
+		find_result(depth);
+	}
+
+	bool valid() const override
+	{
+		return m_valid;
+	}
+
+	void next_batch(ColumnBatch& batch) override
+	{
+		DBSI_CHECK_PRECOND(batch.num_columns() == m_slots.size());
+
+		const size_t depth = num_depths() - 1;
+		if (m_levels.empty() || (m_outer != nullptr && depth == 0))
 		{
-			// even with the remark above, it is still necessary
-			// for all iterators to be valid!
-			DBSI_CHECK_INVARIANT(iter->valid());
+			// (just `m_outer`, so no loop over triples to batch up)
+			ISlotRowIterator::next_batch(batch);
+			return;
+		}
 
-			bool success = merge(vm, iter->current());
+		// the innermost loop's matches are read a batch at a time,
+		// and each column is either copied from them or, for the
+		// variables bound outside the innermost loop, filled in
+		Level& inner = m_levels.back();
+		while (m_valid && !batch.full())
+		{
+			m_inner_matches.clear(std::min(batch.capacity() - batch.num_rows(),
+				ColumnBatch::DEFAULT_CAPACITY));
+			inner.iter->next_batch(m_inner_matches);
+
+			const size_t n = m_inner_matches.num_rows();
+			DBSI_CHECK_INVARIANT(n > 0);
+			const size_t first = batch.add_rows(n);
+			for (size_t slot = 0; slot < m_slots.size(); ++slot)
+			{
+				CodedResource* const out = batch.column(slot) + first;
+				if (m_inner_columns[slot] == NO_COLUMN)
+					std::fill(out, out + n, m_binding[slot]);
+				else
+				{
+					const CodedResource* const in = m_inner_matches.column(m_inner_columns[slot]);
+					std::copy(in, in + n, out);
+				}
+			}
 
-			// if this fails then the RDF index iterator
-			// implementation is faulty, it should automatically
-			// apply selections.
-			DBSI_CHECK_POSTCOND(success);
+			find_result(depth);
 		}
+	}
 
-		return vm;
+	const VariableSlots& slots() const override
+	{
+		return m_slots;
 	}
 
-	void next() override
+	const CodedResource* row() const override
 	{
 		DBSI_CHECK_PRECOND(valid());
+		return m_binding.data();
+	}
+
+private:
+	static constexpr std::array<CodedTerm CodedTriplePattern::*, 3> PATTERN_TERMS = {
+		&CodedTriplePattern::sub, &CodedTriplePattern::pred, &CodedTriplePattern::obj };
+	static constexpr std::array<CodedResource CodedTriple::*, 3> TRIPLE_TERMS = {
+		&CodedTriple::sub, &CodedTriple::pred, &CodedTriple::obj };
 
-		m_iter_depth.back()->next();
-		update_iterators();
+	/*
+	* One loop of the join, over the matches of a pattern given the
+	* variables bound by the loops outside it.
+	*/
+	struct Level
+	{
+		CodedTriplePattern pattern;
+
+		// `pattern`, with the values of its bound variables filled in
+		// (once the loop has been opened)
+		CodedTriplePattern lookup;
+
+		// the slot of each component of the pattern (sub, pred, obj),
+		// or `NO_SLOT` if it is a constant, and whether it is bound by
+		// an outer loop (otherwise, this loop binds it)
+		std::array<size_t, 3> slot;
+		std::array<bool, 3> bound;
+		bool has_bound;
+
+		// the matches for the current binding of the outer loops, and
+		// the same iterator, if it came from the index, for rebinding
+		// it to the next binding
+		std::unique_ptr<ICodedTripleIterator> iter;
+		IMatchIterator* matches = nullptr;
+	};
+
+	/*
+	* The loops are numbered from the outermost, which is `m_outer` if
+	* there is one, followed by `m_levels`.
+	*/
+	size_t num_depths() const
+	{
+		return (m_outer != nullptr ? 1 : 0) + m_levels.size();
 	}
 
-	bool valid() const override
+	/*
+	* Start the loop at `depth`, given the binding of the loops
+	* outside it.
+	*/
+	void open(size_t depth)
 	{
-		return !m_iter_depth.empty();
+		if (m_outer != nullptr)
+		{
+			if (depth == 0)
+			{
+				m_outer->start();
+				return;
+			}
+			--depth;
+		}
+
+		Level& level = m_levels[depth];
+
+		// fill in any variables set by outer loops (which only writes
+		// over codes, so doesn't allocate)
+		for (size_t i = 0; i < 3; ++i)
+		{
+			if (level.bound[i])
+				std::get<CodedResource>(level.lookup.*PATTERN_TERMS[i]) = m_binding[level.slot[i]];
+		}
+
+		// the iterator is created on the first opening, and after that,
+		// just pointed at the new values, so the inner loops don't
+		// allocate. a pattern with nothing bound (e.g. the outermost)
+		// has the same matches every time, so is just restarted
+		if (level.iter == nullptr)
+		{
+			auto matches = m_idx->match(level.lookup);
+			if (m_profiles != nullptr)
+				matches = profile_matches(std::move(matches), m_profiles[depth]);
+			level.matches = matches.get();
+			level.iter = std::move(matches);
+		}
+		else if (level.has_bound)
+		{
+			DBSI_CHECK_INVARIANT(level.matches != nullptr);
+			level.matches->rebind(level.lookup);
+		}
+		level.iter->start();
 	}
 
-private:
-	void update_iterators()
+	bool depth_valid(size_t depth) const
+	{
+		if (m_outer != nullptr)
+		{
+			if (depth == 0)
+				return m_outer->valid();
+			--depth;
+		}
+		return m_levels[depth].iter->valid();
+	}
+
+	void advance(size_t depth)
 	{
-		// while there exists a finished iterator at the back,
-		// or we need to create more iterators
-		while (!m_iter_depth.empty() && (
-			!m_iter_depth.back()->valid() || m_iter_depth.size() < m_patterns.size()))
+		if (m_outer != nullptr)
 		{
-			// clear all finished iterators
-			while (!m_iter_depth.empty() && !m_iter_depth.back()->valid())
+			if (depth == 0)
 			{
-				m_iter_depth.pop_back();
-				if (!m_iter_depth.empty())
-				{
-					DBSI_CHECK_INVARIANT(m_iter_depth.back()->valid());
-					m_iter_depth.back()->next();
-				}
+				m_outer->next();
+				return;
 			}
+			--depth;
+		}
+		m_levels[depth].iter->next();
+	}
 
-			// bring the list back up to full strength
-			// (more than one will be added where necessary
-			// due to the outer while loop; we need to be careful
-			// that we don't do it here, in case newly created
-			// iterators are invalid.)
-			if (!m_iter_depth.empty() && m_iter_depth.size() < m_patterns.size())
+	/*
+	* Bind the variables of the current result of the (valid) loop at
+	* `depth`.
+	*/
+	void bind(size_t depth)
+	{
+		if (m_outer != nullptr)
+		{
+			if (depth == 0)
 			{
-				// get current pattern
-				CodedTriplePattern pat = m_patterns[m_iter_depth.size()];
-				// fill in any variables set by outer loops
-				pat = substitute(current(), std::move(pat));
-				// create iterator for next loop depth
-				m_iter_depth.push_back(
-					m_idx.evaluate(std::move(pat))
-				);
-				// start iterator
-				m_iter_depth.back()->start();
-
-				// NOTE: no guarantee that this new iterator is valid,
-				// this will be checked again in the outer while loop.
+				const CodedResource* const row = m_outer->row();
+				for (size_t i = 0; i < m_outer_slots.size(); ++i)
+					m_binding[m_outer_slots[i]] = row[i];
+				return;
 			}
+			--depth;
+		}
+
+		const Level& level = m_levels[depth];
+		const CodedTriple t = level.iter->current();
+		for (size_t i = 0; i < 3; ++i)
+		{
+			// (the index has already checked that the triple agrees
+			// with the bound variables, and with itself where the
+			// pattern repeats a variable)
+			if (level.slot[i] != VariableSlots::NO_SLOT && !level.bound[i])
+				m_binding[level.slot[i]] = t.*TRIPLE_TERMS[i];
 		}
+	}
 
-		DBSI_CHECK_INVARIANT(m_iter_depth.empty() ||
-			m_iter_depth.size() == m_patterns.size());
+	/*
+	* Find the next result, where the loops outside `depth` are at a
+	* binding, and the loop at `depth` has just been started or moved
+	* on: loops are moved on when they finish, and started again when
+	* a loop outside them moves on.
+	*/
+	void find_result(size_t depth)
+	{
+		while (true)
+		{
+			if (depth_valid(depth))
+			{
+				bind(depth);
+				if (depth + 1 == num_depths())
+				{
+					m_valid = true;
+					return;
+				}
+				++depth;
+				open(depth);
+			}
+			else if (depth == 0)
+			{
+				m_valid = false;
+				return;
+			}
+			else
+			{
+				--depth;
+				advance(depth);
+			}
+		}
 	}
 
 private:
-	const RDFIndex& m_idx;
-	const std::vector<CodedTriplePattern> m_patterns;
-	
-	// this is a stack-like data structure of iterators, one corresponding
-	// to each part of the join.
-	// invariant: all iterators here are valid.
-	// invariant: this vector is empty iff this iterator is invalid
-	// invariant: if this iterator is nonempty then its size is equal
-	// to that of `m_patterns`.
-	std::vector<std::unique_ptr<ICodedVarMapIterator>> m_iter_depth;
+	// all of the patterns are evaluated over the same snapshot, so
+	// that triples being added can't give inconsistent results. it
+	// is shared with the rest of the plan (and must outlive `m_outer`)
+	const std::shared_ptr<const RDFIndex::Snapshot> m_idx;
+
+	// if non-null, the outermost loop
+	std::unique_ptr<ISlotRowIterator> m_outer;
+
+	const VariableSlots m_slots;
+
+	// the slots of the variables of `m_outer`'s results, in order
+	const std::vector<size_t> m_outer_slots;
+
+	std::vector<Level> m_levels;
+
+	// the variables bound by the loops so far.
+	// invariant: if valid(), this is the current result
+	SlotBinding m_binding;
+	bool m_valid;
+
+	// if non-null, where each level's lookups are measured
+	StepProfile* const m_profiles;
+
+	// for `next_batch`: the matches of the innermost pattern, and the
+	// column of them which each slot is copied from, or `NO_COLUMN` if
+	// the slot is bound outside the innermost loop
+	static constexpr size_t NO_COLUMN = 3;
+	ColumnBatch m_inner_matches;
+	std::vector<size_t> m_inner_columns;
 };
 
 
@@ -193,48 +450,59 @@ std::unique_ptr<ICodedVarMapIterator> create_nested_loop_join_iterator(
 	const RDFIndex& rdf_idx, std::vector<CodedTriplePattern> patterns)
 {
 	DBSI_CHECK_PRECOND(patterns.size() > 0);
-	return std::make_unique<NestedLoopJoinIterator>(rdf_idx, std::move(patterns));
+
+	return std::make_unique<NestedLoopJoinIterator>(
+		std::make_shared<const RDFIndex::Snapshot>(rdf_idx.snapshot()),
+		std::move(patterns));
 }
 
 
-void greedy_join_order_opt(std::vector<CodedTriplePattern>& patterns)
+void greedy_join_order_opt(const RDFIndex& rdf_idx, std::vector<CodedTriplePattern>& patterns)
 {
 	static const size_t bad_idx = static_cast<size_t>(-1);
 
+	const RDFIndex::Snapshot stats = rdf_idx.snapshot();
 	CodedVarMap cvm;
 	for (size_t cur_idx = 0; cur_idx < patterns.size(); ++cur_idx)
 	{
 		// firstly, get the pattern in range [cur_idx, patterns.size())
-		// with lowest score, where the score is determined by the
-		// pattern conditional on the maps from patterns in range
-		// [0, cur_idx).
+		// with lowest estimate (and then score), where both are
+		// determined by the pattern conditional on the maps from
+		// patterns in range [0, cur_idx).
 		size_t best_idx = bad_idx;
+		double best_estimate = 0.0;
 		int best_score = 10;  // or any number > 7
 		CodedVarMap best_cvm;
 		for (size_t i = cur_idx; i < patterns.size(); ++i)
 		{
-			// get the pattern's variable map, and its score after substitution
+			// get the pattern's variable map, its estimate, and its
+			// score after substitution
 			CodedVarMap cur_cvm = extract_map(patterns[i]);
+			const double cur_estimate = stats.estimate_cardinality(patterns[i], cvm);
 			const int cur_score = score_pattern(pattern_type(
 				substitute(cvm, patterns[i])));
+			const bool is_better = (best_score > 7) || cur_estimate < best_estimate
+				|| (cur_estimate == best_estimate && cur_score < best_score);
 
 			/*
-			* In addition to selecting only when the score is better,
+			* In addition to selecting only when the pattern is better,
 			* we also want to only select when it's not going to create
 			* a full cross product.
 			* In order to avoid a full cross product, they either have
 			* to share a variable in common, or the new CVM has no variables
-			* (in which case it is just an index lookup).
+			* (in which case it is just an index lookup), or there is
+			* nothing to join with yet.
 			* 
 			* Note: in the special case where there are no unavoidable
 			* cross products, we have to arbitrarily pick a next pattern
 			* to be joined. WLOG we may pick the one at `cur_idx`. This
 			* case is handled by the `else if`.
 			*/
-			if (cur_score < best_score &&
-				(cur_cvm.empty() || !var_maps_disjoint(cvm, cur_cvm)))
+			if (is_better &&
+				(cvm.empty() || cur_cvm.empty() || !var_maps_disjoint(cvm, cur_cvm)))
 			{
 				best_idx = i;
+				best_estimate = cur_estimate;
 				best_score = cur_score;
 				best_cvm = std::move(cur_cvm);
 			}
@@ -259,5 +527,765 @@ void greedy_join_order_opt(std::vector<CodedTriplePattern>& patterns)
 }
 
 
+// the most patterns that `plan_join` orders by dynamic programming,
+// which takes O(2^n * n) time
+static const size_t MAX_DP_PATTERNS = 12;
+
+
+/*
+* The costs of the work done by the joins, relative to reading a row
+* of the index (and binding its variables, if it matches). A nested
+* loop join does an index lookup per outer row, and then reads the
+* rows it finds. A hash join reads the rows of the pattern (with
+* nothing bound) just once, but has to store the matches in a hash
+* table, which costs several times as much, and then does a hash
+* table lookup per outer row, and returns each match found from there.
+* (These were measured on the linked list index.)
+*/
+static const double LOOKUP_COST = 1.0;
+static const double BUILD_COST = 4.0;
+static const double PROBE_COST = 1.0;
+
+
+/*
+* The estimates for a pattern, given what is bound (see
+* `RDFIndex::Snapshot::estimate_cardinality` and `estimate_scan`).
+*/
+struct PatternEstimate
+{
+	double matches;
+	double scan;
+
+	PatternEstimate(const RDFIndex::Snapshot& stats, const CodedTriplePattern& pattern,
+		const CodedVarMap& bound) :
+		matches(stats.estimate_cardinality(pattern, bound)),
+		scan(stats.estimate_scan(pattern, bound))
+	{ }
+};
+
+
+/*
+* The cost model of `plan_join`, for a join done one pattern at a time.
+*/
+struct JoinCost
+{
+	double cost;  // of the whole join so far
+	double rows;  // estimated number of results so far
+
+	/*
+	* Join one more pattern, given its estimates per outer row, and
+	* with nothing bound (for building a hash table), using whichever
+	* method is cheaper. That method is written to `method`.
+	*/
+	JoinCost extend(const PatternEstimate& per_row, const PatternEstimate& unbound,
+		JoinMethod& method) const
+	{
+		const double new_rows = rows * per_row.matches;
+		const double nested_loop_cost = rows * (LOOKUP_COST + per_row.scan);
+		const double hash_cost = LOOKUP_COST + unbound.scan + unbound.matches * BUILD_COST
+			+ rows * PROBE_COST + new_rows;
+		method = (hash_cost < nested_loop_cost) ? JoinMethod::HASH : JoinMethod::NESTED_LOOP;
+		return { cost + std::min(nested_loop_cost, hash_cost), new_rows };
+	}
+};
+
+
+/*
+* Choose how to join each of the patterns, in the given order.
+*/
+JoinPlan plan_join_methods(const RDFIndex::Snapshot& stats, std::vector<CodedTriplePattern> patterns)
+{
+	JoinPlan plan;
+	JoinCost total{ 0.0, 1.0 };
+	CodedVarMap cvm;
+	for (const auto& pat : patterns)
+	{
+		JoinMethod method;
+		total = total.extend(PatternEstimate(stats, pat, cvm),
+			PatternEstimate(stats, pat, CodedVarMap()), method);
+		plan.methods.push_back(plan.methods.empty() ? JoinMethod::NESTED_LOOP : method);
+		cvm.merge(extract_map(pat));
+	}
+	plan.patterns = std::move(patterns);
+	plan.cost = total.cost;
+	return plan;
+}
+
+
+/*
+* The dynamic programming version of `plan_join`. The cheapest order
+* of a set of patterns is the cheapest order of the set minus one
+* pattern, followed by that pattern, for whichever pattern is best.
+* So, the cheapest order of every subset is found, in order of size,
+* where a subset is only extended by patterns which don't make a cross
+* product (as in `greedy_join_order_opt`) unless none can.
+* Note: only left-deep orders are enumerated (rather than bushy plans
+* as in DPccp) since joins are done one pattern at a time.
+*/
+JoinPlan dp_plan_join(const RDFIndex::Snapshot& stats, std::vector<CodedTriplePattern> patterns)
+{
+	const size_t n = patterns.size();
+	DBSI_CHECK_PRECOND(n <= MAX_DP_PATTERNS);
+
+	// number the variables, so that sets of them are bitmasks (there
+	// are at most three per pattern)
+	std::vector<Variable> vars;
+	std::vector<std::uint64_t> pattern_vars(n, 0);
+	for (size_t i = 0; i < n; ++i)
+	{
+		for (const auto& kv : extract_map(patterns[i]))
+		{
+			auto iter = std::find(vars.begin(), vars.end(), kv.first);
+			if (iter == vars.end())
+				iter = vars.insert(vars.end(), kv.first);
+			pattern_vars[i] |= std::uint64_t(1) << (iter - vars.begin());
+		}
+	}
+
+	// a pattern's estimate only depends on which of its own variables
+	// are bound, so estimate each pattern for each of those subsets
+	std::vector<std::vector<std::pair<std::uint64_t, PatternEstimate>>> estimates(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		for (std::uint64_t bound = pattern_vars[i]; ; bound = (bound - 1) & pattern_vars[i])
+		{
+			CodedVarMap cvm;
+			for (size_t v = 0; v < vars.size(); ++v)
+			{
+				if (bound & (std::uint64_t(1) << v))
+					cvm.emplace(vars[v], CodedResource());
+			}
+			estimates[i].emplace_back(bound, PatternEstimate(stats, patterns[i], cvm));
+			if (bound == 0)
+				break;
+		}
+	}
+	auto estimate = [&estimates](size_t i, std::uint64_t bound) -> const PatternEstimate&
+	{
+		for (const auto& [b, est] : estimates[i])
+		{
+			if (b == bound)
+				return est;
+		}
+		DBSI_CHECK_INVARIANT(false);  // ???
+		return estimates[i].back().second;
+	};
+
+	// for each subset of the patterns (as a bitmask), the cheapest
+	// order's cost, and last pattern (or `n` if there is no order yet)
+	// and its method, and the variables bound by the subset
+	const size_t num_sets = size_t(1) << n;
+	std::vector<JoinCost> best(num_sets,
+		JoinCost{ std::numeric_limits<double>::infinity(), 0.0 });
+	std::vector<size_t> best_last(num_sets, n);
+	std::vector<JoinMethod> best_method(num_sets, JoinMethod::NESTED_LOOP);
+	std::vector<std::uint64_t> set_vars(num_sets, 0);
+	best[0] = JoinCost{ 0.0, 1.0 };
+
+	// every subset is smaller (as a number) than its supersets, so
+	// this visits subsets before they are extended
+	for (size_t set = 0; set + 1 < num_sets; ++set)
+	{
+		if (set != 0 && best_last[set] == n)
+			continue;  // can't be joined without an avoidable cross product
+
+		auto connected = [&](size_t i)
+		{
+			return set_vars[set] == 0 || pattern_vars[i] == 0
+				|| (pattern_vars[i] & set_vars[set]) != 0;
+		};
+		bool any_connected = false;
+		for (size_t i = 0; i < n; ++i)
+			any_connected |= !(set & (size_t(1) << i)) && connected(i);
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			if ((set & (size_t(1) << i)) || (any_connected && !connected(i)))
+				continue;
+
+			const size_t next_set = set | (size_t(1) << i);
+			JoinMethod method;
+			const JoinCost cost = best[set].extend(estimate(i, pattern_vars[i] & set_vars[set]),
+				estimate(i, 0), method);
+			if (cost.cost < best[next_set].cost)
+			{
+				best[next_set] = cost;
+				best_last[next_set] = i;
+				best_method[next_set] = (set == 0) ? JoinMethod::NESTED_LOOP : method;
+				set_vars[next_set] = set_vars[set] | pattern_vars[i];
+			}
+		}
+	}
+
+	// read the plan back off, from the end
+	JoinPlan plan;
+	plan.patterns.resize(n);
+	plan.methods.resize(n);
+	plan.cost = best[num_sets - 1].cost;
+	for (size_t set = num_sets - 1, pos = n; set != 0; )
+	{
+		const size_t i = best_last[set];
+		DBSI_CHECK_INVARIANT(i < n && pos > 0);
+		--pos;
+		plan.patterns[pos] = std::move(patterns[i]);
+		plan.methods[pos] = best_method[set];
+		set &= ~(size_t(1) << i);
+	}
+	return plan;
+}
+
+
+/*
+* The costs of a leapfrog triejoin, relative to reading a row of the
+* index as above: of storing a match of a pattern in its trie (which
+* is mostly sorting, so much cheaper than building a hash table), and
+* of each partial result which it visits (a few seeks, each of which
+* is a search of a small part of a sorted array).
+*/
+static const double TRIE_BUILD_COST = 0.25;
+static const double LEAPFROG_COST = 0.25;
+
+
+/*
+* Whether the variables of the patterns form a cyclic hypergraph (with
+* a hyperedge for each pattern), found by GYO reduction: repeatedly
+* remove variables which are only in one pattern, and then patterns
+* whose variables are all in another pattern. The hypergraph is
+* acyclic iff this removes everything.
+*/
+bool is_cyclic(const std::vector<CodedTriplePattern>& patterns)
+{
+	std::vector<CodedVarMap> edges;
+	for (const auto& pat : patterns)
+		edges.push_back(extract_map(pat));
+
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+
+		for (size_t i = 0; i < edges.size(); ++i)
+		{
+			for (auto iter = edges[i].begin(); iter != edges[i].end(); )
+			{
+				auto in_edge = [&iter](const CodedVarMap& edge)
+				{
+					return edge.find(iter->first) != edge.end();
+				};
+				if (std::count_if(edges.begin(), edges.end(), in_edge) == 1)
+				{
+					iter = edges[i].erase(iter);
+					changed = true;
+				}
+				else
+				{
+					++iter;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < edges.size(); ++i)
+		{
+			for (size_t j = 0; j < edges.size(); ++j)
+			{
+				auto in_edge_j = [&edges, j](const auto& kv)
+				{
+					return edges[j].find(kv.first) != edges[j].end();
+				};
+				if (i != j && std::all_of(edges[i].begin(), edges[i].end(), in_edge_j))
+				{
+					edges.erase(edges.begin() + i);
+					--i;
+					changed = true;
+					break;
+				}
+			}
+		}
+	}
+	return edges.size() > 1 || (edges.size() == 1 && !edges[0].empty());
+}
+
+
+/*
+* If the patterns are cyclic, and a leapfrog triejoin is estimated to
+* be cheaper than `plan`, then change it into one. The variables are
+* bound in the order in which `plan` would bind them, which puts the
+* most selective ones first.
+*/
+void consider_leapfrog(const RDFIndex::Snapshot& stats, JoinPlan& plan)
+{
+	if (!is_cyclic(plan.patterns))
+		return;
+
+	// every match of every pattern is read into a trie. then, the
+	// partial results visited are at most the intermediate results
+	// of `plan`, as each consists of the values of some prefix of
+	// `order` which agree with every pattern seen so far (and
+	// usually far fewer, as they must also agree with the later
+	// patterns on the variables bound so far)
+	double cost = 0.0, rows = 1.0;
+	CodedVarMap cvm;
+	std::vector<Variable> order;
+	for (const auto& pat : plan.patterns)
+	{
+		const PatternEstimate unbound(stats, pat, CodedVarMap());
+		cost += unbound.scan + unbound.matches * TRIE_BUILD_COST;
+		rows *= stats.estimate_cardinality(pat, cvm);
+		cost += rows * LEAPFROG_COST;
+
+		for (const auto& kv : extract_map(pat))
+		{
+			if (cvm.emplace(kv).second)
+				order.push_back(kv.first);
+		}
+	}
+
+	if (cost < plan.cost)
+	{
+		plan.cost = cost;
+		plan.leapfrog_order = std::move(order);
+	}
+}
+
+
+JoinPlan plan_join(const RDFIndex& rdf_idx, std::vector<CodedTriplePattern> patterns)
+{
+	DBSI_CHECK_PRECOND(patterns.size() > 0);
+
+	const RDFIndex::Snapshot stats = rdf_idx.snapshot();
+	JoinPlan plan;
+	if (patterns.size() <= MAX_DP_PATTERNS)
+	{
+		plan = dp_plan_join(stats, std::move(patterns));
+	}
+	else
+	{
+		greedy_join_order_opt(rdf_idx, patterns);
+		plan = plan_join_methods(stats, std::move(patterns));
+	}
+	consider_leapfrog(stats, plan);
+	return plan;
+}
+
+
+/*
+* The implementation of `create_join_iterator`, which, if `profiles` is
+* non-null, measures each pattern's lookups in `profiles[i]`.
+*/
+static std::unique_ptr<ICodedVarMapIterator> create_join_iterator(
+	std::shared_ptr<const RDFIndex::Snapshot> snapshot, JoinPlan plan, StepProfile* profiles)
+{
+	DBSI_CHECK_PRECOND(plan.patterns.size() > 0);
+
+	if (!plan.leapfrog_order.empty())
+	{
+		return create_leapfrog_join_iterator(std::move(snapshot),
+			std::move(plan.patterns), std::move(plan.leapfrog_order), profiles);
+	}
+	DBSI_CHECK_PRECOND(plan.methods.size() == plan.patterns.size());
+
+	// the joins before `nested`, if any
+	std::unique_ptr<ISlotRowIterator> iter;
+
+	// the patterns since the last hash join, the first of which is
+	// pattern `nested_start` of the plan
+	std::vector<CodedTriplePattern> nested;
+	size_t nested_start = 0;
+
+	auto join_nested = [&]()
+	{
+		StepProfile* const nested_profiles = (profiles != nullptr) ? profiles + nested_start : nullptr;
+		if (iter == nullptr)
+		{
+			iter = std::make_unique<NestedLoopJoinIterator>(snapshot, std::move(nested),
+				nullptr, nested_profiles);
+		}
+		else
+		{
+			iter = std::make_unique<NestedLoopJoinIterator>(snapshot,
+				std::move(iter), std::move(nested), nested_profiles);
+		}
+		nested.clear();
+	};
+
+	for (size_t i = 0; i < plan.patterns.size(); ++i)
+	{
+		CodedTriplePattern& pat = plan.patterns[i];
+
+		if (i > 0 && plan.methods[i] == JoinMethod::HASH)
+		{
+			// everything so far is the probe side, and the pattern,
+			// with nothing bound, is the build side
+			if (!nested.empty())
+				join_nested();
+
+			std::unique_ptr<IMatchIterator> matches = snapshot->match(pat);
+			if (profiles != nullptr)
+				matches = profile_matches(std::move(matches), profiles[i]);
+			iter = create_hash_join_iterator(std::move(iter), pat, std::move(matches));
+		}
+		else
+		{
+			if (nested.empty())
+				nested_start = i;
+			nested.push_back(std::move(pat));
+		}
+	}
+
+	if (!nested.empty())
+		join_nested();
+	return iter;
+}
+
+
+std::unique_ptr<ICodedVarMapIterator> create_join_iterator(
+	const RDFIndex& rdf_idx, JoinPlan plan)
+{
+	// the nested loop joins share the snapshot, and keep it alive for
+	// the hash joins (whose probe side is always a nested loop join)
+	return create_join_iterator(std::make_shared<const RDFIndex::Snapshot>(rdf_idx.snapshot()),
+		std::move(plan), nullptr);
+}
+
+
+// the number of results of the first pattern which a thread of a
+// parallel join takes at a time. this is small because each of them
+// may have many results with the rest of the patterns
+static const size_t MORSEL_SIZE = 256;
+
+
+/*
+* Iterates over a morsel: some of the matches of the first pattern of
+* a join, which a thread of a parallel join has taken to work on.
+*/
+class MorselIterator :
+	public ICodedTripleIterator
+{
+public:
+	explicit MorselIterator(std::vector<CodedTriple> triples) :
+		m_triples(std::move(triples)),
+		m_pos(m_triples.size())
+	{ }
+
+	void start() override
+	{
+		m_pos = 0;
+	}
+
+	CodedTriple current() const override
+	{
+		DBSI_CHECK_PRECOND(valid());
+		return m_triples[m_pos];
+	}
+
+	void next() override
+	{
+		DBSI_CHECK_PRECOND(valid());
+		++m_pos;
+	}
+
+	bool valid() const override
+	{
+		return m_pos < m_triples.size();
+	}
+
+private:
+	const std::vector<CodedTriple> m_triples;
+	size_t m_pos;
+};
+
+
+/*
+* Whether a plan can be evaluated by `for_each_morsel`.
+*/
+bool is_parallelisable(const JoinPlan& plan)
+{
+	return plan.leapfrog_order.empty()
+		&& std::all_of(plan.methods.begin(), plan.methods.end(),
+			[](JoinMethod method) { return method == JoinMethod::NESTED_LOOP; });
+}
+
+
+/*
+* The morsel-driven evaluation of a plan of nested loop joins, using
+* `num_threads` threads from `pool` (including this one). Each thread
+* repeatedly takes the next morsel of matches of the first pattern, and
+* joins it with the rest of the patterns by itself. Then it calls
+* `process(morsel_idx, join)` from that thread, where the morsels are
+* numbered in the order in which the first pattern returned them, and
+* `join` is a `NestedLoopJoinIterator` (not yet started) over the
+* morsel's results.
+*/
+template<typename ProcessMorsel>
+void for_each_morsel(std::shared_ptr<const RDFIndex::Snapshot> snapshot,
+	const JoinPlan& plan, ThreadPool& pool, size_t num_threads, ProcessMorsel process)
+{
+	DBSI_CHECK_PRECOND(is_parallelisable(plan));
+	DBSI_CHECK_PRECOND(num_threads > 0);
+
+	// the first pattern is read by one thread at a time
+	std::unique_ptr<ICodedTripleIterator> outer = snapshot->match(plan.patterns[0]);
+	std::mutex outer_mutex;
+	size_t next_morsel = 0;
+	outer->start();
+
+	auto worker = [&]()
+	{
+		while (true)
+		{
+			std::vector<CodedTriple> morsel;
+			size_t morsel_idx;
+			{
+				std::lock_guard<std::mutex> lock(outer_mutex);
+				if (!outer->valid())
+					return;
+				morsel_idx = next_morsel++;
+				for (; outer->valid() && morsel.size() < MORSEL_SIZE; outer->next())
+					morsel.push_back(outer->current());
+			}
+
+			NestedLoopJoinIterator join(snapshot, plan.patterns,
+				std::make_unique<MorselIterator>(std::move(morsel)));
+			process(morsel_idx, join);
+		}
+	};
+
+	pool.run(num_threads, worker);
+}
+
+
+/*
+* Iterates over the results of a join which were all found up-front,
+* by `for_each_morsel`, the first time that it is started.
+*/
+class ParallelJoinIterator :
+	public ISlotRowIterator
+{
+public:
+	ParallelJoinIterator(
+		std::shared_ptr<const RDFIndex::Snapshot> snapshot,
+		JoinPlan plan,
+		ThreadPool& pool,
+		size_t num_threads) :
+		m_snapshot(std::move(snapshot)),
+		m_plan(std::move(plan)),
+		m_pool(pool),
+		m_num_threads(num_threads),
+		m_slots(CodedVarMap(), m_plan.patterns),
+		m_morsel_idx(0),
+		m_result_idx(0)
+	{ }
+
+	void start() override
+	{
+		if (m_snapshot != nullptr)
+			evaluate();
+
+		m_morsel_idx = 0;
+		m_result_idx = 0;
+		skip_empty_morsels();
+	}
+
+	void next() override
+	{
+		DBSI_CHECK_PRECOND(valid());
+		++m_result_idx;
+		skip_empty_morsels();
+	}
+
+	bool valid() const override
+	{
+		return m_morsel_idx < m_results.size();
+	}
+
+	const VariableSlots& slots() const override
+	{
+		return m_slots;
+	}
+
+	const CodedResource* row() const override
+	{
+		DBSI_CHECK_PRECOND(valid());
+		return m_results[m_morsel_idx].codes.data() + m_result_idx * m_slots.size();
+	}
+
+	void next_batch(ColumnBatch& batch) override
+	{
+		DBSI_CHECK_PRECOND(batch.num_columns() == m_slots.size());
+
+		// the buffered rows are transposed into the batch's columns
+		const size_t width = m_slots.size();
+		while (valid() && !batch.full())
+		{
+			const MorselResults& results = m_results[m_morsel_idx];
+			const size_t n = std::min(results.num_rows - m_result_idx,
+				batch.capacity() - batch.num_rows());
+			const size_t first = batch.add_rows(n);
+			for (size_t col = 0; col < width; ++col)
+			{
+				CodedResource* const out = batch.column(col) + first;
+				const CodedResource* const in = results.codes.data() + m_result_idx * width + col;
+				for (size_t i = 0; i < n; ++i)
+					out[i] = in[i * width];
+			}
+
+			m_result_idx += n;
+			skip_empty_morsels();
+		}
+	}
+
+private:
+	void evaluate()
+	{
+		std::mutex results_mutex;
+		for_each_morsel(m_snapshot, m_plan, m_pool, m_num_threads,
+			[this, &results_mutex](size_t morsel_idx, NestedLoopJoinIterator& join)
+			{
+				// (the join's slots are the same as `m_slots`, since
+				// they are of the same patterns)
+				MorselResults results{ 0, SlotBinding() };
+				const size_t width = join.slots().size();
+				for (join.start(); join.valid(); join.next())
+				{
+					const CodedResource* const row = join.row();
+					results.codes.insert(results.codes.end(), row, row + width);
+					++results.num_rows;
+				}
+
+				std::lock_guard<std::mutex> lock(results_mutex);
+				if (m_results.size() <= morsel_idx)
+					m_results.resize(morsel_idx + 1);
+				m_results[morsel_idx] = std::move(results);
+			});
+
+		// nothing else will be read from it
+		m_snapshot.reset();
+	}
+
+	// move on from the end of a morsel's results to the next result
+	void skip_empty_morsels()
+	{
+		while (m_morsel_idx < m_results.size()
+			&& m_result_idx == m_results[m_morsel_idx].num_rows)
+		{
+			++m_morsel_idx;
+			m_result_idx = 0;
+		}
+	}
+
+private:
+	// null once the results have been found
+	std::shared_ptr<const RDFIndex::Snapshot> m_snapshot;
+	const JoinPlan m_plan;
+	ThreadPool& m_pool;
+	const size_t m_num_threads;
+	const VariableSlots m_slots;
+
+	// the bindings of a morsel's results, one after another
+	struct MorselResults
+	{
+		size_t num_rows;
+		SlotBinding codes;
+	};
+
+	// the results of each morsel, in order
+	std::vector<MorselResults> m_results;
+
+	// invariant: if `valid()`, the current result is row
+	// `m_result_idx` of `m_results[m_morsel_idx]`
+	size_t m_morsel_idx, m_result_idx;
+};
+
+
+std::unique_ptr<ICodedVarMapIterator> create_parallel_join_iterator(
+	const RDFIndex& rdf_idx, JoinPlan plan, ThreadPool& pool, size_t num_threads)
+{
+	DBSI_CHECK_PRECOND(plan.patterns.size() > 0);
+	DBSI_CHECK_PRECOND(num_threads > 0);
+
+	if (num_threads == 1 || !is_parallelisable(plan))
+		return create_join_iterator(rdf_idx, std::move(plan));
+
+	return std::make_unique<ParallelJoinIterator>(
+		std::make_shared<const RDFIndex::Snapshot>(rdf_idx.snapshot()),
+		std::move(plan), pool, num_threads);
+}
+
+
+/*
+* Count the results of an iterator over rows with `num_columns`
+* columns, a batch at a time.
+*/
+size_t count_rows(ICodedVarMapIterator& iter, size_t num_columns)
+{
+	ColumnBatch batch(num_columns);
+	size_t count = 0;
+	for (iter.start(); iter.valid(); )
+	{
+		batch.clear();
+		iter.next_batch(batch);
+		count += batch.num_rows();
+	}
+	return count;
+}
+
+
+size_t count_join(const RDFIndex& rdf_idx, JoinPlan plan, ThreadPool& pool, size_t num_threads)
+{
+	DBSI_CHECK_PRECOND(plan.patterns.size() > 0);
+	DBSI_CHECK_PRECOND(num_threads > 0);
+
+	if (num_threads == 1 || !is_parallelisable(plan))
+	{
+		const size_t num_columns = VariableSlots(CodedVarMap(), plan.patterns).size();
+		auto iter = create_join_iterator(rdf_idx, std::move(plan));
+		return count_rows(*iter, num_columns);
+	}
+
+	std::atomic<size_t> count(0);
+	for_each_morsel(std::make_shared<const RDFIndex::Snapshot>(rdf_idx.snapshot()),
+		plan, pool, num_threads,
+		[&count](size_t, NestedLoopJoinIterator& join)
+		{
+			count += count_rows(join, join.slots().size());
+		});
+	return count;
+}
+
+
+JoinProfile analyze_join(const RDFIndex& rdf_idx, const JoinPlan& plan)
+{
+	DBSI_CHECK_PRECOND(plan.patterns.size() > 0);
+
+	auto snapshot = std::make_shared<const RDFIndex::Snapshot>(rdf_idx.snapshot());
+	JoinProfile profile;
+	profile.steps.resize(plan.patterns.size());
+
+	// patterns which are hash joined, or read into the tries of a
+	// leapfrog triejoin, are looked up with nothing bound
+	const bool is_leapfrog = !plan.leapfrog_order.empty();
+	CodedVarMap bound;
+	for (size_t i = 0; i < plan.patterns.size(); ++i)
+	{
+		const CodedTriplePattern& pat = plan.patterns[i];
+		const bool is_hash = !is_leapfrog && (plan.methods[i] == JoinMethod::HASH);
+		profile.steps[i].access = snapshot->describe_access(pat,
+			(is_leapfrog || is_hash) ? CodedVarMap() : bound);
+		bound.merge(extract_map(pat));
+	}
+
+	const size_t num_columns = VariableSlots(CodedVarMap(), plan.patterns).size();
+	const auto start_time = std::chrono::steady_clock::now();
+	{
+		// (the rows scanned are only added up as the iterators are
+		// destroyed)
+		auto iter = create_join_iterator(snapshot, plan, profile.steps.data());
+		profile.num_results = count_rows(*iter, num_columns);
+	}
+	profile.time = std::chrono::steady_clock::now() - start_time;
+	return profile;
+}
+
+
 }  // namespace joins
 }  // namespace dbsi
@@ -6,6 +6,8 @@
 #include <memory>
 #include "dbsi_types.h"
 #include "dbsi_iterator.h"
+#include "dbsi_thread_pool.h"
+#include "dbsi_profile.h"
 
 
 namespace dbsi
@@ -28,6 +30,8 @@ namespace joins
 * first be created for patterns[0], which will then bind
 * variables into the rest of the expressions, then an iterator
 * for patterns[1] will be created, etc...
+* The join reads a snapshot of `rdf_idx` taken at this point
+* (see `RDFIndex::Snapshot`).
 */
 std::unique_ptr<ICodedVarMapIterator> create_nested_loop_join_iterator(
 	const RDFIndex& rdf_idx,
@@ -40,8 +44,12 @@ std::unique_ptr<ICodedVarMapIterator> create_nested_loop_join_iterator(
 * more efficient one. Good idea to call this just before
 * `create_nested_loop_join_iterator`. It will permute the array
 * given as input.
+* Patterns are chosen greedily, each time taking the one with the
+* lowest estimated number of matches per binding of the patterns
+* already chosen (see `RDFIndex::Snapshot::estimate_cardinality`),
+* while avoiding cross products.
 * 
-* Implementation according to the reference:
+* Ties are broken by the ranking of pattern types from:
 * Petros Tsialiamanis, Lefteris Sidirourgos, Irini Fundulaki,
 * Vassilis Christophides, Peter A. Boncz. Heuristics-based query
 * optimisation for SPARQL. Proc. of the 15th Int. Conf. on Extending
@@ -49,10 +57,117 @@ std::unique_ptr<ICodedVarMapIterator> create_nested_loop_join_iterator(
 * March 2730 2012. ACM.
 */
 void greedy_join_order_opt(
+	const RDFIndex& rdf_idx,
 	std::vector<CodedTriplePattern>& patterns
 );
 
 
+/*
+* How a pattern is joined to the patterns before it in a plan.
+*/
+enum class JoinMethod
+{
+	NESTED_LOOP,  // evaluate it once per result so far (as above)
+	HASH  // evaluate it once, and hash join it (see `dbsi_hash_join.h`)
+};
+
+
+/*
+* A join plan: the patterns in the order in which they are joined,
+* the method used to join each of them (the first one's is always
+* NESTED_LOOP), and the estimated cost, in terms of the number of
+* rows of the index read (see `dbsi_nlj.cpp` for the details).
+* If `leapfrog_order` is nonempty, then the patterns are instead all
+* joined at once by a leapfrog triejoin (see `dbsi_leapfrog.h`), which
+* binds the variables in that order, and `methods` are ignored.
+*/
+struct JoinPlan
+{
+	std::vector<CodedTriplePattern> patterns;
+	std::vector<JoinMethod> methods;
+	double cost;
+	std::vector<Variable> leapfrog_order;
+};
+
+
+/*
+* Find the cheapest plan for the join of the given patterns, using
+* `RDFIndex::Snapshot::estimate_cardinality` and `estimate_scan`.
+* The join is done one pattern at a time, each joined to the ones
+* before it by a nested loop join or a hash join, whichever is
+* estimated to be cheaper.
+* Up to 12 patterns, every order (which doesn't introduce a cross
+* product, where possible) is considered, by dynamic programming over
+* the subsets of patterns. Beyond that, the order is chosen by
+* `greedy_join_order_opt`.
+* If the patterns are cyclic (e.g. a triangle), then joining them
+* pairwise may generate far more intermediate results than the join
+* has, so a leapfrog triejoin is used instead if it is estimated to
+* be cheaper.
+*/
+JoinPlan plan_join(
+	const RDFIndex& rdf_idx,
+	std::vector<CodedTriplePattern> patterns
+);
+
+
+/*
+* Creates an iterator which returns the join of the patterns of
+* `plan`, carried out exactly as planned. The join reads a snapshot
+* of `rdf_idx` taken at this point.
+*/
+std::unique_ptr<ICodedVarMapIterator> create_join_iterator(
+	const RDFIndex& rdf_idx,
+	JoinPlan plan
+);
+
+
+/*
+* Like `create_join_iterator`, but the join is evaluated by
+* `num_threads` threads from `pool` (including the one which starts
+* it), using morsel-driven parallelism: the results of the first
+* pattern are split into small morsels, which the threads take as they
+* need more work, and each thread joins its morsels with the rest of
+* the patterns by itself, into a buffer per morsel.
+* This all happens the first time that the iterator is started, after
+* which the results are returned from the buffers, in the same order
+* as `create_join_iterator` would return them.
+* Only plans made of nested loop joins are split up like this; any
+* other plan is just evaluated by `create_join_iterator`.
+*/
+std::unique_ptr<ICodedVarMapIterator> create_parallel_join_iterator(
+	const RDFIndex& rdf_idx,
+	JoinPlan plan,
+	ThreadPool& pool,
+	size_t num_threads
+);
+
+
+/*
+* Count the results of the join of the patterns of `plan`, using
+* `num_threads` threads as in `create_parallel_join_iterator`, but
+* without storing the results: each morsel is just counted.
+*/
+size_t count_join(
+	const RDFIndex& rdf_idx,
+	JoinPlan plan,
+	ThreadPool& pool,
+	size_t num_threads
+);
+
+
+/*
+* Evaluate `plan` as `create_join_iterator` would (so on this thread
+* only), counting its results, and measure what is done to look up
+* each of its patterns (for EXPLAIN ANALYZE). Measuring slows the join
+* down somewhat, since every call to the index is timed.
+*/
+JoinProfile analyze_join(
+	const RDFIndex& rdf_idx,
+	const JoinPlan& plan
+);
+
+
 }  // namespace joins
 }  // namespace dbsi
 
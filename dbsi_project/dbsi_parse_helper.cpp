@@ -1,5 +1,6 @@
 #include "dbsi_parse_helper.h"
 #include <vector>
+#include <string>
 
 
 namespace dbsi
@@ -15,13 +16,6 @@ bool next_nonws_char(char& out_c, std::istream& in)
 
 std::optional<Resource> parse_resource(std::istream& in)
 {
-	// this buffer is especially for reducing allocations between
-	// resource parses.
-	// the only downside is it is persistent, so technically, extremely
-	// long IRIs/Literals will be held twice in memory, but that is
-	// unlikely and it is a big improvement to load times.
-	static std::vector<char> str(32);
-
 	// the first character tells us whether this is
 	// a literal/IRI
 	char start_char;
@@ -31,26 +25,21 @@ std::optional<Resource> parse_resource(std::istream& in)
 	if (start_char != '<' && start_char != '"')
 		return std::nullopt;
 
-	str.clear();
+	// read straight into the resource's own string, rather than via
+	// a buffer, so there is no state shared between parses (or
+	// threads)
 	const char end_char = (start_char == '<') ? '>' : '"';
-	char next_char;
-
-	while (in.good() && (next_char = in.get()) != end_char)
-	{
-		str.push_back(next_char);
-	}
+	std::string val;
+	std::getline(in, val, end_char);
 
 	// if the stream ended in the middle of an expression
-	// (note: warnings about `next_char` being uninitialised
-	// here are unfounded, because the while loop above is
-	// guaranteed to perform at least one iteration.)
-	if (end_char != next_char)
+	if (in.eof())
 		return std::nullopt;
 
 	if (start_char == '<')
-		return IRI{ std::string(str.begin(), str.end()) };
+		return IRI{ std::move(val) };
 	else
-		return Literal{ std::string(str.begin(), str.end()) };
+		return Literal{ std::move(val) };
 }
 
 
@@ -32,13 +32,60 @@ bool pattern_matches(const GeneralTerm<ResT>& t, const ResT& r)
 	};
 	return std::visit(PatternVisitor{ r }, t);
 }
+
+
+/*
+* A triple pattern prepared for checking many triples against it (as
+* `pattern_matches` does), without building variable maps or comparing
+* variable names for each one: the constants are compared, and so are
+* the components of the triple where the pattern repeats a variable
+* (e.g. `?x <p> ?x`).
+*/
+template<typename ResT>
+class TripleMatcher
+{
+public:
+	explicit TripleMatcher(const GeneralTriplePattern<ResT>& pat) :
+		m_sub(constant(pat.sub)), m_pred(constant(pat.pred)), m_obj(constant(pat.obj)),
+		m_sub_is_pred(same_variable(pat.sub, pat.pred)),
+		m_sub_is_obj(same_variable(pat.sub, pat.obj)),
+		m_pred_is_obj(same_variable(pat.pred, pat.obj))
+	{ }
+
+	bool operator()(const GeneralTriple<ResT>& t) const
+	{
+		return (!m_sub || *m_sub == t.sub)
+			&& (!m_pred || *m_pred == t.pred)
+			&& (!m_obj || *m_obj == t.obj)
+			&& (!m_sub_is_pred || t.sub == t.pred)
+			&& (!m_sub_is_obj || t.sub == t.obj)
+			&& (!m_pred_is_obj || t.pred == t.obj);
+	}
+
+private:
+	static std::optional<ResT> constant(const GeneralTerm<ResT>& t)
+	{
+		if (std::holds_alternative<ResT>(t))
+			return std::get<ResT>(t);
+		return std::nullopt;
+	}
+
+	static bool same_variable(const GeneralTerm<ResT>& t1, const GeneralTerm<ResT>& t2)
+	{
+		return std::holds_alternative<Variable>(t1) && std::holds_alternative<Variable>(t2)
+			&& std::get<Variable>(t1) == std::get<Variable>(t2);
+	}
+
+private:
+	std::optional<ResT> m_sub, m_pred, m_obj;
+	bool m_sub_is_pred, m_sub_is_obj, m_pred_is_obj;
+};
+
+
 template<typename ResT>
 bool pattern_matches(const GeneralTriplePattern<ResT>& pat, const GeneralTriple<ResT>& t)
 {
-	// unfortunately this isn't so simple because we need to check
-	// that the variable assignments are consistent
-	// (although this could probably be optimised)
-	return (bool)bind(pat, t);
+	return TripleMatcher<ResT>(pat)(t);
 }
 
 
@@ -0,0 +1,102 @@
+#include "dbsi_profile.h"
+#include "dbsi_assert.h"
+
+
+namespace dbsi
+{
+namespace joins
+{
+
+
+/*
+* Passes everything on to another iterator, counting and timing it.
+*/
+class ProfiledMatchIterator :
+	public IMatchIterator
+{
+public:
+	ProfiledMatchIterator(std::unique_ptr<IMatchIterator> iter, StepProfile& profile) :
+		m_iter(std::move(iter)),
+		m_profile(profile)
+	{
+		DBSI_CHECK_PRECOND(m_iter != nullptr);
+	}
+
+	~ProfiledMatchIterator()
+	{
+		m_profile.rows_scanned += m_iter->rows_scanned();
+	}
+
+	void start() override
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+		m_iter->start();
+		m_profile.time += std::chrono::steady_clock::now() - start_time;
+
+		++m_profile.lookups;
+		if (m_iter->valid())
+			++m_profile.rows_matched;
+	}
+
+	CodedTriple current() const override
+	{
+		return m_iter->current();
+	}
+
+	void next() override
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+		m_iter->next();
+		m_profile.time += std::chrono::steady_clock::now() - start_time;
+
+		if (m_iter->valid())
+			++m_profile.rows_matched;
+	}
+
+	bool valid() const override
+	{
+		return m_iter->valid();
+	}
+
+	void next_batch(ColumnBatch& batch) override
+	{
+		// (the current row, which is part of the batch, has already
+		// been counted)
+		const size_t num_rows = batch.num_rows();
+		const auto start_time = std::chrono::steady_clock::now();
+		m_iter->next_batch(batch);
+		m_profile.time += std::chrono::steady_clock::now() - start_time;
+
+		if (batch.num_rows() > num_rows)
+			m_profile.rows_matched += batch.num_rows() - num_rows - 1;
+		if (m_iter->valid())
+			++m_profile.rows_matched;
+	}
+
+	void rebind(const CodedTriplePattern& pattern) override
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+		m_iter->rebind(pattern);
+		m_profile.time += std::chrono::steady_clock::now() - start_time;
+	}
+
+	size_t rows_scanned() const override
+	{
+		return m_iter->rows_scanned();
+	}
+
+private:
+	const std::unique_ptr<IMatchIterator> m_iter;
+	StepProfile& m_profile;
+};
+
+
+std::unique_ptr<IMatchIterator> profile_matches(std::unique_ptr<IMatchIterator> iter,
+	StepProfile& profile)
+{
+	return std::make_unique<ProfiledMatchIterator>(std::move(iter), profile);
+}
+
+
+}  // namespace joins
+}  // namespace dbsi
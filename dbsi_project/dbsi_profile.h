@@ -0,0 +1,67 @@
+#ifndef DBSI_PROFILE_H
+#define DBSI_PROFILE_H
+
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <chrono>
+#include "dbsi_iterator.h"
+
+
+namespace dbsi
+{
+namespace joins
+{
+
+
+/*
+* What was done to evaluate one pattern of a join plan, as measured
+* for EXPLAIN ANALYZE (see `analyze_join`).
+*/
+struct StepProfile
+{
+	// how the index finds the pattern's matches (see
+	// `RDFIndex::Snapshot::describe_access`)
+	std::string access;
+
+	// the number of times the pattern was looked up in the index
+	// (for a nested loop join, once per result of the patterns before)
+	size_t lookups = 0;
+
+	// the rows of the index read, and how many of those matched (and
+	// so went on to bind the pattern's variables)
+	size_t rows_scanned = 0;
+	size_t rows_matched = 0;
+
+	// the time spent in the index, looking up and reading rows (not
+	// including the time spent on the other patterns in between)
+	std::chrono::nanoseconds time = std::chrono::nanoseconds::zero();
+};
+
+
+/*
+* What was done to evaluate a whole join plan.
+*/
+struct JoinProfile
+{
+	std::vector<StepProfile> steps;  // one per pattern of the plan, in order
+	size_t num_results = 0;
+	std::chrono::nanoseconds time = std::chrono::nanoseconds::zero();
+};
+
+
+/*
+* Wrap an iterator over the matches of a pattern so that what it does
+* is added to `profile` (when it is destroyed, for the rows scanned).
+* This times every call, so is only for EXPLAIN ANALYZE.
+*/
+std::unique_ptr<IMatchIterator> profile_matches(std::unique_ptr<IMatchIterator> iter,
+	StepProfile& profile);
+
+
+}  // namespace joins
+}  // namespace dbsi
+
+
+#endif  // DBSI_PROFILE_H
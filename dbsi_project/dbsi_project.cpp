@@ -1,16 +1,29 @@
 ﻿#include <iostream>
 #include <fstream>
+#include <filesystem>
 #include <chrono>
 #include <sstream>
+#include <iomanip>
 #include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <optional>
 #include "dbsi_assert.h"
 #include "dbsi_dictionary.h"
 #include "dbsi_rdf_index.h"
 #include "dbsi_turtle.h"
+#include "dbsi_load_pipeline.h"
+#include "dbsi_dump.h"
 #include "dbsi_query.h"
 #include "dbsi_dictionary_utils.h"
 #include "dbsi_nlj.h"
 #include "dbsi_pattern_utils.h"
+#include "dbsi_image.h"
+#include "dbsi_log.h"
+#include "dbsi_thread_pool.h"
+#include "dbsi_slots.h"
 
 
 using namespace dbsi;
@@ -31,10 +44,10 @@ using namespace dbsi;
 * What this is used for: when performing a selection
 * over the entire DB, we use the RDF index's `full_scan`
 * method, which returns an iterator over coded triples.
-* However, our function `QueryApplication::evaluate_patterns`
-* below returns iterators over `VarMap`s. But, since we
+* However, our function `QueryApplication::evaluate_plan`
+* below returns iterators over `CodedVarMap`s. But, since we
 * don't care about the return results (*), we can just
-* default construct `VarMap` for each coded triple in the
+* default construct `CodedVarMap` for each coded triple in the
 * DB.
 * 
 * (*) Why we don't care about the return results: because
@@ -44,7 +57,7 @@ using namespace dbsi;
 */
 template<typename T, typename U>
 class NullIterator :
-	public IIterator<T>
+	public ICodedRowIterator<T>
 {
 public:
 	NullIterator(std::unique_ptr<IIterator<U>> p_iter) :
@@ -78,11 +91,28 @@ private:
 class QueryApplication
 {
 public:
-	QueryApplication(bool log_plan_types, bool profiling_mode) :
+	QueryApplication(bool log_plan_types, bool profiling_mode, bool auto_compact,
+		size_t num_load_threads, size_t num_query_threads, bool background_loads,
+		bool write_ahead_log) :
 		m_done(false),
 		m_log_plan_types(log_plan_types),
-		m_profiling_mode(profiling_mode)
-	{ }
+		m_profiling_mode(profiling_mode),
+		m_auto_compact(auto_compact),
+		m_background_loads(background_loads),
+		m_write_ahead_log(write_ahead_log),
+		m_num_load_threads(num_load_threads),
+		m_num_query_threads(num_query_threads),
+		m_pool(pool_size(num_load_threads, num_query_threads))
+	{
+		// background loads only use `bulk_load`, which is the only
+		// way of loading which snapshots can be read alongside
+		DBSI_CHECK_PRECOND(!background_loads || (num_load_threads == 1 && !auto_compact));
+	}
+
+	~QueryApplication()
+	{
+		wait_for_load();
+	}
 
 	void operator()(const EmptyQuery&) {}
 
@@ -93,39 +123,336 @@ public:
 
 	void operator()(const QuitQuery&)
 	{
+		wait_for_load();
 		std::cout << "Exiting..." << std::endl;
 		m_done = true;
 	}
 
 	void operator()(const LoadQuery& q)
 	{
+		// only one LOAD may run at a time
+		wait_for_load();
+
+		const auto start_time = std::chrono::system_clock::now();
+
+		// parse the file in place if it can be mapped, and otherwise
+		// (e.g. if it's empty) as a stream
+		std::shared_ptr<const MappedFile> mapped;
+		std::unique_ptr<std::ifstream> file;
+		try
+		{
+			mapped = std::make_shared<MappedFile>(q.filename);
+		}
+		catch (const std::runtime_error& e)
+		{
+			// (an empty file isn't a valid binary dump anyway)
+			if (q.binary)
+			{
+				std::cerr << "Unfortunately the file '" << q.filename
+					<< "' could not be loaded. Error: " << e.what() << std::endl;
+				return;
+			}
+
+			file = std::make_unique<std::ifstream>(q.filename, std::ios::binary);
+
+			if (!*file)
+			{
+				std::cerr << "Unfortunately the given file '"
+					<< q.filename << "' cannot be opened." << std::endl;
+				return;
+			}
+		}
+
+		if (m_background_loads)
+		{
+			// queries can carry on in the meantime, reading snapshots
+			// of the index, which don't see the new triples until the
+			// load has finished
+			m_loader = std::thread(
+				[this, filename = q.filename, binary = q.binary, mapped, file = std::move(file), start_time]()
+				{
+					load_file(filename, binary, mapped, file.get(), start_time);
+				});
+		}
+		else
+		{
+			load_file(q.filename, q.binary, mapped, file.get(), start_time);
+		}
+	}
+
+	void operator()(const SaveQuery& q)
+	{
+		wait_for_load();
+
 		const auto start_time = std::chrono::system_clock::now();
 
-		std::ifstream file(q.filename, std::ios::binary);
+		// write to a temporary file and then move it into place, because
+		// the file being replaced might be the image currently opened,
+		// which mustn't change while it's mapped
+		const std::string temp_filename = q.filename + ".tmp";
+		std::ofstream file(temp_filename, std::ios::binary);
 
 		if (!file)
 		{
 			std::cerr << "Unfortunately the given file '"
-				<< q.filename << "' cannot be opened." << std::endl;
+				<< temp_filename << "' cannot be opened." << std::endl;
 			return;
 		}
 
-		auto file_iter = autoencode(m_dict, create_turtle_file_parser(file));
+		try
+		{
+			ImageWriter out(file);
+			m_dict.save(out);
+			m_idx.save(out);
+			out.finish();
+			file.close();
+			std::filesystem::rename(temp_filename, q.filename);
+		}
+		catch (const std::exception& e)
+		{
+			file.close();
+			std::error_code ignored;
+			std::filesystem::remove(temp_filename, ignored);
+			std::cerr << "Unfortunately the file '" << q.filename
+				<< "' could not be saved. Error: " << e.what() << std::endl;
+			return;
+		}
 
-		size_t add_count = 0;
-		file_iter->start();
-		while (file_iter->valid())
+		// everything logged so far is in the image now, so the image's
+		// log (if any) starts again from empty
+		set_wal(nullptr);
+		if (m_write_ahead_log)
+		{
+			try
+			{
+				set_wal(WriteAheadLog::create(wal_filename(q.filename), m_dict, m_idx));
+			}
+			catch (const std::runtime_error& e)
+			{
+				std::cerr << "Unfortunately the log for '" << q.filename
+					<< "' could not be created, so changes won't be logged. Error: "
+					<< e.what() << std::endl;
+			}
+		}
+		else
 		{
-			m_idx.add(file_iter->current());
-			file_iter->next();
-			++add_count;
+			std::error_code ignored;
+			std::filesystem::remove(wal_filename(q.filename), ignored);
 		}
 
 		const auto end_time = std::chrono::system_clock::now();
 
 		if (!m_profiling_mode)
 		{
-			std::cout << "Loaded " << add_count << " triples in " <<
+			std::cout << "Saved in " <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< "ms." << std::endl;
+		}
+		else
+		{
+			std::cout <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< std::endl;
+		}
+	}
+
+	void operator()(const OpenQuery& q)
+	{
+		wait_for_load();
+
+		const auto start_time = std::chrono::system_clock::now();
+
+		try
+		{
+			// (if the file can't be mapped, or has the wrong header,
+			// this throws before the current database is touched)
+			ImageReader in(std::make_shared<MappedFile>(q.filename));
+
+			// the current log doesn't follow on from the new image
+			set_wal(nullptr);
+
+			try
+			{
+				m_dict.open(in);
+				m_idx.open(in);
+
+				// replay any changes made since the image was saved, even
+				// if we aren't going to log any more of them
+				const std::string log_filename = wal_filename(q.filename);
+				if (std::filesystem::exists(log_filename))
+				{
+					auto log = WriteAheadLog::recover(log_filename, m_dict, m_idx);
+					if (m_write_ahead_log)
+						set_wal(std::move(log));
+				}
+				else if (m_write_ahead_log)
+				{
+					set_wal(WriteAheadLog::create(log_filename, m_dict, m_idx));
+				}
+			}
+			catch (const std::runtime_error&)
+			{
+				m_dict.clear();
+				m_idx.clear();
+				throw;
+			}
+		}
+		catch (const std::runtime_error& e)
+		{
+			std::cerr << "Unfortunately the file '" << q.filename
+				<< "' could not be opened. Error: " << e.what() << std::endl;
+			return;
+		}
+
+		const auto end_time = std::chrono::system_clock::now();
+
+		if (!m_profiling_mode)
+		{
+			std::cout << "Opened in " <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< "ms." << std::endl;
+		}
+		else
+		{
+			std::cout <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< std::endl;
+		}
+	}
+
+	void operator()(const DumpQuery& q)
+	{
+		wait_for_load();
+
+		const auto start_time = std::chrono::system_clock::now();
+
+		// (written to a temporary file first, as for SAVE, so that a
+		// failed dump doesn't replace an older one)
+		const std::string temp_filename = q.filename + ".tmp";
+		std::ofstream file(temp_filename, std::ios::binary);
+
+		if (!file)
+		{
+			std::cerr << "Unfortunately the given file '"
+				<< temp_filename << "' cannot be opened." << std::endl;
+			return;
+		}
+
+		try
+		{
+			if (q.binary)
+				write_binary_dump(file, m_dict, m_idx);
+			else
+				write_turtle_dump(file, m_dict, m_idx);
+			file.close();
+			std::filesystem::rename(temp_filename, q.filename);
+		}
+		catch (const std::exception& e)
+		{
+			file.close();
+			std::error_code ignored;
+			std::filesystem::remove(temp_filename, ignored);
+			std::cerr << "Unfortunately the file '" << q.filename
+				<< "' could not be dumped. Error: " << e.what() << std::endl;
+			return;
+		}
+
+		const auto end_time = std::chrono::system_clock::now();
+
+		if (!m_profiling_mode)
+		{
+			std::cout << "Dumped " << m_idx.size() << " triples in " <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< "ms." << std::endl;
+		}
+		else
+		{
+			std::cout <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< std::endl;
+		}
+	}
+
+	void operator()(const CompactQuery&)
+	{
+		wait_for_load();
+
+		const auto start_time = std::chrono::system_clock::now();
+
+		m_idx.compact();
+
+		const auto end_time = std::chrono::system_clock::now();
+
+		if (!m_profiling_mode)
+		{
+			std::cout << "Compacted in " <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< "ms." << std::endl;
+		}
+		else
+		{
+			std::cout <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< std::endl;
+		}
+	}
+
+	void operator()(const DeleteQuery& q)
+	{
+		// removal can't happen alongside a load
+		wait_for_load();
+
+		const auto start_time = std::chrono::system_clock::now();
+
+		// find all of the triples to remove before removing any, so
+		// that we don't invalidate the iterator while using it.
+		// (note that an empty where clause has no triples to remove)
+		std::vector<CodedTriple> to_remove;
+		if (!q.match.empty())
+		{
+			std::vector<CodedTriplePattern> coded_pats;
+			std::transform(q.match.begin(), q.match.end(), std::back_inserter(coded_pats),
+				[this](const TriplePattern& pat) { return encode(m_dict, pat); });
+
+			auto iter = joins::create_nested_loop_join_iterator(m_idx, coded_pats);
+			iter->start();
+			while (iter->valid())
+			{
+				const auto cvm = iter->current();
+
+				// every variable is bound, so these are all triples
+				for (const auto& pat : coded_pats)
+				{
+					const auto t = substitute(cvm, pat);
+					to_remove.push_back(CodedTriple{
+						std::get<CodedResource>(t.sub),
+						std::get<CodedResource>(t.pred),
+						std::get<CodedResource>(t.obj) });
+				}
+
+				iter->next();
+			}
+		}
+
+		// the same triple may appear several times, but is only
+		// removed (and counted) once
+		size_t remove_count = 0;
+		for (const auto& t : to_remove)
+		{
+			if (m_idx.remove(t))
+				++remove_count;
+		}
+
+		commit_wal();
+
+		if (m_auto_compact)
+			m_idx.compact();
+
+		const auto end_time = std::chrono::system_clock::now();
+
+		if (!m_profiling_mode)
+		{
+			std::cout << "Deleted " << remove_count << " triples in " <<
 				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
 				<< "ms." << std::endl;
 		}
@@ -148,8 +475,16 @@ public:
 	{
 		const bool print_mode = (!q.projection.empty());
 		const auto start_time = std::chrono::system_clock::now();
-		auto iter = evaluate_patterns(q.match);
+
+		// an empty where clause has nothing to plan (see `evaluate_plan`)
+		std::optional<joins::JoinPlan> plan;
+		if (!q.match.empty())
+			plan = plan_patterns(q.match);
 		const auto planning_time = std::chrono::system_clock::now();
+		const auto pool_stats = m_pool.statistics();
+
+		// don't let a background load's output interrupt ours
+		std::lock_guard<std::mutex> output_lock(m_output_mutex);
 
 		// header
 		if (print_mode)
@@ -161,36 +496,60 @@ public:
 		}
 
 		size_t count = 0;
-		iter->start();
-		while (iter->valid())
+		if (print_mode)
 		{
-			// get current map
-			const auto vm = iter->current();
+			// the results are read and decoded a batch at a time
+			const VariableSlots slots = plan_slots(plan);
+			auto iter = evaluate_plan(std::move(plan));
+			ColumnBatch batch(slots.size());
+
+			// the slot of each variable in the projection, and its
+			// decoded values in the current batch
+			std::vector<size_t> proj_slots;
+			for (const auto& v : q.projection)
+				proj_slots.push_back(slots.find(v));
+			std::vector<std::vector<Resource>> proj_values(q.projection.size(),
+				std::vector<Resource>(batch.capacity()));
 
-			if (print_mode)
+			for (iter->start(); iter->valid(); )
 			{
-				// print columns in this row
+				batch.clear();
+				iter->next_batch(batch);
 				for (size_t i = 0; i < q.projection.size(); ++i)
 				{
-					auto vm_iter = vm.find(q.projection[i]);
-					if (vm_iter != vm.end())
+					if (proj_slots[i] != VariableSlots::NO_SLOT)
 					{
-						std::cout << std::visit(DbsiToStringVisitor(),
-							vm_iter->second) << '\t';
+						m_dict.decode(batch.column(proj_slots[i]), batch.num_rows(),
+							proj_values[i].data());
 					}
-					else
+				}
+
+				for (size_t row = 0; row < batch.num_rows(); ++row)
+				{
+					// print columns in this row
+					for (size_t i = 0; i < q.projection.size(); ++i)
 					{
-						// in this case the user has mentioned a variable
-						// in the projection which is not present in the
-						// patterns
-						std::cout << q.projection[i].name << '\t';
+						if (proj_slots[i] != VariableSlots::NO_SLOT)
+						{
+							std::cout << std::visit(DbsiToStringVisitor(),
+								proj_values[i][row]) << '\t';
+						}
+						else
+						{
+							// in this case the user has mentioned a variable
+							// in the projection which is not present in the
+							// patterns
+							std::cout << q.projection[i].name << '\t';
+						}
 					}
+					std::cout << std::endl;
 				}
-				std::cout << std::endl;
+				count += batch.num_rows();
 			}
-
-			iter->next();
-			++count;
+		}
+		else
+		{
+			count = count_plan(std::move(plan));
 		}
 
 		// footer
@@ -208,6 +567,8 @@ public:
 				<< "ms planning + " <<
 				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - planning_time).count()
 				<< "ms evaluation)." << std::endl;
+			if (m_log_plan_types && m_num_query_threads > 1)
+				log_worker_statistics(pool_stats);
 		}
 		else
 		{
@@ -217,73 +578,408 @@ public:
 		}
 	}
 
+	void operator()(const ExplainQuery& q)
+	{
+		const auto start_time = std::chrono::system_clock::now();
+
+		if (q.match.empty())
+		{
+			std::lock_guard<std::mutex> output_lock(m_output_mutex);
+			std::cout << "Empty where clause: every triple is a result ("
+				<< count_plan(std::nullopt) << " results)." << std::endl;
+			return;
+		}
+
+		const joins::JoinPlan plan = plan_patterns(q.match);
+		const auto planning_time = std::chrono::system_clock::now();
+		const joins::JoinProfile profile = joins::analyze_join(m_idx, plan);
+		const auto end_time = std::chrono::system_clock::now();
+
+		// (in fractions of a millisecond, since each step may be quick)
+		auto to_ms = [](std::chrono::nanoseconds time)
+		{
+			std::ostringstream out;
+			out << std::fixed << std::setprecision(3)
+				<< std::chrono::duration<double, std::milli>(time).count() << "ms";
+			return out.str();
+		};
+
+		std::lock_guard<std::mutex> output_lock(m_output_mutex);
+		const bool is_leapfrog = !plan.leapfrog_order.empty();
+		if (is_leapfrog)
+		{
+			std::cout << "Leapfrog triejoin binding";
+			for (const Variable& var : plan.leapfrog_order)
+				std::cout << ' ' << var.name;
+		}
+		else
+		{
+			std::cout << "Join";
+		}
+		std::cout << " with estimated cost " << plan.cost
+			<< (m_idx.is_compact() ? ", using sorted index" : "") << ':' << std::endl;
+
+		for (size_t i = 0; i < plan.patterns.size(); ++i)
+		{
+			const TriplePattern pat = decode(m_dict, plan.patterns[i]);
+			const joins::StepProfile& step = profile.steps[i];
+			const char* method = is_leapfrog ? "read into trie"
+				: (plan.methods[i] == joins::JoinMethod::HASH) ? "hash join" : "nested loop join";
+			std::cout << '\t' << (i + 1) << ". "
+				<< std::visit(DbsiToStringVisitor(), pat.sub) << ' '
+				<< std::visit(DbsiToStringVisitor(), pat.pred) << ' '
+				<< std::visit(DbsiToStringVisitor(), pat.obj)
+				<< " (" << method << "; " << step.access << ')' << std::endl;
+			std::cout << "\t\t" << step.lookups << " lookups, " << step.rows_scanned
+				<< " rows scanned, " << step.rows_matched << " rows matched, "
+				<< to_ms(step.time) << std::endl;
+		}
+
+		std::cout << profile.num_results << " results obtained in " <<
+			std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+			<< "ms (= " <<
+			std::chrono::duration_cast<std::chrono::milliseconds>(planning_time - start_time).count()
+			<< "ms planning + " << to_ms(profile.time) << " evaluation)." << std::endl;
+	}
+
 	bool done() const
 	{
 		return m_done;
 	}
 
 private:
-	std::unique_ptr<IVarMapIterator> evaluate_patterns(std::vector<TriplePattern> pats)
+	/*
+	* Load the triples of a file, which is either `mapped` or (if that
+	* is null) read from `stream`. A `binary` file is always mapped.
+	*/
+	void load_file(const std::string& filename, bool binary, std::shared_ptr<const MappedFile> mapped,
+		std::istream* stream, std::chrono::system_clock::time_point start_time)
 	{
-		if (pats.empty())
+		DBSI_CHECK_PRECOND(!binary || mapped);
+
+		const auto pool_stats = m_pool.statistics();
+
+		size_t add_count = 0;
+		std::vector<LoadStageStatistics> stage_stats;
+		try
 		{
-			// if there is an empty where clause, then all triples
-			// satisfy the query, by vacuosity
-			return std::make_unique<NullIterator<VarMap, CodedTriple>>(m_idx.full_scan());
+			if (binary)
+			{
+				// (which checks the whole file before changing the
+				// dictionary or the index, so leaves both unchanged if
+				// it isn't a valid dump)
+				add_count = load_binary_dump(*mapped, m_dict, m_idx, m_pool, m_num_load_threads);
+			}
+			else if (mapped && m_num_load_threads > 1)
+			{
+				// the parsing is shared out between the threads too
+				add_count = m_idx.parallel_load(
+					parse_mapped_turtle(mapped, m_dict, m_pool, m_num_load_threads),
+					m_pool, m_num_load_threads);
+			}
+			else if (mapped)
+			{
+				// parsing, encoding and indexing overlap instead
+				add_count = pipelined_load(mapped, m_dict, m_idx, &stage_stats);
+			}
+			else
+			{
+				auto file_iter = autoencode(m_dict, create_turtle_file_parser(*stream));
+				if (m_num_load_threads > 1)
+					add_count = m_idx.parallel_load(*file_iter, m_pool, m_num_load_threads);
+				else
+					add_count = m_idx.bulk_load(*file_iter);
+			}
 		}
-		else
+		catch (const std::runtime_error& e)
 		{
-			// first need to encode the patterns
-			std::vector<CodedTriplePattern> coded_pats;
-			std::transform(pats.begin(), pats.end(), std::back_inserter(coded_pats),
-				[this](const TriplePattern& pat) { return encode(m_dict, pat); });
+			// (this is reported rather than let through, since it may
+			// be on the background loader thread, where nothing would
+			// catch it. the index is left unchanged if it is a
+			// `std::overflow_error` or an invalid binary dump, but not
+			// necessarily if writing to the log failed part-way)
+			std::lock_guard<std::mutex> output_lock(m_output_mutex);
+			std::cerr << "Unfortunately the file '" << filename
+				<< "' could not be loaded. Error: " << e.what() << std::endl;
+			return;
+		}
+
+		commit_wal();
 
-			// join optimisation!
-			joins::greedy_join_order_opt(coded_pats);
+		if (m_auto_compact)
+			m_idx.compact();
 
+		const auto end_time = std::chrono::system_clock::now();
+
+		std::lock_guard<std::mutex> output_lock(m_output_mutex);
+		if (!m_profiling_mode)
+		{
+			std::cout << "Loaded " << add_count << " triples in " <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< "ms." << std::endl;
+			if (m_log_plan_types && m_num_load_threads > 1)
+				log_worker_statistics(pool_stats);
 			if (m_log_plan_types)
-			{
-				// need to work out the conditional types
-				CodedVarMap cvm;
-				std::vector<CodedTriplePattern> cond_coded_pats;
-				for (const auto& cpat : coded_pats)
-				{
-					auto ccpat = substitute(cvm, cpat);
-					const bool ok = merge(cvm, extract_map(ccpat));
-					DBSI_CHECK_POSTCOND(ok);
-					cond_coded_pats.push_back(std::move(ccpat));
-				}
+				log_stage_statistics(stage_stats);
+		}
+		else
+		{
+			std::cout <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+				<< std::endl;
+		}
+	}
+
+	/*
+	* Wait for the background load (if any) to finish, which must be
+	* done before anything which modifies the index other than a load.
+	*/
+	void wait_for_load()
+	{
+		if (m_loader.joinable())
+			m_loader.join();
+	}
+
+	/*
+	* The write-ahead log which goes with an image.
+	*/
+	static std::string wal_filename(const std::string& image_filename)
+	{
+		return image_filename + ".wal";
+	}
+
+	/*
+	* Start appending all changes to `wal`, or stop logging if it is
+	* null.
+	*/
+	void set_wal(std::unique_ptr<WriteAheadLog> wal)
+	{
+		m_dict.set_log(wal.get());
+		m_idx.set_log(wal.get());
+		m_wal = std::move(wal);
+	}
+
+	/*
+	* Make the changes logged so far durable, if logging. This is
+	* done at the end of each command which changes the database.
+	*/
+	void commit_wal()
+	{
+		if (m_wal == nullptr)
+			return;
+
+		try
+		{
+			m_wal->commit();
+		}
+		catch (const std::runtime_error& e)
+		{
+			std::lock_guard<std::mutex> output_lock(m_output_mutex);
+			std::cerr << "Unfortunately the log could not be written, so changes "
+				"are no longer being logged. Error: " << e.what() << std::endl;
+			set_wal(nullptr);
+		}
+	}
+
+	joins::JoinPlan plan_patterns(const std::vector<TriplePattern>& pats)
+	{
+		DBSI_CHECK_PRECOND(!pats.empty());
+
+		// first need to encode the patterns
+		std::vector<CodedTriplePattern> coded_pats;
+		std::transform(pats.begin(), pats.end(), std::back_inserter(coded_pats),
+			[this](const TriplePattern& pat) { return encode(m_dict, pat); });
 
-				std::cout << "\t--> NLJ over patterns with (conditional) types ";
-				for (const auto& pat : cond_coded_pats)
-					std::cout << trip_pat_type_str(pattern_type(pat)) << ' ';
-				std::cout << std::endl;
+		// join optimisation!
+		joins::JoinPlan plan = joins::plan_join(m_idx, std::move(coded_pats));
+
+		if (m_log_plan_types)
+		{
+			// need to work out the conditional types (except that
+			// hash joined patterns are evaluated with nothing bound),
+			// and the estimated number of matches per binding
+			const RDFIndex::Snapshot stats = m_idx.snapshot();
+			const bool is_leapfrog = !plan.leapfrog_order.empty();
+			CodedVarMap cvm;
+
+			// (the callers only take the lock once this has returned)
+			std::lock_guard<std::mutex> output_lock(m_output_mutex);
+			std::cout << (is_leapfrog ? "\t--> Leapfrog triejoin" : "\t--> Join")
+				<< " over patterns with (conditional) types ";
+			for (size_t i = 0; i < plan.patterns.size(); ++i)
+			{
+				const auto& cpat = plan.patterns[i];
+				const bool is_hash = !is_leapfrog && (plan.methods[i] == joins::JoinMethod::HASH);
+				std::cout << trip_pat_type_str(pattern_type(is_hash ? cpat : substitute(cvm, cpat)))
+					<< " (~" << stats.estimate_cardinality(cpat, cvm)
+					<< (is_hash ? ", hash join" : "") << ") ";
+				cvm.merge(extract_map(cpat));
+			}
+			if (is_leapfrog)
+			{
+				std::cout << "binding";
+				for (const Variable& var : plan.leapfrog_order)
+					std::cout << ' ' << var.name;
+				std::cout << ' ';
 			}
+			std::cout << "with estimated cost " << plan.cost << ' ';
+			if (m_idx.is_compact())
+				std::cout << "using sorted index";
+			std::cout << std::endl;
+		}
+
+		return plan;
+	}
 
-			return autodecode(m_dict,
-				joins::create_nested_loop_join_iterator(m_idx, std::move(coded_pats)));
+	/*
+	* Create an iterator over the (coded) results of a plan, or if
+	* there is no plan (because the where clause is empty), of the
+	* empty pattern. Its columns are the slots of `plan_slots(plan)`.
+	*/
+	std::unique_ptr<ICodedVarMapIterator> evaluate_plan(std::optional<joins::JoinPlan> plan)
+	{
+		if (!plan)
+		{
+			// if there is an empty where clause, then all triples
+			// satisfy the query, by vacuosity
+			return std::make_unique<NullIterator<CodedVarMap, CodedTriple>>(m_idx.full_scan());
+		}
+
+		return joins::create_parallel_join_iterator(m_idx, std::move(*plan), m_pool,
+			m_num_query_threads);
+	}
+
+	/*
+	* The slots of the variables of a plan's results.
+	*/
+	static VariableSlots plan_slots(const std::optional<joins::JoinPlan>& plan)
+	{
+		return plan ? VariableSlots(CodedVarMap(), plan->patterns) : VariableSlots();
+	}
+
+	/*
+	* Count the results of a plan, as `evaluate_plan` would return them
+	* (but without decoding them).
+	*/
+	size_t count_plan(std::optional<joins::JoinPlan> plan)
+	{
+		if (!plan)
+		{
+			size_t count = 0;
+			auto iter = m_idx.full_scan();
+			for (iter->start(); iter->valid(); iter->next())
+				++count;
+			return count;
+		}
+
+		return joins::count_join(m_idx, std::move(*plan), m_pool, m_num_query_threads);
+	}
+
+	/*
+	* The number of workers for the thread pool: enough for every
+	* hardware thread, or more if asked for more threads (in either
+	* case, less the thread which uses the pool, which works too).
+	*/
+	static size_t pool_size(size_t num_load_threads, size_t num_query_threads)
+	{
+		const size_t num_threads = std::max({ static_cast<size_t>(std::thread::hardware_concurrency()),
+			num_load_threads, num_query_threads });
+		return std::max<size_t>(num_threads, 2) - 1;
+	}
+
+	/*
+	* Show what each stage of a pipelined LOAD did (if it was one), and
+	* how fast it went, counting only its busy time.
+	*/
+	static void log_stage_statistics(const std::vector<LoadStageStatistics>& stats)
+	{
+		for (const LoadStageStatistics& stage : stats)
+		{
+			const double busy_s = std::chrono::duration<double>(stage.busy_time).count();
+			std::cout << "\t--> Stage " << stage.name << ": " << stage.num_triples
+				<< " triples, busy "
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(stage.busy_time).count()
+				<< "ms (" << static_cast<size_t>(busy_s > 0 ? stage.num_triples / busy_s : 0)
+				<< " triples/s), waiting "
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(stage.wait_time).count()
+				<< "ms" << std::endl;
+		}
+	}
+
+	/*
+	* Show (with -L) what each worker of the thread pool has done since
+	* `before` was taken from `m_pool.statistics()`, so that it can be
+	* seen how evenly the work was shared out.
+	*/
+	void log_worker_statistics(const std::vector<ThreadPool::WorkerStatistics>& before)
+	{
+		const auto after = m_pool.statistics();
+		for (size_t i = 0; i < after.size(); ++i)
+		{
+			std::cout << "\t--> Worker " << i << ": busy "
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(
+					after[i].busy_time - before[i].busy_time).count()
+				<< "ms, idle "
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(
+					after[i].idle_time - before[i].idle_time).count()
+				<< "ms, " << (after[i].tasks_run - before[i].tasks_run) << " tasks ("
+				<< (after[i].tasks_stolen - before[i].tasks_stolen) << " stolen)" << std::endl;
 		}
 	}
 
 private:
 	bool m_done;
-	const bool m_log_plan_types, m_profiling_mode;
+	const bool m_log_plan_types, m_profiling_mode, m_auto_compact, m_background_loads,
+		m_write_ahead_log;
+	const size_t m_num_load_threads, m_num_query_threads;
+
+	// the workers which every parallel LOAD or query shares (see
+	// `pool_size`)
+	ThreadPool m_pool;
 	Dictionary m_dict;
 	RDFIndex m_idx;
+
+	// if non-null, the log which all changes are appended to (see
+	// `m_write_ahead_log`)
+	std::unique_ptr<WriteAheadLog> m_wal;
+
+	// the thread running the current LOAD, if `m_background_loads`
+	std::thread m_loader;
+
+	// held while writing results to stdout, so that the loader's
+	// output doesn't end up in the middle of a query's
+	std::mutex m_output_mutex;
 };
 
 
 void show_help()
 {
 	std::cout << "-h : Print help. If using this option, no other options can be used." << std::endl;
-	std::cout << "-L : Show join plan selection types. Good for debugging performance "
-		"issues. If used, it must be appear before any -i or -f options." << std::endl;
+	std::cout << "-L : Show join plan selection types, and with -T or -Q, what each "
+		"worker thread did, or without -T, what each stage of a LOAD did. "
+		"Good for debugging performance issues. If used, it must appear before any -i or -f options." << std::endl;
 	std::cout << "-P : 'Profiling mode'. This means that the timings for each query "
 		"will only output an integer, the amount of time it took, with no extra text. "
 		"This is mutually exclusive with -L. "
 		"Also, it doesn't make much sense to use this with SELECT commands, or in interactive mode. "
 		"Errors will still be printed."
 		<< std::endl;
+	std::cout << "-C : Automatically COMPACT the database after each LOAD or DELETE, "
+		"so that queries are always evaluated using the sorted index. "
+		"If used, it must appear before any -i or -f options." << std::endl;
+	std::cout << "-T n : Use n threads to insert triples during LOAD. "
+		"If used, it must appear before any -i or -f options." << std::endl;
+	std::cout << "-Q n : Use n threads to evaluate each SELECT or COUNT query. "
+		"If used, it must appear before any -i or -f options." << std::endl;
+	std::cout << "-B : Run each LOAD in the background, so that SELECT and COUNT "
+		"queries can run at the same time (they won't see the triples being loaded "
+		"until the LOAD finishes). Any other command waits for the LOAD to finish first. "
+		"This is mutually exclusive with -C and -T. "
+		"If used, it must appear before any -i or -f options." << std::endl;
+	std::cout << "-W : Keep a write-ahead log of the changes made since the last SAVE "
+		"or OPEN of an image, in the image's filename followed by '.wal', so that "
+		"they aren't lost if the application stops. OPEN replays the log. "
+		"If used, it must appear before any -i or -f options." << std::endl;
 	std::cout << "-i query : Execute query/queries." << std::endl;
 	std::cout << "-f filename : Execute query/queries from file." << std::endl;
 	std::cout << "Using either -i or -f will open the application in non-interactive "
@@ -301,12 +997,49 @@ int main(int argc, char* argv[])
 		return 0;
 	}
 
-	const bool log_plan_types = (argc > 1 && std::string(argv[1]) == "-L");
-	const bool profiling_mode = (argc > 1 && std::string(argv[1]) == "-P");
-	const int cmd_start_idx = (log_plan_types || profiling_mode) ? 2 : 1;
+	// read the options which come before any -i or -f
+	bool log_plan_types = false, profiling_mode = false, auto_compact = false,
+		background_loads = false, write_ahead_log = false;
+	size_t num_load_threads = 1, num_query_threads = 1;
+	int cmd_start_idx = 1;
+	for (; cmd_start_idx < argc; ++cmd_start_idx)
+	{
+		const std::string opt = argv[cmd_start_idx];
+		if (opt == "-L")
+			log_plan_types = true;
+		else if (opt == "-P")
+			profiling_mode = true;
+		else if (opt == "-C")
+			auto_compact = true;
+		else if (opt == "-B")
+			background_loads = true;
+		else if (opt == "-W")
+			write_ahead_log = true;
+		else if ((opt == "-T" || opt == "-Q") && cmd_start_idx + 1 < argc)
+		{
+			const int n = std::atoi(argv[++cmd_start_idx]);
+			if (n <= 0)
+			{
+				std::cerr << "The number of threads must be positive. Showing help." << std::endl;
+				show_help();
+				return 1;
+			}
+			(opt == "-T" ? num_load_threads : num_query_threads) = static_cast<size_t>(n);
+		}
+		else
+			break;
+	}
 	const int num_commands = (argc - cmd_start_idx) / 2;
 
-	QueryApplication app(log_plan_types, profiling_mode);
+	if (background_loads && (auto_compact || num_load_threads > 1))
+	{
+		std::cerr << "-B cannot be used with -C or -T. Showing help." << std::endl;
+		show_help();
+		return 1;
+	}
+
+	QueryApplication app(log_plan_types, profiling_mode, auto_compact, num_load_threads,
+		num_query_threads, background_loads, write_ahead_log);
 
 	if (num_commands > 0)  // noninteractive mode
 	{
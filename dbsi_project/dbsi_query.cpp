@@ -8,7 +8,23 @@ namespace dbsi
 {
 
 
-std::variant<BadQuery, SelectQuery, CountQuery, LoadQuery, QuitQuery, EmptyQuery> parse_query(std::istream& in)
+/*
+* Read the rest of the line as a filename, which may be followed by
+* the word BINARY, in which case `binary` is set.
+*/
+static void read_filename(std::istream& in, std::string& filename, bool& binary)
+{
+	static const std::string BINARY_SUFFIX = " BINARY";
+
+	std::getline(in >> std::ws, filename);
+	binary = filename.size() > BINARY_SUFFIX.size()
+		&& filename.compare(filename.size() - BINARY_SUFFIX.size(), std::string::npos, BINARY_SUFFIX) == 0;
+	if (binary)
+		filename.resize(filename.size() - BINARY_SUFFIX.size());
+}
+
+
+std::variant<BadQuery, SelectQuery, CountQuery, ExplainQuery, DeleteQuery, LoadQuery, SaveQuery, OpenQuery, DumpQuery, CompactQuery, QuitQuery, EmptyQuery> parse_query(std::istream& in)
 {
 	if (!in.good())
 		return EmptyQuery();
@@ -25,12 +41,53 @@ std::variant<BadQuery, SelectQuery, CountQuery, LoadQuery, QuitQuery, EmptyQuery
 	if (first_word == "LOAD")
 	{
 		LoadQuery lq;
-		std::getline(in >> std::ws, lq.filename);
+		read_filename(in, lq.filename, lq.binary);
 		return lq;
 	}
 
-	if (first_word != "SELECT" && first_word != "COUNT")
-		return BadQuery("Invalid command: " + first_word + ", must be QUIT/LOAD/SELECT/COUNT.");
+	if (first_word == "SAVE")
+	{
+		SaveQuery sq;
+		std::getline(in >> std::ws, sq.filename);
+		return sq;
+	}
+
+	if (first_word == "OPEN")
+	{
+		OpenQuery oq;
+		std::getline(in >> std::ws, oq.filename);
+		return oq;
+	}
+
+	if (first_word == "DUMP")
+	{
+		DumpQuery dq;
+		read_filename(in, dq.filename, dq.binary);
+		return dq;
+	}
+
+	if (first_word == "COMPACT")
+		return CompactQuery();
+
+	if (first_word == "EXPLAIN")
+	{
+		std::string second_word;
+		in >> second_word;
+		if (second_word != "ANALYZE")
+			return BadQuery("EXPLAIN must be followed by ANALYZE.");
+
+		auto query = parse_query(in);
+		if (auto* select = std::get_if<SelectQuery>(&query))
+			return ExplainQuery{ std::move(select->match) };
+		if (auto* count = std::get_if<CountQuery>(&query))
+			return ExplainQuery{ std::move(count->match) };
+		if (auto* bad = std::get_if<BadQuery>(&query))
+			return *bad;
+		return BadQuery("EXPLAIN ANALYZE must be followed by a SELECT or COUNT query.");
+	}
+
+	if (first_word != "SELECT" && first_word != "COUNT" && first_word != "DELETE")
+		return BadQuery("Invalid command: " + first_word + ", must be QUIT/LOAD/SAVE/OPEN/DUMP/COMPACT/SELECT/COUNT/EXPLAIN/DELETE.");
 
 	// read in the arguments that come before the WHERE clause
 	std::vector<Variable> args;
@@ -48,6 +105,9 @@ std::variant<BadQuery, SelectQuery, CountQuery, LoadQuery, QuitQuery, EmptyQuery
 	if (next_word != "WHERE")
 		return BadQuery("Missing WHERE clause.");
 
+	if (first_word == "DELETE" && !args.empty())
+		return BadQuery("DELETE does not take any variables before its WHERE clause.");
+
 	// read bracket
 	char delimiter = 'x';
 	in >> delimiter;
@@ -120,6 +180,8 @@ std::variant<BadQuery, SelectQuery, CountQuery, LoadQuery, QuitQuery, EmptyQuery
 
 	if (first_word == "SELECT")
 		return SelectQuery{ std::move(args), std::move(pattern) };
+	else if (first_word == "DELETE")
+		return DeleteQuery{ std::move(pattern) };
 	else
 		return CountQuery{ std::move(pattern) };
 }
@@ -35,12 +35,72 @@ struct CountQuery
 };
 
 
+/*
+* Evaluates the patterns of a SELECT or COUNT query (written after
+* `EXPLAIN ANALYZE`), and shows how they were joined, and what each
+* step of the join did and how long it took, rather than the results.
+*/
+struct ExplainQuery
+{
+	std::vector<TriplePattern> match;
+};
+
+
+/*
+* Removes every triple which is an instance of one of the patterns,
+* for each solution of the patterns (like SPARQL's DELETE WHERE).
+*/
+struct DeleteQuery
+{
+	std::vector<TriplePattern> match;
+};
+
+
+/*
+* Adds the triples of a Turtle file to the database, or, if `binary`,
+* those of a binary dump written by `DumpQuery` (see `dbsi_dump.h`).
+*/
 struct LoadQuery
 {
 	std::string filename;
+	bool binary = false;
 };
 
 
+/*
+* Writes the whole database to a file (an "image", see
+* `dbsi_image.h`) which can be read back instantly by `OpenQuery`.
+*/
+struct SaveQuery
+{
+	std::string filename;
+};
+
+
+/*
+* Replaces the whole database with one written by `SaveQuery`.
+*/
+struct OpenQuery
+{
+	std::string filename;
+};
+
+
+/*
+* Writes the triples of the database to a Turtle file, or, if
+* `binary`, to a binary dump (see `dbsi_dump.h`), which `LoadQuery`
+* can read back into any database.
+*/
+struct DumpQuery
+{
+	std::string filename;
+	bool binary = false;
+};
+
+
+struct CompactQuery {};
+
+
 struct QuitQuery {};
 
 
@@ -55,7 +115,7 @@ struct EmptyQuery {};
 * In all other cases, the foremost query in the string is
 * read and returned.
 */
-std::variant<BadQuery, SelectQuery, CountQuery, LoadQuery, QuitQuery, EmptyQuery> parse_query(std::istream& in);
+std::variant<BadQuery, SelectQuery, CountQuery, ExplainQuery, DeleteQuery, LoadQuery, SaveQuery, OpenQuery, DumpQuery, CompactQuery, QuitQuery, EmptyQuery> parse_query(std::istream& in);
 
 
 }  // namespace dbsi
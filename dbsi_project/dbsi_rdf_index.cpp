@@ -1,8 +1,13 @@
 #include "dbsi_rdf_index.h"
 #include "dbsi_pattern_utils.h"
 #include "dbsi_assert.h"
+#include <algorithm>
+#include <numeric>
+#include <tuple>
+#include <stdexcept>
 #ifdef DBSI_CHECKING_INVARIANTS
 #include <unordered_set>  // used for checking integrity in debug mode
+#include <unordered_map>
 #endif
 
 
@@ -10,137 +15,1022 @@ namespace dbsi
 {
 
 
+RDFIndex::RDFIndex() :
+	m_triple_index(rdf_idx_helper::TripleIndexPolicy{ &m_triples }),
+	m_published_size(0),
+	m_published_num_triples(0), m_published_num_subjects(0),
+	m_published_num_preds(0), m_published_num_objects(0),
+	m_num_dead(0),
+	m_num_rows(0), m_num_sp_pairs(0), m_num_op_pairs(0),
+	m_first_concurrent_row(0),
+	m_log(nullptr)
+{ }
+
+
+// dead rows are purged once they make up more than this fraction
+// of the table, which keeps the amortised cost of `remove` constant
+static const double MAX_DEAD_FRACTION = 0.25;
+
+
+/*
+* Push some rows, which are already linked together, onto the front
+* of the (term, pred) group of the given pair index, where `entry` is
+* the single index entry for `term`. If the pair has not been seen
+* before, a new group is created at the front of `term`'s list.
+* `first_row` is the first of the rows, and `last_next` is the next
+* pointer of the last of the rows (which is the same row, if just one
+* row is being added), which is filled in here.
+* A new pair also gets a size (of zero) in `pair_sizes`.
+* Returns the pair's ID.
+* Note that everything is written before the rows are published (in
+* the pair heads, the pair index, or `entry`) so that snapshots never
+* see a partly-linked list.
+*/
+rdf_idx_helper::PairID push_pair_head(
+	rdf_idx_helper::SingleTermIndexEntry& entry,
+	rdf_idx_helper::PairIndex& pair_index,
+	rdf_idx_helper::PairHeads& pair_heads,
+	rdf_idx_helper::PairSizes& pair_sizes,
+	std::pair<CodedResource, CodedResource> key,
+	rdf_idx_helper::TableIterator first_row,
+	rdf_idx_helper::Link& last_next)
+{
+	const rdf_idx_helper::PairID* id = pair_index.find(key);
+
+	if (id == nullptr)
+	{
+		/* Important note:
+		* If instead we'd put the natural TABLE_END here, this
+		* would make the `n_sp` and `n_op` pointers only be linked
+		* lists *within* each sp/op group.
+		* However, we want these pointers to contain different `p`s,
+		* grouped by `p`.
+		* To achieve this, we point to whichever group is at the
+		* front of `term`'s list, and then make the new group the
+		* new front. Since this happens exactly once per group,
+		* the list never repeats a `pred`.
+		* But: what happens if another entry corresponding to the
+		* old front group gets inserted? It is updated in the pair
+		* heads, and thus there is no need to update it in the table,
+		* because we point to it via its pair link!
+		*/
+		const auto new_id = static_cast<rdf_idx_helper::PairID>(pair_heads.size());
+		last_next = entry.offset;
+		pair_heads.push_back(first_row);
+		pair_sizes.push_back(0);
+		pair_index.insert(key, new_id);
+		rdf_idx_helper::store_release(entry.offset, rdf_idx_helper::pair_link(new_id));
+		return new_id;
+	}
+	else
+	{
+		// just push onto the front of the existing group
+		last_next = pair_heads[*id];
+		rdf_idx_helper::store_release(pair_heads[*id], first_row);
+		return *id;
+	}
+}
+
+
+/*
+* Push `value` onto the front of the lock-free linked list whose head
+* is `head`, by making it point to the old head (via `next`) and then
+* swapping it in, retrying if another thread got there first.
+*/
+template<typename T>
+void push_front_concurrent(T& head, T& next, T value)
+{
+	std::atomic_ref<T> atomic_head(head);
+	T old_head = atomic_head.load(std::memory_order_relaxed);
+	do
+	{
+		next = old_head;
+	} while (!atomic_head.compare_exchange_weak(old_head, value, std::memory_order_relaxed));
+}
+
+
+/*
+* The thread-safe version of `push_pair_head`, for use by
+* `concurrent_add`, which sets the `next` pointer of `row` itself.
+* `num_pairs` is used to allocate new pair IDs.
+* Returns the pair's ID.
+*/
+rdf_idx_helper::PairID push_pair_head_concurrent(
+	rdf_idx_helper::SingleTermIndexEntry& entry,
+	rdf_idx_helper::PairIndex& pair_index,
+	rdf_idx_helper::PairHeads& pair_heads,
+	std::atomic<size_t>& num_pairs,
+	std::pair<CodedResource, CodedResource> key,
+	rdf_idx_helper::TableIterator row,
+	rdf_idx_helper::Link& next)
+{
+	auto [id, is_new] = pair_index.insert_concurrent(key, [&]()
+		{
+			// only called if the pair is new, and before any other
+			// thread can see the ID, so they will never see a stale
+			// head for it
+			const auto new_id = static_cast<rdf_idx_helper::PairID>(
+				num_pairs.fetch_add(1, std::memory_order_relaxed));
+			DBSI_CHECK_INVARIANT(new_id < pair_heads.size());
+			pair_heads[new_id] = row;
+			return new_id;
+		});
+
+	if (is_new)
+	{
+		// as in `push_pair_head`, the new group goes on the front of
+		// the term's list. `row` is the last row of its group (other
+		// threads will push rows in front of it) so it can point to
+		// the old front.
+		push_front_concurrent(entry.offset, next, rdf_idx_helper::pair_link(*id));
+	}
+	else
+	{
+		push_front_concurrent(pair_heads[*id], next, row);
+	}
+	return *id;
+}
+
+
 void RDFIndex::add(CodedTriple t)
 {
-	// don't insert duplicates!
-	if (m_triple_index.find(t) != m_triple_index.end())
+	// don't insert duplicates! (but a removed triple is added
+	// again, as a new row, so that snapshots never see it change)
+	if (const auto row = m_triple_index.find(t); row != nullptr && !m_triples.is_dead(*row))
 		return;
 
+	if (m_triples.size() >= rdf_idx_helper::MAX_TABLE_SIZE)
+		throw std::overflow_error("Too many triples for the table offset width; "
+			"consider building without DBSI_32_BIT_IDS.");
+
 	using rdf_idx_helper::TABLE_END;
 
 	// fill in defaults where applicable
-	m_sub_index.insert(std::make_pair(t.sub, rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }));
-	m_pred_index.insert(std::make_pair(t.pred, rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }));
-	m_obj_index.insert(std::make_pair(t.obj, rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }));
-
-	const auto new_offset = m_triples.size();
-
-	auto sp_iter = m_sp_index.find(std::make_pair(t.sub, t.pred));
-	auto op_iter = m_op_index.find(std::make_pair(t.obj, t.pred));
-
-	/* Important note:
-	* Below, where we use `m_sub_index[t.sub].offset` and the
-	* corresponding version for `obj`, what does this mean?
-	* If instead we'd put the natural `cend()` iterator, this
-	* would make the `n_sp` and `n_op` pointers only be linked
-	* lists *within* each sp/op group.
-	* However, we want these pointers to contain different `p`s,
-	* grouped by `p`.
-	* To achieve this, observe that if an s/p combination does
-	* not already exist, then `m_sub_index[t.sub]` will contain
-	* a different `pred` to the current one.
-	* Since we always update `m_sub_index[t.sub]` to be the new
-	* value, the quantity `m_sub_index[t.sub].pred` will, over
-	* the course of the RDFIndex's lifetime, never repeat a
-	* `pred`.
-	* But: what happens if another entry corresponding to the
-	* old `pred` gets inserted? It is updated in the index, and
-	* thus there is no need to update it in the table!
-	*/
+	// (note that these references remain valid for the rest of this
+	// function, because we don't insert into these indices again.)
+	auto& sub_entry = *m_sub_index.insert(t.sub, rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }).first;
+	auto& pred_entry = *m_pred_index.insert(t.pred, rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }).first;
+	auto& obj_entry = *m_obj_index.insert(t.obj, rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }).first;
+
+	// add to table, and then fill in its pointers as we link it in
+	const auto new_offset = static_cast<rdf_idx_helper::TableIterator>(m_triples.size());
+	m_triples.push_back(t, TABLE_END, TABLE_END, TABLE_END);
+
+	const auto sp_id = push_pair_head(sub_entry, m_sp_index, m_sp_heads, m_sp_sizes,
+		std::make_pair(t.sub, t.pred), new_offset, m_triples.n_sp[new_offset]);
+	const auto op_id = push_pair_head(obj_entry, m_op_index, m_op_heads, m_op_sizes,
+		std::make_pair(t.obj, t.pred), new_offset, m_triples.n_op[new_offset]);
+
+	// always add to the front of the `pred` index as this
+	// case is slightly simpler
+	m_triples.n_p[new_offset] = pred_entry.offset;
+	rdf_idx_helper::store_release(pred_entry.offset, new_offset);
+
+	// always increment sizes in the single term indices
+	rdf_idx_helper::add_to_size(sub_entry, 1);
+	rdf_idx_helper::add_to_size(pred_entry, 1);
+	rdf_idx_helper::add_to_size(obj_entry, 1);
+	add_to_pair_size(m_sp_sizes, sp_id, t.pred, &rdf_idx_helper::PredicateStats::num_subjects, 1);
+	add_to_pair_size(m_op_sizes, op_id, t.pred, &rdf_idx_helper::PredicateStats::num_objects, 1);
+
+	insert_triple_index(t, new_offset);
 
-	DBSI_CHECK_INVARIANT(m_sub_index[t.sub].offset == TABLE_END  // first occurrence of this `sub`
-		|| sp_iter != m_sp_index.cend()  // this `sub/pred` combo has appeared before
-		|| m_triples[m_sub_index[t.sub].offset].t.pred != t.pred);  // else, has a new `pred`
-	// similar check for `obj`:
-	DBSI_CHECK_INVARIANT(m_obj_index[t.obj].offset == TABLE_END
-		|| op_iter != m_op_index.cend()
-		|| m_triples[m_obj_index[t.obj].offset].t.pred != t.pred);
+	// the sorted index is now out of date
+	set_sorted(nullptr);
 
-	// decide which n_sp and n_op pointers to use
-	rdf_idx_helper::IndexTableIterVariant sp_source, op_source;
-	if (sp_iter == m_sp_index.cend())
+	publish();
+
+	if (m_log != nullptr)
+		m_log->log_add(&t, 1);
+
+#ifdef DBSI_CHECKING_INVARIANTS
+	// in debug mode, check integrity every 100 triples added.
+	// this check is expensive so don't do it every time.
+	if (m_triples.size() % 5000 == 0)
+		check_integrity();
+#endif  // DBSI_CHECKING_INVARIANTS
+}
+
+
+bool RDFIndex::remove(CodedTriple t)
+{
+	const auto row = m_triple_index.find(t);
+	if (row == nullptr || m_triples.is_dead(*row))
+		return false;
+
+	// the row stays in all of the linked lists, and in the triple
+	// index, so only the sizes need updating
+	if (m_triples.dead.empty())
+		m_triples.dead.resize(m_triples.size(), 0);
+	m_triples.dead[*row] = 1;
+	++m_num_dead;
+
+	--m_sub_index.find(t.sub)->size;
+	--m_pred_index.find(t.pred)->size;
+	--m_obj_index.find(t.obj)->size;
+	add_to_pair_size(m_sp_sizes, *m_sp_index.find(std::make_pair(t.sub, t.pred)), t.pred,
+		&rdf_idx_helper::PredicateStats::num_subjects, static_cast<rdf_idx_helper::TableIterator>(-1));
+	add_to_pair_size(m_op_sizes, *m_op_index.find(std::make_pair(t.obj, t.pred)), t.pred,
+		&rdf_idx_helper::PredicateStats::num_objects, static_cast<rdf_idx_helper::TableIterator>(-1));
+
+	// the sorted index is now out of date
+	set_sorted(nullptr);
+	publish();
+
+	if (m_log != nullptr)
+		m_log->log_remove(t);
+
+	if (m_num_dead > MAX_DEAD_FRACTION * m_triples.size())
+		purge_dead_rows();
+
+#ifdef DBSI_CHECKING_INVARIANTS
+	// as in `add`, don't check integrity every time
+	if (m_num_dead % 1000 == 0)
+		check_integrity();
+#endif  // DBSI_CHECKING_INVARIANTS
+
+	return true;
+}
+
+
+void RDFIndex::insert_triple_index(const CodedTriple& t, rdf_idx_helper::TableIterator row)
+{
+	auto [slot, is_new] = m_triple_index.insert(t, row);
+	if (!is_new)
 	{
-		if (m_sub_index[t.sub].offset == rdf_idx_helper::TABLE_END)
+		// the triple was removed before, so replace its dead row
+		DBSI_CHECK_PRECOND(m_triples.is_dead(*slot));
+		rdf_idx_helper::store_release(*slot, row);
+	}
+}
+
+
+void RDFIndex::add_to_pair_size(rdf_idx_helper::PairSizes& pair_sizes,
+	rdf_idx_helper::PairID id, CodedResource pred,
+	rdf_idx_helper::TableIterator rdf_idx_helper::PredicateStats::* distinct,
+	rdf_idx_helper::TableIterator delta)
+{
+	rdf_idx_helper::TableIterator& size = pair_sizes[id];
+	const bool was_empty = (size == 0);
+	rdf_idx_helper::add_to_size(size, delta);
+
+	if (was_empty != (size == 0))
+	{
+		auto& stats = *m_pred_stats.insert(pred, rdf_idx_helper::PredicateStats{ 0, 0 }).first;
+		rdf_idx_helper::add_to_size(stats.*distinct,
+			was_empty ? 1 : static_cast<rdf_idx_helper::TableIterator>(-1));
+	}
+}
+
+
+void RDFIndex::add_to_pair_size_concurrent(rdf_idx_helper::PairSizes& pair_sizes,
+	rdf_idx_helper::PairID id, CodedResource pred,
+	rdf_idx_helper::TableIterator rdf_idx_helper::PredicateStats::* distinct,
+	rdf_idx_helper::TableIterator delta)
+{
+	using rdf_idx_helper::TableIterator;
+
+	// only the thread which takes the size from zero counts the pair
+	if (std::atomic_ref<TableIterator>(pair_sizes[id]).fetch_add(delta, std::memory_order_relaxed) == 0)
+	{
+		auto& stats = *m_pred_stats.insert_concurrent(pred,
+			[]() { return rdf_idx_helper::PredicateStats{ 0, 0 }; }).first;
+		std::atomic_ref<TableIterator>(stats.*distinct).fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+
+void RDFIndex::publish()
+{
+	// the size is stored last, so that a snapshot which reads it first
+	// (see `Snapshot::Snapshot`) gets statistics at least as new
+	m_published_num_triples.store(size(), std::memory_order_relaxed);
+	m_published_num_subjects.store(m_sub_index.size(), std::memory_order_relaxed);
+	m_published_num_preds.store(m_pred_index.size(), std::memory_order_relaxed);
+	m_published_num_objects.store(m_obj_index.size(), std::memory_order_relaxed);
+	m_published_size.store(m_triples.size(), std::memory_order_release);
+}
+
+
+void RDFIndex::purge_dead_rows()
+{
+	std::vector<CodedTriple> live;
+	live.reserve(m_triples.size() - m_num_dead);
+	for (rdf_idx_helper::TableIterator i = 0; i < m_triples.size(); ++i)
+	{
+		if (!m_triples.is_dead(i))
+			live.push_back(m_triples.triple(i));
+	}
+
+	// start again from empty
+	clear();
+	bulk_insert(std::move(live));
+}
+
+
+void RDFIndex::clear()
+{
+	m_published_size = 0;
+	set_sorted(nullptr);
+	m_triples.clear();
+	m_sub_index.clear();
+	m_pred_index.clear();
+	m_obj_index.clear();
+	m_sp_index.clear();
+	m_op_index.clear();
+	m_sp_heads.clear();
+	m_op_heads.clear();
+	m_triple_index.clear();
+	m_sp_sizes.clear();
+	m_op_sizes.clear();
+	m_pred_stats.clear();
+	m_num_dead = 0;
+	publish();
+}
+
+
+size_t RDFIndex::size() const
+{
+	return m_triples.size() - m_num_dead;
+}
+
+
+void RDFIndex::set_log(WriteAheadLog* log)
+{
+	m_log = log;
+}
+
+
+void RDFIndex::log_rows_from(rdf_idx_helper::TableIterator first)
+{
+	if (m_log == nullptr)
+		return;
+
+	// copy the rows out a chunk at a time, rather than all at once
+	static const size_t CHUNK_SIZE = 4096;
+	std::vector<CodedTriple> chunk;
+	chunk.reserve(CHUNK_SIZE);
+	for (rdf_idx_helper::TableIterator i = first; i < m_triples.size(); ++i)
+	{
+		chunk.push_back(m_triples.triple(i));
+		if (chunk.size() == CHUNK_SIZE)
 		{
-			// the first time this subject is entered into the DB,
-			// there is nothing for n_sp to point to!
-			sp_source = rdf_idx_helper::TABLE_END;
+			m_log->log_add(chunk.data(), chunk.size());
+			chunk.clear();
 		}
-		else
+	}
+	if (!chunk.empty())
+		m_log->log_add(chunk.data(), chunk.size());
+}
+
+
+void RDFIndex::save(ImageWriter& out) const
+{
+	m_triples.save(out);
+	m_sp_heads.save(out);
+	m_op_heads.save(out);
+	m_sp_sizes.save(out);
+	m_op_sizes.save(out);
+	m_sub_index.save(out);
+	m_pred_index.save(out);
+	m_obj_index.save(out);
+	m_sp_index.save(out);
+	m_op_index.save(out);
+	m_triple_index.save(out);
+	m_pred_stats.save(out);
+	out.write_value<std::uint64_t>(m_num_dead);
+}
+
+
+void RDFIndex::open(ImageReader& in)
+{
+	clear();
+
+	m_triples.open(in);
+	m_sp_heads.open(in);
+	m_op_heads.open(in);
+	m_sp_sizes.open(in);
+	m_op_sizes.open(in);
+	m_sub_index.open(in);
+	m_pred_index.open(in);
+	m_obj_index.open(in);
+	m_sp_index.open(in);
+	m_op_index.open(in);
+	m_triple_index.open(in);
+	m_pred_stats.open(in);
+	m_num_dead = in.read_value<std::uint64_t>();
+
+	// (as with the dictionary, the contents are trusted, because
+	// checking them all would take as long as rebuilding them)
+	if (m_sp_index.size() != m_sp_heads.size() || m_op_index.size() != m_op_heads.size()
+		|| m_sp_sizes.size() != m_sp_heads.size() || m_op_sizes.size() != m_op_heads.size()
+		|| m_triple_index.size() < m_triples.size() - std::min<size_t>(m_num_dead, m_triples.size()))
+		throw std::runtime_error("Corrupted image: bad index.");
+
+	publish();
+
+	check_integrity();
+}
+
+
+size_t RDFIndex::bulk_load(ICodedTripleIterator& triples)
+{
+	// buffer everything up-front
+	std::vector<CodedTriple> buffer;
+	triples.start();
+	while (triples.valid())
+	{
+		buffer.push_back(triples.current());
+		triples.next();
+	}
+
+	return bulk_load(std::move(buffer));
+}
+
+
+size_t RDFIndex::bulk_load(std::vector<CodedTriple> triples)
+{
+	const size_t read_count = triples.size();
+	const auto first_new = static_cast<rdf_idx_helper::TableIterator>(m_triples.size());
+
+	bulk_insert(std::move(triples));
+	log_rows_from(first_new);
+
+	return read_count;
+}
+
+
+void RDFIndex::bulk_insert(std::vector<CodedTriple> buffer)
+{
+	insert_batch(std::move(buffer));
+
+	// only now that every list is complete can snapshots see the rows
+	publish();
+
+	check_integrity();
+}
+
+
+void RDFIndex::begin_batched_load()
+{
+	m_first_concurrent_row = m_triples.size();
+}
+
+
+void RDFIndex::add_batch(std::vector<CodedTriple> triples)
+{
+	// (duplicates of triples in earlier batches are skipped, since
+	// those are in the triple index already)
+	insert_batch(std::move(triples));
+}
+
+
+void RDFIndex::end_batched_load()
+{
+	// as in `bulk_insert`, the rows of all of the batches only become
+	// visible now that they are all linked in
+	publish();
+	log_rows_from(static_cast<rdf_idx_helper::TableIterator>(m_first_concurrent_row));
+
+	check_integrity();
+}
+
+
+void RDFIndex::abort_batched_load()
+{
+	using rdf_idx_helper::TableIterator;
+
+	const size_t first_new = m_first_concurrent_row;
+	if (m_triples.size() == first_new)
+		return;
+
+	// as in `remove`, the rows stay in all of the lists, and only the
+	// sizes need updating. (snapshots only read the `dead` flags of
+	// rows which they can see, which these aren't yet)
+	if (m_triples.dead.empty())
+		m_triples.dead.resize(m_triples.size(), 0);
+	for (size_t i = first_new; i < m_triples.size(); ++i)
+	{
+		const auto row = static_cast<TableIterator>(i);
+		const CodedTriple t = m_triples.triple(row);
+		m_triples.dead[row] = 1;
+		++m_num_dead;
+
+		rdf_idx_helper::add_to_size(*m_sub_index.find(t.sub), static_cast<TableIterator>(-1));
+		rdf_idx_helper::add_to_size(*m_pred_index.find(t.pred), static_cast<TableIterator>(-1));
+		rdf_idx_helper::add_to_size(*m_obj_index.find(t.obj), static_cast<TableIterator>(-1));
+		add_to_pair_size(m_sp_sizes, *m_sp_index.find(std::make_pair(t.sub, t.pred)), t.pred,
+			&rdf_idx_helper::PredicateStats::num_subjects, static_cast<TableIterator>(-1));
+		add_to_pair_size(m_op_sizes, *m_op_index.find(std::make_pair(t.obj, t.pred)), t.pred,
+			&rdf_idx_helper::PredicateStats::num_objects, static_cast<TableIterator>(-1));
+	}
+
+	// (the dead rows are purged by the next `remove` or `compact`,
+	// rather than now, since snapshots may still be reading the table)
+	publish();
+
+	check_integrity();
+}
+
+
+void RDFIndex::insert_batch(std::vector<CodedTriple> buffer)
+{
+	using rdf_idx_helper::TableIterator;
+	using rdf_idx_helper::TABLE_END;
+
+	// sort into SPO order, which removes the need for any hashing
+	// when deduplicating within the batch, and also means the rows
+	// we append will already be grouped correctly for the `n_sp` lists.
+	// (a binary dump loaded into an empty DB is in this order already)
+	auto spo_less = [](const CodedTriple& a, const CodedTriple& b)
+	{
+		return std::tie(a.sub, a.pred, a.obj) < std::tie(b.sub, b.pred, b.obj);
+	};
+	if (!std::is_sorted(buffer.begin(), buffer.end(), spo_less))
+		std::sort(buffer.begin(), buffer.end(), spo_less);
+	buffer.erase(std::unique(buffer.begin(), buffer.end()), buffer.end());
+
+	// don't insert duplicates of triples which are already in the DB
+	// (the common case of loading into an empty DB skips this)
+	if (!m_triple_index.empty())
+	{
+		buffer.erase(std::remove_if(buffer.begin(), buffer.end(),
+			[this](const CodedTriple& t)
+			{
+				const auto row = m_triple_index.find(t);
+				return row != nullptr && !m_triples.is_dead(*row);
+			}), buffer.end());
+	}
+
+	if (buffer.empty())
+		return;
+
+	// check this before modifying anything, so that the DB is
+	// left unchanged on failure
+	if (m_triples.size() + buffer.size() > rdf_idx_helper::MAX_TABLE_SIZE)
+		throw std::overflow_error("Too many triples for the table offset width; "
+			"consider building without DBSI_32_BIT_IDS.");
+
+	// append all rows, with their pointers to be filled in below
+	const TableIterator first_new = m_triples.size();
+	m_triples.reserve(m_triples.size() + buffer.size());
+	m_triple_index.reserve(m_triple_index.size() + buffer.size());
+	for (const CodedTriple& t : buffer)
+	{
+		const TableIterator row = static_cast<TableIterator>(m_triples.size());
+		m_triples.push_back(t, TABLE_END, TABLE_END, TABLE_END);
+		insert_triple_index(t, row);
+	}
+	buffer.clear();
+	buffer.shrink_to_fit();
+
+	// the sorted index is now out of date
+	set_sorted(nullptr);
+
+	// the new rows are already in (sub, pred) order
+	std::vector<TableIterator> rows(m_triples.size() - first_new);
+	std::iota(rows.begin(), rows.end(), first_new);
+	link_pair_chains(rows, m_triples.sub, m_triples.n_sp,
+		m_sub_index, m_sp_index, m_sp_heads, m_sp_sizes,
+		&rdf_idx_helper::PredicateStats::num_subjects);
+
+	// sort them into (obj, pred) order for the `n_op` lists
+	std::sort(rows.begin(), rows.end(),
+		[this](TableIterator a, TableIterator b)
+		{
+			return std::tie(m_triples.obj[a], m_triples.pred[a], a)
+				< std::tie(m_triples.obj[b], m_triples.pred[b], b);
+		});
+	link_pair_chains(rows, m_triples.obj, m_triples.n_op,
+		m_obj_index, m_op_index, m_op_heads, m_op_sizes,
+		&rdf_idx_helper::PredicateStats::num_objects);
+
+	// and finally into `pred` order for the `n_p` lists, which are
+	// simpler because there is no grouping involved
+	std::sort(rows.begin(), rows.end(),
+		[this](TableIterator a, TableIterator b)
+		{
+			return std::tie(m_triples.pred[a], a) < std::tie(m_triples.pred[b], b);
+		});
+	for (size_t begin = 0, end = 0; begin < rows.size(); begin = end)
+	{
+		const CodedResource pred = m_triples.pred[rows[begin]];
+		for (end = begin + 1; end < rows.size() && m_triples.pred[rows[end]] == pred; ++end)
+			m_triples.n_p[rows[end - 1]] = rows[end];
+
+		auto& entry = *m_pred_index.insert(pred,
+			rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }).first;
+		m_triples.n_p[rows[end - 1]] = entry.offset;
+		rdf_idx_helper::store_release(entry.offset, rows[begin]);
+		rdf_idx_helper::add_to_size(entry, static_cast<TableIterator>(end - begin));
+	}
+}
+
+
+void RDFIndex::begin_concurrent_add(size_t max_new_triples)
+{
+	using rdf_idx_helper::TABLE_END;
+
+	if (m_triples.size() + max_new_triples > rdf_idx_helper::MAX_TABLE_SIZE)
+		throw std::overflow_error("Too many triples for the table offset width; "
+			"consider building without DBSI_32_BIT_IDS.");
+
+	m_first_concurrent_row = m_triples.size();
+	m_num_rows = m_triples.size();
+	m_num_sp_pairs = m_sp_heads.size();
+	m_num_op_pairs = m_op_heads.size();
+
+	// in the worst case, every triple is new, and has a new `sub`,
+	// `pred`, `obj`, (sub, pred) and (obj, pred)
+	m_triples.resize(m_triples.size() + max_new_triples);
+	m_sp_heads.resize(m_sp_heads.size() + max_new_triples, TABLE_END);
+	m_op_heads.resize(m_op_heads.size() + max_new_triples, TABLE_END);
+	m_sp_sizes.resize(m_sp_heads.size(), 0);
+	m_op_sizes.resize(m_op_heads.size(), 0);
+	m_triple_index.reserve(m_triple_index.size() + max_new_triples);
+	m_sub_index.reserve(m_sub_index.size() + max_new_triples);
+	m_pred_index.reserve(m_pred_index.size() + max_new_triples);
+	m_obj_index.reserve(m_obj_index.size() + max_new_triples);
+	m_sp_index.reserve(m_sp_index.size() + max_new_triples);
+	m_op_index.reserve(m_op_index.size() + max_new_triples);
+	m_pred_stats.reserve(m_pred_stats.size() + max_new_triples);
+
+	// the sorted index is now out of date
+	set_sorted(nullptr);
+}
+
+
+bool RDFIndex::concurrent_add(const CodedTriple& t)
+{
+	using rdf_idx_helper::TABLE_END;
+	using rdf_idx_helper::TableIterator;
+
+	// the duplicate check and the row reservation happen together,
+	// so that only the thread which wins the insertion uses up a row
+	auto [row_ptr, is_new] = m_triple_index.insert_concurrent(t, [this, &t]()
 		{
-			// pick an arbitrary (sub, pred') pair for some other pred' != pred
-			const CodedTriple& other_trip = m_triples[m_sub_index[t.sub].offset].t;
-			sp_source = (rdf_idx_helper::IndexHelper::PairIndexIterator)m_sp_index.find(
-				std::make_pair(other_trip.sub, other_trip.pred));
+			const auto row = static_cast<TableIterator>(m_num_rows.fetch_add(1, std::memory_order_relaxed));
+			DBSI_CHECK_INVARIANT(row < m_triples.size());
+			m_triples.sub[row] = t.sub;
+			m_triples.pred[row] = t.pred;
+			m_triples.obj[row] = t.obj;
+			return row;
+		});
+	const TableIterator row = *row_ptr;
+
+	if (!is_new)
+	{
+		// bring back a removed triple, unless another thread is
+		// already doing so. its single index entries already exist
+		// (but other threads may be inserting into those tables, so
+		// we can't use `find`)
+		if (!m_triples.dead.empty()
+			&& std::atomic_ref<std::uint8_t>(m_triples.dead[row]).exchange(0) != 0)
+		{
+			auto no_entry = []() -> rdf_idx_helper::SingleTermIndexEntry
+			{
+				DBSI_CHECK_INVARIANT(false);  // ???
+				return { TABLE_END, 0 };
+			};
+			auto no_pair = []() -> rdf_idx_helper::PairID
+			{
+				DBSI_CHECK_INVARIANT(false);  // ???
+				return TABLE_END;
+			};
+			std::atomic_ref<size_t>(m_num_dead).fetch_sub(1, std::memory_order_relaxed);
+			for (auto entry : { m_sub_index.insert_concurrent(t.sub, no_entry).first,
+				m_pred_index.insert_concurrent(t.pred, no_entry).first,
+				m_obj_index.insert_concurrent(t.obj, no_entry).first })
+				std::atomic_ref<TableIterator>(entry->size).fetch_add(1, std::memory_order_relaxed);
+			add_to_pair_size_concurrent(m_sp_sizes,
+				*m_sp_index.insert_concurrent(std::make_pair(t.sub, t.pred), no_pair).first,
+				t.pred, &rdf_idx_helper::PredicateStats::num_subjects, 1);
+			add_to_pair_size_concurrent(m_op_sizes,
+				*m_op_index.insert_concurrent(std::make_pair(t.obj, t.pred), no_pair).first,
+				t.pred, &rdf_idx_helper::PredicateStats::num_objects, 1);
+
+			// (this row isn't one of the new ones which
+			// `end_concurrent_add` logs)
+			if (m_log != nullptr)
+				m_log->log_add(&t, 1);
+			return true;
 		}
+		return false;
 	}
-	else
-		sp_source = sp_iter->second;
 
-	if (op_iter == m_op_index.cend())
+	// nobody else will ever touch the pointers of `row`, so
+	// they can be written directly by the functions below
+	auto& sub_entry = *m_sub_index.insert_concurrent(t.sub,
+		[]() { return rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }; }).first;
+	auto& pred_entry = *m_pred_index.insert_concurrent(t.pred,
+		[]() { return rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }; }).first;
+	auto& obj_entry = *m_obj_index.insert_concurrent(t.obj,
+		[]() { return rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }; }).first;
+
+	const auto sp_id = push_pair_head_concurrent(sub_entry, m_sp_index, m_sp_heads, m_num_sp_pairs,
+		std::make_pair(t.sub, t.pred), row, m_triples.n_sp[row]);
+	const auto op_id = push_pair_head_concurrent(obj_entry, m_op_index, m_op_heads, m_num_op_pairs,
+		std::make_pair(t.obj, t.pred), row, m_triples.n_op[row]);
+	push_front_concurrent(pred_entry.offset, m_triples.n_p[row], row);
+
+	std::atomic_ref<TableIterator>(sub_entry.size).fetch_add(1, std::memory_order_relaxed);
+	std::atomic_ref<TableIterator>(pred_entry.size).fetch_add(1, std::memory_order_relaxed);
+	std::atomic_ref<TableIterator>(obj_entry.size).fetch_add(1, std::memory_order_relaxed);
+	add_to_pair_size_concurrent(m_sp_sizes, sp_id, t.pred,
+		&rdf_idx_helper::PredicateStats::num_subjects, 1);
+	add_to_pair_size_concurrent(m_op_sizes, op_id, t.pred,
+		&rdf_idx_helper::PredicateStats::num_objects, 1);
+
+	return true;
+}
+
+
+void RDFIndex::end_concurrent_add()
+{
+	// (all of the other threads' writes are visible to us, because
+	// the caller must have joined them)
+	m_triples.resize(m_num_rows);
+	m_sp_heads.resize(m_num_sp_pairs);
+	m_op_heads.resize(m_num_op_pairs);
+	m_sp_sizes.resize(m_num_sp_pairs);
+	m_op_sizes.resize(m_num_op_pairs);
+	m_triples.shrink_to_fit();
+	m_sp_heads.shrink_to_fit();
+	m_op_heads.shrink_to_fit();
+	m_sp_sizes.shrink_to_fit();
+	m_op_sizes.shrink_to_fit();
+
+	m_triple_index.shrink_to_fit();
+	m_sub_index.shrink_to_fit();
+	m_pred_index.shrink_to_fit();
+	m_obj_index.shrink_to_fit();
+	m_sp_index.shrink_to_fit();
+	m_op_index.shrink_to_fit();
+	m_pred_stats.shrink_to_fit();
+
+	publish();
+
+	log_rows_from(static_cast<rdf_idx_helper::TableIterator>(m_first_concurrent_row));
+
+	check_integrity();
+}
+
+
+size_t RDFIndex::parallel_load(ICodedTripleIterator& triples, ThreadPool& pool, size_t num_threads)
+{
+	// buffer everything up-front, so that the threads can share it out
+	std::vector<CodedTriple> buffer;
+	triples.start();
+	while (triples.valid())
+	{
+		buffer.push_back(triples.current());
+		triples.next();
+	}
+
+	return parallel_load(buffer, pool, num_threads);
+}
+
+
+size_t RDFIndex::parallel_load(const std::vector<CodedTriple>& buffer, ThreadPool& pool, size_t num_threads)
+{
+	DBSI_CHECK_PRECOND(num_threads > 0);
+
+	begin_concurrent_add(buffer.size());
+
+	// threads take chunks of the buffer as they need them, so that
+	// one slow thread can't hold everyone else up
+	static const size_t CHUNK_SIZE = 4096;
+	std::atomic<size_t> next_chunk(0);
+	auto worker = [this, &buffer, &next_chunk]()
 	{
-		if (m_obj_index[t.obj].offset == rdf_idx_helper::TABLE_END)
+		for (size_t begin = next_chunk.fetch_add(CHUNK_SIZE); begin < buffer.size();
+			begin = next_chunk.fetch_add(CHUNK_SIZE))
 		{
-			// the first time this subject is entered into the DB,
-			// there is nothing for n_sp to point to!
-			op_source = rdf_idx_helper::TABLE_END;
+			const size_t end = std::min(begin + CHUNK_SIZE, buffer.size());
+			for (size_t i = begin; i < end; ++i)
+				concurrent_add(buffer[i]);
 		}
-		else
+	};
+
+	pool.run(num_threads, worker);
+
+	end_concurrent_add();
+
+	return buffer.size();
+}
+
+
+void RDFIndex::link_pair_chains(const std::vector<rdf_idx_helper::TableIterator>& rows,
+	const SegmentedVector<CodedResource>& term,
+	SegmentedVector<rdf_idx_helper::Link>& next,
+	rdf_idx_helper::SingleIndex& single_index,
+	rdf_idx_helper::PairIndex& pair_index,
+	rdf_idx_helper::PairHeads& pair_heads,
+	rdf_idx_helper::PairSizes& pair_sizes,
+	rdf_idx_helper::TableIterator rdf_idx_helper::PredicateStats::* distinct)
+{
+	using rdf_idx_helper::TABLE_END;
+
+	for (size_t term_begin = 0, term_end = 0; term_begin < rows.size(); term_begin = term_end)
+	{
+		const CodedResource x = term[rows[term_begin]];
+		auto& entry = *single_index.insert(x,
+			rdf_idx_helper::SingleTermIndexEntry{ TABLE_END, 0 }).first;
+
+		// process each (x, pred) group in turn
+		for (term_end = term_begin; term_end < rows.size() && term[rows[term_end]] == x; )
 		{
-			// pick an arbitrary (obj, pred') pair for some other pred' != pred
-			const CodedTriple& other_trip = m_triples[m_obj_index[t.obj].offset].t;
-			op_source = (rdf_idx_helper::IndexHelper::PairIndexIterator)m_op_index.find(
-				std::make_pair(other_trip.obj, other_trip.pred));
+			const size_t group_begin = term_end;
+			const CodedResource pred = m_triples.pred[rows[group_begin]];
+
+			// within the group, just point each row at the next
+			size_t group_end = group_begin + 1;
+			for (; group_end < rows.size() && term[rows[group_end]] == x
+				&& m_triples.pred[rows[group_end]] == pred; ++group_end)
+				next[rows[group_end - 1]] = rows[group_end];
+
+			// then the whole group becomes the new front of the
+			// (x, pred) pair's list, exactly as in `add`
+			const auto id = push_pair_head(entry, pair_index, pair_heads, pair_sizes,
+				std::make_pair(x, pred), rows[group_begin], next[rows[group_end - 1]]);
+
+			const auto group_size = static_cast<rdf_idx_helper::TableIterator>(group_end - group_begin);
+			rdf_idx_helper::add_to_size(entry, group_size);
+			add_to_pair_size(pair_sizes, id, pred, distinct, group_size);
+			term_end = group_end;
 		}
 	}
-	else
-		op_source = op_iter->second;
-
-	// add to table
-	m_triples.emplace_back(
-		t, sp_source, op_source,
-		m_pred_index[t.pred].offset
-	);
-
-	/* Now, we don't *always* want to set this new triple to
-	* be the 'front' of the sub/obj index. We ONLY want to do
-	* this when the triple introduces a new value of `pred`,
-	* or if the triple agrees with the value of `pred`
-	* currently being pointed to. It is all about making sure
-	* we update the offset iff the new triple has a `pred`
-	* from the group at the front of the linked list.
-	*/
-	if (sp_iter == m_sp_index.cend() ||
-		m_triples[m_sub_index[t.sub].offset].t.pred == t.pred)
-		m_sub_index[t.sub].offset = new_offset;
-	if (op_iter == m_op_index.cend() ||
-		m_triples[m_obj_index[t.obj].offset].t.pred == t.pred)
-		m_obj_index[t.obj].offset = new_offset;
+}
 
-	// always add to the `pred` index as this case
-	// is slightly simpler
-	m_pred_index[t.pred].offset = new_offset;
 
-	// always increment sizes in the single term indices
-	++m_sub_index[t.sub].size;
-	++m_pred_index[t.pred].size;
-	++m_obj_index[t.obj].size;
+void RDFIndex::compact()
+{
+	if (m_num_dead > 0)
+		purge_dead_rows();
+	set_sorted(std::make_shared<const SortedIndex>(m_triples));
+}
 
-	m_sp_index[std::make_pair(t.sub, t.pred)] = new_offset;
-	m_op_index[std::make_pair(t.obj, t.pred)] = new_offset;
-	m_triple_index[t] = new_offset;
 
-#ifdef DBSI_CHECKING_INVARIANTS
-	// in debug mode, check integrity every 100 triples added.
-	// this check is expensive so don't do it every time.
-	if (m_triples.size() % 5000 == 0)
-		check_integrity();
-#endif  // DBSI_CHECKING_INVARIANTS
+bool RDFIndex::is_compact() const
+{
+	return sorted() != nullptr;
+}
+
+
+void RDFIndex::set_sorted(std::shared_ptr<const SortedIndex> sorted)
+{
+	// only the writer changes `m_sorted`, so it can read it without
+	// the lock, which saves taking it for every triple added
+	if (sorted == nullptr && m_sorted == nullptr)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_sorted_mutex);
+	m_sorted = std::move(sorted);
+}
+
+
+std::shared_ptr<const SortedIndex> RDFIndex::sorted() const
+{
+	std::lock_guard<std::mutex> lock(m_sorted_mutex);
+	return m_sorted;
+}
+
+
+RDFIndex::Snapshot RDFIndex::snapshot() const
+{
+	return Snapshot(*this);
 }
 
 
 std::unique_ptr<ICodedVarMapIterator> RDFIndex::evaluate(CodedTriplePattern pattern) const
 {
+	return snapshot().evaluate(std::move(pattern));
+}
+
+
+std::unique_ptr<ICodedTripleIterator> RDFIndex::full_scan() const
+{
+	return snapshot().full_scan();
+}
+
+
+double RDFIndex::estimate_cardinality(const CodedTriplePattern& pattern, const CodedVarMap& bound) const
+{
+	return snapshot().estimate_cardinality(pattern, bound);
+}
+
+
+double RDFIndex::PredicateStatistics::subject_fan_out() const
+{
+	return (num_subjects > 0) ? static_cast<double>(num_triples) / num_subjects : 0.0;
+}
+
+
+double RDFIndex::PredicateStatistics::object_fan_out() const
+{
+	return (num_objects > 0) ? static_cast<double>(num_triples) / num_objects : 0.0;
+}
+
+
+RDFIndex::Snapshot::Snapshot(const RDFIndex& idx) :
+	m_idx(idx),
+	// the size must be read first: everything read afterwards is at
+	// least as new, so holds all of the rows it counts
+	m_size(static_cast<rdf_idx_helper::TableIterator>(
+		idx.m_published_size.load(std::memory_order_acquire))),
+	m_stats{ idx.m_published_num_triples.load(std::memory_order_relaxed),
+		idx.m_published_num_subjects.load(std::memory_order_relaxed),
+		idx.m_published_num_preds.load(std::memory_order_relaxed),
+		idx.m_published_num_objects.load(std::memory_order_relaxed) },
+	m_sub_index(idx.m_sub_index.view()),
+	m_pred_index(idx.m_pred_index.view()),
+	m_obj_index(idx.m_obj_index.view()),
+	m_sp_index(idx.m_sp_index.view()),
+	m_op_index(idx.m_op_index.view()),
+	m_triple_index(idx.m_triple_index.view()),
+	m_pred_stats(idx.m_pred_stats.view()),
+	m_sorted(idx.sorted())
+{ }
+
+
+/*
+* Binds the variables of a pattern to each of the triples matching it,
+* which another iterator returns.
+*/
+class PatternBindingIterator :
+	public ICodedVarMapIterator
+{
+public:
+	PatternBindingIterator(CodedTriplePattern pattern,
+		std::unique_ptr<ICodedTripleIterator> matches) :
+		m_pattern(std::move(pattern)),
+		m_matches(std::move(matches))
+	{ }
+
+	void start() override
+	{
+		m_matches->start();
+	}
+
+	CodedVarMap current() const override
+	{
+		DBSI_CHECK_PRECOND(valid());
+		auto cvm = bind(m_pattern, m_matches->current());
+
+		// if this fails then the triple didn't match the pattern
+		DBSI_CHECK_POSTCOND(cvm.has_value());
+
+		return *cvm;
+	}
+
+	void next() override
+	{
+		DBSI_CHECK_PRECOND(valid());
+		m_matches->next();
+	}
+
+	bool valid() const override
+	{
+		return m_matches->valid();
+	}
+
+private:
+	const CodedTriplePattern m_pattern;
+	const std::unique_ptr<ICodedTripleIterator> m_matches;
+};
+
+
+std::unique_ptr<ICodedVarMapIterator> bind_matches(CodedTriplePattern pattern,
+	std::unique_ptr<ICodedTripleIterator> matches)
+{
+	return std::make_unique<PatternBindingIterator>(std::move(pattern), std::move(matches));
+}
+
+
+std::unique_ptr<ICodedVarMapIterator> RDFIndex::Snapshot::evaluate(CodedTriplePattern pattern) const
+{
+	auto matches = match(pattern);
+	return bind_matches(std::move(pattern), std::move(matches));
+}
+
+
+std::unique_ptr<IMatchIterator> RDFIndex::Snapshot::match(const CodedTriplePattern& pattern) const
+{
+	if (m_sorted != nullptr)
+		return m_sorted->match(pattern);
+
+	return std::make_unique<IndexIterator>(*this, pattern);
+}
+
+
+std::pair<rdf_idx_helper::TableIterator, RDFIndex::EvaluationType> RDFIndex::Snapshot::locate(
+	const CodedTriplePattern& pattern) const
+{
+	using rdf_idx_helper::load_acquire;
+
+	const rdf_idx_helper::PairHeads& sp_heads = m_idx.m_sp_heads;
+	const rdf_idx_helper::PairHeads& op_heads = m_idx.m_op_heads;
+
 	auto [index_type, eval_type] = plan_pattern(pattern);
 	auto start_index = rdf_idx_helper::TABLE_END;
 
@@ -151,15 +1041,15 @@ std::unique_ptr<ICodedVarMapIterator> RDFIndex::evaluate(CodedTriplePattern patt
 		// however in the special case where the DB is empty, 0
 		// is an unnacceptable index (see the assertion at the
 		// bottom of this function).
-		start_index = (m_triples.empty()) ? rdf_idx_helper::TABLE_END : 0;
+		start_index = (m_size == 0) ? rdf_idx_helper::TABLE_END : 0;
 		break;
 	case IndexType::SUB:
 		// if this fails, `plan_pattern` is faulty
 		DBSI_CHECK_POSTCOND(std::holds_alternative<CodedResource>(pattern.sub));
 		{
-			auto iter = m_sub_index.find(std::get<CodedResource>(pattern.sub));
-			if (iter != m_sub_index.end())
-				start_index = iter->second.offset;
+			auto entry = m_sub_index.find(std::get<CodedResource>(pattern.sub));
+			if (entry != nullptr)
+				start_index = rdf_idx_helper::resolve_link(load_acquire(entry->offset), sp_heads);
 			// else no triple exists
 		}
 		break;
@@ -167,9 +1057,9 @@ std::unique_ptr<ICodedVarMapIterator> RDFIndex::evaluate(CodedTriplePattern patt
 		// if this fails, `plan_pattern` is faulty
 		DBSI_CHECK_POSTCOND(std::holds_alternative<CodedResource>(pattern.pred));
 		{
-			auto iter = m_pred_index.find(std::get<CodedResource>(pattern.pred));
-			if (iter != m_pred_index.end())
-				start_index = iter->second.offset;
+			auto entry = m_pred_index.find(std::get<CodedResource>(pattern.pred));
+			if (entry != nullptr)
+				start_index = load_acquire(entry->offset);
 			// else no triple exists
 		}
 		break;
@@ -177,9 +1067,9 @@ std::unique_ptr<ICodedVarMapIterator> RDFIndex::evaluate(CodedTriplePattern patt
 		// if this fails, `plan_pattern` is faulty
 		DBSI_CHECK_POSTCOND(std::holds_alternative<CodedResource>(pattern.obj));
 		{
-			auto iter = m_obj_index.find(std::get<CodedResource>(pattern.obj));
-			if (iter != m_obj_index.end())
-				start_index = iter->second.offset;
+			auto entry = m_obj_index.find(std::get<CodedResource>(pattern.obj));
+			if (entry != nullptr)
+				start_index = rdf_idx_helper::resolve_link(load_acquire(entry->offset), op_heads);
 			// else no triple exists
 		}
 		break;
@@ -188,11 +1078,11 @@ std::unique_ptr<ICodedVarMapIterator> RDFIndex::evaluate(CodedTriplePattern patt
 		DBSI_CHECK_POSTCOND(std::holds_alternative<CodedResource>(pattern.sub));
 		DBSI_CHECK_POSTCOND(std::holds_alternative<CodedResource>(pattern.pred));
 		{
-			auto iter = m_sp_index.find(std::make_pair(
+			auto id = m_sp_index.find(std::make_pair(
 				std::get<CodedResource>(pattern.sub),
 				std::get<CodedResource>(pattern.pred)));
-			if (iter != m_sp_index.end())
-				start_index = iter->second;
+			if (id != nullptr)
+				start_index = load_acquire(sp_heads[*id]);
 			// else no triple exists
 		}
 		break;
@@ -201,11 +1091,11 @@ std::unique_ptr<ICodedVarMapIterator> RDFIndex::evaluate(CodedTriplePattern patt
 		DBSI_CHECK_POSTCOND(std::holds_alternative<CodedResource>(pattern.obj));
 		DBSI_CHECK_POSTCOND(std::holds_alternative<CodedResource>(pattern.pred));
 		{
-			auto iter = m_op_index.find(std::make_pair(
+			auto id = m_op_index.find(std::make_pair(
 				std::get<CodedResource>(pattern.obj),
 				std::get<CodedResource>(pattern.pred)));
-			if (iter != m_op_index.end())
-				start_index = iter->second;
+			if (id != nullptr)
+				start_index = load_acquire(op_heads[*id]);
 			// else no triple exists
 		}
 		break;
@@ -215,62 +1105,251 @@ std::unique_ptr<ICodedVarMapIterator> RDFIndex::evaluate(CodedTriplePattern patt
 		DBSI_CHECK_POSTCOND(std::holds_alternative<CodedResource>(pattern.pred));
 		DBSI_CHECK_POSTCOND(std::holds_alternative<CodedResource>(pattern.obj));
 		{
-			auto iter = m_triple_index.find({
+			auto row = m_triple_index.find(CodedTriple{
 				std::get<CodedResource>(pattern.sub),
 				std::get<CodedResource>(pattern.pred),
 				std::get<CodedResource>(pattern.obj)
 				});
-			if (iter != m_triple_index.end())
-				start_index = iter->second;
+			if (row != nullptr)
+				start_index = load_acquire(*row);
 			// else no triple exists
 		}
 		break;
 	}
 
-	DBSI_CHECK_INVARIANT(start_index < m_triples.size() || start_index == rdf_idx_helper::TABLE_END);
+	DBSI_CHECK_INVARIANT(start_index < m_idx.m_triples.size() || start_index == rdf_idx_helper::TABLE_END);
 
-	return std::make_unique<IndexIterator>(m_triples, pattern, start_index, eval_type);
+	return std::make_pair(start_index, eval_type);
 }
 
 
-std::unique_ptr<ICodedTripleIterator> RDFIndex::full_scan() const
+std::unique_ptr<ICodedTripleIterator> RDFIndex::Snapshot::full_scan() const
 {
 	// keeping this class internal to this function because it's so simple
 	class FullRDFScanIterator :
 		public ICodedTripleIterator
 	{
 	public:
-		FullRDFScanIterator(const rdf_idx_helper::Table& table) :
-			m_table(table), m_idx(0)
+		FullRDFScanIterator(const rdf_idx_helper::Table& table, size_t size) :
+			m_table(table), m_size(size), m_idx(0)
 		{ }
 
-		void start() override { m_idx = 0; }
+		void start() override
+		{
+			m_idx = 0;
+			skip_dead();
+		}
 
-		bool valid() const override { return m_idx < m_table.size(); }
+		bool valid() const override { return m_idx < m_size; }
 
 		void next() override
 		{
 			DBSI_CHECK_PRECOND(valid());
 			++m_idx;
+			skip_dead();
 		}
 
 		CodedTriple current() const override
 		{
 			DBSI_CHECK_PRECOND(valid());
-			return m_table[m_idx].t;
+			return m_table.triple(m_idx);
+		}
+
+	private:
+		void skip_dead()
+		{
+			while (valid() && m_table.is_dead(m_idx))
+				++m_idx;
 		}
 
 	private:
 		const rdf_idx_helper::Table& m_table;
+		const size_t m_size;
 		size_t m_idx;
 	};
 
-	return std::make_unique<FullRDFScanIterator>(m_triples);
+	return std::make_unique<FullRDFScanIterator>(m_idx.m_triples, m_size);
 }
 
 
-std::pair<RDFIndex::IndexType, RDFIndex::EvaluationType> RDFIndex::plan_pattern(
-	CodedTriplePattern pattern) const
+RDFIndex::Statistics RDFIndex::Snapshot::statistics() const
+{
+	return m_stats;
+}
+
+
+RDFIndex::PredicateStatistics RDFIndex::Snapshot::predicate_statistics(CodedResource pred) const
+{
+	using rdf_idx_helper::load_acquire;
+
+	PredicateStatistics result{ 0, 0, 0 };
+	if (auto entry = m_pred_index.find(pred); entry != nullptr)
+		result.num_triples = load_acquire(entry->size);
+	if (auto stats = m_pred_stats.find(pred); stats != nullptr)
+	{
+		result.num_subjects = load_acquire(stats->num_subjects);
+		result.num_objects = load_acquire(stats->num_objects);
+	}
+	return result;
+}
+
+
+double RDFIndex::Snapshot::estimate_cardinality(const CodedTriplePattern& pattern,
+	const CodedVarMap& bound) const
+{
+	return estimate(pattern, bound, false);
+}
+
+
+double RDFIndex::Snapshot::estimate_scan(const CodedTriplePattern& pattern,
+	const CodedVarMap& bound) const
+{
+	return estimate(pattern, bound, true);
+}
+
+
+std::string RDFIndex::Snapshot::describe_access(const CodedTriplePattern& pattern,
+	const CodedVarMap& bound) const
+{
+	// the bound variables are looked up as constants, whose values
+	// don't matter (except below)
+	CodedTriplePattern lookup = pattern;
+	bool sub_or_obj_bound = false;
+	for (CodedTerm* term : { &lookup.sub, &lookup.pred, &lookup.obj })
+	{
+		if (std::holds_alternative<Variable>(*term)
+			&& bound.find(std::get<Variable>(*term)) != bound.end())
+		{
+			sub_or_obj_bound = sub_or_obj_bound || (term != &lookup.pred);
+			*term = CodedResource(0);
+		}
+	}
+
+	if (m_sorted != nullptr)
+		return m_sorted->describe_access(lookup);
+
+	// which of these is chosen depends on the values
+	if (pattern_type(lookup) == TriplePatternType::SVO && sub_or_obj_bound)
+		return "SUB index and SP links, or OBJ index and OP links (whichever is shorter)";
+
+	static const char* const INDEX_NAMES[] = { "no", "SPO", "SP", "OP", "SUB", "PRED", "OBJ" };
+	static const char* const EVALUATION_NAMES[] = {
+		"all rows", "one row", "SP links", "P links", "OP links" };
+
+	const auto [index_type, eval_type] = plan_pattern(lookup);
+	return std::string(INDEX_NAMES[static_cast<size_t>(index_type)]) + " index and "
+		+ EVALUATION_NAMES[static_cast<size_t>(eval_type)];
+}
+
+
+double RDFIndex::Snapshot::estimate(const CodedTriplePattern& pattern,
+	const CodedVarMap& bound, bool scanned) const
+{
+	using rdf_idx_helper::load_acquire;
+
+	// what is known about each term of the pattern. (a repeated
+	// variable narrows down the matches, but not the rows read, as
+	// it is only checked once each row has been found)
+	enum class Term { CONSTANT, BOUND, FREE };
+	std::vector<Variable> seen;
+	auto classify = [&bound, &seen, scanned](const CodedTerm& term)
+	{
+		if (std::holds_alternative<CodedResource>(term))
+			return Term::CONSTANT;
+		const Variable& var = std::get<Variable>(term);
+		if (bound.find(var) != bound.end()
+			|| (!scanned && std::find(seen.begin(), seen.end(), var) != seen.end()))
+			return Term::BOUND;
+		seen.push_back(var);
+		return Term::FREE;
+	};
+	const Term sub = classify(pattern.sub), pred = classify(pattern.pred),
+		obj = classify(pattern.obj);
+
+	// the number of live triples with the given constant term, or in
+	// the given pair
+	auto single_size = [](const rdf_idx_helper::SingleIndex::View& index, const CodedTerm& term)
+	{
+		auto entry = index.find(std::get<CodedResource>(term));
+		return (entry != nullptr) ? static_cast<double>(load_acquire(entry->size)) : 0.0;
+	};
+	auto pair_size = [](const rdf_idx_helper::PairIndex::View& index,
+		const rdf_idx_helper::PairSizes& sizes, const CodedTerm& term, const CodedTerm& pred)
+	{
+		auto id = index.find(std::make_pair(std::get<CodedResource>(term),
+			std::get<CodedResource>(pred)));
+		return (id != nullptr) ? static_cast<double>(load_acquire(sizes[*id])) : 0.0;
+	};
+
+	// (this also rules out dividing by zero below)
+	if (m_stats.num_triples == 0)
+		return 0.0;
+
+	if (sub == Term::CONSTANT && pred == Term::CONSTANT && obj == Term::CONSTANT)
+	{
+		auto row = m_triple_index.find(CodedTriple{ std::get<CodedResource>(pattern.sub),
+			std::get<CodedResource>(pattern.pred), std::get<CodedResource>(pattern.obj) });
+		if (row == nullptr)
+			return 0.0;
+		// (a row which this snapshot can't see yet doesn't count)
+		const auto i = load_acquire(*row);
+		return (i < m_size && !m_idx.m_triples.is_dead(i)) ? 1.0 : 0.0;
+	}
+
+	if (pred == Term::CONSTANT)
+	{
+		const PredicateStatistics stats = predicate_statistics(std::get<CodedResource>(pattern.pred));
+		if (stats.num_triples == 0)
+			return 0.0;
+		const double num_triples = static_cast<double>(stats.num_triples);
+		const double num_subjects = static_cast<double>(std::max<size_t>(stats.num_subjects, 1));
+		const double num_objects = static_cast<double>(std::max<size_t>(stats.num_objects, 1));
+
+		if (sub == Term::CONSTANT)
+		{
+			const double n = pair_size(m_sp_index, m_idx.m_sp_sizes, pattern.sub, pattern.pred);
+			return (obj == Term::BOUND) ? n / num_objects : n;
+		}
+		if (obj == Term::CONSTANT)
+		{
+			const double n = pair_size(m_op_index, m_idx.m_op_sizes, pattern.obj, pattern.pred);
+			return (sub == Term::BOUND) ? n / num_subjects : n;
+		}
+		double n = num_triples;
+		if (sub == Term::BOUND)
+			n /= num_subjects;
+		if (obj == Term::BOUND)
+			n /= num_objects;
+		return n;
+	}
+
+	// without a predicate, only the global statistics can be used
+	const double num_triples = static_cast<double>(m_stats.num_triples);
+	double sub_rows = num_triples, obj_rows = num_triples;
+	if (sub == Term::CONSTANT)
+		sub_rows = single_size(m_sub_index, pattern.sub);
+	else if (sub == Term::BOUND)
+		sub_rows /= std::max<size_t>(m_stats.num_subjects, 1);
+	if (obj == Term::CONSTANT)
+		obj_rows = single_size(m_obj_index, pattern.obj);
+	else if (obj == Term::BOUND)
+		obj_rows /= std::max<size_t>(m_stats.num_objects, 1);
+
+	// if only the subject and object are known, then (unless the index
+	// is sorted) only the shorter of their lists is followed, and its
+	// rows are filtered by the other
+	if (scanned && pred == Term::FREE && sub != Term::FREE && obj != Term::FREE
+		&& m_sorted == nullptr)
+		return std::min(sub_rows, obj_rows);
+	double n = sub_rows * obj_rows / num_triples;
+	if (pred == Term::BOUND)
+		n /= std::max<size_t>(m_stats.num_predicates, 1);
+	return n;
+}
+
+
+std::pair<RDFIndex::IndexType, RDFIndex::EvaluationType> RDFIndex::Snapshot::plan_pattern(
+	const CodedTriplePattern& pattern) const
 {
 	RDFIndex::IndexType index_type;
 	RDFIndex::EvaluationType eval_type;
@@ -311,7 +1390,7 @@ std::pair<RDFIndex::IndexType, RDFIndex::EvaluationType> RDFIndex::plan_pattern(
 		// based on index selectivity (see paper)
 		auto sub_iter = m_sub_index.find(std::get<CodedResource>(pattern.sub));
 		auto obj_iter = m_obj_index.find(std::get<CodedResource>(pattern.obj));
-		if (sub_iter == m_sub_index.end() || obj_iter == m_obj_index.end())
+		if (sub_iter == nullptr || obj_iter == nullptr)
 		{
 			// however obviously if either sub or obj do not
 			// exist then the query will return empty results.
@@ -319,7 +1398,8 @@ std::pair<RDFIndex::IndexType, RDFIndex::EvaluationType> RDFIndex::plan_pattern(
 			index_type = RDFIndex::IndexType::NONE;
 			eval_type = RDFIndex::EvaluationType::NONE;
 		}
-		else if (sub_iter->second.size < obj_iter->second.size)  //	`sub` more selective
+		else if (rdf_idx_helper::load_acquire(sub_iter->size)
+			< rdf_idx_helper::load_acquire(obj_iter->size))  //	`sub` more selective
 		{
 			index_type = RDFIndex::IndexType::SUB;
 			eval_type = RDFIndex::EvaluationType::SP;
@@ -356,211 +1436,153 @@ std::pair<RDFIndex::IndexType, RDFIndex::EvaluationType> RDFIndex::plan_pattern(
 void RDFIndex::check_integrity()
 {
 	using rdf_idx_helper::TABLE_END;
-	rdf_idx_helper::TripleRowVisitor get_row;
-
-	// check the triple index
-	DBSI_CHECK_INVARIANT(m_triples.size() == m_triple_index.size());
-	for (const auto& kv : m_triple_index)
-		DBSI_CHECK_INVARIANT(m_triples[kv.second].t == kv.first);
+	using rdf_idx_helper::TableIterator;
+	using rdf_idx_helper::resolve_link;
+
+	// check the dead rows (which are still in the triple index)
+	DBSI_CHECK_INVARIANT(m_triples.dead.empty() || m_triples.dead.size() == m_triples.size());
+	size_t num_dead = 0;
+	for (size_t i = 0; i < m_triples.dead.size(); ++i)
+		num_dead += (m_triples.dead[i] != 0);
+	DBSI_CHECK_INVARIANT(m_num_dead == num_dead);
+	DBSI_CHECK_INVARIANT(m_published_size == m_triples.size());
+
+	// check the triple index, which holds the newest row of each
+	// triple (older rows of the same triple must be dead)
+	DBSI_CHECK_INVARIANT(m_triple_index.size() >= m_triples.size() - m_num_dead);
+	for (TableIterator row : m_triple_index)
+		DBSI_CHECK_INVARIANT(row < m_triples.size()
+			&& m_triple_index.find(m_triples.triple(row)) != nullptr
+			&& *m_triple_index.find(m_triples.triple(row)) == row);
+	for (size_t i = 0; i < m_triples.size(); ++i)
+		DBSI_CHECK_INVARIANT(m_triples.is_dead(i)
+			|| *m_triple_index.find(m_triples.triple(i)) == i);
 
 	// check the linked list pointers
 	for (size_t i = 0; i < m_triples.size(); ++i)
 	{
-		const size_t n_sp = std::visit(get_row, m_triples[i].n_sp),
-			n_op = std::visit(get_row, m_triples[i].n_op);
+		const TableIterator n_sp = resolve_link(m_triples.n_sp[i], m_sp_heads),
+			n_op = resolve_link(m_triples.n_op[i], m_op_heads);
 
 		// check the linked list pointers have the guarantees
 		// of the same sub/pred/obj respectively
 		DBSI_CHECK_INVARIANT(n_sp == TABLE_END ||
-			m_triples[n_sp].t.sub == m_triples[i].t.sub);
-		DBSI_CHECK_INVARIANT(m_triples[i].n_p == TABLE_END ||
-			m_triples[m_triples[i].n_p].t.pred == m_triples[i].t.pred);
+			m_triples.sub[n_sp] == m_triples.sub[i]);
+		DBSI_CHECK_INVARIANT(m_triples.n_p[i] == TABLE_END ||
+			m_triples.pred[m_triples.n_p[i]] == m_triples.pred[i]);
 		DBSI_CHECK_INVARIANT(n_op == TABLE_END ||
-			m_triples[n_op].t.obj == m_triples[i].t.obj);
+			m_triples.obj[n_op] == m_triples.obj[i]);
 	}
 
-	// check that the pair indices point to the first of a linked
-	// list which (i) terminates, and (ii) holds only the correct
-	// values, and (iii) contains ALL of the right values
-	for (const auto& kv : m_sp_index)
+	/*
+	* Follow the linked list starting at `head` until it ends (or,
+	* if `stop_at_pair_link`, until it goes via the pair index),
+	* checking that it (i) terminates and (ii) visits each row at
+	* most once, and (iii) only visits rows satisfying `matches`.
+	* Then, do a full table scan to make sure it visited (iv) ALL
+	* of the rows satisfying `matches`.
+	* Returns the number of live rows visited.
+	*/
+	auto check_list = [this](rdf_idx_helper::Link head,
+		const SegmentedVector<rdf_idx_helper::Link>& next,
+		const rdf_idx_helper::PairHeads* heads,
+		bool stop_at_pair_link, auto matches)
 	{
-		const auto [sub, pred] = kv.first;
-
 		std::unordered_set<size_t> idxs_found;
 
 		// `tab_idx` is the linked list pointer we are following.
 		// `i` is only here to ensure termination, and isn't strictly
 		// necessary.
-		size_t tab_idx = kv.second;
-		idxs_found.insert(tab_idx);
-		for (size_t i = 0; i < m_triples.size(); ++i)
+		TableIterator tab_idx = (heads != nullptr) ? resolve_link(head, *heads) : head;
+		for (size_t i = 0; i <= m_triples.size() && tab_idx != TABLE_END; ++i)
 		{
-			DBSI_CHECK_INVARIANT(m_triples[tab_idx].t.sub == sub);
-			DBSI_CHECK_INVARIANT(m_triples[tab_idx].t.pred == pred);
-
-			if (!std::holds_alternative<size_t>(m_triples[tab_idx].n_sp))
-				break;  // changing to a different `pred` group
-			else
-				tab_idx = std::get<size_t>(m_triples[tab_idx].n_sp);
-
-			if (tab_idx == TABLE_END)
-				break;
+			DBSI_CHECK_INVARIANT(tab_idx < m_triples.size());
+			DBSI_CHECK_INVARIANT(matches(tab_idx));
 
 			// check we've not found a linked-list loop!
 			DBSI_CHECK_INVARIANT(idxs_found.find(tab_idx) == idxs_found.end());
 			idxs_found.insert(tab_idx);
+
+			if (stop_at_pair_link && rdf_idx_helper::is_pair_link(next[tab_idx]))
+				break;  // changing to a different `pred` group
+			tab_idx = (heads != nullptr) ? resolve_link(next[tab_idx], *heads) : next[tab_idx];
 		}
 
-		// now do a full table scan to make sure we got the precise set
-		// of matching triples
 		for (size_t i = 0; i < m_triples.size(); ++i)
 		{
-			if (m_triples[i].t.sub == sub && m_triples[i].t.pred == pred)
+			if (matches(i))
 				DBSI_CHECK_INVARIANT(idxs_found.find(i) != idxs_found.end());
 		}
+
+		return std::count_if(idxs_found.begin(), idxs_found.end(),
+			[this](size_t i) { return !m_triples.is_dead(i); });
+	};
+
+	// check that the pair indices point to the first of a linked
+	// list of the right values, and that their sizes are correct,
+	// while counting the distinct subjects and objects of each `pred`
+	std::unordered_map<CodedResource, rdf_idx_helper::PredicateStats> pred_stats;
+	DBSI_CHECK_INVARIANT(m_sp_index.size() == m_sp_heads.size());
+	DBSI_CHECK_INVARIANT(m_sp_sizes.size() == m_sp_heads.size());
+	for (const auto& kv : m_sp_index)
+	{
+		const auto [sub, pred] = kv.first;
+		const size_t n = check_list(m_sp_heads[kv.second], m_triples.n_sp, &m_sp_heads, true,
+			[this, sub = sub, pred = pred](size_t i)
+			{ return m_triples.sub[i] == sub && m_triples.pred[i] == pred; });
+		DBSI_CHECK_INVARIANT(n == m_sp_sizes[kv.second]);
+		if (n > 0)
+			++pred_stats[pred].num_subjects;
 	}
 	// same as for above but for OP rather than SP
+	DBSI_CHECK_INVARIANT(m_op_index.size() == m_op_heads.size());
+	DBSI_CHECK_INVARIANT(m_op_sizes.size() == m_op_heads.size());
 	for (const auto& kv : m_op_index)
 	{
 		const auto [obj, pred] = kv.first;
+		const size_t n = check_list(m_op_heads[kv.second], m_triples.n_op, &m_op_heads, true,
+			[this, obj = obj, pred = pred](size_t i)
+			{ return m_triples.obj[i] == obj && m_triples.pred[i] == pred; });
+		DBSI_CHECK_INVARIANT(n == m_op_sizes[kv.second]);
+		if (n > 0)
+			++pred_stats[pred].num_objects;
+	}
 
-		std::unordered_set<size_t> idxs_found;
-
-		// `tab_idx` is the linked list pointer we are following.
-		// `i` is only here to ensure termination, and isn't strictly
-		// necessary.
-		size_t tab_idx = kv.second;
-		idxs_found.insert(tab_idx);
-		for (size_t i = 0; i < m_triples.size(); ++i)
-		{
-			DBSI_CHECK_INVARIANT(m_triples[tab_idx].t.obj == obj);
-			DBSI_CHECK_INVARIANT(m_triples[tab_idx].t.pred == pred);
-
-			if (!std::holds_alternative<size_t>(m_triples[tab_idx].n_op))
-				break;  // changing to a different `pred` group
-			else
-				tab_idx = std::get<size_t>(m_triples[tab_idx].n_op);
-
-			if (tab_idx == TABLE_END)
-				break;
-
-			// check we've not found a linked-list loop!
-			DBSI_CHECK_INVARIANT(idxs_found.find(tab_idx) == idxs_found.end());
-			idxs_found.insert(tab_idx);
-		}
-
-		// now do a full table scan to make sure we got the precise set
-		// of matching triples
-		for (size_t i = 0; i < m_triples.size(); ++i)
-		{
-			if (m_triples[i].t.obj == obj && m_triples[i].t.pred == pred)
-				DBSI_CHECK_INVARIANT(idxs_found.find(i) != idxs_found.end());
-		}
+	// check the statistics against those counts (predicates whose
+	// triples have all been removed may still have zeroed statistics)
+	for (const auto& [pred, stats] : pred_stats)
+		DBSI_CHECK_INVARIANT(m_pred_stats.find(pred) != nullptr);
+	for (const auto& kv : m_pred_stats)
+	{
+		const rdf_idx_helper::PredicateStats& expected = pred_stats[kv.first];
+		DBSI_CHECK_INVARIANT(kv.second.num_subjects == expected.num_subjects
+			&& kv.second.num_objects == expected.num_objects);
 	}
+	DBSI_CHECK_INVARIANT(m_published_num_triples == m_triples.size() - m_num_dead);
 
 	// check that the single indices point to the first of a linked
-	// list which (i) terminates, and (ii) holds only the correct
-	// values, and (iii) contains ALL of the right values
+	// list of the right values, and that their sizes are correct
 	for (const auto& kv : m_sub_index)
 	{
-		std::unordered_set<size_t> idxs_found;
-
-		// `tab_idx` is the linked list pointer we are following.
-		// `i` is only here to ensure termination, and isn't strictly
-		// necessary.
-		size_t tab_idx = kv.second.offset;
-		idxs_found.insert(tab_idx);
-		for (size_t i = 0; i < m_triples.size(); ++i)
-		{
-			DBSI_CHECK_INVARIANT(m_triples[tab_idx].t.sub == kv.first);
-
-			tab_idx = std::visit(get_row, m_triples[tab_idx].n_sp);
-
-			if (tab_idx == TABLE_END)
-				break;
-
-			// check we've not found a linked-list loop!
-			DBSI_CHECK_INVARIANT(idxs_found.find(tab_idx) == idxs_found.end());
-			idxs_found.insert(tab_idx);
-		}
-
-		// now do a full table scan to make sure we got the precise set
-		// of matching triples
-		for (size_t i = 0; i < m_triples.size(); ++i)
-		{
-			if (m_triples[i].t.sub == kv.first)
-				DBSI_CHECK_INVARIANT(idxs_found.find(i) != idxs_found.end());
-		}
-
-		DBSI_CHECK_INVARIANT(idxs_found.size() == kv.second.size);
+		DBSI_CHECK_INVARIANT(rdf_idx_helper::is_pair_link(kv.second.offset));
+		const size_t n = check_list(kv.second.offset, m_triples.n_sp, &m_sp_heads, false,
+			[this, sub = kv.first](size_t i) { return m_triples.sub[i] == sub; });
+		DBSI_CHECK_INVARIANT(n == kv.second.size);
 	}
 	// same for `obj`
 	for (const auto& kv : m_obj_index)
 	{
-		std::unordered_set<size_t> idxs_found;
-
-		// `tab_idx` is the linked list pointer we are following.
-		// `i` is only here to ensure termination, and isn't strictly
-		// necessary.
-		size_t tab_idx = kv.second.offset;
-		idxs_found.insert(tab_idx);
-		for (size_t i = 0; i < m_triples.size(); ++i)
-		{
-			DBSI_CHECK_INVARIANT(m_triples[tab_idx].t.obj == kv.first);
-
-			tab_idx = std::visit(get_row, m_triples[tab_idx].n_op);
-
-			if (tab_idx == TABLE_END)
-				break;
-
-			// check we've not found a linked-list loop!
-			DBSI_CHECK_INVARIANT(idxs_found.find(tab_idx) == idxs_found.end());
-			idxs_found.insert(tab_idx);
-		}
-
-		// now do a full table scan to make sure we got the precise set
-		// of matching triples
-		for (size_t i = 0; i < m_triples.size(); ++i)
-		{
-			if (m_triples[i].t.obj == kv.first)
-				DBSI_CHECK_INVARIANT(idxs_found.find(i) != idxs_found.end());
-		}
-
-		DBSI_CHECK_INVARIANT(idxs_found.size() == kv.second.size);
+		DBSI_CHECK_INVARIANT(rdf_idx_helper::is_pair_link(kv.second.offset));
+		const size_t n = check_list(kv.second.offset, m_triples.n_op, &m_op_heads, false,
+			[this, obj = kv.first](size_t i) { return m_triples.obj[i] == obj; });
+		DBSI_CHECK_INVARIANT(n == kv.second.size);
 	}
 	// and finally, something similar but slightly simpler for `pred`
 	for (const auto& kv : m_pred_index)
 	{
-		std::unordered_set<size_t> idxs_found;
-
-		// `tab_idx` is the linked list pointer we are following.
-		// `i` is only here to ensure termination, and isn't strictly
-		// necessary.
-		size_t tab_idx = kv.second.offset;
-		idxs_found.insert(tab_idx);
-		for (size_t i = 0; i < m_triples.size(); ++i)
-		{
-			DBSI_CHECK_INVARIANT(m_triples[tab_idx].t.pred == kv.first);
-
-			tab_idx = m_triples[tab_idx].n_p;
-
-			if (tab_idx == TABLE_END)
-				break;
-
-			// check we've not found a linked-list loop!
-			DBSI_CHECK_INVARIANT(idxs_found.find(tab_idx) == idxs_found.end());
-			idxs_found.insert(tab_idx);
-		}
-
-		DBSI_CHECK_INVARIANT(idxs_found.size() == kv.second.size);
-
-		// now do a full table scan to make sure we got the precise set
-		// of matching triples
-		for (size_t i = 0; i < m_triples.size(); ++i)
-		{
-			if (m_triples[i].t.pred == kv.first)
-				DBSI_CHECK_INVARIANT(idxs_found.find(i) != idxs_found.end());
-		}
+		const size_t n = check_list(kv.second.offset, m_triples.n_p, nullptr, false,
+			[this, pred = kv.first](size_t i) { return m_triples.pred[i] == pred; });
+		DBSI_CHECK_INVARIANT(n == kv.second.size);
 	}
 }
 
@@ -574,15 +1596,38 @@ void RDFIndex::check_integrity() { /* no-op */ }
 #endif  // DBSI_CHECKING_INVARIANTS
 
 
-RDFIndex::IndexIterator::IndexIterator(
-	const rdf_idx_helper::Table& triples,
-	CodedTriplePattern pattern,
-	rdf_idx_helper::TableIterator start_idx, EvaluationType eval_type) :
-	m_eval_type(eval_type), m_triples(triples),
-	m_start_idx(start_idx), m_cur_idx(triples.size()),
-	m_pattern(std::move(pattern))
+RDFIndex::IndexIterator::IndexIterator(const Snapshot& snapshot,
+	const CodedTriplePattern& pattern) :
+	m_snapshot(snapshot), m_triples(snapshot.m_idx.m_triples), m_size(snapshot.m_size),
+	m_pair_heads(nullptr), m_eval_type(EvaluationType::NONE), m_matcher(pattern),
+	m_start_idx(rdf_idx_helper::TABLE_END), m_cur_idx(rdf_idx_helper::TABLE_END),
+	m_cur_matches(false), m_rows_scanned(0)
+{
+	rebind(pattern);
+}
+
+
+void RDFIndex::IndexIterator::rebind(const CodedTriplePattern& pattern)
 {
+	std::tie(m_start_idx, m_eval_type) = m_snapshot.locate(pattern);
 	DBSI_CHECK_PRECOND(m_start_idx < m_triples.size() || m_start_idx == rdf_idx_helper::TABLE_END);
+
+	m_matcher = TripleMatcher<CodedResource>(pattern);
+	if (m_eval_type == EvaluationType::SP)
+		m_pair_heads = &m_snapshot.m_idx.m_sp_heads;
+	else if (m_eval_type == EvaluationType::OP)
+		m_pair_heads = &m_snapshot.m_idx.m_op_heads;
+	else
+		m_pair_heads = nullptr;
+
+	m_cur_idx = rdf_idx_helper::TABLE_END;
+	m_cur_matches = false;
+}
+
+
+size_t RDFIndex::IndexIterator::rows_scanned() const
+{
+	return m_rows_scanned;
 }
 
 
@@ -591,22 +1636,17 @@ void RDFIndex::IndexIterator::start()
 	m_cur_idx = m_start_idx;
 	if (valid())
 	{
-		m_cur_map = bind(m_pattern, m_triples[m_cur_idx].t);
+		match_cur_row();
 		inc_till_pattern_match();
 	}
 }
 
 
-CodedVarMap RDFIndex::IndexIterator::current() const
+CodedTriple RDFIndex::IndexIterator::current() const
 {
 	DBSI_CHECK_PRECOND(valid());
-	DBSI_CHECK_INVARIANT(pattern_matches(m_pattern, m_triples[m_cur_idx].t));
-	auto cvm = bind(m_pattern, m_triples[m_cur_idx].t);
-
-	// if this fails then the pattern utils functions are faulty
-	DBSI_CHECK_POSTCOND(cvm.has_value());
-
-	return *cvm;
+	DBSI_CHECK_INVARIANT(m_cur_matches);
+	return m_triples.triple(m_cur_idx);
 }
 
 
@@ -626,6 +1666,28 @@ void RDFIndex::IndexIterator::next()
 }
 
 
+void RDFIndex::IndexIterator::next_batch(ColumnBatch& batch)
+{
+	DBSI_CHECK_PRECOND(batch.num_columns() == 3);
+
+	CodedResource* const subs = batch.column(0);
+	CodedResource* const preds = batch.column(1);
+	CodedResource* const objs = batch.column(2);
+	while (valid() && !batch.full())
+	{
+		DBSI_CHECK_INVARIANT(m_cur_matches);
+		const size_t row = batch.add_rows(1);
+		subs[row] = m_triples.sub[m_cur_idx];
+		preds[row] = m_triples.pred[m_cur_idx];
+		objs[row] = m_triples.obj[m_cur_idx];
+
+		increment_idx();
+		if (valid())
+			inc_till_pattern_match();
+	}
+}
+
+
 bool RDFIndex::IndexIterator::valid() const
 {
 	DBSI_CHECK_INVARIANT(m_cur_idx < m_triples.size()
@@ -638,8 +1700,8 @@ bool RDFIndex::IndexIterator::valid() const
 void RDFIndex::IndexIterator::increment_idx()
 {
 #ifdef DBSI_CHECKING_INVARIANTS
-	const CodedResource last_sub = m_triples[m_cur_idx].t.sub;
-	const CodedResource last_obj = m_triples[m_cur_idx].t.obj;
+	const CodedResource last_sub = m_triples.sub[m_cur_idx];
+	const CodedResource last_obj = m_triples.obj[m_cur_idx];
 #endif
 	switch (m_eval_type)
 	{
@@ -650,7 +1712,7 @@ void RDFIndex::IndexIterator::increment_idx()
 	case EvaluationType::ALL:
 		++m_cur_idx;
 
-		if (m_cur_idx >= m_triples.size())
+		if (m_cur_idx >= m_size)
 			m_cur_idx = rdf_idx_helper::TABLE_END;
 		break;
 
@@ -658,7 +1720,7 @@ void RDFIndex::IndexIterator::increment_idx()
 		/*
 		* Note: this one statement hides substantial complexity,
 		* as explained at length in `dbsi_rdf_index_helper.h` and
-		* `TripleRowVisitor`.
+		* `resolve_link`.
 		* 
 		* In short, there are two possibilities when advancing
 		* along the `n_sp` pointer. Either:
@@ -671,22 +1733,20 @@ void RDFIndex::IndexIterator::increment_idx()
 		* Note that, crucially, (i) is constant time, because
 		* `n_sp` already stores the pointer to the right element.
 		*/
-		m_cur_idx = std::visit(rdf_idx_helper::TripleRowVisitor(),
-			m_triples[m_cur_idx].n_sp);
+		m_cur_idx = rdf_idx_helper::resolve_link(m_triples.n_sp[m_cur_idx], *m_pair_heads);
 		DBSI_CHECK_INVARIANT(m_cur_idx == rdf_idx_helper::TABLE_END
-			|| last_sub == m_triples[m_cur_idx].t.sub);
+			|| last_sub == m_triples.sub[m_cur_idx]);
 		break;
 
 	case EvaluationType::P:
-		m_cur_idx = m_triples[m_cur_idx].n_p;
+		m_cur_idx = m_triples.n_p[m_cur_idx];
 		break;
 
 	case EvaluationType::OP:
 		// see comment for SP
-		m_cur_idx = std::visit(rdf_idx_helper::TripleRowVisitor(),
-			m_triples[m_cur_idx].n_op);
+		m_cur_idx = rdf_idx_helper::resolve_link(m_triples.n_op[m_cur_idx], *m_pair_heads);
 		DBSI_CHECK_INVARIANT(m_cur_idx == rdf_idx_helper::TABLE_END
-			|| last_obj == m_triples[m_cur_idx].t.obj);
+			|| last_obj == m_triples.obj[m_cur_idx]);
 		break;
 
 	default:
@@ -695,14 +1755,25 @@ void RDFIndex::IndexIterator::increment_idx()
 	}
 
 	if (valid())
-		m_cur_map = bind(m_pattern, m_triples[m_cur_idx].t);
+		match_cur_row();
+}
+
+
+void RDFIndex::IndexIterator::match_cur_row()
+{
+	// dead rows, and rows added after the snapshot was taken
+	// (which we pass on our way to older rows), are treated as
+	// though they don't match
+	++m_rows_scanned;
+	m_cur_matches = m_cur_idx < m_size && !m_triples.is_dead(m_cur_idx)
+		&& m_matcher(m_triples.triple(m_cur_idx));
 }
 
 
 void RDFIndex::IndexIterator::inc_till_pattern_match()
 {
 	// increment until we finish or until we finally get a triple which matches the pattern
-	while (valid() && !m_cur_map)
+	while (valid() && !m_cur_matches)
 		increment_idx();
 }
 
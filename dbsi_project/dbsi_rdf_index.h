@@ -4,9 +4,16 @@
 
 #include <optional>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <string>
 #include "dbsi_types.h"
 #include "dbsi_iterator.h"
 #include "dbsi_rdf_index_helper.h"
+#include "dbsi_sorted_index.h"
+#include "dbsi_log.h"
+#include "dbsi_thread_pool.h"
+#include "dbsi_pattern_utils.h"
 
 
 namespace dbsi
@@ -40,73 +47,464 @@ private:
 		OP  // evaluate rows by following the obj-pred pointers
 	};
 
-	// iterator class for producing evaluation results
+public:
+	/*
+	* Statistics about the whole database. The distinct terms counted
+	* include any whose triples have all been removed, until the dead
+	* rows are purged.
+	*/
+	struct Statistics
+	{
+		size_t num_triples;
+		size_t num_subjects, num_predicates, num_objects;  // distinct ones
+	};
+
+	/*
+	* Statistics about the triples with a single predicate.
+	*/
+	struct PredicateStatistics
+	{
+		size_t num_triples;
+		size_t num_subjects, num_objects;  // distinct ones
+
+		// the average number of triples per subject (resp. object),
+		// or 0 if there are none
+		double subject_fan_out() const;
+		double object_fan_out() const;
+	};
+
+	/*
+	* A read-only view of the database as it was when `snapshot` was
+	* called. Unlike the index itself, this can be read from other
+	* threads while one thread keeps adding triples (using `add` or
+	* `bulk_load`): the triples added after the snapshot was taken are
+	* just invisible to it.
+	* This works because rows are only ever appended, and the linked
+	* lists always run from newest to oldest. So the snapshot only
+	* needs to remember how many rows there were, and skip any newer
+	* rows it comes across. See also `FlatHashTable::View`.
+	* Note: all other modifications (`remove`, `compact`, and the
+	* concurrent insertion functions) still require that nobody else
+	* is using the index.
+	* Iterators returned by a snapshot shouldn't outlive it.
+	*/
+	class Snapshot
+	{
+	public:
+		/*
+		* Create an iterator to begin evaluation over
+		* a certain pattern (the returned triples will
+		* satisfy this).
+		*/
+		std::unique_ptr<ICodedVarMapIterator> evaluate(CodedTriplePattern pattern) const;
+
+		/*
+		* Like `evaluate`, but return the matching triples themselves,
+		* rather than binding the pattern's variables to them. This is
+		* for joins which bind the variables themselves (see
+		* `VariableSlots`), so that no map is built per triple.
+		* The iterator can be rebound to other patterns (see
+		* `IMatchIterator`) while this snapshot exists.
+		*/
+		std::unique_ptr<IMatchIterator> match(const CodedTriplePattern& pattern) const;
+
+		/*
+		* Perform a basic full scan over the RDF database.
+		* Note that this functionality is NOT encapsulated by `evaluate`,
+		* because in order to do a full scan using `evaluate`, you necessarily
+		* have to bind variables with names, whereas this function has
+		* nothing to do with variables.
+		*/
+		std::unique_ptr<ICodedTripleIterator> full_scan() const;
+
+		/*
+		* Get the statistics which the index keeps up-to-date as triples
+		* are added and removed. These take constant time.
+		* The statistics of a predicate with no triples are all zero.
+		*/
+		Statistics statistics() const;
+		PredicateStatistics predicate_statistics(CodedResource pred) const;
+
+		/*
+		* Estimate the number of triples matching `pattern`, in constant
+		* time, from the statistics. Variables in `bound` are treated as
+		* if they had already been bound to some unknown value (e.g. by
+		* an outer loop of a join) so that the estimate is per binding,
+		* and so are variables which appear again later in the pattern.
+		* Constants are looked up exactly (including the number of
+		* triples in their (sub, pred) or (obj, pred) pair) and bound
+		* values are assumed to be spread evenly, over the predicate's
+		* distinct subjects and objects if the predicate is known, or
+		* else over all of them.
+		*/
+		double estimate_cardinality(const CodedTriplePattern& pattern,
+			const CodedVarMap& bound = CodedVarMap()) const;
+
+		/*
+		* Like `estimate_cardinality`, but estimate the number of rows
+		* which `evaluate` reads to find the matches, including any that
+		* it then skips because they don't match (e.g. when the pattern
+		* repeats a variable, or only its subject and object are known,
+		* so only one of their lists can be followed).
+		*/
+		double estimate_scan(const CodedTriplePattern& pattern,
+			const CodedVarMap& bound = CodedVarMap()) const;
+
+		/*
+		* Describe how `match` finds the matches of `pattern` (with
+		* the variables in `bound` known, as for `estimate_cardinality`):
+		* the index used to find the first row, and how the rest are
+		* read (see `plan_pattern`), or which sorted copy is read.
+		* This is for EXPLAIN ANALYZE.
+		*/
+		std::string describe_access(const CodedTriplePattern& pattern,
+			const CodedVarMap& bound = CodedVarMap()) const;
+
+	private:
+		friend class RDFIndex;
+
+		// the implementation of `estimate_cardinality` and `estimate_scan`
+		double estimate(const CodedTriplePattern& pattern, const CodedVarMap& bound,
+			bool scanned) const;
+
+		explicit Snapshot(const RDFIndex& idx);
+
+		/*
+		* This function takes a pattern, and chooses (i) which, if any,
+		* index to use to find the first element, and (ii) which, if any,
+		* linked list structure to follow to evaluate the triples.
+		* If the first element of the returned pair is none, start from
+		* the start. Otherwise use the index on the relevant term type.
+		*/
+		std::pair<RDFIndex::IndexType, EvaluationType> plan_pattern(const CodedTriplePattern& pattern) const;
+
+		/*
+		* Find the first row to read to evaluate `pattern` (or
+		* `TABLE_END` if nothing matches), and how to go on from there,
+		* using `plan_pattern`.
+		*/
+		std::pair<rdf_idx_helper::TableIterator, EvaluationType> locate(
+			const CodedTriplePattern& pattern) const;
+
+	private:
+		// the table and pair heads never move, so can be used directly
+		const RDFIndex& m_idx;
+
+		// the number of rows which had been added at the time
+		const rdf_idx_helper::TableIterator m_size;
+
+		// the statistics as of `m_size` rows
+		const Statistics m_stats;
+
+		// these keep the indices' arrays alive, even if they grow
+		rdf_idx_helper::SingleIndex::View m_sub_index, m_pred_index, m_obj_index;
+		rdf_idx_helper::PairIndex::View m_sp_index, m_op_index;
+		rdf_idx_helper::TripleIndex::View m_triple_index;
+		rdf_idx_helper::PredicateStatsIndex::View m_pred_stats;
+		std::shared_ptr<const SortedIndex> m_sorted;
+	};
+
+	RDFIndex();
+
+	// the triple index refers to `m_triples`, so don't copy
+	RDFIndex(const RDFIndex&) = delete;
+	RDFIndex& operator=(const RDFIndex&) = delete;
+
+	/*
+	* Add a coded triple to the database.
+	* Other threads may read `Snapshot`s while this happens.
+	*/
+	void add(CodedTriple t);
+
+	/*
+	* Remove a coded triple from the database, returning false if
+	* it wasn't present. The triple's row is only marked dead, and
+	* is skipped during evaluation, so this is constant time. Once
+	* too many rows are dead, they are purged by rebuilding the
+	* table (see `purge_dead_rows`), so that evaluation doesn't
+	* slow down.
+	* WARNING: invalidates any currently-alive iterators.
+	*/
+	bool remove(CodedTriple t);
+
+	/*
+	* Add all of the triples produced by the given iterator to
+	* the database. This is equivalent to calling `add` on each
+	* of them, but is much faster for large inputs: the triples
+	* are buffered, deduplicated by sorting, and then the table
+	* and all of its linked lists are built in a few linear passes,
+	* rather than with several hash lookups per triple.
+	* Returns the number of triples read from the iterator
+	* (including duplicates).
+	* Other threads may read `Snapshot`s while this happens, and the
+	* new triples become visible to new snapshots all at once, at
+	* the end.
+	*/
+	size_t bulk_load(ICodedTripleIterator& triples);
+	size_t bulk_load(std::vector<CodedTriple> triples);
+
+	/*
+	* Batched insertion, for triples which arrive a batch at a time
+	* (see `pipelined_load`), so that each batch can be inserted while
+	* the next is still being produced. Usage: call
+	* `begin_batched_load`, then `add_batch` with each batch, and then
+	* `end_batched_load`, or `abort_batched_load` if the load failed
+	* part-way. Nothing else may modify the index in between.
+	* Each batch is inserted as by `bulk_load`, but the new triples
+	* only become visible to snapshots (and are only written to the
+	* log) in `end_batched_load`, all at once, so other threads may
+	* read `Snapshot`s throughout.
+	* `abort_batched_load` marks the rows added since
+	* `begin_batched_load` dead, as if their triples had been removed
+	* (see `remove`), so the database holds the same triples as
+	* before.
+	*/
+	void begin_batched_load();
+	void add_batch(std::vector<CodedTriple> triples);
+	void end_batched_load();
+	void abort_batched_load();
+
+	/*
+	* Concurrent insertion, following the Motik et al. paper cited in
+	* `dbsi_rdf_index_helper.h`. Usage: call `begin_concurrent_add`
+	* with an upper bound on the number of triples which will be
+	* added, then any number of threads may call `concurrent_add` at
+	* the same time, and once they have all finished, call
+	* `end_concurrent_add`. No other member functions may be called
+	* in between.
+	* Rows are appended by reserving them with an atomic counter, and
+	* all of the linked lists are updated by compare-and-swap on their
+	* heads, so no locks are taken (except that a thread may briefly
+	* wait for another to finish creating a hash table entry, see
+	* `FlatHashTable::insert_concurrent`).
+	* To make this possible, all of the indices are allocated up-front,
+	* for the worst case of every triple being distinct, and only
+	* shrunk again by `end_concurrent_add`.
+	* WARNING: invalidates any currently-alive iterators.
+	*/
+	void begin_concurrent_add(size_t max_new_triples);
+
+	/*
+	* Add a coded triple to the database. Thread-safe with respect to
+	* other calls to `concurrent_add` only (see above).
+	* Returns false if the triple was already present.
+	*/
+	bool concurrent_add(const CodedTriple& t);
+
+	/*
+	* Finish concurrent insertion; see `begin_concurrent_add`.
+	*/
+	void end_concurrent_add();
+
+	/*
+	* Like `bulk_load`, but inserts the triples using `num_threads`
+	* threads from `pool` (this one included) calling `concurrent_add`.
+	* Returns the number of triples read from the iterator
+	* (including duplicates).
+	* WARNING: invalidates any currently-alive iterators.
+	*/
+	size_t parallel_load(ICodedTripleIterator& triples, ThreadPool& pool, size_t num_threads);
+	size_t parallel_load(const std::vector<CodedTriple>& triples, ThreadPool& pool, size_t num_threads);
+
+	/*
+	* Purge any dead rows, and then build sorted copies of the table
+	* (see `SortedIndex`), which will be used by `evaluate` from now
+	* on, until the next time a triple is added or removed. This
+	* trades memory, and the time taken to sort, for faster
+	* evaluation.
+	*/
+	void compact();
+
+	/*
+	* Returns true iff `compact` has been called since the last
+	* time a triple was added or removed.
+	*/
+	bool is_compact() const;
+
+	/*
+	* Write the whole index (except for the sorted index, which can
+	* be rebuilt with `compact`) to an image; see `dbsi_image.h`.
+	*/
+	void save(ImageWriter& out) const;
+
+	/*
+	* Replace the contents of the index with those of an image. The
+	* image's arrays are used in place, so this takes constant time,
+	* and they are only copied (a page at a time, by the OS) if they
+	* are modified.
+	* If this fails (with `std::runtime_error`), the index must be
+	* cleared before it is used again.
+	* WARNING: invalidates any currently-alive iterators.
+	*/
+	void open(ImageReader& in);
+
+	/*
+	* Remove all triples.
+	* WARNING: invalidates any currently-alive iterators.
+	*/
+	void clear();
+
+	// the number of triples in the database
+	size_t size() const;
+
+	/*
+	* If `log` is non-null, every triple added or removed from now on
+	* (by any of the functions above) is appended to it; see
+	* `dbsi_log.h`. Nothing else may be using the index meanwhile.
+	*/
+	void set_log(WriteAheadLog* log);
+
+	/*
+	* Take a snapshot of the database as it is now, which can be
+	* read from any thread. See `Snapshot`.
+	*/
+	Snapshot snapshot() const;
+
+	/*
+	* Shorthands for `snapshot().evaluate(pattern)` and
+	* `snapshot().full_scan()`, for when nothing else is
+	* modifying the index.
+	*/
+	std::unique_ptr<ICodedVarMapIterator> evaluate(CodedTriplePattern pattern) const;
+	std::unique_ptr<ICodedTripleIterator> full_scan() const;
+
+	/*
+	* Shorthand for `snapshot().estimate_cardinality(pattern, bound)`.
+	*/
+	double estimate_cardinality(const CodedTriplePattern& pattern,
+		const CodedVarMap& bound = CodedVarMap()) const;
+
+private:
+	// iterator class for producing the triples which match a pattern
 	class IndexIterator :
-		public ICodedVarMapIterator
+		public IMatchIterator
 	{
 	public:
-		IndexIterator(
-			const rdf_idx_helper::Table& triples,
-			CodedTriplePattern pattern,
-			rdf_idx_helper::TableIterator start_idx,
-			EvaluationType eval_type);
+		/*
+		* Iterate over the triples of `snapshot` matching `pattern`.
+		* Only the rows of the table which existed when the snapshot
+		* was taken are returned.
+		*/
+		IndexIterator(const Snapshot& snapshot, const CodedTriplePattern& pattern);
 
 		void start() override;
-		CodedVarMap current() const override;
+		CodedTriple current() const override;
 		void next() override;
 		bool valid() const override;
+		void next_batch(ColumnBatch& batch) override;
+		void rebind(const CodedTriplePattern& pattern) override;
+		size_t rows_scanned() const override;
 
 	private:
 		void increment_idx();
 		void inc_till_pattern_match();
+		void match_cur_row();
 
 	private:
+		const Snapshot& m_snapshot;
 		const rdf_idx_helper::Table& m_triples;
-		const EvaluationType m_eval_type;
-		const CodedTriplePattern m_pattern;
-		const rdf_idx_helper::TableIterator m_start_idx;
+		const rdf_idx_helper::TableIterator m_size;
+
+		// these depend on the pattern. `m_pair_heads` is only used
+		// when following `Link`s, so is the SP (resp. OP) pair heads
+		// if `m_eval_type` is SP (resp. OP), and null otherwise
+		const rdf_idx_helper::PairHeads* m_pair_heads;
+		EvaluationType m_eval_type;
+		TripleMatcher<CodedResource> m_matcher;
+		rdf_idx_helper::TableIterator m_start_idx;
+
 		rdf_idx_helper::TableIterator m_cur_idx;
 
 		/*
-		* invariant: m_cur_map = bind(m_pattern, m_triples[m_cur_idx])
-		* if valid(), else m_cur_map is std::nullopt if !valid()
+		* invariant: if valid(), m_cur_matches iff the row
+		* m_triples[m_cur_idx] is alive, below `m_size`, and matches
+		* the pattern
 		*/
-		std::optional<CodedVarMap> m_cur_map;
+		bool m_cur_matches;
+
+		size_t m_rows_scanned;
 	};
 
-public:
 	/*
-	* Add a coded triple to the database.
-	* WARNING: invalidates any currently-alive iterators.
-	* Please do not insert while you read!
+	* The implementation of `bulk_load`, given the buffered triples.
 	*/
-	void add(CodedTriple t);
+	void bulk_insert(std::vector<CodedTriple> buffer);
 
 	/*
-	* Create an iterator to begin evaluation over
-	* a certain pattern (the returned triples will
-	* satisfy this).
+	* The implementation of `bulk_insert` and `add_batch`: append the
+	* new triples of `buffer` and link them in, but leave making them
+	* visible to snapshots to the caller (see `publish`).
 	*/
-	std::unique_ptr<ICodedVarMapIterator> evaluate(CodedTriplePattern pattern) const;
+	void insert_batch(std::vector<CodedTriple> buffer);
 
 	/*
-	* Perform a basic full scan over the RDF database.
-	* Note that this functionality is NOT encapsulated by `evaluate`,
-	* because in order to do a full scan using `evaluate`, you necessarily
-	* have to bind variables with names, whereas this function has
-	* nothing to do with variables.
+	* Rebuild the table and all of the indices from only the live
+	* rows, so that dead rows no longer need to be skipped.
 	*/
-	std::unique_ptr<ICodedTripleIterator> full_scan() const;
+	void purge_dead_rows();
+
+	/*
+	* Insert `row` (which holds `t`) into the triple index. If `t`
+	* is already there, its row must be dead, and is replaced.
+	*/
+	void insert_triple_index(const CodedTriple& t, rdf_idx_helper::TableIterator row);
+
+	/*
+	* Add `delta` (which may be "negative", i.e. wrap around) to the
+	* size of pair `id` in `pair_sizes`, and if the pair becomes empty
+	* or nonempty, update `distinct` (i.e. the number of distinct
+	* subjects, for the SP pairs, or objects, for the OP pairs) in the
+	* statistics of `pred`.
+	*/
+	void add_to_pair_size(rdf_idx_helper::PairSizes& pair_sizes,
+		rdf_idx_helper::PairID id, CodedResource pred,
+		rdf_idx_helper::TableIterator rdf_idx_helper::PredicateStats::* distinct,
+		rdf_idx_helper::TableIterator delta);
 
-private:
 	/*
-	* This function takes a pattern, and chooses (i) which, if any,
-	* index to use to find the first element, and (ii) which, if any,
-	* linked list structure to follow to evaluate the triples.
-	* If the first element of the returned pair is none, start from
-	* the start. Otherwise use the index on the relevant term type.
+	* The thread-safe version of `add_to_pair_size` for
+	* `concurrent_add`, which can only add.
 	*/
-	std::pair<RDFIndex::IndexType, EvaluationType> plan_pattern(CodedTriplePattern pattern) const;
+	void add_to_pair_size_concurrent(rdf_idx_helper::PairSizes& pair_sizes,
+		rdf_idx_helper::PairID id, CodedResource pred,
+		rdf_idx_helper::TableIterator rdf_idx_helper::PredicateStats::* distinct,
+		rdf_idx_helper::TableIterator delta);
+
+	/*
+	* Make all of the rows added so far, and the statistics, visible
+	* to new snapshots; see `Snapshot`.
+	*/
+	void publish();
+
+	/*
+	* Append the triples in rows `first` onwards to `m_log` (if any),
+	* as having been added.
+	*/
+	void log_rows_from(rdf_idx_helper::TableIterator first);
+
+	/*
+	* Set, or get, `m_sorted`, which snapshots may be getting at the
+	* same time.
+	*/
+	void set_sorted(std::shared_ptr<const SortedIndex> sorted);
+	std::shared_ptr<const SortedIndex> sorted() const;
+
+	/*
+	* Helper for `bulk_load`. Given some newly appended table rows,
+	* sorted so that rows with equal `term` are adjacent, and within
+	* those, rows with equal `pred` are adjacent, this links them
+	* into the `next` linked lists, and updates the corresponding
+	* single and pair indices, exactly as if they had been inserted
+	* with `add`.
+	*/
+	void link_pair_chains(const std::vector<rdf_idx_helper::TableIterator>& rows,
+		const SegmentedVector<CodedResource>& term,
+		SegmentedVector<rdf_idx_helper::Link>& next,
+		rdf_idx_helper::SingleIndex& single_index,
+		rdf_idx_helper::PairIndex& pair_index,
+		rdf_idx_helper::PairHeads& pair_heads,
+		rdf_idx_helper::PairSizes& pair_sizes,
+		rdf_idx_helper::TableIterator rdf_idx_helper::PredicateStats::* distinct);
 
 	/*
 	* This function will test whether the RDF index satisfies
@@ -122,10 +520,53 @@ private:
 	rdf_idx_helper::Table m_triples;
 	rdf_idx_helper::SingleIndex m_sub_index, m_pred_index, m_obj_index;
 	rdf_idx_helper::PairIndex m_sp_index, m_op_index;
+	rdf_idx_helper::PairHeads m_sp_heads, m_op_heads;
 	rdf_idx_helper::TripleIndex m_triple_index;
+
+	// see `Statistics` and `PredicateStatistics`. the pair sizes
+	// are parallel to the pair heads
+	rdf_idx_helper::PairSizes m_sp_sizes, m_op_sizes;
+	rdf_idx_helper::PredicateStatsIndex m_pred_stats;
+
+	// if non-null, then it is up-to-date with `m_triples`. snapshots
+	// share it, so it is guarded by `m_sorted_mutex` (see `sorted`)
+	std::shared_ptr<const SortedIndex> m_sorted;
+	mutable std::mutex m_sorted_mutex;
+
+	// the number of rows which snapshots can see, which is only
+	// updated once they are all linked in
+	std::atomic<size_t> m_published_size;
+
+	// the global statistics which snapshots can see, which are also
+	// only updated by `publish`
+	std::atomic<size_t> m_published_num_triples, m_published_num_subjects,
+		m_published_num_preds, m_published_num_objects;
+
+	// the number of dead rows in `m_triples`
+	size_t m_num_dead;
+
+	// between `begin_concurrent_add` and `end_concurrent_add`, these
+	// are the true sizes of `m_triples`, `m_sp_heads` and `m_op_heads`
+	// (which are allocated with room to spare)
+	std::atomic<size_t> m_num_rows, m_num_sp_pairs, m_num_op_pairs;
+
+	// the number of rows before `begin_concurrent_add`, or
+	// `begin_batched_load`
+	size_t m_first_concurrent_row;
+
+	WriteAheadLog* m_log;
 };
 
 
+/*
+* Bind the variables of `pattern` to each of the triples returned by
+* `matches`, which must all match it (as `RDFIndex::Snapshot::evaluate`
+* does, for the triples returned by `match`).
+*/
+std::unique_ptr<ICodedVarMapIterator> bind_matches(CodedTriplePattern pattern,
+	std::unique_ptr<ICodedTripleIterator> matches);
+
+
 }  // namespace dbsi
 
 
@@ -3,9 +3,10 @@
 
 
 #include <vector>
-#include <variant>
-#include <unordered_map>
+#include <atomic>
 #include "dbsi_types.h"
+#include "dbsi_flat_hash_map.h"
+#include "dbsi_segmented_vector.h"
 
 
 /*
@@ -15,47 +16,65 @@
 * of Datalog Programs in Centralised, Main-Memory RDF Systems. Proc. of the 28th AAAI Conf.
 * on Artificial Intelligence (AAAI 2014), pages 129137, Quebec City, Quebec, Canada, July 27
 * 31 2014. AAAI Press.
-* 
-* The purpose of this file is to 'construct' the types used
-* for indexing in the RDFIndex class. This is nontrivial because
-* the types are circular: the indices hold iterators to the table,
-* and the table holds iterators to the indices.
-* 
+*
+* The purpose of this file is to define the types used for
+* indexing in the RDFIndex class.
+*
 * The ultimate takeaway from this file are the types `Table`,
 * `SingleIndex` and `PairIndex`. They are as follows.
-* 
-* `Table` is a vector of `TripleRows`. A `TripleRow` has a coded
-* triple, and three pointer-like objects.
-* 
+*
+* `Table` stores its six columns separately (a "structure of
+* arrays") so that following one of the linked lists below only
+* touches the column of pointers being followed, plus whichever
+* columns of the triple are actually being read. Each row has a
+* coded triple, and three pointer-like objects.
+*
+* Rows can also be marked dead ("tombstoned") when their triple is
+* removed, which leaves all of the linked lists intact; readers just
+* skip them. See `RDFIndex::remove`.
+*
 * Note: throughout this file, "table iterators" are a synonym for
 * plain-old offsets. We cannot use std::vector iterators because
 * they are invalidated on reallocation!
 *
+* The columns, and the pair heads below, are `SegmentedVector`s, so
+* that they can be read by other threads while rows are appended;
+* see `RDFIndex::Snapshot`. Rows are only ever appended, and each
+* is fully written before anything points to it, so readers just
+* need to read the heads of the lists atomically (see
+* `load_acquire` and `store_release`).
+*
 * The first of these, `n_p`, is an iterator pointing to another
 * element in the table which has the same `pred` value, in such
 * a way that all triples with the same predicate can be reached
 * by starting from the 'correct' start point.
 * The 'correct' start point for a given predicate is given precisely
 * in the `SingleIndex` corresponding to `pred`.
-* 
+*
 * The other two pointers, `n_sp` and `n_op`, are like `n_p` insofar as
 * they represent all triples with a given `sub` (or `obj`, resp.)
 * but they are grouped by `pred`.
-* An important difference is that these pointers come in exactly
-* one of two forms. A table iterator or a PairIndexIterator.
-* 
-* In the former case, the value of `pred` changes, so instead you must
-* go *via* the PairIndexIterator to reach the corresponding table
-* entry.
+* An important difference is that these pointers are `Link`s, which
+* come in exactly one of two forms, distinguished by their top bit:
+* a table iterator, or the ID of an entry in the pair index.
+*
+* In the latter case, the value of `pred` changes, so instead you must
+* go *via* the pair index to reach the corresponding table entry.
+* Pair index IDs are offsets into a dense array `PairHeads` of table
+* iterators, holding the first row of each (sub, pred) or (obj, pred)
+* group.
 * Note: understanding this, it is clear that you never really need to
 * treat these pointers as anything other than a table iterator. This
-* is exactly right! So, to make this as convenient as possible, a
-* visitor struct `TripleRowVisitor`.
-* 
+* is exactly right! So, to make this as convenient as possible, use
+* `resolve_link`.
+*
 * It has been designed this way to make insertion of triples easy.
 * It, crucially, has the effect that you can alter the start point
 * of the pair index (if a new triple is inserted) without altering
 * all of the table entries which point to that element!
+* For the same reason, the `sub` and `obj` single indices hold a
+* `Link` to the pair group at the front of their list, rather than
+* a table iterator.
 */
 
 
@@ -65,114 +84,265 @@ namespace rdf_idx_helper
 {
 
 
-template<typename ParentT>
-struct TableHelper
+// offsets have the same width as coded resources, see `DBSI_32_BIT_IDS`
+typedef CodedResource TableIterator;
+typedef CodedResource PairID;
+typedef CodedResource Link;
+
+
+// representing a null offset / invalid table iterator
+static const TableIterator TABLE_END = static_cast<TableIterator>(-1);
+
+
+// the top bit of a `Link` is set iff it is a `PairID`
+// (TABLE_END is never considered to be a pair link)
+static const Link LINK_PAIR_TAG = ~(static_cast<Link>(-1) >> 1);
+
+
+// the maximum number of rows in the table (and hence of pairs)
+// such that every row can be referred to by a `Link`
+static const size_t MAX_TABLE_SIZE = LINK_PAIR_TAG - 1;
+
+
+inline Link pair_link(PairID id)
+{
+	return LINK_PAIR_TAG | id;
+}
+
+
+inline bool is_pair_link(Link l)
+{
+	return (l & LINK_PAIR_TAG) != 0 && l != TABLE_END;
+}
+
+
+/*
+* Read (resp. write) a list head which may be written (resp. read)
+* by another thread at the same time. The release-store makes sure
+* that the rows being pointed to have been fully written before
+* anyone can follow the pointer.
+*/
+inline TableIterator load_acquire(const TableIterator& head)
 {
-	typedef size_t TableIterator;
+	return std::atomic_ref<TableIterator>(const_cast<TableIterator&>(head))
+		.load(std::memory_order_acquire);
+}
+inline void store_release(TableIterator& head, TableIterator value)
+{
+	std::atomic_ref<TableIterator>(head).store(value, std::memory_order_release);
+}
+
+
+typedef SegmentedVector<TableIterator> PairHeads;
+
+
+// the number of live triples in each pair, indexed by `PairID`
+typedef SegmentedVector<TableIterator> PairSizes;
+
+
+/*
+* Obtain the table iterator referred to by the given link, going
+* via the pair heads if necessary (which may be TABLE_END).
+* Its usage will almost always be one of:
+* resolve_link(my_table.n_sp[i], my_sp_heads)
+* resolve_link(my_table.n_op[i], my_op_heads)
+*/
+inline TableIterator resolve_link(Link l, const PairHeads& heads)
+{
+	return is_pair_link(l) ? load_acquire(heads[l & ~LINK_PAIR_TAG]) : l;
+}
+
+
+struct Table
+{
+	SegmentedVector<CodedResource> sub, pred, obj;
+	SegmentedVector<Link> n_sp, n_op;
+	SegmentedVector<TableIterator> n_p;
+
+	// nonzero for rows whose triple has been removed. this is
+	// either empty (if no row has been removed) or has a byte for
+	// every row, so that tables which never have rows removed
+	// don't pay for it
+	SegmentedVector<std::uint8_t> dead;
+
+	size_t size() const { return sub.size(); }
+	bool empty() const { return sub.empty(); }
 
-	struct SingleIndexIterator :
-		public ParentT::SingleIndexIterator
+	bool is_dead(TableIterator i) const
 	{
-		SingleIndexIterator() = default;
-		SingleIndexIterator(typename ParentT::SingleIndexIterator i) :
-			ParentT::SingleIndexIterator(i)
-		{ }
-	};
-	struct PairIndexIterator :
-		public ParentT::PairIndexIterator
+		return !dead.empty() && dead[i] != 0;
+	}
+
+	CodedTriple triple(TableIterator i) const
 	{
-		PairIndexIterator() = default;
-		PairIndexIterator(typename ParentT::PairIndexIterator i) :
-			ParentT::PairIndexIterator(i)
-		{ }
-	};
-
-	typedef std::variant<PairIndexIterator, TableIterator> IndexTableIterVariant;
-	struct TripleRow
+		return { sub[i], pred[i], obj[i] };
+	}
+
+	void push_back(const CodedTriple& t, Link next_sp, Link next_op, TableIterator next_p)
 	{
-		TripleRow(CodedTriple t, IndexTableIterVariant n_sp,
-			IndexTableIterVariant n_op, TableIterator n_p) :
-			t(std::move(t)), n_sp(std::move(n_sp)),
-			n_op(std::move(n_op)), n_p(std::move(n_p))
-		{ }
-		CodedTriple t;
-		IndexTableIterVariant n_sp, n_op;
-		TableIterator n_p;
-	};
-
-	typedef std::vector<TripleRow> Table;
-};
+		sub.push_back(t.sub);
+		pred.push_back(t.pred);
+		obj.push_back(t.obj);
+		n_sp.push_back(next_sp);
+		n_op.push_back(next_op);
+		n_p.push_back(next_p);
+		if (!dead.empty())
+			dead.push_back(0);
+	}
 
+	// new rows have null pointers
+	void resize(size_t n)
+	{
+		sub.resize(n);
+		pred.resize(n);
+		obj.resize(n);
+		n_sp.resize(n, TABLE_END);
+		n_op.resize(n, TABLE_END);
+		n_p.resize(n, TABLE_END);
+		if (!dead.empty())
+			dead.resize(n, 0);
+	}
 
-struct IndexHelper :
-	public TableHelper<IndexHelper>
-{
-	struct SingleTermIndexEntry
+	void reserve(size_t n)
 	{
-		TableIterator offset;  // pointer to head
-		size_t size;  // total number of elements
-
-		// invariant: size == 0 iff offset == end
-	};
-
-	/*
-	* note: single index is unordered map here, rather than vector,
-	* differing from the paper's implementation, because we want resizing
-	* to preserve iterators.
-	*/
-	typedef std::unordered_map<CodedResource, SingleTermIndexEntry> SingleIndex;
-	typedef std::unordered_map<std::pair<CodedResource, CodedResource>, TableIterator> PairIndex;
-
-	struct SingleIndexIterator :
-		public SingleIndex::const_iterator
+		sub.reserve(n);
+		pred.reserve(n);
+		obj.reserve(n);
+		n_sp.reserve(n);
+		n_op.reserve(n);
+		n_p.reserve(n);
+		if (!dead.empty())
+			dead.reserve(n);
+	}
+
+	void shrink_to_fit()
 	{
-		SingleIndexIterator() = default;
-		SingleIndexIterator(typename SingleIndex::const_iterator i) :
-			SingleIndex::const_iterator(i)
-		{ }
-	};
-	struct PairIndexIterator :
-		public PairIndex::const_iterator
+		sub.shrink_to_fit();
+		pred.shrink_to_fit();
+		obj.shrink_to_fit();
+		n_sp.shrink_to_fit();
+		n_op.shrink_to_fit();
+		n_p.shrink_to_fit();
+		dead.shrink_to_fit();
+	}
+
+	void clear()
+	{
+		sub.clear();
+		pred.clear();
+		obj.clear();
+		n_sp.clear();
+		n_op.clear();
+		n_p.clear();
+		dead.clear();
+	}
+
+	// see `SegmentedVector::save` and `SegmentedVector::open`
+	void save(ImageWriter& out) const
 	{
-		PairIndexIterator() = default;
-		PairIndexIterator(typename PairIndex::const_iterator i) :
-			PairIndex::const_iterator(i)
-		{ }
-	};
+		sub.save(out);
+		pred.save(out);
+		obj.save(out);
+		n_sp.save(out);
+		n_op.save(out);
+		n_p.save(out);
+		dead.save(out);
+	}
+	void open(ImageReader& in)
+	{
+		sub.open(in);
+		pred.open(in);
+		obj.open(in);
+		n_sp.open(in);
+		n_op.open(in);
+		n_p.open(in);
+		dead.open(in);
+
+		const size_t n = sub.size();
+		if (pred.size() != n || obj.size() != n || n_sp.size() != n
+			|| n_op.size() != n || n_p.size() != n || (!dead.empty() && dead.size() != n))
+			throw std::runtime_error("Corrupted image: bad table.");
+	}
+};
+
+
+struct SingleTermIndexEntry
+{
+	// pointer to head. this is a pair link for the `sub` and
+	// `obj` indices, and a table iterator for the `pred` index.
+	Link offset;
+	TableIterator size;  // total number of live (not dead) elements
+
+	// invariant: offset == end implies size == 0 (but not
+	// conversely, because the list may only contain dead rows)
 };
 
 
-using Table = typename IndexHelper::Table;
-using TableIterator = typename IndexHelper::TableIterator;
-using SingleIndex = typename IndexHelper::SingleIndex;
-using PairIndex = typename IndexHelper::PairIndex;
-using TripleIndex = std::unordered_map<CodedTriple, TableIterator>;
-using TripleRow = IndexHelper::TripleRow;
-using IndexTableIterVariant = IndexHelper::IndexTableIterVariant;
-using SingleTermIndexEntry = IndexHelper::SingleTermIndexEntry;
+/*
+* Adjust a size (e.g. `entry.size`), which snapshots may be reading at
+* the same time (as it's only a statistic, no ordering is needed).
+*/
+inline void add_to_size(TableIterator& size, TableIterator delta)
+{
+	std::atomic_ref<TableIterator> atomic_size(size);
+	atomic_size.store(atomic_size.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+inline void add_to_size(SingleTermIndexEntry& entry, TableIterator delta)
+{
+	add_to_size(entry.size, delta);
+}
 
 
-// representing a null offset / invalid table iterator
-static const TableIterator TABLE_END = static_cast<TableIterator>(-1);
+/*
+* Statistics about the triples with a given predicate, which are kept
+* up-to-date in the same way as the sizes above. Together with the
+* size of the predicate's single index entry, these give its average
+* fan-out.
+*/
+struct PredicateStats
+{
+	// the number of (sub, pred) (resp. (obj, pred)) pairs with at least
+	// one live triple, i.e. the number of distinct subjects (resp. objects)
+	TableIterator num_subjects, num_objects;
+};
+
+
+/*
+* note: these are all flat (open addressing) hash tables, so insertion
+* may move their elements. This is fine because nothing refers to
+* their elements by address: in particular, the table refers to pairs
+* by their `PairID`, which is an offset into the `PairHeads` array.
+*/
+typedef FlatHashMap<CodedResource, SingleTermIndexEntry> SingleIndex;
+typedef FlatHashMap<std::pair<CodedResource, CodedResource>, PairID> PairIndex;
+typedef FlatHashMap<CodedResource, PredicateStats> PredicateStatsIndex;
 
 
 /*
-* This struct has an explanation at the top of the file. But
-* its usage will almost always be one of:
-* std::visit(TripleRowVisitor(), my_triple_row.n_sp)
-* std::visit(TripleRowVisitor(), my_triple_row.n_op)
+* The triple index is a set of table iterators, which are hashed and
+* compared via the triple stored in that row of the table. This way,
+* each triple costs one table iterator in the index (plus a control
+* byte), rather than a copy of the triple.
 */
-struct TripleRowVisitor
+struct TripleIndexPolicy
 {
-	TableIterator operator()(const PairIndex::const_iterator& iter) const
+	const Table* table;
+
+	size_t hash(const CodedTriple& t) const
+	{
+		return std::hash<CodedTriple>()(t);
+	}
+	size_t hash_slot(const TableIterator& row) const
 	{
-		return iter->second;
+		return hash(table->triple(row));
 	}
-	TableIterator operator()(const TableIterator& iter) const
+	bool equal(const TableIterator& row, const CodedTriple& t) const
 	{
-		return iter;
+		// a removed triple's row is replaced if it is added again
+		return table->triple(load_acquire(row)) == t;
 	}
 };
+typedef FlatHashTable<TableIterator, TripleIndexPolicy> TripleIndex;
 
 
 }  // namespace rdf_idx_helper
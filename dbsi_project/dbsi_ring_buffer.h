@@ -0,0 +1,133 @@
+#ifndef DBSI_RING_BUFFER_H
+#define DBSI_RING_BUFFER_H
+
+
+#include <vector>
+#include <atomic>
+#include <limits>
+#include "dbsi_assert.h"
+
+
+namespace dbsi
+{
+
+
+/*
+* A bounded queue from one producer thread to one consumer thread
+* (such as between two stages of a pipeline), which doesn't lock:
+* each end only ever writes its own index, and the slots between the
+* indices belong to whichever end is about to read or write them.
+*
+* When the queue is full, `push` waits for the consumer to catch up
+* (so a slow stage holds back the ones before it, rather than letting
+* them fill memory), and when it is empty, `pop` waits for the
+* producer. Waiting is done with `std::atomic::wait`, so doesn't spin.
+*
+* Either end can close the queue: the producer once it has pushed
+* everything (after which `pop` returns false once the queue is
+* empty), or the consumer if it is giving up (after which `push`
+* returns false).
+*/
+template<typename T>
+class RingBuffer
+{
+public:
+	explicit RingBuffer(size_t capacity) :
+		m_slots(capacity),
+		m_head(0),
+		m_tail(0)
+	{
+		DBSI_CHECK_PRECOND(capacity > 0);
+	}
+
+	RingBuffer(const RingBuffer&) = delete;
+	RingBuffer& operator=(const RingBuffer&) = delete;
+
+	/*
+	* Add `item` to the back, waiting for room if necessary. Returns
+	* false (without adding it) if the consumer has closed the queue.
+	* Only the producer may call this.
+	*/
+	bool push(T&& item)
+	{
+		const size_t tail = m_tail.load(std::memory_order_relaxed);
+		while (true)
+		{
+			const size_t head = m_head.load(std::memory_order_acquire);
+			if (head & CLOSED)
+				return false;
+			if (tail - head < m_slots.size())
+				break;
+			m_head.wait(head, std::memory_order_acquire);
+		}
+
+		m_slots[tail % m_slots.size()] = std::move(item);
+		m_tail.store(tail + 1, std::memory_order_release);
+		m_tail.notify_one();
+		return true;
+	}
+
+	/*
+	* Take the item at the front into `out`, waiting for one if
+	* necessary. Returns false if the producer has closed the queue,
+	* and it is empty.
+	* Only the consumer may call this.
+	*/
+	bool pop(T& out)
+	{
+		const size_t head = m_head.load(std::memory_order_relaxed);
+		while (true)
+		{
+			const size_t tail = m_tail.load(std::memory_order_acquire);
+			if ((tail & ~CLOSED) != head)
+				break;
+			if (tail & CLOSED)
+				return false;
+			m_tail.wait(tail, std::memory_order_acquire);
+		}
+
+		out = std::move(m_slots[head % m_slots.size()]);
+		m_head.store(head + 1, std::memory_order_release);
+		m_head.notify_one();
+		return true;
+	}
+
+	/*
+	* Close the queue from the producer's end: there will be no more
+	* items.
+	*/
+	void close_producer()
+	{
+		m_tail.fetch_or(CLOSED, std::memory_order_release);
+		m_tail.notify_all();
+	}
+
+	/*
+	* Close the queue from the consumer's end: no more items will be
+	* taken, so any more pushes fail.
+	*/
+	void close_consumer()
+	{
+		m_head.fetch_or(CLOSED, std::memory_order_release);
+		m_head.notify_all();
+	}
+
+private:
+	// set in an index once its end has closed the queue (which leaves
+	// plenty of bits for the index itself)
+	static constexpr size_t CLOSED = size_t(1) << (std::numeric_limits<size_t>::digits - 1);
+
+	std::vector<T> m_slots;
+
+	// the number of items ever popped (written by the consumer) and
+	// pushed (written by the producer), each on its own cache line so
+	// that the two ends don't keep taking the line from each other
+	alignas(64) std::atomic<size_t> m_head;
+	alignas(64) std::atomic<size_t> m_tail;
+};
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_RING_BUFFER_H
@@ -0,0 +1,215 @@
+#include "dbsi_scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define DBSI_SCAN_X86
+#include <immintrin.h>
+#endif
+
+
+namespace dbsi
+{
+
+
+static bool is_space(char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+
+static const char* find_char_scalar(const char* begin, const char* end, char c)
+{
+	while (begin != end && *begin != c)
+		++begin;
+	return begin;
+}
+
+
+static const char* skip_space_scalar(const char* begin, const char* end)
+{
+	while (begin != end && is_space(*begin))
+		++begin;
+	return begin;
+}
+
+
+#ifdef DBSI_SCAN_X86
+
+
+/*
+* Each kernel handles whole vectors, and leaves the last few bytes
+* (fewer than a vector's worth) to the scalar loop, so that it never
+* reads past `end`.
+* A byte is whitespace if it's a space, or if it minus '\t' is at
+* most '\r' - '\t' as an unsigned byte (i.e. '\t' to '\r').
+*/
+
+
+static const char* find_char_sse2(const char* begin, const char* end, char c)
+{
+	const __m128i target = _mm_set1_epi8(c);
+	for (; end - begin >= 16; begin += 16)
+	{
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+		const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, target));
+		if (mask != 0)
+			return begin + __builtin_ctz(static_cast<unsigned>(mask));
+	}
+	return find_char_scalar(begin, end, c);
+}
+
+
+static const char* skip_space_sse2(const char* begin, const char* end)
+{
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i range = _mm_set1_epi8('\r' - '\t');
+	for (; end - begin >= 16; begin += 16)
+	{
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+		const __m128i from_tab = _mm_sub_epi8(v, tab);
+		const __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+			_mm_cmpeq_epi8(_mm_min_epu8(from_tab, range), from_tab));
+		const int mask = ~_mm_movemask_epi8(ws) & 0xFFFF;
+		if (mask != 0)
+			return begin + __builtin_ctz(static_cast<unsigned>(mask));
+	}
+	return skip_space_scalar(begin, end);
+}
+
+
+__attribute__((target("avx2")))
+static const char* find_char_avx2(const char* begin, const char* end, char c)
+{
+	// most IRIs and Literals are short, so try 16 bytes first, which
+	// is cheaper to set up
+	if (end - begin >= 16)
+	{
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+		const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+		if (mask != 0)
+			return begin + __builtin_ctz(static_cast<unsigned>(mask));
+		begin += 16;
+	}
+
+	// (then two vectors per iteration, for long ones, which only
+	// need to be told apart once one of them has a match)
+	const __m256i target = _mm256_set1_epi8(c);
+	for (; end - begin >= 64; begin += 64)
+	{
+		const __m256i eq0 = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin)), target);
+		const __m256i eq1 = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + 32)), target);
+		if (!_mm256_testz_si256(_mm256_or_si256(eq0, eq1), _mm256_or_si256(eq0, eq1)))
+		{
+			const unsigned mask0 = static_cast<unsigned>(_mm256_movemask_epi8(eq0));
+			if (mask0 != 0)
+				return begin + __builtin_ctz(mask0);
+			return begin + 32 + __builtin_ctz(static_cast<unsigned>(_mm256_movemask_epi8(eq1)));
+		}
+	}
+	for (; end - begin >= 32; begin += 32)
+	{
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+		const unsigned mask = static_cast<unsigned>(
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, target)));
+		if (mask != 0)
+			return begin + __builtin_ctz(mask);
+	}
+	return find_char_sse2(begin, end, c);
+}
+
+
+__attribute__((target("avx2")))
+static const char* skip_space_avx2(const char* begin, const char* end)
+{
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i range = _mm256_set1_epi8('\r' - '\t');
+	for (; end - begin >= 32; begin += 32)
+	{
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+		const __m256i from_tab = _mm256_sub_epi8(v, tab);
+		const __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(from_tab, range), from_tab));
+		const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(ws));
+		if (mask != 0)
+			return begin + __builtin_ctz(mask);
+	}
+	return skip_space_sse2(begin, end);
+}
+
+
+#endif  // DBSI_SCAN_X86
+
+
+namespace
+{
+
+
+// the kernels in use, chosen when the program starts
+struct Kernels
+{
+	const char* (*find_char)(const char*, const char*, char);
+	const char* (*skip_space)(const char*, const char*);
+
+	Kernels()
+	{
+#ifdef DBSI_SCAN_X86
+		// (this runs before main, so possibly before the CPU's
+		// features would otherwise have been found)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			find_char = find_char_avx2;
+			skip_space = skip_space_avx2;
+			return;
+		}
+		find_char = find_char_sse2;
+		skip_space = skip_space_sse2;
+#else
+		find_char = find_char_scalar;
+		skip_space = skip_space_scalar;
+#endif
+	}
+};
+
+
+const Kernels KERNELS;
+
+
+}  // namespace
+
+
+const char* find_char(const char* begin, const char* end, char c)
+{
+	return KERNELS.find_char(begin, end, c);
+}
+
+
+const char* skip_space(const char* begin, const char* end)
+{
+	// separators are usually a single space, which isn't worth
+	// setting up a vector for
+	if (begin == end || !is_space(*begin))
+		return begin;
+	++begin;
+	if (begin == end || !is_space(*begin))
+		return begin;
+	return KERNELS.skip_space(begin, end);
+}
+
+
+std::vector<ScanKernels> available_scan_kernels()
+{
+	std::vector<ScanKernels> kernels{ { "scalar", find_char_scalar, skip_space_scalar } };
+#ifdef DBSI_SCAN_X86
+	kernels.push_back({ "SSE2", find_char_sse2, skip_space_sse2 });
+	if (__builtin_cpu_supports("avx2"))
+		kernels.push_back({ "AVX2", find_char_avx2, skip_space_avx2 });
+#endif
+	return kernels;
+}
+
+
+}  // namespace dbsi
@@ -0,0 +1,62 @@
+#ifndef DBSI_SCAN_H
+#define DBSI_SCAN_H
+
+
+#include <cstddef>
+#include <vector>
+
+
+namespace dbsi
+{
+
+
+/*
+* Kernels for scanning text, used by the parsers to find the end of
+* each IRI or Literal, and to skip whitespace. They look at 32 bytes
+* at a time using AVX2 if the CPU has it, otherwise 16 bytes at a
+* time using SSE2 (on x86), otherwise one byte at a time; which one
+* is chosen once, at startup.
+* They never read outside of `[begin, end)`.
+*/
+
+
+/*
+* The first occurrence of `c` in `[begin, end)`, or `end` if there
+* isn't one.
+*/
+const char* find_char(const char* begin, const char* end, char c);
+
+
+/*
+* The first character in `[begin, end)` which isn't whitespace (as
+* defined by `std::isspace` in the "C" locale), or `end` if there
+* isn't one.
+*/
+const char* skip_space(const char* begin, const char* end);
+
+
+/*
+* A set of the kernels, for `dbsi_scan_bench`, which checks them
+* against each other and times them. Unlike `skip_space` itself,
+* their `skip_space` doesn't first look at the first two bytes alone.
+*/
+struct ScanKernels
+{
+	const char* name;
+	const char* (*find_char)(const char* begin, const char* end, char c);
+	const char* (*skip_space)(const char* begin, const char* end);
+};
+
+
+/*
+* Each set of kernels which this CPU can run: the scalar ones first,
+* and then those of each wider vector in turn, so the last set is
+* the one which `find_char` and `skip_space` use.
+*/
+std::vector<ScanKernels> available_scan_kernels();
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_SCAN_H
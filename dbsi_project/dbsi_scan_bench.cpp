@@ -0,0 +1,267 @@
+/*
+* A microbenchmark and check of the scanning kernels (see
+* `dbsi_scan.h`), built with the CMake option `DBSI_BUILD_BENCH`.
+*
+* It first checks every set of kernels which this CPU can run against
+* the scalar ones, on random input, and then times scanning a Turtle
+* file (or, without one, some generated Turtle) for its IRIs and
+* Literals with each of them, and with the loop which the stream parser
+* used to use, reading a character at a time from an `std::istream`.
+*
+* Usage: dbsi_scan_bench [file.ttl]
+* Exits with status 1 if any kernel disagrees with the scalar ones.
+*/
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cctype>
+#include "dbsi_scan.h"
+
+
+using namespace dbsi;
+
+
+// the number of random inputs each kernel is checked on
+static const size_t NUM_CHECKS = 200000;
+
+// each timing is the best of this many passes over the data
+static const size_t NUM_PASSES = 7;
+
+// the size of the generated Turtle, if no file is given
+static const size_t GENERATED_SIZE = size_t(32) << 20;
+
+
+/*
+* Check each of `kernels` against the first (the scalar ones) on
+* random inputs, printing the first few disagreements. Each input is
+* a vector of its own, of exactly its size, so that a kernel which
+* reads past the end is caught by AddressSanitizer, if enabled.
+*/
+static bool check_kernels(const std::vector<ScanKernels>& kernels)
+{
+	static const char SPACES[] = { ' ', '\t', '\n', '\v', '\f', '\r' };
+
+	// (the densities of delimiters and whitespace vary between inputs,
+	// so that there are long runs without either, and of whitespace)
+	static const double DELIMITER_DENSITIES[] = { 0.0, 0.002, 0.02, 0.2 };
+	static const double SPACE_DENSITIES[] = { 0.0, 0.5, 0.9, 0.99, 1.0 };
+
+	std::mt19937 rng(12345);
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	size_t num_errors = 0;
+
+	for (size_t trial = 0; trial < NUM_CHECKS; ++trial)
+	{
+		const size_t size = std::uniform_int_distribution<size_t>(0, 300)(rng);
+		const double delimiters = DELIMITER_DENSITIES[rng() % std::size(DELIMITER_DENSITIES)];
+		const double spaces = SPACE_DENSITIES[rng() % std::size(SPACE_DENSITIES)];
+
+		std::vector<char> input(size);
+		for (char& c : input)
+		{
+			const double r = unit(rng);
+			if (r < delimiters)
+				c = (rng() % 2 == 0) ? '>' : '"';
+			else if (r < delimiters + spaces)
+				c = SPACES[rng() % std::size(SPACES)];
+			else
+				c = static_cast<char>(rng() % 256);
+		}
+
+		// (starting part-way in, so that the vectors aren't aligned)
+		const char* const end = input.data() + size;
+		const char* const begin = input.data() + std::min<size_t>(size, rng() % 64);
+		const char targets[] = { '>', '"', static_cast<char>(rng() % 256) };
+
+		for (size_t k = 1; k < kernels.size(); ++k)
+		{
+			for (char c : targets)
+			{
+				const char* expected = kernels[0].find_char(begin, end, c);
+				const char* got = kernels[k].find_char(begin, end, c);
+				if (got != expected && num_errors++ < 10)
+				{
+					std::cerr << kernels[k].name << " find_char(" << int(static_cast<unsigned char>(c))
+						<< ") gave " << (got - begin) << " instead of " << (expected - begin)
+						<< " on an input of " << (end - begin) << " bytes." << std::endl;
+				}
+			}
+
+			const char* expected = kernels[0].skip_space(begin, end);
+			const char* got = kernels[k].skip_space(begin, end);
+			if (got != expected && num_errors++ < 10)
+			{
+				std::cerr << kernels[k].name << " skip_space gave " << (got - begin)
+					<< " instead of " << (expected - begin)
+					<< " on an input of " << (end - begin) << " bytes." << std::endl;
+			}
+		}
+	}
+
+	std::cout << "Checked";
+	for (size_t k = 1; k < kernels.size(); ++k)
+		std::cout << ' ' << kernels[k].name;
+	std::cout << " against scalar on " << NUM_CHECKS << " random inputs: "
+		<< num_errors << " disagreements." << std::endl;
+	return num_errors == 0;
+}
+
+
+/*
+* Some Turtle in the style of the benchmark data: IRIs of a few dozen
+* bytes, and Literals of up to a couple of hundred.
+*/
+static std::string generate_turtle()
+{
+	std::mt19937 rng(54321);
+	std::string out;
+	out.reserve(GENERATED_SIZE + 512);
+	while (out.size() < GENERATED_SIZE)
+	{
+		out += "<http://www.example.org/resource/" + std::to_string(rng() % 1000000) + "> ";
+		out += "<http://www.example.org/property/p" + std::to_string(rng() % 50) + ">  ";
+		if (rng() % 2 == 0)
+		{
+			out += "<http://www.example.org/resource/" + std::to_string(rng() % 1000000) + ">";
+		}
+		else
+		{
+			out += '"';
+			out.append(rng() % 200, 'a' + static_cast<char>(rng() % 26));
+			out += '"';
+		}
+		out += " .\n";
+	}
+	return out;
+}
+
+
+/*
+* Find the IRIs and Literals in `data` using the given kernels, as the
+* mapped Turtle parser does, and return how many there are.
+*/
+template<typename FindChar, typename SkipSpace>
+static size_t scan_terms(std::string_view data, FindChar find, SkipSpace skip)
+{
+	size_t num_terms = 0;
+	const char* p = data.data();
+	const char* const end = p + data.size();
+	while ((p = skip(p, end)) != end)
+	{
+		const char c = *p++;
+		if (c != '<' && c != '"')
+			continue;
+		p = find(p, end, (c == '<') ? '>' : '"');
+		if (p == end)
+			break;
+		++p;
+		++num_terms;
+	}
+	return num_terms;
+}
+
+
+/*
+* The same, but as the stream parser used to, a character at a time
+* from an `std::istream`, copying each IRI or Literal into a buffer.
+*/
+static size_t scan_terms_stream(const std::string& data)
+{
+	std::istringstream in(data);
+	std::vector<char> str(32);
+	size_t num_terms = 0;
+	char c;
+	while (true)
+	{
+		while (std::isspace(c = in.get()));
+		if (c == -1 /* EOF */)
+			break;
+		if (c != '<' && c != '"')
+			continue;
+
+		str.clear();
+		const char end_char = (c == '<') ? '>' : '"';
+		char next_char = 0;
+		while (in.good() && (next_char = in.get()) != end_char)
+			str.push_back(next_char);
+		if (next_char != end_char)
+			break;
+		++num_terms;
+	}
+	return num_terms;
+}
+
+
+/*
+* Print the best time of `NUM_PASSES` runs of `scan`, and check that it
+* found `expected_terms` terms. Returns whether it did.
+*/
+template<typename Scan>
+static bool time_scan(const std::string& name, size_t size, size_t expected_terms, Scan scan)
+{
+	auto best = std::chrono::steady_clock::duration::max();
+	size_t num_terms = 0;
+	for (size_t pass = 0; pass < NUM_PASSES; ++pass)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		num_terms = scan();
+		best = std::min(best, std::chrono::steady_clock::now() - start);
+	}
+
+	const double ms = std::chrono::duration<double, std::milli>(best).count();
+	std::cout << '\t' << name << ": " << ms << "ms ("
+		<< (static_cast<double>(size) / (1 << 20)) / (ms / 1000) << " MB/s)";
+	if (num_terms != expected_terms)
+		std::cout << ", but found " << num_terms << " terms instead of " << expected_terms;
+	std::cout << std::endl;
+	return num_terms == expected_terms;
+}
+
+
+int main(int argc, char* argv[])
+{
+	const std::vector<ScanKernels> kernels = available_scan_kernels();
+	bool ok = check_kernels(kernels);
+
+	std::string data;
+	if (argc > 1)
+	{
+		std::ifstream file(argv[1], std::ios::binary);
+		if (!file)
+		{
+			std::cerr << "Unfortunately the given file '" << argv[1] << "' cannot be opened." << std::endl;
+			return 1;
+		}
+		std::ostringstream contents;
+		contents << file.rdbuf();
+		data = contents.str();
+	}
+	else
+	{
+		data = generate_turtle();
+	}
+
+	const size_t expected_terms = scan_terms(data, kernels[0].find_char, kernels[0].skip_space);
+	std::cout << "Scanning " << data.size() << " bytes for " << expected_terms
+		<< " IRIs and Literals, best of " << NUM_PASSES << " passes:" << std::endl;
+
+	ok &= time_scan("istream get() loop (old)", data.size(), expected_terms,
+		[&data]() { return scan_terms_stream(data); });
+	for (const ScanKernels& k : kernels)
+	{
+		ok &= time_scan(k.name, data.size(), expected_terms,
+			[&data, &k]() { return scan_terms(data, k.find_char, k.skip_space); });
+	}
+	ok &= time_scan("find_char and skip_space", data.size(), expected_terms,
+		[&data]() { return scan_terms(data, find_char, skip_space); });
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,217 @@
+#ifndef DBSI_SEGMENTED_VECTOR_H
+#define DBSI_SEGMENTED_VECTOR_H
+
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include "dbsi_image.h"
+
+
+namespace dbsi
+{
+
+
+/*
+* A replacement for `std::vector` whose elements never move, even
+* when it grows. Elements are stored in fixed-size segments, which
+* are found via a directory of pointers.
+*
+* This means that other threads can keep reading elements while one
+* thread appends more (as long as each element they read was written
+* before it was published to them, e.g. by a release-store of its
+* index). The directory itself may need to grow, in which case the
+* old one is kept around (it is tiny compared to the segments) so
+* that readers never see it freed.
+*
+* Note that element access is only slightly more expensive than for
+* a `std::vector`: an extra shift, mask, and (well-cached) load.
+*
+* When opened from an image, the segments point straight into the
+* mapped file, rather than being copied.
+*/
+template<typename T>
+class SegmentedVector
+{
+public:
+	static constexpr size_t SEGMENT_BITS = 16;
+	static constexpr size_t SEGMENT_SIZE = size_t(1) << SEGMENT_BITS;
+
+	SegmentedVector() :
+		m_dir(nullptr),
+		m_dir_capacity(0),
+		m_num_segments(0),
+		m_num_mapped_segments(0),
+		m_size(0)
+	{ }
+
+	~SegmentedVector()
+	{
+		free_segments(0);
+	}
+
+	// elements must not move, so neither can we
+	SegmentedVector(const SegmentedVector&) = delete;
+	SegmentedVector& operator=(const SegmentedVector&) = delete;
+
+	// (the size is read with acquire, and written with release, so that
+	// another thread which sees the new size also sees the elements)
+	size_t size() const { return m_size.load(std::memory_order_acquire); }
+	bool empty() const { return size() == 0; }
+
+	T& operator[](size_t i)
+	{
+		return m_dir.load(std::memory_order_acquire)[i >> SEGMENT_BITS][i & (SEGMENT_SIZE - 1)];
+	}
+	const T& operator[](size_t i) const
+	{
+		return m_dir.load(std::memory_order_acquire)[i >> SEGMENT_BITS][i & (SEGMENT_SIZE - 1)];
+	}
+
+	void push_back(const T& x)
+	{
+		const size_t i = size();
+		reserve(i + 1);
+		(*this)[i] = x;
+		m_size.store(i + 1, std::memory_order_release);
+	}
+
+	/*
+	* Note: unlike `std::vector`, shrinking does not destroy
+	* elements (which must be trivial).
+	*/
+	void resize(size_t n, const T& value = T())
+	{
+		reserve(n);
+		for (size_t i = size(); i < n; ++i)
+			(*this)[i] = value;
+		m_size.store(n, std::memory_order_release);
+	}
+
+	/*
+	* Allocate all of the segments needed to hold `n` elements.
+	*/
+	void reserve(size_t n)
+	{
+		const size_t segments_needed = (n + SEGMENT_SIZE - 1) >> SEGMENT_BITS;
+		if (segments_needed <= m_num_segments)
+			return;
+
+		reserve_directory(segments_needed);
+		T** dir = m_dir.load(std::memory_order_relaxed);
+		for (size_t s = m_num_segments; s < segments_needed; ++s)
+			dir[s] = new T[SEGMENT_SIZE]();
+		m_num_segments = segments_needed;
+		m_dir.store(dir, std::memory_order_release);
+	}
+
+	/*
+	* Free any segments which are no longer needed for the
+	* current size. Only do this if no other thread could be
+	* reading those elements.
+	*/
+	void shrink_to_fit()
+	{
+		free_segments((size() + SEGMENT_SIZE - 1) >> SEGMENT_BITS);
+	}
+
+	/*
+	* Remove (and free) all elements. Only do this if no other
+	* thread could be reading them.
+	*/
+	void clear()
+	{
+		m_size.store(0, std::memory_order_relaxed);
+		free_segments(0);
+	}
+
+	/*
+	* Write the elements to an image as a single array.
+	*/
+	void save(ImageWriter& out) const
+	{
+		out.begin_array(sizeof(T), size());
+		for (size_t i = 0; i < size(); i += SEGMENT_SIZE)
+			out.write_bytes(&(*this)[i], std::min(SEGMENT_SIZE, size() - i) * sizeof(T));
+		out.end_array();
+	}
+
+	/*
+	* Replace the contents with the next array of an image. All of
+	* the full segments are used in place, and only the last partial
+	* segment (which may yet be appended to) is copied.
+	* Only do this if no other thread could be reading the elements.
+	*/
+	void open(ImageReader& in)
+	{
+		clear();
+
+		auto [data, n] = in.read_array<T>();
+		const size_t num_full = n >> SEGMENT_BITS;
+		reserve_directory(num_full + 1);
+		T** dir = m_dir.load(std::memory_order_relaxed);
+		for (size_t s = 0; s < num_full; ++s)
+			dir[s] = data + (s << SEGMENT_BITS);
+		m_num_segments = m_num_mapped_segments = num_full;
+		m_mapping = in.mapping();
+
+		reserve(n);
+		std::copy(data + (num_full << SEGMENT_BITS), data + n, dir[num_full]);
+		m_size.store(n, std::memory_order_relaxed);
+	}
+
+private:
+	void reserve_directory(size_t segments_needed)
+	{
+		if (segments_needed <= m_dir_capacity)
+			return;
+
+		// grow the directory, keeping the old one alive for
+		// any readers which are still using it
+		T** dir = m_dir.load(std::memory_order_relaxed);
+		const size_t new_capacity = std::max<size_t>(
+			std::max<size_t>(16, 2 * m_dir_capacity), segments_needed);
+		std::unique_ptr<T*[]> new_dir(new T*[new_capacity]());
+		std::copy(dir, dir + m_num_segments, new_dir.get());
+		m_dir.store(new_dir.get(), std::memory_order_release);
+		m_dirs.push_back(std::move(new_dir));
+		m_dir_capacity = new_capacity;
+	}
+
+	void free_segments(size_t keep)
+	{
+		T** dir = m_dir.load(std::memory_order_relaxed);
+		for (size_t s = keep; s < m_num_segments; ++s)
+		{
+			if (s >= m_num_mapped_segments)
+				delete[] dir[s];
+			dir[s] = nullptr;
+		}
+		m_num_segments = std::min(m_num_segments, keep);
+		m_num_mapped_segments = std::min(m_num_mapped_segments, keep);
+		if (m_num_mapped_segments == 0)
+			m_mapping.reset();
+	}
+
+private:
+	// the current directory, which is the last of `m_dirs`
+	std::atomic<T**> m_dir;
+	std::vector<std::unique_ptr<T*[]>> m_dirs;
+	size_t m_dir_capacity;
+
+	// the first `m_num_segments` entries of the directory are
+	// allocated, which is enough to hold `m_size` elements, and the
+	// first `m_num_mapped_segments` of those are in an image's mapped
+	// file (which `m_mapping` keeps alive) rather than allocated
+	size_t m_num_segments;
+	size_t m_num_mapped_segments;
+	std::atomic<size_t> m_size;
+	std::shared_ptr<const void> m_mapping;
+};
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_SEGMENTED_VECTOR_H
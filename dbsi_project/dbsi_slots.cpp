@@ -0,0 +1,88 @@
+#include <algorithm>
+#include "dbsi_slots.h"
+#include "dbsi_assert.h"
+
+
+namespace dbsi
+{
+
+
+VariableSlots::VariableSlots(const CodedVarMap& vars,
+	const std::vector<CodedTriplePattern>& patterns)
+{
+	for (const auto& kv : vars)
+		m_vars.push_back(kv.first);
+	add_patterns(patterns);
+}
+
+
+VariableSlots::VariableSlots(const VariableSlots& vars,
+	const std::vector<CodedTriplePattern>& patterns) :
+	m_vars(vars.m_vars)
+{
+	add_patterns(patterns);
+}
+
+
+void VariableSlots::add_patterns(const std::vector<CodedTriplePattern>& patterns)
+{
+	for (const CodedTriplePattern& pat : patterns)
+	{
+		for (const CodedTerm* term : { &pat.sub, &pat.pred, &pat.obj })
+		{
+			if (std::holds_alternative<Variable>(*term))
+				m_vars.push_back(std::get<Variable>(*term));
+		}
+	}
+
+	std::sort(m_vars.begin(), m_vars.end());
+	m_vars.erase(std::unique(m_vars.begin(), m_vars.end()), m_vars.end());
+}
+
+
+size_t VariableSlots::size() const
+{
+	return m_vars.size();
+}
+
+
+const Variable& VariableSlots::variable(size_t slot) const
+{
+	DBSI_CHECK_PRECOND(slot < m_vars.size());
+	return m_vars[slot];
+}
+
+
+size_t VariableSlots::find(const Variable& var) const
+{
+	auto iter = std::lower_bound(m_vars.begin(), m_vars.end(), var);
+	if (iter == m_vars.end() || *iter != var)
+		return NO_SLOT;
+	return static_cast<size_t>(iter - m_vars.begin());
+}
+
+
+std::vector<size_t> VariableSlots::find_all(const VariableSlots& slots) const
+{
+	std::vector<size_t> found;
+	found.reserve(slots.size());
+	for (const Variable& var : slots.m_vars)
+	{
+		found.push_back(find(var));
+		DBSI_CHECK_PRECOND(found.back() != NO_SLOT);
+	}
+	return found;
+}
+
+
+CodedVarMap VariableSlots::to_map(const CodedResource* codes) const
+{
+	// (the slots are in the map's order, so each insertion is at the end)
+	CodedVarMap vm;
+	for (size_t slot = 0; slot < m_vars.size(); ++slot)
+		vm.emplace_hint(vm.end(), m_vars[slot], codes[slot]);
+	return vm;
+}
+
+
+}  // namespace dbsi
@@ -0,0 +1,122 @@
+#ifndef DBSI_SLOTS_H
+#define DBSI_SLOTS_H
+
+
+#include <vector>
+#include <limits>
+#include "dbsi_types.h"
+#include "dbsi_iterator.h"
+#include "dbsi_assert.h"
+
+
+namespace dbsi
+{
+
+
+/*
+* A binding of the variables of a query to codes, as a flat array
+* indexed by the variables' slots (see `VariableSlots`). Unlike a
+* `CodedVarMap`, this is allocated once per query rather than per
+* result, and binding a variable is just a write to its slot.
+*/
+typedef std::vector<CodedResource> SlotBinding;
+
+
+/*
+* The variables of a query, numbered densely from 0 (their slots), in
+* order of name. Because the order is the same as that of a
+* `CodedVarMap`, converting between the two is a linear scan.
+*/
+class VariableSlots
+{
+public:
+	static constexpr size_t NO_SLOT = std::numeric_limits<size_t>::max();
+
+	VariableSlots() = default;
+
+	/*
+	* Give a slot to every variable of `vars` (whose values are
+	* ignored, as with `extract_map`) and `patterns`.
+	*/
+	VariableSlots(const CodedVarMap& vars,
+		const std::vector<CodedTriplePattern>& patterns);
+	VariableSlots(const VariableSlots& vars,
+		const std::vector<CodedTriplePattern>& patterns);
+
+	size_t size() const;
+
+	const Variable& variable(size_t slot) const;
+
+	/*
+	* Find the slot of `var`, or `NO_SLOT` if it doesn't have one.
+	*/
+	size_t find(const Variable& var) const;
+
+	/*
+	* Get the slot of each variable of `slots`, in the order of its
+	* slots.
+	*/
+	std::vector<size_t> find_all(const VariableSlots& slots) const;
+
+	/*
+	* Convert the binding made of the `size()` codes starting at
+	* `codes` to a map.
+	*/
+	CodedVarMap to_map(const CodedResource* codes) const;
+
+private:
+	// give a slot to every variable of `patterns`, as well as to those
+	// already in `m_vars`
+	void add_patterns(const std::vector<CodedTriplePattern>& patterns);
+
+private:
+	// sorted, without duplicates
+	std::vector<Variable> m_vars;
+};
+
+
+/*
+* An iterator over the results of a join, whose current result can be
+* read as a binding of its slots, rather than as a `CodedVarMap`
+* (which `current` builds from it). The joins read each other's
+* results like this, so that no map is built per result.
+*/
+class ISlotRowIterator :
+	public ICodedVarMapIterator
+{
+public:
+	// the slots of the variables of the results
+	virtual const VariableSlots& slots() const = 0;
+
+	// the `slots().size()` codes of the current result, by slot.
+	// pre: `valid()`
+	virtual const CodedResource* row() const = 0;
+
+	CodedVarMap current() const override
+	{
+		DBSI_CHECK_PRECOND(this->valid());
+		return slots().to_map(row());
+	}
+
+	// (copying each row's codes into the batch, rather than building
+	// a map of them)
+	void next_batch(ColumnBatch& batch) override
+	{
+		DBSI_CHECK_PRECOND(batch.num_columns() == slots().size());
+
+		while (this->valid() && !batch.full())
+		{
+			const size_t r = batch.add_rows(1);
+			const CodedResource* const codes = row();
+			for (size_t slot = 0; slot < batch.num_columns(); ++slot)
+				batch.column(slot)[r] = codes[slot];
+			this->next();
+		}
+	}
+};
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_SLOTS_H
@@ -0,0 +1,249 @@
+#include <array>
+#include <algorithm>
+#include <tuple>
+#include "dbsi_sorted_index.h"
+#include "dbsi_pattern_utils.h"
+#include "dbsi_assert.h"
+
+
+namespace dbsi
+{
+
+
+/*
+* The order in which the components of the triples are sorted.
+*/
+typedef std::array<CodedResource CodedTriple::*, 3> Permutation;
+static const Permutation SPO_PERM = { &CodedTriple::sub, &CodedTriple::pred, &CodedTriple::obj };
+static const Permutation POS_PERM = { &CodedTriple::pred, &CodedTriple::obj, &CodedTriple::sub };
+static const Permutation OSP_PERM = { &CodedTriple::obj, &CodedTriple::sub, &CodedTriple::pred };
+
+
+/*
+* Compares triples by only the first `len` components of the
+* given permutation.
+*/
+struct PrefixLess
+{
+	bool operator()(const CodedTriple& a, const CodedTriple& b) const
+	{
+		for (size_t i = 0; i < len; ++i)
+		{
+			if (a.*perm[i] != b.*perm[i])
+				return a.*perm[i] < b.*perm[i];
+		}
+		return false;
+	}
+
+	const Permutation& perm;
+	size_t len;
+};
+
+
+enum class SortOrder
+{
+	SPO, POS, OSP
+};
+
+
+/*
+* Pick the sorted copy in which the constants of a pattern of the
+* given type form a prefix, and how long that prefix is.
+*/
+static std::pair<SortOrder, size_t> choose_order(TriplePatternType type)
+{
+	switch (type)
+	{
+	case TriplePatternType::VVV:
+		return { SortOrder::SPO, 0 };
+	case TriplePatternType::SVV:
+		return { SortOrder::SPO, 1 };
+	case TriplePatternType::SPV:
+		return { SortOrder::SPO, 2 };
+	case TriplePatternType::SPO:
+		return { SortOrder::SPO, 3 };
+	case TriplePatternType::VPV:
+		return { SortOrder::POS, 1 };
+	case TriplePatternType::VPO:
+		return { SortOrder::POS, 2 };
+	case TriplePatternType::VVO:
+		return { SortOrder::OSP, 1 };
+	case TriplePatternType::SVO:
+		return { SortOrder::OSP, 2 };
+	default:
+		DBSI_CHECK_POSTCOND(false);  // ???
+		return { SortOrder::SPO, 0 };
+	}
+}
+
+
+/*
+* Iterates over a contiguous range of sorted triples, returning
+* those which match the pattern. All triples in the range will
+* match the pattern's constants, so the only triples which are
+* skipped are those which don't agree with repeated variables
+* (e.g. `?x <p> ?x`).
+*/
+class SortedRangeIterator :
+	public IMatchIterator
+{
+public:
+	SortedRangeIterator(const SortedIndex& index, const CodedTriplePattern& pattern) :
+		m_index(index), m_matcher(pattern), m_rows_scanned(0)
+	{
+		rebind(pattern);
+	}
+
+	void rebind(const CodedTriplePattern& pattern) override
+	{
+		std::tie(m_begin, m_end) = m_index.range(pattern);
+		m_cur = m_end;
+		m_matcher = TripleMatcher<CodedResource>(pattern);
+	}
+
+	size_t rows_scanned() const override
+	{
+		return m_rows_scanned;
+	}
+
+	void start() override
+	{
+		m_cur = m_begin;
+		skip_till_pattern_match();
+	}
+
+	CodedTriple current() const override
+	{
+		DBSI_CHECK_PRECOND(valid());
+		return *m_cur;
+	}
+
+	void next() override
+	{
+		DBSI_CHECK_PRECOND(valid());
+		++m_cur;
+		skip_till_pattern_match();
+	}
+
+	bool valid() const override
+	{
+		return m_cur != m_end;
+	}
+
+	void next_batch(ColumnBatch& batch) override
+	{
+		DBSI_CHECK_PRECOND(batch.num_columns() == 3);
+
+		CodedResource* const subs = batch.column(0);
+		CodedResource* const preds = batch.column(1);
+		CodedResource* const objs = batch.column(2);
+		while (m_cur != m_end && !batch.full())
+		{
+			const size_t row = batch.add_rows(1);
+			subs[row] = m_cur->sub;
+			preds[row] = m_cur->pred;
+			objs[row] = m_cur->obj;
+
+			++m_cur;
+			skip_till_pattern_match();
+		}
+	}
+
+private:
+	void skip_till_pattern_match()
+	{
+		for (; m_cur != m_end; ++m_cur)
+		{
+			++m_rows_scanned;
+			if (m_matcher(*m_cur))
+				break;
+		}
+	}
+
+private:
+	const SortedIndex& m_index;
+	const CodedTriple* m_begin;
+	const CodedTriple* m_end;
+	// invariant: *m_cur matches the pattern if valid()
+	const CodedTriple* m_cur;
+	TripleMatcher<CodedResource> m_matcher;
+	size_t m_rows_scanned;
+};
+
+
+SortedIndex::SortedIndex(const rdf_idx_helper::Table& table)
+{
+	m_spo.reserve(table.size());
+	for (rdf_idx_helper::TableIterator i = 0; i < table.size(); ++i)
+	{
+		if (!table.is_dead(i))
+			m_spo.push_back(table.triple(i));
+	}
+	m_pos = m_spo;
+	m_osp = m_spo;
+
+	std::sort(m_spo.begin(), m_spo.end(), PrefixLess{ SPO_PERM, 3 });
+	std::sort(m_pos.begin(), m_pos.end(), PrefixLess{ POS_PERM, 3 });
+	std::sort(m_osp.begin(), m_osp.end(), PrefixLess{ OSP_PERM, 3 });
+}
+
+
+std::unique_ptr<IMatchIterator> SortedIndex::match(const CodedTriplePattern& pattern) const
+{
+	return std::make_unique<SortedRangeIterator>(*this, pattern);
+}
+
+
+std::string SortedIndex::describe_access(const CodedTriplePattern& pattern) const
+{
+	static const char* const ORDER_NAMES[] = { "SPO", "POS", "OSP" };
+
+	const auto [order, prefix_len] = choose_order(pattern_type(pattern));
+	const std::string copy = std::string("sorted ") + ORDER_NAMES[static_cast<size_t>(order)] + " copy";
+	if (prefix_len == 0)
+		return "all of " + copy;
+	return "range of " + copy + " found by " + std::to_string(prefix_len) + " component(s)";
+}
+
+
+std::pair<const CodedTriple*, const CodedTriple*> SortedIndex::range(
+	const CodedTriplePattern& pattern) const
+{
+	const auto [order, prefix_len] = choose_order(pattern_type(pattern));
+	const std::vector<CodedTriple>* triples = nullptr;
+	const Permutation* perm = nullptr;
+	switch (order)
+	{
+	case SortOrder::SPO:
+		triples = &m_spo;
+		perm = &SPO_PERM;
+		break;
+	case SortOrder::POS:
+		triples = &m_pos;
+		perm = &POS_PERM;
+		break;
+	case SortOrder::OSP:
+		triples = &m_osp;
+		perm = &OSP_PERM;
+		break;
+	}
+
+	// fill in the constants; variables' positions are ignored by
+	// the comparison, because they come after the prefix
+	CodedTriple key{ 0, 0, 0 };
+	if (std::holds_alternative<CodedResource>(pattern.sub))
+		key.sub = std::get<CodedResource>(pattern.sub);
+	if (std::holds_alternative<CodedResource>(pattern.pred))
+		key.pred = std::get<CodedResource>(pattern.pred);
+	if (std::holds_alternative<CodedResource>(pattern.obj))
+		key.obj = std::get<CodedResource>(pattern.obj);
+
+	const auto [lo, hi] = std::equal_range(triples->begin(), triples->end(),
+		key, PrefixLess{ *perm, prefix_len });
+
+	return std::make_pair(triples->data() + (lo - triples->begin()),
+		triples->data() + (hi - triples->begin()));
+}
+
+
+}  // namespace dbsi
@@ -0,0 +1,69 @@
+#ifndef DBSI_SORTED_INDEX_H
+#define DBSI_SORTED_INDEX_H
+
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <string>
+#include "dbsi_types.h"
+#include "dbsi_iterator.h"
+#include "dbsi_rdf_index_helper.h"
+
+
+namespace dbsi
+{
+
+
+/*
+* A read-optimised alternative to the linked lists of the RDF index.
+* This stores three copies of the triples, sorted in SPO, POS and OSP
+* order respectively. Every triple pattern has its constants forming
+* a prefix of one of these orders, so can be evaluated by a binary
+* search followed by a contiguous scan, rather than by pointer
+* chasing.
+*
+* A nice consequence of this is that the results of `match` come
+* in a well-defined order: sorted by the variable positions, in the
+* order of the permutation used. For example, a pattern with only
+* the predicate known is answered using the POS order, so its results
+* are sorted by object, then subject.
+*
+* This cannot be updated incrementally; it must be rebuilt from
+* scratch if the underlying table changes. Dead rows of the table
+* are left out.
+*/
+class SortedIndex
+{
+public:
+	explicit SortedIndex(const rdf_idx_helper::Table& table);
+
+	/*
+	* Create an iterator over the triples which match a
+	* certain pattern (see `RDFIndex::Snapshot::match`).
+	*/
+	std::unique_ptr<IMatchIterator> match(const CodedTriplePattern& pattern) const;
+
+	/*
+	* Find the range of one of the sorted copies which holds the
+	* triples matching the constants of `pattern` (though they may
+	* not all match, if it repeats a variable).
+	*/
+	std::pair<const CodedTriple*, const CodedTriple*> range(
+		const CodedTriplePattern& pattern) const;
+
+	/*
+	* Describe how `match` finds the matches of `pattern`: which
+	* sorted copy it reads, and how many of its components are known.
+	*/
+	std::string describe_access(const CodedTriplePattern& pattern) const;
+
+private:
+	std::vector<CodedTriple> m_spo, m_pos, m_osp;
+};
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_SORTED_INDEX_H
@@ -0,0 +1,294 @@
+#include "dbsi_thread_pool.h"
+#include "dbsi_assert.h"
+
+
+namespace dbsi
+{
+
+
+// the pool (if any) which the current thread is a worker of, and which
+// worker it is
+static thread_local const ThreadPool* t_pool = nullptr;
+static thread_local size_t t_worker_idx = 0;
+
+
+// the time, for the workers' statistics
+static std::int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+ThreadPool::TaskGroup::TaskGroup() :
+	m_pending(0)
+{ }
+
+
+ThreadPool::ThreadPool(size_t num_workers) :
+	m_num_queued(0),
+	m_next_deque(0),
+	m_stop(false)
+{
+	DBSI_CHECK_PRECOND(num_workers > 0);
+
+	for (size_t i = 0; i < num_workers; ++i)
+	{
+		auto worker = std::make_unique<Worker>();
+		worker->tasks_run = 0;
+		worker->tasks_stolen = 0;
+		worker->busy_ns = 0;
+		worker->idle_ns = 0;
+		worker->idle_since_ns = -1;
+		m_workers.push_back(std::move(worker));
+	}
+
+	// (only once every worker exists, since they steal from each other)
+	for (size_t i = 0; i < num_workers; ++i)
+		m_workers[i]->thread = std::thread(&ThreadPool::worker_main, this, i);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_sleep_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+
+	for (auto& worker : m_workers)
+		worker->thread.join();
+
+	// otherwise some group was never waited for
+	DBSI_CHECK_POSTCOND(m_num_queued == 0);
+}
+
+
+size_t ThreadPool::num_workers() const
+{
+	return m_workers.size();
+}
+
+
+void ThreadPool::spawn(TaskGroup& group, Task task)
+{
+	++group.m_pending;
+
+	size_t deque_idx = current_worker();
+	if (deque_idx == m_workers.size())
+		deque_idx = m_next_deque.fetch_add(1) % m_workers.size();
+
+	{
+		Worker& worker = *m_workers[deque_idx];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.tasks.push_back(QueuedTask{ std::move(task), &group });
+	}
+	++m_num_queued;
+
+	// (taking the lock means that a thread which has just seen that
+	// there are no tasks is already waiting, so will be woken)
+	{
+		std::lock_guard<std::mutex> lock(m_sleep_mutex);
+	}
+	m_wake.notify_one();
+}
+
+
+void ThreadPool::wait(TaskGroup& group)
+{
+	const size_t self = current_worker();
+	while (group.m_pending > 0)
+	{
+		if (try_run_task(self))
+			continue;
+
+		std::unique_lock<std::mutex> lock(m_sleep_mutex);
+		m_wake.wait(lock, [this, &group]()
+			{ return group.m_pending == 0 || m_num_queued > 0; });
+	}
+
+	std::lock_guard<std::mutex> lock(group.m_error_mutex);
+	if (group.m_error)
+	{
+		std::exception_ptr error = group.m_error;
+		group.m_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+
+void ThreadPool::run(size_t num_threads, const Task& task)
+{
+	DBSI_CHECK_PRECOND(num_threads > 0);
+
+	TaskGroup group;
+	for (size_t i = 1; i < num_threads; ++i)
+		spawn(group, [&task]() { task(); });
+
+	// this thread helps too, but the others must finish before
+	// anything is rethrown, since they refer to `task`
+	std::exception_ptr error;
+	try
+	{
+		task();
+	}
+	catch (...)
+	{
+		error = std::current_exception();
+	}
+
+	try
+	{
+		wait(group);
+	}
+	catch (...)
+	{
+		if (!error)
+			error = std::current_exception();
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+
+std::vector<ThreadPool::WorkerStatistics> ThreadPool::statistics() const
+{
+	const std::int64_t now = now_ns();
+
+	std::vector<WorkerStatistics> stats;
+	for (const auto& worker : m_workers)
+	{
+		// (racing with the worker waking up can count a little of its
+		// idle time twice, which is fine for statistics)
+		std::int64_t idle_ns = worker->idle_ns;
+		const std::int64_t idle_since = worker->idle_since_ns;
+		if (idle_since >= 0)
+			idle_ns += now - idle_since;
+
+		stats.push_back(WorkerStatistics{
+			worker->tasks_run,
+			worker->tasks_stolen,
+			std::chrono::nanoseconds(worker->busy_ns),
+			std::chrono::nanoseconds(idle_ns)
+			});
+	}
+	return stats;
+}
+
+
+void ThreadPool::worker_main(size_t worker_idx)
+{
+	t_pool = this;
+	t_worker_idx = worker_idx;
+	Worker& worker = *m_workers[worker_idx];
+
+	while (true)
+	{
+		if (try_run_task(worker_idx))
+			continue;
+
+		const std::int64_t idle_start = now_ns();
+		worker.idle_since_ns = idle_start;
+		{
+			std::unique_lock<std::mutex> lock(m_sleep_mutex);
+			m_wake.wait(lock, [this]() { return m_stop || m_num_queued > 0; });
+			if (m_stop && m_num_queued == 0)
+				return;
+		}
+		worker.idle_since_ns = -1;
+		worker.idle_ns += now_ns() - idle_start;
+	}
+}
+
+
+bool ThreadPool::try_run_task(size_t self)
+{
+	// first, the newest task of our own
+	if (self < m_workers.size())
+	{
+		Worker& worker = *m_workers[self];
+		std::unique_lock<std::mutex> lock(worker.mutex);
+		if (!worker.tasks.empty())
+		{
+			QueuedTask queued = std::move(worker.tasks.back());
+			worker.tasks.pop_back();
+			--m_num_queued;
+			lock.unlock();
+
+			execute(queued, self, false);
+			return true;
+		}
+	}
+
+	// otherwise, the oldest task of somebody else (starting from
+	// the next worker along, so that thieves spread out)
+	const size_t start = (self < m_workers.size()) ? self + 1 : m_next_deque.load();
+	for (size_t i = 0; i < m_workers.size(); ++i)
+	{
+		const size_t victim = (start + i) % m_workers.size();
+		if (victim == self)
+			continue;
+
+		Worker& worker = *m_workers[victim];
+		std::unique_lock<std::mutex> lock(worker.mutex);
+		if (!worker.tasks.empty())
+		{
+			QueuedTask queued = std::move(worker.tasks.front());
+			worker.tasks.pop_front();
+			--m_num_queued;
+			lock.unlock();
+
+			execute(queued, self, true);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+void ThreadPool::execute(QueuedTask& queued, size_t self, bool stolen)
+{
+	const std::int64_t busy_start = now_ns();
+	try
+	{
+		queued.task();
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> lock(queued.group->m_error_mutex);
+		if (!queued.group->m_error)
+			queued.group->m_error = std::current_exception();
+	}
+
+	if (self < m_workers.size())
+	{
+		Worker& worker = *m_workers[self];
+		worker.busy_ns += now_ns() - busy_start;
+		++worker.tasks_run;
+		if (stolen)
+			++worker.tasks_stolen;
+	}
+
+	// the group may be destroyed as soon as this reaches zero (by a
+	// thread which sees it without sleeping), so it can't be touched
+	// after that
+	if (--queued.group->m_pending == 0)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_sleep_mutex);
+		}
+		m_wake.notify_all();
+	}
+}
+
+
+size_t ThreadPool::current_worker() const
+{
+	return (t_pool == this) ? t_worker_idx : m_workers.size();
+}
+
+
+}  // namespace dbsi
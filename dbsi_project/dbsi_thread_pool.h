@@ -0,0 +1,184 @@
+#ifndef DBSI_THREAD_POOL_H
+#define DBSI_THREAD_POOL_H
+
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <cstdint>
+
+
+namespace dbsi
+{
+
+
+/*
+* A fixed set of worker threads which run tasks, shared by everything
+* which does work in parallel (so that, for example, a parallel LOAD
+* and a parallel query don't each start their own threads).
+*
+* Scheduling is by work stealing: each worker has its own deque of
+* tasks. Tasks spawned by a worker go on the back of its own deque,
+* and it runs tasks from the back of its own deque first (so related
+* work stays on one thread, and in cache). Tasks spawned by any other
+* thread are dealt out to the workers' deques in turn. A worker whose
+* deque is empty steals from the front of another's, so no worker is
+* left idle while another has a backlog (e.g. when some tasks take
+* much longer than others, because of a skewed predicate).
+*
+* Tasks belong to a `TaskGroup`, which can be waited for. A thread
+* which waits for a group helps to run tasks in the meantime, so
+* tasks can themselves spawn and wait for more tasks.
+*/
+class ThreadPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	/*
+	* A set of tasks which can be waited for together. It must not be
+	* destroyed while any of its tasks are yet to finish.
+	*/
+	class TaskGroup
+	{
+	public:
+		TaskGroup();
+
+	private:
+		friend class ThreadPool;
+
+		// the number of tasks spawned but not yet finished
+		std::atomic<size_t> m_pending;
+
+		// the first exception thrown by one of the tasks, if any
+		std::mutex m_error_mutex;
+		std::exception_ptr m_error;
+	};
+
+	/*
+	* What a worker has done since the pool was created. Busy time is
+	* time spent running tasks, and idle time is time spent asleep,
+	* waiting for tasks to be spawned.
+	*/
+	struct WorkerStatistics
+	{
+		size_t tasks_run;
+		size_t tasks_stolen;  // (of `tasks_run`) from other workers' deques
+		std::chrono::nanoseconds busy_time, idle_time;
+	};
+
+	/*
+	* Start `num_workers` worker threads.
+	*/
+	explicit ThreadPool(size_t num_workers);
+
+	/*
+	* Stop the worker threads. Every group must have been waited for.
+	*/
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t num_workers() const;
+
+	/*
+	* Queue up `task` to be run by some thread, as part of `group`.
+	*/
+	void spawn(TaskGroup& group, Task task);
+
+	/*
+	* Wait until every task of `group` has finished, running tasks
+	* (of any group) in the meantime. If any of them threw an
+	* exception, the first one is rethrown.
+	*/
+	void wait(TaskGroup& group);
+
+	/*
+	* Run `task` on `num_threads` threads at once: this one, and
+	* `num_threads - 1` tasks, and wait for them all to finish. This
+	* is for work which the threads share out among themselves (e.g.
+	* by taking chunks of it from a shared counter).
+	* If any of them threw an exception, one is rethrown.
+	*/
+	void run(size_t num_threads, const Task& task);
+
+	/*
+	* Get each worker's statistics, for seeing how evenly the work
+	* was spread. Tasks run by other threads (while waiting) aren't
+	* counted.
+	*/
+	std::vector<WorkerStatistics> statistics() const;
+
+private:
+	struct QueuedTask
+	{
+		Task task;
+		TaskGroup* group;
+	};
+
+	struct Worker
+	{
+		// guards `tasks` only
+		std::mutex mutex;
+		std::deque<QueuedTask> tasks;
+
+		std::atomic<size_t> tasks_run, tasks_stolen;
+		std::atomic<std::int64_t> busy_ns, idle_ns;
+
+		// when the worker last went to sleep (in nanoseconds of
+		// `std::chrono::steady_clock`), or -1 if it's awake, so that
+		// `statistics` can include the time it has been asleep so far
+		std::atomic<std::int64_t> idle_since_ns;
+
+		std::thread thread;
+	};
+
+	void worker_main(size_t worker_idx);
+
+	/*
+	* Find a task, from the back of the deque of worker `self` (or
+	* if `self` isn't a worker, no deque), or else the front of any
+	* other, and run it. Returns false if there were none.
+	*/
+	bool try_run_task(size_t self);
+
+	/*
+	* Run a task which has been taken from a deque, and record that
+	* it has finished.
+	*/
+	void execute(QueuedTask& queued, size_t self, bool stolen);
+
+	// the index of the worker that the current thread is, in this pool,
+	// or `num_workers()` if it isn't one
+	size_t current_worker() const;
+
+private:
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	// the number of tasks in all of the deques, which is what the
+	// sleeping threads wait for (along with their group finishing)
+	std::atomic<size_t> m_num_queued;
+
+	// the deque which the next task spawned by a non-worker goes on
+	std::atomic<size_t> m_next_deque;
+
+	// sleeping threads wait on `m_wake`, which is notified when a task
+	// is spawned or a group finishes, or the pool is stopping
+	std::mutex m_sleep_mutex;
+	std::condition_variable m_wake;
+	bool m_stop;
+};
+
+
+}  // namespace dbsi
+
+
+#endif  // DBSI_THREAD_POOL_H
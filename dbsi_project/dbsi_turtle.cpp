@@ -1,9 +1,15 @@
 #include <cctype>
+#include <algorithm>
+#include <atomic>
 #include <list>
 #include <iostream>
 #include "dbsi_turtle.h"
 #include "dbsi_assert.h"
 #include "dbsi_parse_helper.h"
+#include "dbsi_dictionary.h"
+#include "dbsi_image.h"
+#include "dbsi_thread_pool.h"
+#include "dbsi_scan.h"
 
 
 namespace dbsi
@@ -146,10 +152,447 @@ private:
 };
 
 
+/*
+* The same parser as `TurtleTripleIterator`, over the part of a mapped
+* file from `m_range_begin` to `m_end`, with the same invariants,
+* except that `m_pos` plays the part of the stream position.
+*/
+class MappedTurtleScanner :
+	public IIterator<RawTriple>
+{
+public:
+	/*
+	* If `report_errors` is false, errors are only recorded, for the
+	* caller to report (or not) with `report_error`.
+	*/
+	MappedTurtleScanner(std::shared_ptr<const MappedFile> file,
+		size_t begin, size_t end, bool report_errors) :
+		m_file(std::move(file)),
+		m_begin(m_file->data()),
+		m_range_begin(m_begin + begin),
+		m_end(m_begin + end),
+		m_report_errors(report_errors),
+		m_pos(m_range_begin),
+		m_error(false),
+		m_eof(false),
+		m_past_end(false),
+		m_error_what(nullptr)
+	{
+		DBSI_CHECK_PRECOND(begin <= end && end <= m_file->size());
+	}
+
+	void start() override
+	{
+		m_pos = m_range_begin;
+		m_error = false;
+		m_eof = false;
+		m_past_end = false;
+		m_error_what = nullptr;
+
+		read_triple();
+	}
+
+	RawTriple current() const override
+	{
+		DBSI_CHECK_PRECOND(valid());
+
+		return m_current;
+	}
+
+	void next() override
+	{
+		DBSI_CHECK_PRECOND(valid());
+
+		read_end();
+
+		if (valid())
+			read_triple();
+	}
+
+	bool valid() const override
+	{
+		return !m_error && !m_eof;
+	}
+
+	// whether parsing stopped because of an error
+	bool failed() const
+	{
+		return m_error;
+	}
+
+	// whether the error was that the range ended part-way through a
+	// triple
+	bool failed_at_end() const
+	{
+		return m_error && m_past_end;
+	}
+
+	void report_error() const
+	{
+		DBSI_CHECK_PRECOND(m_error);
+
+		// (as with a stream, the position is -1 once reading has gone
+		// past the end)
+		const std::ptrdiff_t pos = m_past_end ? -1 : m_pos - m_begin;
+		std::cerr << "Encountered an invalid "
+			<< m_error_what
+			<< " while loading. Stopping parsing the file. Current file stream position is "
+			<< pos
+			<< std::endl;
+	}
+
+private:
+	void skip_whitespace()
+	{
+		m_pos = skip_space(m_pos, m_end);
+	}
+
+	void read_triple()
+	{
+		DBSI_CHECK_INVARIANT(valid());
+
+		skip_whitespace();
+		if (m_pos == m_end)
+		{
+			m_eof = true;
+			return;
+		}
+
+		if (!parse_resource(m_current.sub))
+		{
+			set_error("subject");
+			return;
+		}
+		if (!parse_resource(m_current.pred))
+		{
+			set_error("predicate");
+			return;
+		}
+		if (!parse_resource(m_current.obj))
+		{
+			set_error("object");
+			return;
+		}
+	}
+
+	void read_end()
+	{
+		DBSI_CHECK_INVARIANT(valid());
+
+		skip_whitespace();
+		m_past_end = (m_pos == m_end);
+		if (m_past_end || *m_pos++ != '.')
+			set_error("triple delimiter");
+	}
+
+	/*
+	* Parse a resource (after any whitespace) into `out`, whose value
+	* is then a view into the mapping. Returns false if the syntax is
+	* bad, as with `parse_resource`.
+	*/
+	bool parse_resource(ResourceRef& out)
+	{
+		skip_whitespace();
+		m_past_end = (m_pos == m_end);
+		if (m_past_end)
+			return false;
+
+		const char start_char = *m_pos++;
+		if (start_char != '<' && start_char != '"')
+			return false;
+
+		// (there are no escapes, so the value is everything up to the
+		// next closing character)
+		const char end_char = (start_char == '<') ? '>' : '"';
+		const char* val_end = find_char(m_pos, m_end, end_char);
+		if (val_end == m_end)
+		{
+			m_pos = m_end;
+			m_past_end = true;
+			return false;
+		}
+
+		out = ResourceRef{ start_char == '<',
+			std::string_view(m_pos, static_cast<size_t>(val_end - m_pos)) };
+		m_pos = val_end + 1;
+		return true;
+	}
+
+	void set_error(const char* what_is_invalid)
+	{
+		m_error = true;
+		m_error_what = what_is_invalid;
+		if (m_report_errors)
+			report_error();
+	}
+
+private:
+	// (shared so that the mapping outlives the iterator)
+	const std::shared_ptr<const MappedFile> m_file;
+
+	// the start of the file (which positions are relative to), and
+	// of the range being parsed, and the end of the range
+	const char* const m_begin;
+	const char* const m_range_begin;
+	const char* const m_end;
+	const bool m_report_errors;
+
+	const char* m_pos;
+
+	bool m_error, m_eof;
+
+	// whether the last read looked for a character beyond the end,
+	// which is where a stream would have hit EOF
+	bool m_past_end;
+
+	const char* m_error_what;
+	RawTriple m_current;
+};
+
+
+/*
+* Encodes the triples of a `MappedTurtleScanner` as it goes. Each one
+* is only encoded once the whole of it has been parsed, so a corrupt
+* triple adds nothing to the dictionary.
+*/
+class MappedTurtleTripleIterator :
+	public ICodedTripleIterator
+{
+public:
+	MappedTurtleTripleIterator(std::shared_ptr<const MappedFile> file, Dictionary& dict) :
+		m_scanner(file, 0, file->size(), true),
+		m_dict(dict)
+	{
+	}
+
+	void start() override
+	{
+		m_scanner.start();
+		encode_current();
+	}
+
+	CodedTriple current() const override
+	{
+		DBSI_CHECK_PRECOND(valid());
+
+		return m_current;
+	}
+
+	void next() override
+	{
+		DBSI_CHECK_PRECOND(valid());
+
+		m_scanner.next();
+		encode_current();
+	}
+
+	bool valid() const override
+	{
+		return m_scanner.valid();
+	}
+
+private:
+	void encode_current()
+	{
+		if (m_scanner.valid())
+		{
+			const RawTriple t = m_scanner.current();
+			m_current = CodedTriple{ m_dict.encode(t.sub), m_dict.encode(t.pred), m_dict.encode(t.obj) };
+		}
+	}
+
+private:
+	MappedTurtleScanner m_scanner;
+	Dictionary& m_dict;
+	CodedTriple m_current;
+};
+
+
+/*
+* Choose where to split `file` into about `num_chunks` chunks: at the
+* start of lines which follow a line ending with a full stop, which
+* is (almost always) the end of a triple. The result starts with 0
+* and ends with the file's size.
+* A literal can contain such a line break, though, so a chunk may
+* not really start at a triple; `parse_mapped_turtle` checks.
+*/
+static std::vector<size_t> split_at_triples(const MappedFile& file, size_t num_chunks)
+{
+	const char* const data = file.data();
+	const size_t size = file.size();
+
+	std::vector<size_t> bounds{ 0 };
+	for (size_t i = 1; i < num_chunks; ++i)
+	{
+		size_t pos = std::max(size / num_chunks * i, bounds.back());
+		while (pos < size)
+		{
+			const char* line_end = find_char(data + pos, data + size, '\n');
+			if (line_end == data + size)
+			{
+				pos = size;
+				break;
+			}
+			pos = static_cast<size_t>(line_end - data) + 1;
+
+			// (allowing for Windows line endings)
+			const char* last = line_end;
+			if (last != data && last[-1] == '\r')
+				--last;
+			if (last != data && last[-1] == '.')
+				break;
+		}
+
+		if (pos >= size)
+			break;
+		if (pos > bounds.back())
+			bounds.push_back(pos);
+	}
+	bounds.push_back(size);
+
+	return bounds;
+}
+
+
+// append the resources of everything `scanner` produces to `out`,
+// three per triple
+static void scan_into(MappedTurtleScanner& scanner, std::vector<ResourceRef>& out)
+{
+	for (scanner.start(); scanner.valid(); scanner.next())
+	{
+		const RawTriple t = scanner.current();
+		out.insert(out.end(), { t.sub, t.pred, t.obj });
+	}
+}
+
+
 std::unique_ptr<ITripleIterator> create_turtle_file_parser(std::istream& in)
 {
 	return std::make_unique<TurtleTripleIterator>(in);
 }
 
 
+std::unique_ptr<IIterator<RawTriple>> create_mapped_turtle_scanner(
+	std::shared_ptr<const MappedFile> file)
+{
+	const size_t size = file->size();
+	return std::make_unique<MappedTurtleScanner>(std::move(file), 0, size, true);
+}
+
+
+std::unique_ptr<ICodedTripleIterator> create_mapped_turtle_parser(
+	std::shared_ptr<const MappedFile> file, Dictionary& dict)
+{
+	return std::make_unique<MappedTurtleTripleIterator>(std::move(file), dict);
+}
+
+
+std::vector<CodedTriple> parse_mapped_turtle(std::shared_ptr<const MappedFile> file,
+	Dictionary& dict, ThreadPool& pool, size_t num_threads)
+{
+	DBSI_CHECK_PRECOND(num_threads > 0);
+
+	// several chunks per thread, so that they can even each other out,
+	// but not so many that the chunks are tiny
+	static const size_t MIN_CHUNK_SIZE = 1 << 20;
+	const size_t num_chunks = std::min(num_threads * 8, file->size() / MIN_CHUNK_SIZE + 1);
+	const std::vector<size_t> bounds = split_at_triples(*file, num_chunks);
+
+	// nothing is encoded until the chunks have been put back together,
+	// since a chunk after an error, or which doesn't really start at a
+	// triple, is thrown away
+	struct Chunk
+	{
+		std::unique_ptr<MappedTurtleScanner> scanner;
+		std::vector<ResourceRef> refs;
+	};
+	std::vector<Chunk> chunks(bounds.size() - 1);
+
+	// threads take chunks as they need them, as in `RDFIndex::parallel_load`
+	std::atomic<size_t> next_chunk(0);
+	pool.run(num_threads, [&]()
+		{
+			for (size_t c = next_chunk++; c < chunks.size(); c = next_chunk++)
+			{
+				chunks[c].scanner = std::make_unique<MappedTurtleScanner>(
+					file, bounds[c], bounds[c + 1], false);
+				scan_into(*chunks[c].scanner, chunks[c].refs);
+			}
+		});
+
+	// then put the chunks back together, stopping at the first error,
+	// just as parsing the whole file in one go would have
+	size_t total = 0;
+	for (const Chunk& chunk : chunks)
+		total += chunk.refs.size();
+
+	std::vector<ResourceRef> refs;
+	refs.reserve(total);
+	for (size_t c = 0; c < chunks.size(); ++c)
+	{
+		const MappedTurtleScanner& scanner = *chunks[c].scanner;
+
+		// if a chunk (other than the last) ends part-way through a
+		// triple, the split wasn't really between triples (but inside
+		// a literal), so scan the rest in one go instead
+		if (scanner.failed_at_end() && c + 1 < chunks.size())
+		{
+			MappedTurtleScanner rest(file, bounds[c], file->size(), true);
+			scan_into(rest, refs);
+			break;
+		}
+
+		refs.insert(refs.end(), chunks[c].refs.begin(), chunks[c].refs.end());
+		std::vector<ResourceRef>().swap(chunks[c].refs);
+
+		if (scanner.failed())
+		{
+			scanner.report_error();
+			break;
+		}
+	}
+	chunks.clear();
+
+	// look up the resources in parallel, a range at a time...
+	static const size_t RANGE_SIZE = 3 << 16;
+	const size_t num_ranges = (refs.size() + RANGE_SIZE - 1) / RANGE_SIZE;
+	std::vector<CodedResource> codes(refs.size());
+	std::vector<std::vector<size_t>> missing(num_ranges);
+	std::atomic<size_t> next_range(0);
+	pool.run(num_threads, [&]()
+		{
+			for (size_t r = next_range++; r < num_ranges; r = next_range++)
+			{
+				const size_t begin = r * RANGE_SIZE;
+				const size_t count = std::min(RANGE_SIZE, refs.size() - begin);
+				missing[r] = dict.find(refs.data() + begin, count, codes.data() + begin);
+			}
+		});
+
+	// ...and then encode the new ones in the order in which they appear
+	// in the file, so that they get the same codes as they would from
+	// parsing the file in one go
+	std::vector<size_t> new_positions;
+	std::vector<ResourceRef> new_refs;
+	for (size_t r = 0; r < num_ranges; ++r)
+	{
+		for (size_t i : missing[r])
+		{
+			new_positions.push_back(r * RANGE_SIZE + i);
+			new_refs.push_back(refs[r * RANGE_SIZE + i]);
+		}
+	}
+	std::vector<CodedResource> new_codes(new_refs.size());
+	dict.encode(new_refs.data(), new_refs.size(), new_codes.data());
+	for (size_t i = 0; i < new_positions.size(); ++i)
+		codes[new_positions[i]] = new_codes[i];
+
+	std::vector<CodedTriple> triples(codes.size() / 3);
+	for (size_t i = 0; i < triples.size(); ++i)
+		triples[i] = CodedTriple{ codes[3 * i], codes[3 * i + 1], codes[3 * i + 2] };
+
+	return triples;
+}
+
+
 }  // namespace dbsi
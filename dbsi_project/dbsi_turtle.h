@@ -4,6 +4,7 @@
 
 #include <memory>
 #include <istream>
+#include <vector>
 #include "dbsi_iterator.h"
 
 
@@ -11,6 +12,11 @@ namespace dbsi
 {
 
 
+class Dictionary;
+class MappedFile;
+class ThreadPool;
+
+
 /*
 * Creates a Turtle file parser, for the given input file stream.
 * The stream must be kept alive for the entire lifetime of this
@@ -27,6 +33,53 @@ namespace dbsi
 std::unique_ptr<ITripleIterator> create_turtle_file_parser(std::istream& in);
 
 
+/*
+* A triple as it appears in a mapped file, i.e. with its resources
+* as views into the mapping, which haven't been encoded yet.
+*/
+typedef GeneralTriple<ResourceRef> RawTriple;
+
+
+/*
+* Creates a Turtle file parser for a file which has been mapped into
+* memory, which produces the triples without encoding them (for when
+* that is done elsewhere, as in `dbsi_load_pipeline.h`). The views
+* are valid for as long as the mapping is, which this iterator keeps
+* alive. It reports errors as `create_turtle_file_parser` does.
+*/
+std::unique_ptr<IIterator<RawTriple>> create_mapped_turtle_scanner(
+	std::shared_ptr<const MappedFile> file);
+
+
+/*
+* Creates a Turtle file parser for a file which has been mapped into
+* memory, which encodes the triples into `dict` as it goes. This
+* accepts the same syntax, and behaves the same way on errors, as
+* `create_turtle_file_parser`, but is much faster: it scans the
+* mapping directly, and hands each resource to the dictionary as a
+* view into it, so a value is only copied when it is new. (The
+* triples are only encoded once the whole of each has been parsed,
+* so a corrupt triple adds nothing to the dictionary.)
+*/
+std::unique_ptr<ICodedTripleIterator> create_mapped_turtle_parser(
+	std::shared_ptr<const MappedFile> file, Dictionary& dict);
+
+
+/*
+* Parse the whole of a mapped file at once, encoding the triples into
+* `dict`, using `num_threads` threads of `pool` (this one included).
+* The file is split into chunks at what look like the ends of triples,
+* which are scanned in parallel, and then put back together. Only then
+* are the triples which were kept encoded: their resources are looked
+* up in parallel, and the new ones are added in the order in which they
+* appear in the file. So the result, and the dictionary afterwards, are
+* exactly the same as from reading `create_mapped_turtle_parser` to the
+* end (including stopping at the first error, and reporting it).
+*/
+std::vector<CodedTriple> parse_mapped_turtle(std::shared_ptr<const MappedFile> file,
+	Dictionary& dict, ThreadPool& pool, size_t num_threads);
+
+
 }  // namespace dbsi
 
 
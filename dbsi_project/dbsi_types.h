@@ -3,8 +3,10 @@
 
 
 #include <string>
+#include <string_view>
 #include <variant>
 #include <map>
+#include <cstdint>
 
 
 namespace dbsi
@@ -51,7 +53,33 @@ struct Variable
 
 
 typedef std::variant<Literal, IRI> Resource;
-typedef size_t CodedResource;
+
+
+/*
+* A resource whose value is held elsewhere (e.g. in a file being
+* parsed), so that it can be encoded without first being copied into
+* a `Resource` (see `Dictionary::encode`).
+*/
+struct ResourceRef
+{
+	bool is_iri;  // otherwise it's a literal
+	std::string_view val;
+};
+
+
+/*
+* By default, coded resources are 64-bit integers. If none of your
+* datasets has more than about 2^32 distinct resources (or 2^31
+* triples), define `DBSI_32_BIT_IDS` (there is a CMake option of the
+* same name) to use 32-bit integers instead, which halves the size of
+* the table, the index keys, and coded variable maps.
+* Exceeding the limit results in a `std::overflow_error` at load time.
+*/
+#ifdef DBSI_32_BIT_IDS
+typedef std::uint32_t CodedResource;
+#else
+typedef std::uint64_t CodedResource;
+#endif
 
 
 template<typename ResT>
@@ -198,6 +226,26 @@ struct DbsiToStringVisitor
 };
 
 
+/*
+* Helpers for hashing integer keys, such as coded resources.
+* These are 64-bit regardless of the width of the keys.
+*/
+inline std::uint64_t hash_mix(std::uint64_t x)
+{
+	// the finaliser from MurmurHash3
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb3fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+inline std::uint64_t hash_combine(std::uint64_t h, std::uint64_t x)
+{
+	return hash_mix(h ^ (x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+
 }  // namespace dbsi
 
 
@@ -244,11 +292,22 @@ struct hash<dbsi::GeneralTriple<dbsi::CodedResource>>
 {
 	std::size_t operator()(const dbsi::GeneralTriple<dbsi::CodedResource>& t) const
 	{
-		// calling `dbsi::my_hash` here helps in the case where ResT
-		// is just an integer, in which case the hash is the identity
-		// function, causing collisions
-		return ((t.sub << (2 * sizeof(dbsi::CodedResource) / 3))
-			^ (t.pred << (sizeof(dbsi::CodedResource) / 3)) ^ t.obj);
+		// the standard hash of an integer is the identity function,
+		// so combining them with shifts and xors collides badly on
+		// small, dense codes (especially 32-bit ones). instead, run
+		// the codes through a multiplicative mixer.
+		return dbsi::hash_combine(dbsi::hash_combine(
+			dbsi::hash_mix(t.sub), t.pred), t.obj);
+	}
+};
+
+
+template<>
+struct hash<pair<dbsi::CodedResource, dbsi::CodedResource>>
+{
+	std::size_t operator()(const pair<dbsi::CodedResource, dbsi::CodedResource>& p) const
+	{
+		return dbsi::hash_combine(dbsi::hash_mix(p.first), p.second);
 	}
 };
 